@@ -0,0 +1,373 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Memory allocation: everything the library allocates is obtained through
+ * the rdns_malloc() family, from either a context's allocator or the
+ * process-wide one, which default to the C library's. The counting
+ * allocator wraps another, keeping track of (and optionally limiting) how
+ * much is allocated through it.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+/* Each block allocated by a counting allocator is preceded by its size,
+ * padded so that the block remains suitably aligned
+ */
+union counting_header
+{
+	size_t size;
+	long double ld;
+	long long ll;
+	void *p;
+};
+
+struct counting
+{
+	radiodns_allocator_t allocator;
+	radiodns_allocator_t *parent;
+	size_t limit;
+	size_t current;
+	size_t peak;
+	unsigned long allocs;
+	unsigned long refused;
+};
+
+static void *counting_alloc(radiodns_allocator_t *allocator, size_t size);
+static void *counting_realloc(radiodns_allocator_t *allocator, void *ptr, size_t size);
+static void counting_free(radiodns_allocator_t *allocator, void *ptr);
+static void counting_destroy(radiodns_allocator_t *allocator);
+static int counting_reserve(struct counting *c, size_t size);
+static void counting_release(struct counting *c, size_t size);
+static void *parent_realloc(radiodns_allocator_t *parent, void *ptr, size_t size);
+static void parent_free(radiodns_allocator_t *parent, void *ptr);
+
+/* The allocator used by contexts which don't have one of their own, and
+ * for everything not belonging to a context; NULL for the C library's
+ */
+static radiodns_allocator_t *default_allocator;
+
+/* Set the allocator used by a context, or the default */
+int
+radiodns_set_allocator(radiodns_t *context, radiodns_allocator_t *allocator)
+{
+	if(allocator && (!allocator->alloc || !allocator->realloc || !allocator->free))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!context)
+	{
+		default_allocator = allocator;
+		return 0;
+	}
+	context->allocator = allocator;
+	return 0;
+}
+
+/* Destroy an allocator */
+void
+radiodns_allocator_destroy(radiodns_allocator_t *allocator)
+{
+	if(allocator && allocator->destroy)
+	{
+		allocator->destroy(allocator);
+	}
+}
+
+/* Create an allocator which obtains memory from parent (or the C library,
+ * if NULL), counting what's allocated, and refusing allocations which
+ * would take the total beyond limit bytes (unless limit is zero)
+ */
+radiodns_allocator_t *
+radiodns_allocator_counting(radiodns_allocator_t *parent, size_t limit)
+{
+	struct counting *c;
+
+	if(NULL == (c = (struct counting *) parent_realloc(parent, NULL, sizeof(struct counting))))
+	{
+		return NULL;
+	}
+	memset(c, 0, sizeof(struct counting));
+	c->allocator.alloc = counting_alloc;
+	c->allocator.realloc = counting_realloc;
+	c->allocator.free = counting_free;
+	c->allocator.destroy = counting_destroy;
+	c->allocator.data = c;
+	c->parent = parent;
+	c->limit = limit;
+	return &(c->allocator);
+}
+
+/* Retrieve the statistics of a counting allocator, optionally beginning
+ * a new measurement: the peak is reset to the current total, and the
+ * counts of allocations to zero
+ */
+int
+radiodns_allocator_stats(radiodns_allocator_t *allocator, radiodns_alloc_stats_t *stats, int reset)
+{
+	struct counting *c;
+
+	if(!allocator || allocator->alloc != counting_alloc)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	c = (struct counting *) allocator->data;
+	if(stats)
+	{
+		stats->current = __atomic_load_n(&(c->current), __ATOMIC_RELAXED);
+		stats->peak = __atomic_load_n(&(c->peak), __ATOMIC_RELAXED);
+		stats->allocs = __atomic_load_n(&(c->allocs), __ATOMIC_RELAXED);
+		stats->refused = __atomic_load_n(&(c->refused), __ATOMIC_RELAXED);
+		stats->limit = c->limit;
+	}
+	if(reset)
+	{
+		__atomic_store_n(&(c->peak), __atomic_load_n(&(c->current), __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_store_n(&(c->allocs), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(c->refused), 0, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/* Return the allocator a context's operations and results should use,
+ * or NULL for the C library's
+ */
+radiodns_allocator_t *
+rdns_allocator(radiodns_t *context)
+{
+	if(context && context->allocator)
+	{
+		return context->allocator;
+	}
+	return default_allocator;
+}
+
+/* Allocate via an allocator, or the default if NULL; these behave as
+ * their C library counterparts, setting errno to ENOMEM on failure
+ */
+void *
+rdns_malloc(radiodns_allocator_t *allocator, size_t size)
+{
+	void *p;
+
+	if(!allocator && !(allocator = default_allocator))
+	{
+		return malloc(size);
+	}
+	if(NULL == (p = allocator->alloc(allocator, size ? size : 1)))
+	{
+		errno = ENOMEM;
+	}
+	return p;
+}
+
+void *
+rdns_calloc(radiodns_allocator_t *allocator, size_t nmemb, size_t size)
+{
+	void *p;
+
+	if(!allocator && !(allocator = default_allocator))
+	{
+		return calloc(nmemb, size);
+	}
+	if(size && nmemb > (size_t) -1 / size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	if((p = rdns_malloc(allocator, nmemb * size)))
+	{
+		memset(p, 0, nmemb * size);
+	}
+	return p;
+}
+
+void *
+rdns_realloc(radiodns_allocator_t *allocator, void *ptr, size_t size)
+{
+	void *p;
+
+	if(!allocator && !(allocator = default_allocator))
+	{
+		return realloc(ptr, size);
+	}
+	if(NULL == (p = allocator->realloc(allocator, ptr, size ? size : 1)))
+	{
+		errno = ENOMEM;
+	}
+	return p;
+}
+
+char *
+rdns_strdup(radiodns_allocator_t *allocator, const char *str)
+{
+	size_t len;
+	char *p;
+
+	if(!allocator && !(allocator = default_allocator))
+	{
+		return strdup(str);
+	}
+	len = strlen(str) + 1;
+	if((p = (char *) rdns_malloc(allocator, len)))
+	{
+		memcpy(p, str, len);
+	}
+	return p;
+}
+
+void
+rdns_free(radiodns_allocator_t *allocator, void *ptr)
+{
+	if(!ptr)
+	{
+		return;
+	}
+	if(!allocator && !(allocator = default_allocator))
+	{
+		free(ptr);
+		return;
+	}
+	allocator->free(allocator, ptr);
+}
+
+static void *
+counting_alloc(radiodns_allocator_t *allocator, size_t size)
+{
+	return counting_realloc(allocator, NULL, size);
+}
+
+static void *
+counting_realloc(radiodns_allocator_t *allocator, void *ptr, size_t size)
+{
+	struct counting *c;
+	union counting_header *h;
+	size_t old;
+
+	c = (struct counting *) allocator->data;
+	if(size > (size_t) -1 - sizeof(union counting_header))
+	{
+		return NULL;
+	}
+	h = NULL;
+	old = 0;
+	if(ptr)
+	{
+		h = ((union counting_header *) ptr) - 1;
+		old = h->size;
+	}
+	/* Account for growth before it happens, so that concurrent
+	 * allocations can't exceed the limit between them
+	 */
+	if(size > old && !counting_reserve(c, size - old))
+	{
+		__atomic_add_fetch(&(c->refused), 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if(NULL == (h = (union counting_header *) parent_realloc(c->parent, h, size + sizeof(union counting_header))))
+	{
+		if(size > old)
+		{
+			counting_release(c, size - old);
+		}
+		return NULL;
+	}
+	if(size < old)
+	{
+		counting_release(c, old - size);
+	}
+	h->size = size;
+	__atomic_add_fetch(&(c->allocs), 1, __ATOMIC_RELAXED);
+	return h + 1;
+}
+
+static void
+counting_free(radiodns_allocator_t *allocator, void *ptr)
+{
+	struct counting *c;
+	union counting_header *h;
+
+	c = (struct counting *) allocator->data;
+	h = ((union counting_header *) ptr) - 1;
+	counting_release(c, h->size);
+	parent_free(c->parent, h);
+}
+
+static void
+counting_destroy(radiodns_allocator_t *allocator)
+{
+	struct counting *c;
+
+	c = (struct counting *) allocator->data;
+	parent_free(c->parent, c);
+}
+
+static int
+counting_reserve(struct counting *c, size_t size)
+{
+	size_t total, peak;
+
+	total = __atomic_add_fetch(&(c->current), size, __ATOMIC_RELAXED);
+	if(c->limit && total > c->limit)
+	{
+		__atomic_sub_fetch(&(c->current), size, __ATOMIC_RELAXED);
+		return 0;
+	}
+	peak = __atomic_load_n(&(c->peak), __ATOMIC_RELAXED);
+	while(total > peak && !__atomic_compare_exchange_n(&(c->peak), &peak, total, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		/* peak has been updated with the current value */
+	}
+	return 1;
+}
+
+static void
+counting_release(struct counting *c, size_t size)
+{
+	__atomic_sub_fetch(&(c->current), size, __ATOMIC_RELAXED);
+}
+
+/* A counting allocator's parent is used directly, rather than via
+ * rdns_realloc(), as NULL means the C library's allocator even if the
+ * counting allocator has become the default
+ */
+static void *
+parent_realloc(radiodns_allocator_t *parent, void *ptr, size_t size)
+{
+	if(parent)
+	{
+		return parent->realloc(parent, ptr, size);
+	}
+	return realloc(ptr, size);
+}
+
+static void
+parent_free(radiodns_allocator_t *parent, void *ptr)
+{
+	if(parent)
+	{
+		parent->free(parent, ptr);
+		return;
+	}
+	free(ptr);
+}
@@ -0,0 +1,389 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* radiodns-bench: measure how quickly each transport can resolve a list
+ * of names. This isn't installed; build it with 'make radiodns-bench'.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+
+#include "radiodns.h"
+
+/* Maximum number of queries the benchmark keeps outstanding at once */
+#define BENCH_SLOTS                     8192
+/* Size of each answer buffer */
+#define BENCH_ANSLEN                    NS_PACKETSZ
+
+struct bench
+{
+	radiodns_transport_t *transport;
+	char **names;
+	size_t nnames;
+	size_t count;
+	size_t next;
+	size_t outstanding;
+	size_t answered;
+	size_t failed;
+	int qtype;
+};
+
+static struct
+{
+	const char *name;
+	radiodns_transport_t *(*create)(void);
+} transports[] = {
+	{ "libresolv", radiodns_transport_libresolv },
+	{ "tcp", radiodns_transport_tcp },
+	{ "udp", radiodns_transport_udp },
+	{ "uring", radiodns_transport_uring },
+	{ NULL, NULL }
+};
+
+static struct
+{
+	const char *name;
+	int qtype;
+} qtypes[] = {
+	{ "A", ns_t_a },
+	{ "AAAA", ns_t_aaaa },
+	{ "CNAME", ns_t_cname },
+	{ "PTR", ns_t_ptr },
+	{ "SRV", ns_t_srv },
+	{ "TXT", ns_t_txt },
+	{ "ANY", ns_t_any },
+	{ NULL, 0 }
+};
+
+static const char *progname = "radiodns-bench";
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] FILE [TRANSPORT ...]\n\n", progname);
+	fprintf(stderr, "Resolves the names listed in FILE (one per line, or '-' for standard input)\n"
+			"using each TRANSPORT in turn, and reports the query rate achieved.\n\n");
+	fprintf(stderr, "OPTIONS is one or more of:\n");
+	fprintf(stderr, " -n COUNT      Perform COUNT queries, cycling through the names (default: one\n"
+			"               query per name)\n");
+	fprintf(stderr, " -t TYPE       Query for records of TYPE (default: ANY)\n");
+	fprintf(stderr, " -s ADDR[:PORT]  Query the IPv4 nameserver ADDR instead of the system's\n\n");
+	fprintf(stderr, "TRANSPORT is one of libresolv, tcp, udp or uring (default: all of them)\n");
+}
+
+static int
+load_names(struct bench *bench, const char *path)
+{
+	FILE *f;
+	char buf[MAXDNAME], *p, **names;
+	size_t size;
+
+	if(!strcmp(path, "-"))
+	{
+		f = stdin;
+	}
+	else if(NULL == (f = fopen(path, "r")))
+	{
+		return -1;
+	}
+	size = 0;
+	while(fgets(buf, sizeof(buf), f))
+	{
+		for(p = buf + strlen(buf); p > buf && (p[-1] == '\n' || p[-1] == '\r' || p[-1] == ' ' || p[-1] == '\t'); p--);
+		*p = 0;
+		if(!buf[0] || buf[0] == '#')
+		{
+			continue;
+		}
+		if(bench->nnames == size)
+		{
+			size = (size ? size * 2 : 256);
+			if(NULL == (names = (char **) realloc(bench->names, size * sizeof(char *))))
+			{
+				break;
+			}
+			bench->names = names;
+		}
+		if(NULL == (bench->names[bench->nnames] = strdup(buf)))
+		{
+			break;
+		}
+		bench->nnames++;
+	}
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	return 0;
+}
+
+static int
+set_nameserver(const char *spec)
+{
+	char buf[64], *p;
+	struct in_addr addr;
+	int port;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	port = NS_DEFAULTPORT;
+	if((p = strchr(buf, ':')))
+	{
+		*p = 0;
+		port = atoi(p + 1);
+	}
+	if(port <= 0 || port > 65535 || 1 != inet_pton(AF_INET, buf, &addr))
+	{
+		return -1;
+	}
+	res_init();
+	_res.nscount = 1;
+	_res.nsaddr_list[0].sin_family = AF_INET;
+	_res.nsaddr_list[0].sin_port = htons(port);
+	_res.nsaddr_list[0].sin_addr = addr;
+	return 0;
+}
+
+static void
+query_complete(radiodns_query_t *query)
+{
+	struct bench *bench;
+
+	bench = (struct bench *) query->data;
+	bench->outstanding--;
+	if(query->len > 0)
+	{
+		bench->answered++;
+	}
+	else
+	{
+		bench->failed++;
+	}
+	/* Keep the slot busy until everything has been submitted */
+	while(bench->next < bench->count)
+	{
+		query->name = bench->names[bench->next % bench->nnames];
+		bench->next++;
+		if(!bench->transport->submit(bench->transport, query))
+		{
+			bench->outstanding++;
+			return;
+		}
+		bench->failed++;
+	}
+}
+
+static int
+run(struct bench *bench, radiodns_query_t *queries, size_t nslots)
+{
+	size_t c;
+
+	bench->next = 0;
+	bench->outstanding = 0;
+	bench->answered = 0;
+	bench->failed = 0;
+	if(!bench->transport->submit || !bench->transport->process)
+	{
+		for(c = 0; c < bench->count; c++)
+		{
+			queries[0].name = bench->names[c % bench->nnames];
+			if(0 < bench->transport->query(bench->transport, &(queries[0])))
+			{
+				bench->answered++;
+			}
+			else
+			{
+				bench->failed++;
+			}
+		}
+		return 0;
+	}
+	for(c = 0; c < nslots && bench->next < bench->count; c++)
+	{
+		queries[c].name = bench->names[bench->next % bench->nnames];
+		bench->next++;
+		if(bench->transport->submit(bench->transport, &(queries[c])))
+		{
+			bench->failed++;
+			continue;
+		}
+		bench->outstanding++;
+	}
+	while(bench->outstanding)
+	{
+		if(0 > bench->transport->process(bench->transport, -1))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench bench;
+	radiodns_query_t *queries;
+	unsigned char *answers;
+	struct timespec start, end;
+	double elapsed;
+	size_t c, nslots;
+	int d, first;
+	char *t;
+
+	if(argv[0])
+	{
+		if((t = strrchr(argv[0], '/')))
+		{
+			progname = t + 1;
+		}
+		else
+		{
+			progname = argv[0];
+		}
+	}
+	memset(&bench, 0, sizeof(bench));
+	bench.qtype = ns_t_any;
+	while(-1 != (d = getopt(argc, argv, "hn:t:s:")))
+	{
+		switch(d)
+		{
+		case 'n':
+			bench.count = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			for(c = 0; qtypes[c].name; c++)
+			{
+				if(!strcasecmp(qtypes[c].name, optarg))
+				{
+					break;
+				}
+			}
+			if(!qtypes[c].name)
+			{
+				fprintf(stderr, "%s: unsupported record type '%s'\n", progname, optarg);
+				return 1;
+			}
+			bench.qtype = qtypes[c].qtype;
+			break;
+		case 's':
+			if(set_nameserver(optarg))
+			{
+				fprintf(stderr, "%s: invalid nameserver '%s'\n", progname, optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(optind >= argc)
+	{
+		usage();
+		return 1;
+	}
+	if(load_names(&bench, argv[optind]))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, argv[optind], strerror(errno));
+		return 1;
+	}
+	if(!bench.nnames)
+	{
+		fprintf(stderr, "%s: %s: no names to resolve\n", progname, argv[optind]);
+		return 1;
+	}
+	if(!bench.count)
+	{
+		bench.count = bench.nnames;
+	}
+	nslots = (bench.count < BENCH_SLOTS ? bench.count : BENCH_SLOTS);
+	queries = (radiodns_query_t *) calloc(nslots, sizeof(radiodns_query_t));
+	answers = (unsigned char *) malloc(nslots * BENCH_ANSLEN);
+	if(!queries || !answers)
+	{
+		fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	for(c = 0; c < nslots; c++)
+	{
+		queries[c].qclass = ns_c_in;
+		queries[c].qtype = bench.qtype;
+		queries[c].answer = answers + c * BENCH_ANSLEN;
+		queries[c].anslen = BENCH_ANSLEN;
+		queries[c].complete = query_complete;
+		queries[c].data = &bench;
+	}
+	printf("%-10s %10s %10s %10s %10s %12s\n", "TRANSPORT", "QUERIES", "ANSWERED", "FAILED", "SECONDS", "QUERIES/SEC");
+	first = ++optind;
+	for(d = 0; transports[d].name; d++)
+	{
+		if(first < argc)
+		{
+			for(optind = first; optind < argc; optind++)
+			{
+				if(!strcmp(argv[optind], transports[d].name))
+				{
+					break;
+				}
+			}
+			if(optind == argc)
+			{
+				continue;
+			}
+		}
+		if(NULL == (bench.transport = transports[d].create()))
+		{
+			fprintf(stderr, "%s: %s: failed to create transport: %s\n", progname, transports[d].name, strerror(errno));
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if(run(&bench, queries, nslots))
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, transports[d].name, strerror(errno));
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		radiodns_transport_destroy(bench.transport);
+		elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-10s %10lu %10lu %10lu %10.3f %12.0f\n", transports[d].name,
+			   (unsigned long) bench.count, (unsigned long) bench.answered, (unsigned long) bench.failed,
+			   elapsed, (elapsed > 0 ? bench.count / elapsed : 0));
+	}
+	free(queries);
+	free(answers);
+	for(c = 0; c < bench.nnames; c++)
+	{
+		free(bench.names[c]);
+	}
+	free(bench.names);
+	return 0;
+}
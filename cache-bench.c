@@ -0,0 +1,322 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* radiodns-cache-bench: measure how application lookups answered by a
+ * shared cache scale with the number of threads making them. Each thread
+ * has its own contexts (and in-memory zone, which is only consulted to
+ * fill the cache), all sharing one cache, and resolves applications for
+ * randomly-chosen stations as fast as it can. With -d, the threads share
+ * one zone as the default transport instead, as embedders sharing the
+ * system resolver do, and so fill the cache through the same transport
+ * at once. This isn't installed; build it with 'make radiodns-cache-bench'.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "radiodns.h"
+
+/* Lookups made between checks of whether to stop */
+#define BENCH_BATCH                     256
+
+struct bench_thread
+{
+	pthread_t thread;
+	radiodns_transport_t *zone;
+	radiodns_t **contexts;
+	uint64_t seed;
+	unsigned long lookups;
+	unsigned long failures;
+};
+
+static const char *progname = "radiodns-cache-bench";
+static int nstations = 1000;
+static radiodns_cache_t *cache;
+static int share;
+static radiodns_transport_t *shared;
+static int ready;
+static int go;
+static int stop;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n\n", progname);
+	fprintf(stderr, "OPTIONS is one or more of:\n");
+	fprintf(stderr, " -n STATIONS   Number of stations looked up (default %d)\n", nstations);
+	fprintf(stderr, " -t THREADS    Largest number of threads (default: one per CPU)\n");
+	fprintf(stderr, " -s SECONDS    Time to run for with each number of threads (default 2)\n");
+	fprintf(stderr, " -d            Share one zone between the threads as the default transport\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+pause_ms(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+/* xorshift64, so that threads don't contend for rand()'s state */
+static unsigned long
+bench_random(struct bench_thread *t)
+{
+	t->seed ^= t->seed << 13;
+	t->seed ^= t->seed >> 7;
+	t->seed ^= t->seed << 17;
+	return (unsigned long) t->seed;
+}
+
+/* Create a zone holding every station's application */
+static radiodns_transport_t *
+bench_zone(void)
+{
+	radiodns_transport_t *zone;
+	char name[64], rdata[64];
+	int c;
+
+	if(NULL == (zone = radiodns_transport_zone()))
+	{
+		return NULL;
+	}
+	for(c = 0; c < nstations; c++)
+	{
+		sprintf(name, "_radioepg._tcp.s%d.bench.radiodns.org", c);
+		sprintf(rdata, "0 100 80 epg%d.example.com", c);
+		if(0 > radiodns_zone_add(zone, name, 3600, "SRV", rdata))
+		{
+			radiodns_transport_destroy(zone);
+			return NULL;
+		}
+	}
+	return zone;
+}
+
+static int
+bench_setup(struct bench_thread *t)
+{
+	char name[64];
+	int c;
+
+	if((!shared && NULL == (t->zone = bench_zone())) ||
+	   NULL == (t->contexts = (radiodns_t **) calloc(nstations, sizeof(radiodns_t *))))
+	{
+		return -1;
+	}
+	for(c = 0; c < nstations; c++)
+	{
+		sprintf(name, "s%d.bench.radiodns.org", c);
+		if(NULL == (t->contexts[c] = radiodns_create(name)))
+		{
+			return -1;
+		}
+		radiodns_set_transport(t->contexts[c], t->zone);
+		radiodns_set_cache(t->contexts[c], cache);
+	}
+	return 0;
+}
+
+static void *
+bench_run(void *data)
+{
+	struct bench_thread *t;
+	radiodns_app_t *app;
+	int c;
+
+	t = (struct bench_thread *) data;
+	/* Find every target, and fill the cache */
+	for(c = 0; c < nstations; c++)
+	{
+		radiodns_destroy_app(radiodns_resolve_app(t->contexts[c], "radioepg", NULL));
+	}
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	while(!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+	{
+		pause_ms(1);
+	}
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+	{
+		for(c = 0; c < BENCH_BATCH; c++)
+		{
+			if(!(app = radiodns_resolve_app(t->contexts[bench_random(t) % nstations], "radioepg", NULL)))
+			{
+				t->failures++;
+			}
+			radiodns_destroy_app(app);
+		}
+		t->lookups += BENCH_BATCH;
+	}
+	return NULL;
+}
+
+static void
+bench_teardown(struct bench_thread *t)
+{
+	int c;
+
+	if(t->contexts)
+	{
+		for(c = 0; c < nstations; c++)
+		{
+			radiodns_destroy(t->contexts[c]);
+		}
+		free(t->contexts);
+	}
+	radiodns_transport_destroy(t->zone);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_thread *threads;
+	unsigned long lookups, failures;
+	double start, elapsed, rate, base;
+	int c, n, maxthreads, seconds;
+
+	maxthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	seconds = 2;
+	while((c = getopt(argc, argv, "hn:t:s:d")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			return 0;
+		case 'n':
+			nstations = atoi(optarg);
+			break;
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'd':
+			share = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(nstations < 1 || maxthreads < 1 || seconds < 1)
+	{
+		usage();
+		return 1;
+	}
+	if(NULL == (threads = (struct bench_thread *) calloc(maxthreads, sizeof(struct bench_thread))))
+	{
+		perror(progname);
+		return 1;
+	}
+	if(share)
+	{
+		/* Contexts without a transport of their own use this one */
+		if(NULL == (shared = bench_zone()))
+		{
+			perror(progname);
+			return 1;
+		}
+		radiodns_set_transport(NULL, shared);
+	}
+	printf("%8s %14s %14s %8s\n", "threads", "lookups/s", "per thread", "speedup");
+	base = 0;
+	/* Double the number of threads each time, ending with the most */
+	for(n = 1; ; n = (n * 2 < maxthreads ? n * 2 : maxthreads))
+	{
+		if(NULL == (cache = radiodns_cache_create()))
+		{
+			perror(progname);
+			return 1;
+		}
+		memset(threads, 0, n * sizeof(struct bench_thread));
+		ready = 0;
+		go = 0;
+		stop = 0;
+		for(c = 0; c < n; c++)
+		{
+			threads[c].seed = 0x9e3779b97f4a7c15ULL * (c + 1);
+			if(0 > bench_setup(&(threads[c])) || pthread_create(&(threads[c].thread), NULL, bench_run, &(threads[c])))
+			{
+				fprintf(stderr, "%s: failed to set up thread %d\n", progname, c);
+				return 1;
+			}
+		}
+		while(__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < n)
+		{
+			pause_ms(1);
+		}
+		start = now();
+		__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+		pause_ms(seconds * 1000L);
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		lookups = 0;
+		failures = 0;
+		for(c = 0; c < n; c++)
+		{
+			pthread_join(threads[c].thread, NULL);
+			lookups += threads[c].lookups;
+			failures += threads[c].failures;
+		}
+		elapsed = now() - start;
+		for(c = 0; c < n; c++)
+		{
+			bench_teardown(&(threads[c]));
+		}
+		radiodns_cache_destroy(cache);
+		rate = (double) lookups / elapsed;
+		if(!base)
+		{
+			base = rate;
+		}
+		printf("%8d %14.0f %14.0f %7.2fx\n", n, rate, rate / n, rate / base);
+		if(failures)
+		{
+			fprintf(stderr, "%s: %lu lookups failed with %d threads\n", progname, failures, n);
+			return 1;
+		}
+		if(n == maxthreads)
+		{
+			break;
+		}
+	}
+	free(threads);
+	radiodns_set_transport(NULL, NULL);
+	radiodns_transport_destroy(shared);
+	return 0;
+}
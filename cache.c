@@ -0,0 +1,830 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Shared application results. Each entry is keyed by the name of the
+ * application's records (_<name>._<protocol>.<target>), and holds a
+ * reference to the result found for it until its TTL expires. While an
+ * entry's result is being looked up, other operations in the same thread
+ * and on the same transport which want it wait for that lookup rather
+ * than repeating it.
+ *
+ * Nearly every lookup finds a result, often in several threads at once,
+ * so finding one takes no locks. Entries are spread across shards by
+ * hash, each with its own lock taken by those changing it, and readers
+ * instead announce the epoch they're reading in. Entries (and outgrown
+ * tables) which are removed are only freed once the epoch has moved on
+ * twice, which it can only do once every reader has seen it, and so
+ * nothing can still be looking at them. Anything which a reader can't
+ * find (because it's being looked up, or moved) is looked for again
+ * with the lock held.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* Number of shards, which is always a power of two */
+#define CACHE_SHARDS                    16
+/* Initial number of hash buckets in each shard, likewise */
+#define CACHE_BUCKETS                   16
+/* Size of a cache line, which separates things written by different
+ * threads
+ */
+#define CACHE_LINE                      64
+
+struct cache_entry
+{
+	struct cache_entry *next;
+	uint32_t hash;
+	char *key;
+	/* The result and when it expires, which are set once, or while app
+	 * is NULL, the lookup in progress
+	 */
+	radiodns_app_t *app;
+	int64_t expires;
+	radiodns_transport_t *transport;
+	const void *thread;
+	struct rdns_cache_wait *owner;
+	struct rdns_cache_wait *waiters;
+	/* Once removed, the epoch it was removed in, and the next entry
+	 * waiting to be freed
+	 */
+	unsigned long epoch;
+	struct cache_entry *retired;
+};
+
+struct cache_table
+{
+	size_t nbuckets;
+	struct cache_entry **buckets;
+	unsigned long epoch;
+	struct cache_table *retired;
+};
+
+struct cache_shard
+{
+	/* Read without the lock, but only replaced with it held */
+	struct cache_table *table;
+	size_t count;
+	struct cache_entry *retired;
+	struct cache_table *rtables;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+	char pad[CACHE_LINE];
+};
+
+struct radiodns_cache_struct
+{
+	unsigned long refs;
+	struct cache_shard shard[CACHE_SHARDS];
+};
+
+/* Each thread which looks for results has a reader, holding the epoch it
+ * is reading in (or zero when it isn't reading). Readers are never freed,
+ * but are reused once their threads have exited.
+ */
+struct cache_reader
+{
+	unsigned long epoch;
+	int used;
+	struct cache_reader *next;
+	char pad[CACHE_LINE];
+};
+
+static radiodns_cache_t *default_cache;
+
+static struct cache_reader *readers;
+static unsigned long cache_epoch = 1;
+static __thread struct cache_reader *reader;
+/* Identifies the current thread: its address differs in each */
+static __thread char cache_self;
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+#endif
+
+static struct cache_shard *cache_shard(radiodns_cache_t *cache, uint32_t hash);
+static struct cache_table *cache_table(size_t nbuckets);
+static struct cache_entry *cache_find(struct cache_shard *shard, const char *key, uint32_t hash, struct cache_entry ***prevp);
+static void cache_remove(struct cache_shard *shard, struct cache_entry **prev);
+static void cache_grow(struct cache_shard *shard, int64_t now);
+static void cache_reclaim(struct cache_shard *shard);
+static void cache_free(struct cache_entry *entry);
+static void cache_wake(radiodns_cache_t *cache, struct cache_shard *shard, struct rdns_cache_wait **waiters);
+static void cache_unlink(struct rdns_cache_wait *wait);
+static uint32_t cache_hash(const char *key);
+static struct cache_reader *cache_enter(void);
+static void cache_leave(struct cache_reader *r);
+static struct cache_reader *cache_reader(void);
+static unsigned long cache_advance(void);
+static void cache_lock(struct cache_shard *shard);
+static void cache_unlock(struct cache_shard *shard);
+#ifdef HAVE_PTHREAD_H
+static void cache_reader_init(void);
+static void cache_reader_exit(void *data);
+#endif
+
+/* Create a new, empty, cache of application results */
+radiodns_cache_t *
+radiodns_cache_create(void)
+{
+	radiodns_cache_t *cache;
+	int c;
+
+	if(NULL == (cache = (radiodns_cache_t *) rdns_calloc(NULL, 1, sizeof(radiodns_cache_t))))
+	{
+		return NULL;
+	}
+	for(c = 0; c < CACHE_SHARDS; c++)
+	{
+		if(NULL == (cache->shard[c].table = cache_table(CACHE_BUCKETS)))
+		{
+			while(c--)
+			{
+				rdns_free(NULL, cache->shard[c].table);
+#ifdef HAVE_PTHREAD_H
+				pthread_mutex_destroy(&(cache->shard[c].lock));
+#endif
+			}
+			rdns_free(NULL, cache);
+			return NULL;
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&(cache->shard[c].lock), NULL);
+#endif
+	}
+	cache->refs = 1;
+	return cache;
+}
+
+/* Release the caller's reference to a cache */
+void
+radiodns_cache_destroy(radiodns_cache_t *cache)
+{
+	rdns_cache_release(cache);
+}
+
+/* Set the cache used by a context, or the default for contexts without
+ * one of their own
+ */
+int
+radiodns_set_cache(radiodns_t *context, radiodns_cache_t *cache)
+{
+	radiodns_cache_t **p;
+
+	p = (context ? &(context->cache) : &default_cache);
+	rdns_cache_ref(cache);
+	rdns_cache_release(*p);
+	*p = cache;
+	return 0;
+}
+
+/* Take another reference to a result */
+radiodns_app_t *
+radiodns_app_ref(radiodns_app_t *app)
+{
+	if(app)
+	{
+		__atomic_add_fetch(&(app->_refs), 1, __ATOMIC_RELAXED);
+	}
+	return app;
+}
+
+/* Return the cache used by a context, or the default */
+radiodns_cache_t *
+rdns_cache(radiodns_t *context)
+{
+	if(context && context->cache)
+	{
+		return context->cache;
+	}
+	return default_cache;
+}
+
+void
+rdns_cache_ref(radiodns_cache_t *cache)
+{
+	if(cache)
+	{
+		__atomic_add_fetch(&(cache->refs), 1, __ATOMIC_RELAXED);
+	}
+}
+
+void
+rdns_cache_release(radiodns_cache_t *cache)
+{
+	struct cache_shard *shard;
+	struct cache_entry *entry;
+	struct cache_table *table;
+	size_t b;
+	int c;
+
+	if(!cache || __atomic_sub_fetch(&(cache->refs), 1, __ATOMIC_ACQ_REL))
+	{
+		return;
+	}
+	/* Lookups in progress hold references, so there are none, and
+	 * nothing can be reading
+	 */
+	for(c = 0; c < CACHE_SHARDS; c++)
+	{
+		shard = &(cache->shard[c]);
+		table = shard->table;
+		for(b = 0; b < table->nbuckets; b++)
+		{
+			while((entry = table->buckets[b]))
+			{
+				table->buckets[b] = entry->next;
+				cache_free(entry);
+			}
+		}
+		rdns_free(NULL, table);
+		while((entry = shard->retired))
+		{
+			shard->retired = entry->retired;
+			cache_free(entry);
+		}
+		while((table = shard->rtables))
+		{
+			shard->rtables = table->retired;
+			rdns_free(NULL, table);
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&(shard->lock));
+#endif
+	}
+	rdns_free(NULL, cache);
+}
+
+/* Look for the result named by key. If there's an unexpired one, a
+ * reference to it is stored in *app and RDNS_CACHE_HIT returned. If
+ * another operation in this thread is looking it up via the same
+ * transport, which must be one that processes queries in the background,
+ * wait is queued to be woken when it finishes, and RDNS_CACHE_WAIT
+ * returned.
+ * Otherwise, RDNS_CACHE_MISS is returned, and the caller must look it up
+ * and pass the result to rdns_cache_complete(), or give up with
+ * rdns_cache_abandon(). RDNS_CACHE_MISS is also returned (without
+ * anything further being necessary) if memory is short.
+ */
+int
+rdns_cache_begin(radiodns_cache_t *cache, const char *key, radiodns_transport_t *transport, struct rdns_cache_wait *wait, radiodns_app_t **app, unsigned long *ttl)
+{
+	struct cache_shard *shard;
+	struct cache_table *table;
+	struct cache_entry *entry, **prev, **bucket;
+	struct cache_reader *r;
+	radiodns_app_t *found;
+	uint32_t hash;
+	int64_t now;
+
+	hash = cache_hash(key);
+	shard = cache_shard(cache, hash);
+	now = rdns_now();
+	wait->cache = NULL;
+	wait->next = NULL;
+	wait->prev = NULL;
+	wait->app = NULL;
+	if((r = cache_enter()))
+	{
+		table = __atomic_load_n(&(shard->table), __ATOMIC_ACQUIRE);
+		entry = __atomic_load_n(&(table->buckets[hash & (table->nbuckets - 1)]), __ATOMIC_ACQUIRE);
+		for(; entry; entry = __atomic_load_n(&(entry->next), __ATOMIC_ACQUIRE))
+		{
+			if(entry->hash != hash || strcasecmp(entry->key, key))
+			{
+				continue;
+			}
+			if((found = __atomic_load_n(&(entry->app), __ATOMIC_ACQUIRE)) && entry->expires > now)
+			{
+				/* The cache's own reference outlives this epoch */
+				*app = radiodns_app_ref(found);
+				*ttl = (unsigned long) ((entry->expires - now + 999) / 1000);
+				cache_leave(r);
+				return RDNS_CACHE_HIT;
+			}
+			break;
+		}
+		cache_leave(r);
+	}
+	cache_lock(shard);
+	if((entry = cache_find(shard, key, hash, &prev)))
+	{
+		if(entry->owner)
+		{
+			if(entry->transport == transport && entry->thread == &cache_self &&
+			   transport->submit && transport->process)
+			{
+				wait->next = entry->waiters;
+				if(wait->next)
+				{
+					wait->next->prev = &(wait->next);
+				}
+				wait->prev = &(entry->waiters);
+				entry->waiters = wait;
+				wait->cache = cache;
+				cache_unlock(shard);
+				rdns_cache_ref(cache);
+				return RDNS_CACHE_WAIT;
+			}
+			/* Only the thread driving the lookup can wake us, by
+			 * processing the transport while we wait for it; those on
+			 * other threads or transports, or on transports which
+			 * can't be processed, just look it up again
+			 */
+			cache_unlock(shard);
+			return RDNS_CACHE_MISS;
+		}
+		if(entry->expires > now)
+		{
+			*app = radiodns_app_ref(entry->app);
+			*ttl = (unsigned long) ((entry->expires - now + 999) / 1000);
+			cache_unlock(shard);
+			return RDNS_CACHE_HIT;
+		}
+		cache_remove(shard, prev);
+	}
+	if(shard->count >= shard->table->nbuckets)
+	{
+		cache_grow(shard, now);
+	}
+	if(NULL == (entry = (struct cache_entry *) rdns_calloc(NULL, 1, sizeof(struct cache_entry))) ||
+	   NULL == (entry->key = rdns_strdup(NULL, key)))
+	{
+		rdns_free(NULL, entry);
+		cache_reclaim(shard);
+		cache_unlock(shard);
+		return RDNS_CACHE_MISS;
+	}
+	entry->hash = hash;
+	entry->transport = transport;
+	entry->thread = &cache_self;
+	entry->owner = wait;
+	bucket = &(shard->table->buckets[hash & (shard->table->nbuckets - 1)]);
+	entry->next = *bucket;
+	__atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+	shard->count++;
+	wait->cache = cache;
+	cache_reclaim(shard);
+	cache_unlock(shard);
+	rdns_cache_ref(cache);
+	return RDNS_CACHE_MISS;
+}
+
+/* Record the outcome of a lookup begun by rdns_cache_begin(), and wake
+ * those waiting for it. app (which may be NULL) is shared, and kept for
+ * ttl seconds unless that's zero.
+ */
+void
+rdns_cache_complete(struct rdns_cache_wait *owner, const char *key, radiodns_app_t *app, unsigned long ttl, int err, int herrno)
+{
+	radiodns_cache_t *cache;
+	struct cache_shard *shard;
+	struct cache_entry *entry, **prev;
+	struct rdns_cache_wait *waiters, *w;
+	uint32_t hash;
+
+	if(!(cache = owner->cache))
+	{
+		return;
+	}
+	owner->cache = NULL;
+	waiters = NULL;
+	hash = cache_hash(key);
+	shard = cache_shard(cache, hash);
+	cache_lock(shard);
+	if((entry = cache_find(shard, key, hash, &prev)) && entry->owner == owner)
+	{
+		if((waiters = entry->waiters))
+		{
+			waiters->prev = &waiters;
+		}
+		entry->waiters = NULL;
+		entry->owner = NULL;
+		if(app && ttl)
+		{
+			entry->expires = rdns_now() + (int64_t) ttl * 1000;
+			__atomic_store_n(&(entry->app), radiodns_app_ref(app), __ATOMIC_RELEASE);
+		}
+		else
+		{
+			cache_remove(shard, prev);
+		}
+		for(w = waiters; w; w = w->next)
+		{
+			w->app = radiodns_app_ref(app);
+			w->ttl = ttl;
+			w->err = err;
+			w->herrno = herrno;
+			w->abandoned = 0;
+		}
+	}
+	cache_reclaim(shard);
+	cache_unlock(shard);
+	cache_wake(cache, shard, &waiters);
+	rdns_cache_release(cache);
+}
+
+/* Stop waiting for, or looking up, a result. If wait was looking it up,
+ * those waiting for it are woken with their abandoned flags set, and
+ * should try again.
+ */
+void
+rdns_cache_abandon(struct rdns_cache_wait *wait, const char *key)
+{
+	radiodns_cache_t *cache;
+	struct cache_shard *shard;
+	struct cache_entry *entry, **prev;
+	struct rdns_cache_wait *waiters, *w;
+	uint32_t hash;
+
+	if(!(cache = wait->cache))
+	{
+		return;
+	}
+	wait->cache = NULL;
+	waiters = NULL;
+	hash = cache_hash(key);
+	shard = cache_shard(cache, hash);
+	cache_lock(shard);
+	if(wait->prev)
+	{
+		/* Still waiting, or about to be woken */
+		cache_unlink(wait);
+	}
+	else if((entry = cache_find(shard, key, hash, &prev)) && entry->owner == wait)
+	{
+		if((waiters = entry->waiters))
+		{
+			waiters->prev = &waiters;
+		}
+		entry->waiters = NULL;
+		cache_remove(shard, prev);
+		for(w = waiters; w; w = w->next)
+		{
+			w->abandoned = 1;
+		}
+	}
+	cache_reclaim(shard);
+	cache_unlock(shard);
+	radiodns_destroy_app(wait->app);
+	wait->app = NULL;
+	cache_wake(cache, shard, &waiters);
+	rdns_cache_release(cache);
+}
+
+/* Wake waiters, one at a time, with the shard unlocked. Each may restart
+ * its lookup, or cause others still in the list to be abandoned (and
+ * unlinked from it).
+ */
+static void
+cache_wake(radiodns_cache_t *cache, struct cache_shard *shard, struct rdns_cache_wait **waiters)
+{
+	struct rdns_cache_wait *w;
+
+	for(;;)
+	{
+		cache_lock(shard);
+		if((w = *waiters))
+		{
+			cache_unlink(w);
+		}
+		cache_unlock(shard);
+		if(!w)
+		{
+			break;
+		}
+		w->cache = NULL;
+		w->wake(w);
+		rdns_cache_release(cache);
+	}
+}
+
+static void
+cache_unlink(struct rdns_cache_wait *wait)
+{
+	*(wait->prev) = wait->next;
+	if(wait->next)
+	{
+		wait->next->prev = wait->prev;
+	}
+	wait->next = NULL;
+	wait->prev = NULL;
+}
+
+static struct cache_shard *
+cache_shard(radiodns_cache_t *cache, uint32_t hash)
+{
+	/* Buckets are chosen by the low bits */
+	return &(cache->shard[(hash >> 24) & (CACHE_SHARDS - 1)]);
+}
+
+/* Allocate an empty table of nbuckets buckets, all in one block */
+static struct cache_table *
+cache_table(size_t nbuckets)
+{
+	struct cache_table *table;
+
+	if(NULL == (table = (struct cache_table *) rdns_calloc(NULL, 1, sizeof(struct cache_table) + nbuckets * sizeof(struct cache_entry *))))
+	{
+		return NULL;
+	}
+	table->nbuckets = nbuckets;
+	table->buckets = (struct cache_entry **) (table + 1);
+	return table;
+}
+
+static struct cache_entry *
+cache_find(struct cache_shard *shard, const char *key, uint32_t hash, struct cache_entry ***prevp)
+{
+	struct cache_entry **prev;
+
+	for(prev = &(shard->table->buckets[hash & (shard->table->nbuckets - 1)]); *prev; prev = &((*prev)->next))
+	{
+		if((*prev)->hash == hash && !strcasecmp((*prev)->key, key))
+		{
+			*prevp = prev;
+			return *prev;
+		}
+	}
+	return NULL;
+}
+
+/* Unlink an entry, leaving it to be freed once nothing can be reading it */
+static void
+cache_remove(struct cache_shard *shard, struct cache_entry **prev)
+{
+	struct cache_entry *entry;
+
+	entry = *prev;
+	__atomic_store_n(prev, entry->next, __ATOMIC_RELEASE);
+	shard->count--;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	entry->epoch = __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST);
+	entry->retired = shard->retired;
+	shard->retired = entry;
+}
+
+/* Discard expired entries, and if that doesn't make enough room, double
+ * the number of buckets. Entries are moved to the new table in place, so
+ * a reader following a chain meanwhile may miss the entry it's after
+ * (and look again with the lock held), but never loses its way.
+ */
+static void
+cache_grow(struct cache_shard *shard, int64_t now)
+{
+	struct cache_table *table, *old;
+	struct cache_entry **prev, *entry, **bucket;
+	size_t c;
+
+	old = shard->table;
+	for(c = 0; c < old->nbuckets; c++)
+	{
+		for(prev = &(old->buckets[c]); *prev; )
+		{
+			if(!(*prev)->owner && (*prev)->expires <= now)
+			{
+				cache_remove(shard, prev);
+				continue;
+			}
+			prev = &((*prev)->next);
+		}
+	}
+	if(shard->count * 2 < old->nbuckets)
+	{
+		return;
+	}
+	if(NULL == (table = cache_table(old->nbuckets * 2)))
+	{
+		/* Carry on with longer chains */
+		return;
+	}
+	for(c = 0; c < old->nbuckets; c++)
+	{
+		while((entry = old->buckets[c]))
+		{
+			__atomic_store_n(&(old->buckets[c]), entry->next, __ATOMIC_RELEASE);
+			bucket = &(table->buckets[entry->hash & (table->nbuckets - 1)]);
+			__atomic_store_n(&(entry->next), *bucket, __ATOMIC_RELEASE);
+			*bucket = entry;
+		}
+	}
+	__atomic_store_n(&(shard->table), table, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	old->epoch = __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST);
+	old->retired = shard->rtables;
+	shard->rtables = old;
+}
+
+/* Free whatever was removed from a shard long enough ago */
+static void
+cache_reclaim(struct cache_shard *shard)
+{
+	struct cache_entry **prev, *entry;
+	struct cache_table **tprev, *table;
+	unsigned long epoch;
+
+	if(!shard->retired && !shard->rtables)
+	{
+		return;
+	}
+	epoch = cache_advance();
+	for(prev = &(shard->retired); (entry = *prev); )
+	{
+		if(entry->epoch + 2 <= epoch)
+		{
+			*prev = entry->retired;
+			cache_free(entry);
+			continue;
+		}
+		prev = &(entry->retired);
+	}
+	for(tprev = &(shard->rtables); (table = *tprev); )
+	{
+		if(table->epoch + 2 <= epoch)
+		{
+			*tprev = table->retired;
+			rdns_free(NULL, table);
+			continue;
+		}
+		tprev = &(table->retired);
+	}
+}
+
+static void
+cache_free(struct cache_entry *entry)
+{
+	radiodns_destroy_app(entry->app);
+	rdns_free(NULL, entry->key);
+	rdns_free(NULL, entry);
+}
+
+/* FNV-1a, ignoring case as DNS does */
+static uint32_t
+cache_hash(const char *key)
+{
+	uint32_t hash;
+
+	for(hash = 2166136261U; *key; key++)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) *key);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Announce that this thread is reading, in the current epoch. Returns
+ * NULL if the thread has no reader and one can't be allocated, in which
+ * case the caller must take the lock instead.
+ */
+static struct cache_reader *
+cache_enter(void)
+{
+	struct cache_reader *r;
+	unsigned long epoch, now;
+
+	if(!(r = reader) && !(r = cache_reader()))
+	{
+		return NULL;
+	}
+	epoch = __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST);
+	for(;;)
+	{
+		__atomic_store_n(&(r->epoch), epoch, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(epoch == (now = __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST)))
+		{
+			return r;
+		}
+		epoch = now;
+	}
+}
+
+static void
+cache_leave(struct cache_reader *r)
+{
+	__atomic_store_n(&(r->epoch), 0, __ATOMIC_RELEASE);
+}
+
+/* Find this thread a reader, reusing one left by a thread which has
+ * exited if there is one
+ */
+static struct cache_reader *
+cache_reader(void)
+{
+	struct cache_reader *r;
+	int unused;
+
+	for(r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next)
+	{
+		unused = 0;
+		if(__atomic_compare_exchange_n(&(r->used), &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	if(!r)
+	{
+		if(NULL == (r = (struct cache_reader *) rdns_calloc(NULL, 1, sizeof(struct cache_reader))))
+		{
+			return NULL;
+		}
+		r->used = 1;
+		r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&readers, &(r->next), r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		{
+		}
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_once(&reader_once, cache_reader_init);
+	pthread_setspecific(reader_key, r);
+#endif
+	reader = r;
+	return r;
+}
+
+/* Move on to the next epoch if every reader has seen the current one,
+ * returning whichever is now current
+ */
+static unsigned long
+cache_advance(void)
+{
+	struct cache_reader *r;
+	unsigned long epoch, seen;
+
+	epoch = __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST);
+	for(r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next)
+	{
+		seen = __atomic_load_n(&(r->epoch), __ATOMIC_SEQ_CST);
+		if(seen && seen != epoch)
+		{
+			return epoch;
+		}
+	}
+	if(__atomic_compare_exchange_n(&cache_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	{
+		return epoch + 1;
+	}
+	return epoch;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void
+cache_reader_init(void)
+{
+	pthread_key_create(&reader_key, cache_reader_exit);
+}
+
+/* A thread with a reader has exited, so let another have it */
+static void
+cache_reader_exit(void *data)
+{
+	struct cache_reader *r;
+
+	r = (struct cache_reader *) data;
+	reader = NULL;
+	__atomic_store_n(&(r->used), 0, __ATOMIC_RELEASE);
+}
+#endif
+
+static void
+cache_lock(struct cache_shard *shard)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&(shard->lock));
+#else
+	(void) shard;
+#endif
+}
+
+static void
+cache_unlock(struct cache_shard *shard)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&(shard->lock));
+#else
+	(void) shard;
+#endif
+}
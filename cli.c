@@ -30,6 +30,9 @@
 
 #include "radiodns.h"
 
+/* Maximum number of applications which -app can look up at once */
+#define RDNS_CLI_MAXAPPS                16
+
 static int cmd_dns(int argc, char **argv);
 static int cmd_fm(int argc, char **argv);
 static int cmd_dab(int argc, char **argv);
@@ -41,7 +44,12 @@ static int cmd_domain(int argc, char **argv);
 static int cmd_target(int argc, char **argv);
 static int cmd_verbose(int argc, char **argv);
 static int cmd_quiet(int argc, char **argv);
+static int cmd_zone(int argc, char **argv);
+static int cmd_tcp(int argc, char **argv);
+static int cmd_udp(int argc, char **argv);
+static int cmd_uring(int argc, char **argv);
 static int cmd_app(int argc, char **argv);
+static void print_app(radiodns_app_t *app);
 static int cmd_help(int argc, char **argv);
 static int cmd_interactive(int argc, char **argv);
 static int cmd_exit(int argc, char **argv);
@@ -71,7 +79,11 @@ static struct command commands[] = {
 	{ "domain", cmd_domain, 0, 0, 0, 1, 1, "Print the domain name of a context", NULL },
 	{ "verbose", cmd_verbose, 0, 0, 1, 0, 1, "Be verbose", NULL },
 	{ "quiet", cmd_quiet, 0, 0, 1, 0, 1, "Don't be verbose", NULL },
-	{ "app", cmd_app, 1, 0, 0, 1, 1, "Look up records for an application", "TYPE" },
+	{ "zone", cmd_zone, 1, 0, 1, 0, 1, "Answer queries from a zone file instead of DNS", "FILE" },
+	{ "tcp", cmd_tcp, 0, 0, 1, 0, 1, "Send queries over persistent TCP connections", NULL },
+	{ "udp", cmd_udp, 0, 0, 1, 0, 1, "Send queries using the batched UDP engine", NULL },
+	{ "uring", cmd_uring, 0, 0, 1, 0, 1, "Send queries using the batched UDP engine and io_uring", NULL },
+	{ "app", cmd_app, 1, 0, 0, 1, 1, "Look up records for one or more applications", "TYPE[,TYPE...]" },
 	{ "help", cmd_help, 0, 0, 1, 0, 1, "Show command list", NULL },
 	{ "interactive", cmd_interactive, 0, 0, 1, 0, 0, NULL, NULL },
 	{ "exit", cmd_exit, 0, 0, 0, 0, 1, "Exit interactive mode", NULL },
@@ -82,6 +94,7 @@ static struct command commands[] = {
 const char *progname;
 static struct command *current_command;
 static radiodns_t *context;
+static radiodns_transport_t *transport;
 static int verbose = -1;
 static int interactive_mode = 0;
 
@@ -109,12 +122,17 @@ usage()
 		fprintf(stderr, "OPTIONS can include any of the following flags:\n");
 		fprintf(stderr, " -quiet        Be quiet\n");
 		fprintf(stderr, " -verbose      Be verbose\n");
-		fprintf(stderr, " -interactive  Enter interactive mode\n\n");
+		fprintf(stderr, " -interactive  Enter interactive mode\n");
+		fprintf(stderr, " -tcp          Send queries over persistent TCP connections\n");
+		fprintf(stderr, " -udp          Send queries using the batched UDP engine\n");
+		fprintf(stderr, " -uring        As -udp, but using io_uring where available\n");
+		fprintf(stderr, " -zone FILE    Answer queries from records in FILE instead of DNS\n\n");
 
 		fprintf(stderr, "OPTIONS can also include any of the following commands:\n");
 		fprintf(stderr, " -target       Print the application-discovery target domain name.\n");
 		fprintf(stderr, " -domain       Print the source (constructed) domain name.\n");
-		fprintf(stderr, " -app NAME     Look for instances of _NAME._tcp within the target domain.\n\n");
+		fprintf(stderr, " -app NAME     Look for instances of _NAME._tcp within the target domain.\n");
+		fprintf(stderr, "               Several comma-separated NAMEs are looked up at once.\n\n");
 
 		fprintf(stderr, "If no OPTIONS are supplied, behaviour is as if -domain -target were\n");
 		fprintf(stderr, "specified on the command-line, and the 'verbose' flag is enabled unless\n");
@@ -555,22 +573,156 @@ cmd_quiet(int argc, char **argv)
 	return 0;
 }
 
+static int
+cmd_zone(int argc, char **argv)
+{
+	if(argc != 2)
+	{
+		usage();
+		return 1;
+	}
+	if(!transport && !(transport = radiodns_transport_zone()))
+	{
+		fprintf(stderr, "%s: failed to create zone: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	if(0 > radiodns_zone_load(transport, argv[1]))
+	{
+		fprintf(stderr, "%s: %s: failed to load zone: %s\n", progname, argv[1], strerror(errno));
+		return 1;
+	}
+	radiodns_set_transport(NULL, transport);
+	return 0;
+}
+
+static int
+cmd_tcp(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	if(transport)
+	{
+		fprintf(stderr, "%s: only one of -tcp, -udp, -uring and -zone may be specified\n", progname);
+		return 1;
+	}
+	if(!(transport = radiodns_transport_tcp()))
+	{
+		fprintf(stderr, "%s: failed to create TCP transport: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	radiodns_set_transport(NULL, transport);
+	return 0;
+}
+
+static int
+cmd_udp(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	if(transport)
+	{
+		fprintf(stderr, "%s: only one of -tcp, -udp, -uring and -zone may be specified\n", progname);
+		return 1;
+	}
+	if(!(transport = radiodns_transport_udp()))
+	{
+		fprintf(stderr, "%s: failed to create UDP transport: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	radiodns_set_transport(NULL, transport);
+	return 0;
+}
+
+static int
+cmd_uring(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	if(transport)
+	{
+		fprintf(stderr, "%s: only one of -tcp, -udp, -uring and -zone may be specified\n", progname);
+		return 1;
+	}
+	if(!(transport = radiodns_transport_uring()))
+	{
+		fprintf(stderr, "%s: failed to create UDP transport: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	radiodns_set_transport(NULL, transport);
+	return 0;
+}
+
 static int
 cmd_app(int argc, char **argv)
 {
-	radiodns_app_t *app, *p;
-	int c;
+	radiodns_app_t *apps[RDNS_CLI_MAXAPPS];
+	const char *names[RDNS_CLI_MAXAPPS];
+	char *buf, *t;
+	int c, count, found;
 
 	if(argc != 2)
 	{
 		usage();
 		return 1;
 	}
-	if(!(app = radiodns_resolve_app(context, argv[1], NULL)))
+	if(!(buf = strdup(argv[1])))
 	{
-		fprintf(stderr, "%s: no instances found\n", argv[1]);
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
 		return 1;
 	}
+	/* Several applications may be given, separated by commas, in which
+	 * case they're all looked up at once
+	 */
+	count = 0;
+	for(t = strtok(buf, ","); t; t = strtok(NULL, ","))
+	{
+		if(count == RDNS_CLI_MAXAPPS)
+		{
+			fprintf(stderr, "%s: at most %d applications may be specified\n", argv[1], RDNS_CLI_MAXAPPS);
+			free(buf);
+			return 1;
+		}
+		names[count] = t;
+		count++;
+	}
+	if(!count)
+	{
+		free(buf);
+		usage();
+		return 1;
+	}
+	found = radiodns_resolve_apps(context, names, count, NULL, apps);
+	for(c = 0; c < count && found >= 0; c++)
+	{
+		if(!apps[c])
+		{
+			fprintf(stderr, "%s: no instances found\n", names[c]);
+			continue;
+		}
+		if(count > 1)
+		{
+			printf("Application \"%s\":\n", names[c]);
+		}
+		print_app(apps[c]);
+		radiodns_destroy_app(apps[c]);
+	}
+	if(found < 0)
+	{
+		fprintf(stderr, "%s: no instances found\n", argv[1]);
+	}
+	free(buf);
+	return (found > 0 ? 0 : 1);
+}
+
+static void
+print_app(radiodns_app_t *app)
+{
+	radiodns_app_t *p;
+	int c;
+
 	for(p = app; p; p = p->next)
 	{
 		if(p->name)
@@ -610,8 +762,6 @@ cmd_app(int argc, char **argv)
 			printf("    %s = %s\n", p->params[c].key, p->params[c].value);
 		}
 	}
-	radiodns_destroy_app(app);
-	return 0;
 }
 
 static int
@@ -857,6 +1007,7 @@ main(int argc, char **argv)
 		r = cmd_target(0, NULL);	   
 	}
 	radiodns_destroy(context);	
+	radiodns_transport_destroy(transport);
 	return r;
 }
 
@@ -0,0 +1,708 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* The client side of radiodnsd's protocol (described in p_radiodns.h),
+ * and the message encoding it shares with the daemon. When the daemon is
+ * listening, the synchronous resolution functions pass requests for
+ * contexts using the system resolver to it, rather than querying DNS
+ * themselves, so that every process on a host shares its cache. If it
+ * isn't, they resolve as they would otherwise, and try the daemon again
+ * a little later.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/un.h>
+
+/* How long to leave it before trying to connect to the daemon again after
+ * failing to, in milliseconds
+ */
+#define DAEMON_RETRY                    5000
+/* The largest response accepted from the daemon */
+#define DAEMON_MAXRESPONSE              (1024 * 1024)
+/* How long to wait for the daemon to send anything before giving up on it,
+ * in milliseconds
+ */
+#define DAEMON_TIMEOUT                  30000
+/* How often to check for the context being cancelled while waiting, in
+ * milliseconds
+ */
+#define DAEMON_POLL                     100
+
+/* The path set by radiodns_set_daemon(), if any */
+static char *daemon_path;
+static int daemon_disabled;
+/* The time before which not to try connecting again */
+static int64_t daemon_retry;
+
+static int daemon_connect(void);
+static int daemon_send(int fd, struct rdns_buf *buf);
+static int daemon_recv(int fd, struct rdns_buf *buf, radiodns_t *context, unsigned long cancels);
+static int daemon_read(int fd, unsigned char *p, size_t len, radiodns_t *context, unsigned long cancels);
+static void daemon_failed(void);
+static int buf_reserve(struct rdns_buf *buf, size_t len);
+static size_t buf_skip(struct rdns_buf *buf);
+
+/* Set the path of the socket radiodnsd listens on, or disable use of the
+ * daemon if path is NULL
+ */
+int
+radiodns_set_daemon(const char *path)
+{
+	char *p;
+
+	p = NULL;
+	if(path && NULL == (p = rdns_strdup(NULL, path)))
+	{
+		return -1;
+	}
+	rdns_free(NULL, daemon_path);
+	daemon_path = p;
+	daemon_disabled = (path == NULL);
+	__atomic_store_n(&daemon_retry, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+rdns_daemon_resolve(radiodns_t *context, const char *const *names, int count, const char *protocol, radiodns_app_t **apps)
+{
+	struct rdns_buf buf;
+	radiodns_app_t *app;
+	char *target, *seen;
+	int fd, c, n, found, err, herrno, failed, cancelled;
+	uint32_t id, ttl, app_ttl;
+	unsigned long cancels;
+
+	/* Contexts using a transport of their own choosing keep using it, and
+	 * the daemon can't be asked to keep to a deadline
+	 */
+	if(rdns_transport(context) != radiodns_transport_libresolv() || context->deadline)
+	{
+		return -2;
+	}
+	cancels = __atomic_load_n(&(context->cancels), __ATOMIC_RELAXED);
+	if(0 > (fd = daemon_connect()))
+	{
+		return -2;
+	}
+	/* Which IDs have been answered, so that a repeated one can't replace
+	 * an earlier result
+	 */
+	if(NULL == (seen = (char *) rdns_calloc(NULL, (count ? count : 1), 1)))
+	{
+		close(fd);
+		h_errno = NETDB_INTERNAL;
+		return -1;
+	}
+	if(!protocol)
+	{
+		protocol = "tcp";
+	}
+	for(c = 0; c < count; c++)
+	{
+		apps[c] = NULL;
+	}
+	/* Send all of the requests at once, with the index of each as its
+	 * ID, then gather the responses as they arrive
+	 */
+	memset(&buf, 0, sizeof(buf));
+	for(c = 0; c < (count ? count : 1); c++)
+	{
+		rdns_put_u32(&buf, 0);
+		n = buf.len;
+		rdns_put_u32(&buf, c);
+		rdns_put_u8(&buf, (count ? RDNS_DAEMON_APP : RDNS_DAEMON_TARGET));
+		rdns_put_str(&buf, context->domain);
+		if(count)
+		{
+			rdns_put_str(&buf, names[c]);
+			rdns_put_str(&buf, protocol);
+		}
+		if(!buf.err)
+		{
+			buf.data[n - 4] = (buf.len - n) >> 24;
+			buf.data[n - 3] = (buf.len - n) >> 16;
+			buf.data[n - 2] = (buf.len - n) >> 8;
+			buf.data[n - 1] = (buf.len - n);
+		}
+	}
+	if(buf.err || daemon_send(fd, &buf))
+	{
+		rdns_free(NULL, buf.data);
+		rdns_free(NULL, seen);
+		close(fd);
+		daemon_failed();
+		return -2;
+	}
+	found = 0;
+	failed = 0;
+	cancelled = 0;
+	errno = 0;
+	h_errno = 0;
+	for(n = 0; n < (count ? count : 1); n++)
+	{
+		if(daemon_recv(fd, &buf, context, cancels))
+		{
+			cancelled = (errno == ECANCELED);
+			break;
+		}
+		id = rdns_get_u32(&buf);
+		err = (int) rdns_get_u32(&buf);
+		herrno = (int) rdns_get_u32(&buf);
+		ttl = rdns_get_u32(&buf);
+		target = rdns_get_str(&buf);
+		app = NULL;
+		app_ttl = 0;
+		if(count)
+		{
+			app_ttl = rdns_get_u32(&buf);
+			app = rdns_get_app(&buf, rdns_allocator(context), rdns_intern(context));
+		}
+		if(buf.err || id >= (uint32_t) (count ? count : 1) || seen[id])
+		{
+			rdns_free(NULL, target);
+			radiodns_destroy_app(app);
+			break;
+		}
+		seen[id] = 1;
+		if(target && !target[0])
+		{
+			rdns_free(NULL, target);
+			target = NULL;
+		}
+		if(target)
+		{
+			context->target_ttl = ttl;
+			if(context->target && !strcmp(context->target, target))
+			{
+				/* Unchanged: keep the string, which the holders of a
+				 * shared context may be using
+				 */
+				rdns_free(NULL, target);
+				target = context->target;
+			}
+			else
+			{
+				rdns_free(NULL, context->target);
+				context->target = target;
+			}
+		}
+		if(count)
+		{
+			apps[id] = app;
+		}
+		if(app)
+		{
+			if(!found || app_ttl < context->app_ttl)
+			{
+				context->app_ttl = app_ttl;
+			}
+			found++;
+		}
+		else if(!failed && (count || !target))
+		{
+			/* Report the first failure, or the only one */
+			failed = 1;
+			errno = err;
+			h_errno = (herrno ? herrno : (err ? NETDB_INTERNAL : 0));
+		}
+	}
+	rdns_free(NULL, buf.data);
+	rdns_free(NULL, seen);
+	close(fd);
+	if(cancelled)
+	{
+		/* Return whatever arrived in time, as a resolution of our own
+		 * would have
+		 */
+		errno = ECANCELED;
+		h_errno = NETDB_INTERNAL;
+		return (count ? found : -1);
+	}
+	if(n < (count ? count : 1))
+	{
+		for(c = 0; c < count; c++)
+		{
+			radiodns_destroy_app(apps[c]);
+			apps[c] = NULL;
+		}
+		if(buf.err == ENOMEM)
+		{
+			/* Not the daemon's fault */
+			errno = ENOMEM;
+			h_errno = NETDB_INTERNAL;
+			return -1;
+		}
+		/* The daemon went away or stalled before answering everything,
+		 * or sent something it shouldn't have
+		 */
+		daemon_failed();
+		return -2;
+	}
+	if(!count)
+	{
+		return (failed ? -1 : 0);
+	}
+	return found;
+}
+
+/* Connect to the daemon, unless it's been disabled, or recently couldn't
+ * be reached
+ */
+static int
+daemon_connect(void)
+{
+	struct sockaddr_un sun;
+	const char *path;
+	int fd;
+
+	if(daemon_disabled)
+	{
+		return -1;
+	}
+	if(!(path = daemon_path) && !(path = getenv("RADIODNS_SOCKET")))
+	{
+		path = RADIODNS_SOCKET;
+	}
+	if(!path[0] || strlen(path) >= sizeof(sun.sun_path))
+	{
+		return -1;
+	}
+	if(rdns_now() < __atomic_load_n(&daemon_retry, __ATOMIC_RELAXED))
+	{
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if(0 > (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)))
+	{
+		return -1;
+	}
+	if(connect(fd, (struct sockaddr *) &sun, sizeof(sun)))
+	{
+		close(fd);
+		daemon_failed();
+		return -1;
+	}
+	return fd;
+}
+
+static int
+daemon_send(int fd, struct rdns_buf *buf)
+{
+	size_t c;
+	ssize_t r;
+
+	for(c = 0; c < buf->len; c += r)
+	{
+		if(0 > (r = send(fd, buf->data + c, buf->len - c, MSG_NOSIGNAL)))
+		{
+			if(errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Read the next message into buf, ready for parsing */
+static int
+daemon_recv(int fd, struct rdns_buf *buf, radiodns_t *context, unsigned long cancels)
+{
+	size_t len;
+
+	if(buf_reserve(buf, 4) || daemon_read(fd, buf->data, 4, context, cancels))
+	{
+		return -1;
+	}
+	len = ((size_t) buf->data[0] << 24) | ((size_t) buf->data[1] << 16) | ((size_t) buf->data[2] << 8) | buf->data[3];
+	if(len > DAEMON_MAXRESPONSE || buf_reserve(buf, len + 4) || daemon_read(fd, buf->data + 4, len, context, cancels))
+	{
+		return -1;
+	}
+	buf->len = len + 4;
+	buf->pos = 4;
+	buf->err = 0;
+	return 0;
+}
+
+/* Read exactly len bytes, failing with ETIMEDOUT if the daemon sends
+ * nothing for too long, or ECANCELED if the context is cancelled while
+ * waiting
+ */
+static int
+daemon_read(int fd, unsigned char *p, size_t len, radiodns_t *context, unsigned long cancels)
+{
+	struct pollfd pfd;
+	int64_t idle;
+	ssize_t r;
+
+	idle = rdns_now() + DAEMON_TIMEOUT;
+	while(len)
+	{
+		if(cancels != __atomic_load_n(&(context->cancels), __ATOMIC_RELAXED))
+		{
+			errno = ECANCELED;
+			return -1;
+		}
+		if(rdns_now() >= idle)
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if(0 >= (r = poll(&pfd, 1, DAEMON_POLL)))
+		{
+			if(r < 0 && errno != EINTR)
+			{
+				return -1;
+			}
+			continue;
+		}
+		if(0 >= (r = recv(fd, p, len, MSG_DONTWAIT)))
+		{
+			if(r < 0 && (errno == EINTR || errno == EAGAIN))
+			{
+				continue;
+			}
+			return -1;
+		}
+		p += r;
+		len -= r;
+		idle = rdns_now() + DAEMON_TIMEOUT;
+	}
+	return 0;
+}
+
+/* Stop using the daemon for a while, so that processes don't spend their
+ * time trying to connect to one which isn't running
+ */
+static void
+daemon_failed(void)
+{
+	__atomic_store_n(&daemon_retry, rdns_now() + DAEMON_RETRY, __ATOMIC_RELAXED);
+}
+
+/* Make room for at least len bytes in a buffer */
+static int
+buf_reserve(struct rdns_buf *buf, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if(len <= buf->size)
+	{
+		return 0;
+	}
+	for(size = (buf->size ? buf->size : 256); size < len; size *= 2);
+	if(NULL == (p = (unsigned char *) rdns_realloc(NULL, buf->data, size)))
+	{
+		buf->err = ENOMEM;
+		return -1;
+	}
+	buf->data = p;
+	buf->size = size;
+	return 0;
+}
+
+/* Skip over a string, returning its length */
+static size_t
+buf_skip(struct rdns_buf *buf)
+{
+	size_t len;
+
+	len = rdns_get_u16(buf);
+	if(buf->err || len > buf->len - buf->pos)
+	{
+		buf->err = EINVAL;
+		return 0;
+	}
+	buf->pos += len;
+	return len;
+}
+
+void
+rdns_put_u8(struct rdns_buf *buf, unsigned int value)
+{
+	if(buf->err || buf_reserve(buf, buf->len + 1))
+	{
+		return;
+	}
+	buf->data[buf->len] = value;
+	buf->len++;
+}
+
+void
+rdns_put_u16(struct rdns_buf *buf, unsigned int value)
+{
+	rdns_put_u8(buf, (value >> 8) & 0xff);
+	rdns_put_u8(buf, value & 0xff);
+}
+
+void
+rdns_put_u32(struct rdns_buf *buf, uint32_t value)
+{
+	rdns_put_u16(buf, value >> 16);
+	rdns_put_u16(buf, value & 0xffff);
+}
+
+void
+rdns_put_u64(struct rdns_buf *buf, uint64_t value)
+{
+	rdns_put_u32(buf, value >> 32);
+	rdns_put_u32(buf, value & 0xffffffff);
+}
+
+/* NULL is encoded as an empty string */
+void
+rdns_put_str(struct rdns_buf *buf, const char *str)
+{
+	size_t len;
+
+	len = (str ? strlen(str) : 0);
+	if(len > 0xffff)
+	{
+		buf->err = ENAMETOOLONG;
+		return;
+	}
+	rdns_put_u16(buf, len);
+	if(buf->err || !len || buf_reserve(buf, buf->len + len))
+	{
+		return;
+	}
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+unsigned int
+rdns_get_u8(struct rdns_buf *buf)
+{
+	if(buf->err || buf->pos >= buf->len)
+	{
+		buf->err = EINVAL;
+		return 0;
+	}
+	buf->pos++;
+	return buf->data[buf->pos - 1];
+}
+
+unsigned int
+rdns_get_u16(struct rdns_buf *buf)
+{
+	unsigned int value;
+
+	value = rdns_get_u8(buf) << 8;
+	return value | rdns_get_u8(buf);
+}
+
+uint32_t
+rdns_get_u32(struct rdns_buf *buf)
+{
+	uint32_t value;
+
+	value = (uint32_t) rdns_get_u16(buf) << 16;
+	return value | rdns_get_u16(buf);
+}
+
+uint64_t
+rdns_get_u64(struct rdns_buf *buf)
+{
+	uint64_t value;
+
+	value = (uint64_t) rdns_get_u32(buf) << 32;
+	return value | rdns_get_u32(buf);
+}
+
+char *
+rdns_get_str(struct rdns_buf *buf)
+{
+	size_t len;
+	char *p;
+
+	len = rdns_get_u16(buf);
+	if(buf->err || len > buf->len - buf->pos)
+	{
+		buf->err = EINVAL;
+		return NULL;
+	}
+	if(NULL == (p = (char *) rdns_malloc(NULL, len + 1)))
+	{
+		buf->err = ENOMEM;
+		return NULL;
+	}
+	memcpy(p, buf->data + buf->pos, len);
+	p[len] = 0;
+	buf->pos += len;
+	return p;
+}
+
+void
+rdns_put_app(struct rdns_buf *buf, const radiodns_app_t *app)
+{
+	const radiodns_app_t *p;
+	int c;
+
+	for(c = 0, p = app; p; p = p->next)
+	{
+		c++;
+	}
+	rdns_put_u16(buf, c);
+	for(p = app; p; p = p->next)
+	{
+		rdns_put_u8(buf, (p->name ? 1 : 0));
+		if(p->name)
+		{
+			rdns_put_str(buf, p->name);
+		}
+		rdns_put_u16(buf, p->nsrv);
+		for(c = 0; c < p->nsrv; c++)
+		{
+			rdns_put_u16(buf, p->srv[c].priority);
+			rdns_put_u16(buf, p->srv[c].weight);
+			rdns_put_u16(buf, p->srv[c].port);
+			rdns_put_str(buf, p->srv[c].target);
+		}
+		rdns_put_u16(buf, p->nparams);
+		for(c = 0; c < p->nparams; c++)
+		{
+			rdns_put_str(buf, p->params[c].key);
+			rdns_put_str(buf, p->params[c].value);
+		}
+	}
+}
+
+/* Decode the instances encoded by rdns_put_app(); the parameters' keys
+ * and values are stored together in each instance's parameter buffer, as
+ * they would have been when parsed
+ */
+radiodns_app_t *
+rdns_get_app(struct rdns_buf *buf, radiodns_allocator_t *allocator, radiodns_intern_t *pool)
+{
+	radiodns_app_t *head, **tail, *app;
+	size_t plen, start;
+	char *s;
+	int n, c, d;
+
+	head = NULL;
+	tail = &head;
+	n = rdns_get_u16(buf);
+	while(!buf->err && n > 0)
+	{
+		n--;
+		if(NULL == (app = rdns_app_create(allocator, pool)))
+		{
+			buf->err = ENOMEM;
+			break;
+		}
+		*tail = app;
+		tail = &(app->next);
+		if(rdns_get_u8(buf))
+		{
+			if(NULL == (s = rdns_get_str(buf)))
+			{
+				break;
+			}
+			app->name = rdns_app_strdup(app, s);
+			rdns_free(NULL, s);
+			if(!app->name)
+			{
+				buf->err = ENOMEM;
+				break;
+			}
+		}
+		if((c = rdns_get_u16(buf)) && NULL == (app->srv = (radiodns_srv_t *) rdns_calloc(app->_alloc, c, sizeof(radiodns_srv_t))))
+		{
+			buf->err = ENOMEM;
+			break;
+		}
+		for(; !buf->err && app->nsrv < c; app->nsrv++)
+		{
+			app->srv[app->nsrv].priority = rdns_get_u16(buf);
+			app->srv[app->nsrv].weight = rdns_get_u16(buf);
+			app->srv[app->nsrv].port = rdns_get_u16(buf);
+			if(NULL == (s = rdns_get_str(buf)))
+			{
+				break;
+			}
+			app->srv[app->nsrv].target = rdns_app_strdup(app, s);
+			rdns_free(NULL, s);
+			if(!app->srv[app->nsrv].target)
+			{
+				buf->err = ENOMEM;
+				break;
+			}
+		}
+		if(buf->err || !(c = rdns_get_u16(buf)))
+		{
+			continue;
+		}
+		/* Measure the keys and values before copying them */
+		start = buf->pos;
+		for(d = 0, plen = 0; d < c * 2 && !buf->err; d++)
+		{
+			plen += buf_skip(buf) + 1;
+		}
+		if(buf->err)
+		{
+			break;
+		}
+		buf->pos = start;
+		if(NULL == (app->params = (radiodns_kv_t *) rdns_calloc(app->_alloc, c, sizeof(radiodns_kv_t))) || NULL == (app->_pbuf = (char *) rdns_malloc(app->_alloc, plen + 2)))
+		{
+			buf->err = ENOMEM;
+			break;
+		}
+		s = app->_pbuf;
+		for(; app->nparams < c; app->nparams++)
+		{
+			d = rdns_get_u16(buf);
+			memcpy(s, buf->data + buf->pos, d);
+			s[d] = 0;
+			app->params[app->nparams].key = s;
+			s += d + 1;
+			buf->pos += d;
+			d = rdns_get_u16(buf);
+			memcpy(s, buf->data + buf->pos, d);
+			s[d] = 0;
+			app->params[app->nparams].value = s;
+			s += d + 1;
+			buf->pos += d;
+		}
+		s[0] = 0;
+		s[1] = 0;
+		app->_plen = s + 2 - app->_pbuf;
+	}
+	if(buf->err)
+	{
+		radiodns_destroy_app(head);
+		return NULL;
+	}
+	return head;
+}
@@ -27,6 +27,53 @@
 
 #include "p_radiodns.h"
 
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* Initial size of the registry's hash table, which is always a power of
+ * two
+ */
+#define REGISTRY_BUCKETS                64
+
+/* The registry of shared contexts, keyed by domain: radiodns_share()
+ * enters a context into it, or returns a new reference to the one already
+ * there with the same domain
+ */
+static radiodns_t **registry;
+static size_t registry_size;
+static size_t registry_count;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static radiodns_t *context_create(const char *domain);
+static int registry_release(radiodns_t *context);
+static void registry_grow(void);
+static uint32_t registry_hash(const char *domain);
+static void registry_lock(void);
+static void registry_unlock(void);
+
+/* The countries of the European Broadcasting Area, as identified by RDS
+ * Extended Country Codes E0 to E4 (IEC 62106, Annex D), each row being
+ * indexed by the country code in the top nibble of a station's PI, less
+ * one. The Global Country Code of a station is that nibble followed by
+ * the ECC. Empty entries are codes which aren't allocated. Countries
+ * elsewhere, which are not listed, are identified by their ISO 3166 codes
+ * instead.
+ */
+#define FM_ECC_FIRST                    0xe0
+
+static const char fm_countries[][15][3] = {
+	/* E0 */ { "de", "dz", "ad", "il", "it", "be", "ru", "ps", "al", "at", "hu", "mt", "de", "", "eg" },
+	/* E1 */ { "gr", "cy", "sm", "ch", "jo", "fi", "lu", "bg", "dk", "gi", "iq", "gb", "ly", "ro", "fr" },
+	/* E2 */ { "ma", "cz", "pl", "va", "sk", "sy", "tn", "", "li", "is", "mc", "lt", "rs", "es", "no" },
+	/* E3 */ { "me", "ie", "tr", "mk", "tj", "", "", "nl", "lv", "lb", "az", "hr", "kz", "se", "by" },
+	/* E4 */ { "md", "ee", "kg", "", "", "ua", "xk", "pt", "si", "am", "uz", "ge", "", "tm", "ba" }
+};
+
+static int fm_gcc(char *buf, unsigned int pi, const char *country);
+
 /** Sanitise a DNS domain name suffix.
  *
  * check_suffix() accepts a DNS domain name suffix and ensures that
@@ -74,56 +121,270 @@ check_suffix(const char *suffix)
  */
 radiodns_t *
 radiodns_create(const char *domain)
+{
+	return context_create(domain);
+}
+
+/* Share a context with every other caller who shares one with the same
+ * domain: either enter it into the registry, or destroy it and return a
+ * new reference to the context already there. context is destroyed if it
+ * can't be shared, and may be NULL (so that the result of a failed
+ * radiodns_create() can be passed straight in).
+ */
+radiodns_t *
+radiodns_share(radiodns_t *context)
+{
+	radiodns_t *p;
+	uint32_t hash;
+
+	if(!context || context->shared)
+	{
+		return context;
+	}
+	hash = registry_hash(context->domain);
+	registry_lock();
+	if(registry)
+	{
+		for(p = registry[hash & (registry_size - 1)]; p; p = p->next)
+		{
+			if(p->hash == hash && !strcasecmp(p->domain, context->domain))
+			{
+				p->refs++;
+				registry_unlock();
+				radiodns_destroy(context);
+				return p;
+			}
+		}
+	}
+	else
+	{
+		if(NULL == (registry = (radiodns_t **) rdns_calloc(NULL, REGISTRY_BUCKETS, sizeof(radiodns_t *))))
+		{
+			registry_unlock();
+			radiodns_destroy(context);
+			return NULL;
+		}
+		registry_size = REGISTRY_BUCKETS;
+	}
+	context->shared = 1;
+	context->hash = hash;
+	context->next = registry[hash & (registry_size - 1)];
+	registry[hash & (registry_size - 1)] = context;
+	registry_count++;
+	if(registry_count > registry_size)
+	{
+		registry_grow();
+	}
+	registry_unlock();
+	return context;
+}
+
+static radiodns_t *
+context_create(const char *domain)
 {
 	radiodns_t *context;
 	
-	if(NULL == (context = calloc(1, sizeof(radiodns_t))))
+	if(NULL == (context = rdns_calloc(NULL, 1, sizeof(radiodns_t))))
 	{
 		return NULL;
 	}
-	if(NULL == (context->domain = strdup(domain)))
+	if(NULL == (context->domain = rdns_strdup(NULL, domain)))
 	{
-		free(context);
+		rdns_free(NULL, context);
 		return NULL;
 	}
 	return context;
 }
 
+/* Drop a reference to a registered context, removing it from the registry
+ * if it was the last; returns non-zero if the context remains in use
+ */
+static int
+registry_release(radiodns_t *context)
+{
+	radiodns_t **prev;
+
+	registry_lock();
+	if(context->refs)
+	{
+		context->refs--;
+		registry_unlock();
+		return 1;
+	}
+	for(prev = &(registry[context->hash & (registry_size - 1)]); *prev != context; prev = &((*prev)->next));
+	*prev = context->next;
+	registry_count--;
+	if(!registry_count)
+	{
+		rdns_free(NULL, registry);
+		registry = NULL;
+		registry_size = 0;
+	}
+	registry_unlock();
+	return 0;
+}
+
+static void
+registry_grow(void)
+{
+	radiodns_t **buckets, *context;
+	size_t c, size;
+
+	size = registry_size * 2;
+	if(NULL == (buckets = (radiodns_t **) rdns_calloc(NULL, size, sizeof(radiodns_t *))))
+	{
+		/* Carry on with longer chains */
+		return;
+	}
+	for(c = 0; c < registry_size; c++)
+	{
+		while((context = registry[c]))
+		{
+			registry[c] = context->next;
+			context->next = buckets[context->hash & (size - 1)];
+			buckets[context->hash & (size - 1)] = context;
+		}
+	}
+	rdns_free(NULL, registry);
+	registry = buckets;
+	registry_size = size;
+}
+
+static uint32_t
+registry_hash(const char *domain)
+{
+	uint32_t hash;
+
+	for(hash = 2166136261U; *domain; domain++)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) *domain);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void
+registry_lock(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&registry_mutex);
+#endif
+}
+
+static void
+registry_unlock(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&registry_mutex);
+#endif
+}
+
 /* Create a new RadioDNS context for a VHF/FM service
  * - country must be either a 2-letter country code or a 3-character
  *   RDS ECC.
  * - suffix may be specified to override the default 'radiodns.org',
  *   otherwise NULL
+ * The same station always has the same domain, however its country was
+ * given: the Global Country Code is used wherever it's known.
  */
 radiodns_t *
 radiodns_create_fm(unsigned int freq, unsigned int pi, const char *country, const char *suffix)
 {
-	char dname[MAXDNAME + 1];
+	char dname[MAXDNAME + 1], gcc[4];
 	
 	if(NULL == (suffix = check_suffix(suffix)))
 	{
 		return NULL;
 	}
+	if(freq > 99999 || pi > 0xFFFF)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(fm_gcc(gcc, pi, country))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	sprintf(dname, "%05d.%04x.%s.fm.%s", freq, pi, gcc, suffix);
+	return radiodns_create(dname);
+}
+
+/* Create a new RadioDNS context for a VHF/FM service from its RDS ECC */
+radiodns_t *
+radiodns_create_fm_ecc(unsigned int freq, unsigned int pi, unsigned int ecc, const char *suffix)
+{
+	char country[4];
+
+	if(ecc > 0xFF)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	sprintf(country, "0%02x", ecc);
+	return radiodns_create_fm(freq, pi, country, suffix);
+}
+
+/* Find the canonical form of an FM service's country: the Global Country
+ * Code where possible, or a lower-case ISO code otherwise. An ECC alone
+ * (two hexadecimal digits which can't be an ISO code, or a GCC whose first
+ * digit is zero) is combined with the PI's country code.
+ */
+static int
+fm_gcc(char *buf, unsigned int pi, const char *country)
+{
+	unsigned int cc, ecc;
+	const char *p;
+	char iso[3];
+
+	cc = (pi >> 12) & 0xF;
+	p = NULL;
 	if(strlen(country) == 3)
 	{
 		if(!isxdigit(country[0]) || !isxdigit(country[1]) || !isxdigit(country[2]))
 		{
-			errno = EINVAL;
-			return NULL;
+			return -1;
 		}
+		if(country[0] != '0' && (unsigned int) (isdigit(country[0]) ? country[0] - '0' : tolower(country[0]) - 'a' + 10) != cc)
+		{
+			/* The GCC belongs to a different country code */
+			return -1;
+		}
+		p = country + 1;
 	}
 	else if(strlen(country) != 2)
 	{
-		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
-	if(freq > 99999 || pi > 0xFFFF)
+	else if(!isalpha(country[0]) || !isalpha(country[1]))
 	{
-		errno = EINVAL;
-		return NULL;
+		if(!isxdigit(country[0]) || !isxdigit(country[1]))
+		{
+			return -1;
+		}
+		p = country;
 	}
-	sprintf(dname, "%05d.%04x.%s.fm.%s", freq, pi, country, suffix);
-	return radiodns_create(dname);
+	if(p)
+	{
+		sprintf(buf, "%x%c%c", cc, tolower(p[0]), tolower(p[1]));
+		return 0;
+	}
+	iso[0] = tolower(country[0]);
+	iso[1] = tolower(country[1]);
+	iso[2] = 0;
+	if(cc)
+	{
+		for(ecc = 0; ecc < sizeof(fm_countries) / sizeof(fm_countries[0]); ecc++)
+		{
+			if(!strcmp(fm_countries[ecc][cc - 1], iso))
+			{
+				sprintf(buf, "%x%02x", cc, ecc + FM_ECC_FIRST);
+				return 0;
+			}
+		}
+	}
+	strcpy(buf, iso);
+	return 0;
 }
 
 /* Create a new RadioDNS context for a DAB service delivered via X-PAD */
@@ -318,12 +579,13 @@ radiodns_create_dvb(unsigned int onid, unsigned int tsid, unsigned long sid, uns
 void
 radiodns_destroy(radiodns_t *context)
 {
-	if(context)
+	if(context && !(context->shared && registry_release(context)))
 	{
-		free(context->domain);
-		free(context->target);
-		free(context->answer);
-		free(context);
+		rdns_free(NULL, context->domain);
+		rdns_free(NULL, context->target);
+		rdns_intern_release(context->intern);
+		rdns_cache_release(context->cache);
+		rdns_free(NULL, context);
 	}
 }
 
@@ -0,0 +1,537 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* DAB ensembles: a context for every service component a receiver can
+ * see, resolved together. Every component's target is looked up at once;
+ * as each is found, the first component with that target (its leader)
+ * looks up the applications wanted, and any others which turn out to
+ * share the target are given references to the leader's results rather
+ * than looking them up again.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+struct ensemble_slot
+{
+	radiodns_ensemble_t *ensemble;
+	radiodns_dab_component_t component;
+	radiodns_t *context;
+	/* The target lookup in progress, if any */
+	radiodns_async_t *target;
+	/* The slot whose results this one shares, which may be itself, or
+	 * -1 if its target isn't known yet (or couldn't be found)
+	 */
+	int leader;
+	/* The application lookups in progress (for a leader), how many of
+	 * them there are, and the results
+	 */
+	radiodns_async_t **ops;
+	int pending;
+	radiodns_app_t **apps;
+	int err;
+	int herrno;
+};
+
+/* Components by SId and SCIdS, for radiodns_ensemble_find() */
+struct ensemble_key
+{
+	unsigned long sid;
+	unsigned int scids;
+	int index;
+};
+
+struct radiodns_ensemble_struct
+{
+	struct ensemble_slot *slots;
+	struct ensemble_key *keys;
+	int count;
+	/* While resolving: the applications wanted, and the number of
+	 * lookups whose callbacks are still to be invoked
+	 */
+	const char *const *names;
+	int napps;
+	const char *protocol;
+	int outstanding;
+	int err;
+};
+
+static void ensemble_reset(radiodns_ensemble_t *ensemble);
+static void ensemble_target_done(radiodns_async_t *op, void *data);
+static void ensemble_targeted(struct ensemble_slot *slot, radiodns_async_t *op);
+static void ensemble_app_done(radiodns_async_t *op, void *data);
+static void ensemble_found(struct ensemble_slot *slot, radiodns_async_t *op);
+static void ensemble_share(struct ensemble_slot *leader, struct ensemble_slot *slot);
+static int ensemble_compare(const void *a, const void *b);
+
+/* Create a context for each component of an ensemble, using the domain
+ * which radiodns_create_dab(), _dab_sc() or _dab_xpad() would
+ */
+radiodns_ensemble_t *
+radiodns_ensemble_create(unsigned int eid, unsigned int ecc, const radiodns_dab_component_t *components, int count, const char *suffix)
+{
+	radiodns_ensemble_t *ensemble;
+	const radiodns_dab_component_t *comp;
+	int c, err;
+
+	if(count < 1 || !components)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(NULL == (ensemble = (radiodns_ensemble_t *) rdns_calloc(NULL, 1, sizeof(radiodns_ensemble_t))) ||
+	   NULL == (ensemble->slots = (struct ensemble_slot *) rdns_calloc(NULL, count, sizeof(struct ensemble_slot))) ||
+	   NULL == (ensemble->keys = (struct ensemble_key *) rdns_calloc(NULL, count, sizeof(struct ensemble_key))))
+	{
+		radiodns_ensemble_destroy(ensemble);
+		return NULL;
+	}
+	for(c = 0; c < count; c++)
+	{
+		comp = &(components[c]);
+		switch(comp->type)
+		{
+		case RADIODNS_DAB_SERVICE:
+			ensemble->slots[c].context = radiodns_create_dab(comp->scids, comp->sid, eid, ecc, suffix);
+			break;
+		case RADIODNS_DAB_SC:
+			ensemble->slots[c].context = radiodns_create_dab_sc(comp->pa, comp->scids, comp->sid, eid, ecc, suffix);
+			break;
+		case RADIODNS_DAB_XPAD:
+			ensemble->slots[c].context = radiodns_create_dab_xpad(comp->appty, comp->uatype, comp->scids, comp->sid, eid, ecc, suffix);
+			break;
+		default:
+			errno = EINVAL;
+			break;
+		}
+		if(!ensemble->slots[c].context)
+		{
+			err = errno;
+			radiodns_ensemble_destroy(ensemble);
+			errno = err;
+			return NULL;
+		}
+		ensemble->count++;
+		ensemble->slots[c].ensemble = ensemble;
+		ensemble->slots[c].component = *comp;
+		ensemble->slots[c].leader = -1;
+		ensemble->keys[c].sid = comp->sid;
+		ensemble->keys[c].scids = comp->scids;
+		ensemble->keys[c].index = c;
+	}
+	qsort(ensemble->keys, count, sizeof(struct ensemble_key), ensemble_compare);
+	return ensemble;
+}
+
+/* Destroy an ensemble's contexts, and any results not yet taken */
+void
+radiodns_ensemble_destroy(radiodns_ensemble_t *ensemble)
+{
+	int c;
+
+	if(!ensemble)
+	{
+		return;
+	}
+	ensemble_reset(ensemble);
+	if(ensemble->slots)
+	{
+		for(c = 0; c < ensemble->count; c++)
+		{
+			radiodns_destroy(ensemble->slots[c].context);
+		}
+	}
+	rdns_free(NULL, ensemble->slots);
+	rdns_free(NULL, ensemble->keys);
+	rdns_free(NULL, ensemble);
+}
+
+/* Return the number of components in an ensemble */
+int
+radiodns_ensemble_count(const radiodns_ensemble_t *ensemble)
+{
+	return ensemble->count;
+}
+
+/* Return the index of the first component (in the order they were given)
+ * with the given SId and SCIdS, or -1 if there isn't one
+ */
+int
+radiodns_ensemble_find(const radiodns_ensemble_t *ensemble, unsigned long sid, unsigned int scids)
+{
+	struct ensemble_key key, *found;
+
+	key.sid = sid;
+	key.scids = scids;
+	key.index = -1;
+	if(NULL == (found = (struct ensemble_key *) bsearch(&key, ensemble->keys, ensemble->count, sizeof(struct ensemble_key), ensemble_compare)))
+	{
+		return -1;
+	}
+	/* bsearch() may land on any of several with the same key */
+	while(found > ensemble->keys && found[-1].sid == sid && found[-1].scids == scids)
+	{
+		found--;
+	}
+	return found->index;
+}
+
+/* Return the context for a component */
+radiodns_t *
+radiodns_ensemble_context(const radiodns_ensemble_t *ensemble, int index)
+{
+	if(index < 0 || index >= ensemble->count)
+	{
+		return NULL;
+	}
+	return ensemble->slots[index].context;
+}
+
+/* Find the instances of each of the applications named, for every
+ * component of an ensemble at once. Returns the number of components for
+ * which any were found, or -1 on error.
+ */
+int
+radiodns_ensemble_resolve(radiodns_ensemble_t *ensemble, const char *const *names, int count, const char *protocol)
+{
+	struct ensemble_slot *slot;
+	radiodns_transport_t *transport;
+	radiodns_async_t *op;
+	int c, n, found;
+
+	ensemble_reset(ensemble);
+	/* Only one transport is driven, so every component must use it. A
+	 * synchronous transport (such as the system resolver) finishes each
+	 * lookup as it's started, so that nothing is ever outstanding, and
+	 * the components are simply resolved one after another.
+	 */
+	transport = rdns_transport(ensemble->slots[0].context);
+	for(c = 1; c < ensemble->count && rdns_transport(ensemble->slots[c].context) == transport; c++);
+	if(c < ensemble->count)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	for(c = 0; c < ensemble->count; c++)
+	{
+		slot = &(ensemble->slots[c]);
+		if(NULL == (slot->apps = (radiodns_app_t **) rdns_calloc(NULL, count ? count : 1, sizeof(radiodns_app_t *))) ||
+		   NULL == (slot->ops = (radiodns_async_t **) rdns_calloc(NULL, count ? count : 1, sizeof(radiodns_async_t *))))
+		{
+			ensemble_reset(ensemble);
+			return -1;
+		}
+	}
+	ensemble->names = names;
+	ensemble->napps = count;
+	ensemble->protocol = protocol;
+	ensemble->outstanding = 0;
+	ensemble->err = 0;
+	for(c = 0; c < ensemble->count && !ensemble->err; c++)
+	{
+		slot = &(ensemble->slots[c]);
+		if(slot->context->target)
+		{
+			ensemble_targeted(slot, NULL);
+			continue;
+		}
+		if(NULL == (op = radiodns_resolve_target_async(slot->context, ensemble_target_done, slot)))
+		{
+			ensemble->err = errno;
+			break;
+		}
+		/* Operations finished while starting don't invoke the callback */
+		if(radiodns_async_done(op))
+		{
+			ensemble_targeted(slot, op);
+			continue;
+		}
+		slot->target = op;
+		ensemble->outstanding++;
+	}
+	while(!ensemble->err && ensemble->outstanding)
+	{
+		if(!transport->process || (0 >= transport->process(transport, -1) && ensemble->outstanding))
+		{
+			/* The transport can't be waited on, or has lost track of
+			 * our queries
+			 */
+			ensemble->err = EIO;
+		}
+	}
+	ensemble->names = NULL;
+	if(ensemble->err)
+	{
+		n = ensemble->err;
+		ensemble_reset(ensemble);
+		errno = n;
+		return -1;
+	}
+	found = 0;
+	for(c = 0; c < ensemble->count; c++)
+	{
+		for(n = 0; n < count; n++)
+		{
+			if(ensemble->slots[c].apps[n])
+			{
+				found++;
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+/* Take the instances found of names[n] for a component; the caller must
+ * pass them to radiodns_destroy_app(). Components with the same target
+ * share their results, which mustn't be modified.
+ */
+radiodns_app_t *
+radiodns_ensemble_app(radiodns_ensemble_t *ensemble, int index, int n)
+{
+	struct ensemble_slot *slot;
+	radiodns_app_t *app;
+
+	if(index < 0 || index >= ensemble->count || !ensemble->slots[index].apps || n < 0 || n >= ensemble->napps)
+	{
+		return NULL;
+	}
+	slot = &(ensemble->slots[index]);
+	app = slot->apps[n];
+	slot->apps[n] = NULL;
+	return app;
+}
+
+/* Return the errno value describing why the first application not found
+ * for a component wasn't (or zero), storing its h_errno value in *herrno
+ */
+int
+radiodns_ensemble_error(const radiodns_ensemble_t *ensemble, int index, int *herrno)
+{
+	if(index < 0 || index >= ensemble->count)
+	{
+		if(herrno)
+		{
+			*herrno = NETDB_INTERNAL;
+		}
+		return EINVAL;
+	}
+	if(herrno)
+	{
+		*herrno = ensemble->slots[index].herrno;
+	}
+	return ensemble->slots[index].err;
+}
+
+/* Abandon any lookups still in progress, and discard the results of the
+ * last resolution
+ */
+static void
+ensemble_reset(radiodns_ensemble_t *ensemble)
+{
+	struct ensemble_slot *slot;
+	int c, n;
+
+	if(!ensemble->slots)
+	{
+		return;
+	}
+	for(c = 0; c < ensemble->count; c++)
+	{
+		slot = &(ensemble->slots[c]);
+		radiodns_async_destroy(slot->target);
+		slot->target = NULL;
+		for(n = 0; n < ensemble->napps; n++)
+		{
+			if(slot->ops)
+			{
+				radiodns_async_destroy(slot->ops[n]);
+			}
+			if(slot->apps)
+			{
+				radiodns_destroy_app(slot->apps[n]);
+			}
+		}
+		rdns_free(NULL, slot->ops);
+		rdns_free(NULL, slot->apps);
+		slot->ops = NULL;
+		slot->apps = NULL;
+		slot->pending = 0;
+		slot->leader = -1;
+		slot->err = 0;
+		slot->herrno = 0;
+	}
+	ensemble->napps = 0;
+	ensemble->outstanding = 0;
+}
+
+static void
+ensemble_target_done(radiodns_async_t *op, void *data)
+{
+	struct ensemble_slot *slot;
+
+	slot = (struct ensemble_slot *) data;
+	slot->target = NULL;
+	slot->ensemble->outstanding--;
+	ensemble_targeted(slot, op);
+}
+
+/* A component's target is known (or can't be found): share the results
+ * of the first component with the same one, or if this is the first,
+ * start looking up the applications
+ */
+static void
+ensemble_targeted(struct ensemble_slot *slot, radiodns_async_t *op)
+{
+	radiodns_ensemble_t *ensemble;
+	struct ensemble_slot *leader;
+	const char *target;
+	int c, n;
+
+	ensemble = slot->ensemble;
+	if(op)
+	{
+		slot->err = radiodns_async_error(op, &(slot->herrno));
+		radiodns_async_destroy(op);
+	}
+	if(!(target = slot->context->target))
+	{
+		if(!slot->err && !slot->herrno)
+		{
+			slot->herrno = NETDB_INTERNAL;
+		}
+		return;
+	}
+	for(c = 0; c < ensemble->count; c++)
+	{
+		leader = &(ensemble->slots[c]);
+		if(leader != slot && leader->leader == c && !strcasecmp(leader->context->target, target))
+		{
+			slot->leader = c;
+			if(!leader->pending)
+			{
+				ensemble_share(leader, slot);
+			}
+			return;
+		}
+	}
+	slot->leader = (int) (slot - ensemble->slots);
+	slot->err = 0;
+	slot->herrno = 0;
+	slot->pending = ensemble->napps;
+	for(n = 0; n < ensemble->napps && !ensemble->err; n++)
+	{
+		if(NULL == (op = radiodns_resolve_app_async(slot->context, ensemble->names[n], ensemble->protocol, ensemble_app_done, slot)))
+		{
+			ensemble->err = errno;
+			break;
+		}
+		slot->ops[n] = op;
+		if(radiodns_async_done(op))
+		{
+			ensemble_found(slot, op);
+			continue;
+		}
+		ensemble->outstanding++;
+	}
+}
+
+static void
+ensemble_app_done(radiodns_async_t *op, void *data)
+{
+	struct ensemble_slot *slot;
+
+	slot = (struct ensemble_slot *) data;
+	slot->ensemble->outstanding--;
+	ensemble_found(slot, op);
+}
+
+/* One of a leader's applications has been looked up. Once they all have,
+ * share the results with the components which have the same target.
+ */
+static void
+ensemble_found(struct ensemble_slot *slot, radiodns_async_t *op)
+{
+	radiodns_ensemble_t *ensemble;
+	int c, n, err, herrno;
+
+	ensemble = slot->ensemble;
+	for(n = 0; n < ensemble->napps && slot->ops[n] != op; n++)
+	{
+	}
+	if(!(slot->apps[n] = radiodns_async_app(op)) && !slot->err && !slot->herrno)
+	{
+		err = radiodns_async_error(op, &herrno);
+		slot->err = err;
+		slot->herrno = (herrno ? herrno : NETDB_INTERNAL);
+	}
+	radiodns_async_destroy(op);
+	slot->ops[n] = NULL;
+	if(--slot->pending)
+	{
+		return;
+	}
+	for(c = 0; c < ensemble->count; c++)
+	{
+		if(&(ensemble->slots[c]) != slot && ensemble->slots[c].leader == (int) (slot - ensemble->slots))
+		{
+			ensemble_share(slot, &(ensemble->slots[c]));
+		}
+	}
+}
+
+static void
+ensemble_share(struct ensemble_slot *leader, struct ensemble_slot *slot)
+{
+	int n;
+
+	for(n = 0; n < slot->ensemble->napps; n++)
+	{
+		slot->apps[n] = radiodns_app_ref(leader->apps[n]);
+	}
+	slot->err = leader->err;
+	slot->herrno = leader->herrno;
+}
+
+static int
+ensemble_compare(const void *a, const void *b)
+{
+	const struct ensemble_key *ka, *kb;
+
+	ka = (const struct ensemble_key *) a;
+	kb = (const struct ensemble_key *) b;
+	if(ka->sid != kb->sid)
+	{
+		return (ka->sid < kb->sid ? -1 : 1);
+	}
+	if(ka->scids != kb->scids)
+	{
+		return (ka->scids < kb->scids ? -1 : 1);
+	}
+	/* Keep those with the same key in the order given; a search (with an
+	 * index of -1) matches any of them
+	 */
+	if(ka->index < 0 || kb->index < 0)
+	{
+		return 0;
+	}
+	return (ka->index < kb->index ? -1 : ka->index > kb->index);
+}
@@ -0,0 +1,302 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* String intern pools: each distinct string added to a pool is stored
+ * once, in large chunks, and found again via an open-addressed hash table,
+ * so that identical strings share a pointer. Pools are reference-counted:
+ * contexts using a pool and results whose strings came from it each hold
+ * a reference, so it lives until the last of them has gone.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* Size of the chunks strings are stored in; longer strings get a chunk of
+ * their own
+ */
+#define INTERN_CHUNKSIZE                8192
+/* Initial size of the hash table, which is always a power of two */
+#define INTERN_TABLESIZE                256
+
+struct intern_chunk
+{
+	struct intern_chunk *next;
+	size_t used;
+	size_t size;
+	char data[1];
+};
+
+struct intern_entry
+{
+	const char *str;
+	size_t len;
+	uint32_t hash;
+};
+
+struct radiodns_intern_struct
+{
+	unsigned long refs;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+#endif
+	struct intern_entry *table;
+	size_t size;
+	size_t count;
+	struct intern_chunk *chunks;
+};
+
+static radiodns_intern_t *default_intern;
+
+static uint32_t intern_hash(const char *str, size_t len);
+static const char *intern_store(radiodns_intern_t *pool, const char *str, size_t len);
+static int intern_grow(radiodns_intern_t *pool);
+static void intern_lock(radiodns_intern_t *pool);
+static void intern_unlock(radiodns_intern_t *pool);
+
+/* Create a new, empty, intern pool */
+radiodns_intern_t *
+radiodns_intern_create(void)
+{
+	radiodns_intern_t *pool;
+
+	if(NULL == (pool = (radiodns_intern_t *) rdns_calloc(NULL, 1, sizeof(radiodns_intern_t))))
+	{
+		return NULL;
+	}
+	if(NULL == (pool->table = (struct intern_entry *) rdns_calloc(NULL, INTERN_TABLESIZE, sizeof(struct intern_entry))))
+	{
+		rdns_free(NULL, pool);
+		return NULL;
+	}
+	pool->size = INTERN_TABLESIZE;
+	pool->refs = 1;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&(pool->lock), NULL);
+#endif
+	return pool;
+}
+
+/* Release the caller's reference to a pool; its strings remain valid for
+ * as long as any context or result using it
+ */
+void
+radiodns_intern_destroy(radiodns_intern_t *pool)
+{
+	rdns_intern_release(pool);
+}
+
+/* Return the pool's copy of str, adding it if it isn't already present */
+const char *
+radiodns_intern(radiodns_intern_t *pool, const char *str)
+{
+	struct intern_entry *entry;
+	const char *p;
+	size_t len, c, mask;
+	uint32_t hash;
+
+	len = strlen(str);
+	hash = intern_hash(str, len);
+	intern_lock(pool);
+	mask = pool->size - 1;
+	for(c = hash & mask; pool->table[c].str; c = (c + 1) & mask)
+	{
+		entry = &(pool->table[c]);
+		if(entry->hash == hash && entry->len == len && !memcmp(entry->str, str, len))
+		{
+			intern_unlock(pool);
+			return entry->str;
+		}
+	}
+	p = NULL;
+	if((pool->count + 1) * 4 <= pool->size * 3 || !intern_grow(pool))
+	{
+		if((p = intern_store(pool, str, len)))
+		{
+			mask = pool->size - 1;
+			for(c = hash & mask; pool->table[c].str; c = (c + 1) & mask);
+			pool->table[c].str = p;
+			pool->table[c].len = len;
+			pool->table[c].hash = hash;
+			pool->count++;
+		}
+	}
+	intern_unlock(pool);
+	return p;
+}
+
+/* Set the pool used by a context for the results it resolves, or the
+ * default for contexts without one of their own
+ */
+int
+radiodns_set_intern(radiodns_t *context, radiodns_intern_t *pool)
+{
+	radiodns_intern_t **p;
+
+	p = (context ? &(context->intern) : &default_intern);
+	rdns_intern_ref(pool);
+	rdns_intern_release(*p);
+	*p = pool;
+	return 0;
+}
+
+/* Return the pool used by a context, or the default */
+radiodns_intern_t *
+rdns_intern(radiodns_t *context)
+{
+	if(context && context->intern)
+	{
+		return context->intern;
+	}
+	return default_intern;
+}
+
+void
+rdns_intern_ref(radiodns_intern_t *pool)
+{
+	if(pool)
+	{
+		__atomic_add_fetch(&(pool->refs), 1, __ATOMIC_RELAXED);
+	}
+}
+
+void
+rdns_intern_release(radiodns_intern_t *pool)
+{
+	struct intern_chunk *chunk;
+
+	if(!pool || __atomic_sub_fetch(&(pool->refs), 1, __ATOMIC_ACQ_REL))
+	{
+		return;
+	}
+	while(pool->chunks)
+	{
+		chunk = pool->chunks;
+		pool->chunks = chunk->next;
+		rdns_free(NULL, chunk);
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&(pool->lock));
+#endif
+	rdns_free(NULL, pool->table);
+	rdns_free(NULL, pool);
+}
+
+/* FNV-1a */
+static uint32_t
+intern_hash(const char *str, size_t len)
+{
+	uint32_t hash;
+	size_t c;
+
+	hash = 2166136261U;
+	for(c = 0; c < len; c++)
+	{
+		hash ^= (unsigned char) str[c];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Copy a string into the pool's chunks */
+static const char *
+intern_store(radiodns_intern_t *pool, const char *str, size_t len)
+{
+	struct intern_chunk *chunk;
+	size_t size;
+	char *p;
+
+	chunk = pool->chunks;
+	if(!chunk || chunk->size - chunk->used < len + 1)
+	{
+		size = (len + 1 > INTERN_CHUNKSIZE ? len + 1 : INTERN_CHUNKSIZE);
+		if(NULL == (chunk = (struct intern_chunk *) rdns_malloc(NULL, sizeof(struct intern_chunk) + size)))
+		{
+			return NULL;
+		}
+		chunk->used = 0;
+		chunk->size = size;
+		if(pool->chunks && len + 1 > INTERN_CHUNKSIZE)
+		{
+			/* Keep filling the current chunk */
+			chunk->next = pool->chunks->next;
+			pool->chunks->next = chunk;
+		}
+		else
+		{
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+		}
+	}
+	p = chunk->data + chunk->used;
+	memcpy(p, str, len + 1);
+	chunk->used += len + 1;
+	return p;
+}
+
+/* Double the size of the hash table */
+static int
+intern_grow(radiodns_intern_t *pool)
+{
+	struct intern_entry *table;
+	size_t c, d, size;
+
+	size = pool->size * 2;
+	if(NULL == (table = (struct intern_entry *) rdns_calloc(NULL, size, sizeof(struct intern_entry))))
+	{
+		return -1;
+	}
+	for(c = 0; c < pool->size; c++)
+	{
+		if(pool->table[c].str)
+		{
+			for(d = pool->table[c].hash & (size - 1); table[d].str; d = (d + 1) & (size - 1));
+			table[d] = pool->table[c];
+		}
+	}
+	rdns_free(NULL, pool->table);
+	pool->table = table;
+	pool->size = size;
+	return 0;
+}
+
+static void
+intern_lock(radiodns_intern_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&(pool->lock));
+#else
+	(void) pool;
+#endif
+}
+
+static void
+intern_unlock(radiodns_intern_t *pool)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&(pool->lock));
+#else
+	(void) pool;
+#endif
+}
@@ -23,7 +23,12 @@
 
 # include <stdlib.h>
 # include <string.h>
+# include <strings.h>
 # include <ctype.h>
+# include <time.h>
+# include <stdint.h>
+# include <sys/types.h>
+# include <sys/socket.h>
 # include <netinet/in.h>
 # include <arpa/nameser.h>
 # include <resolv.h>
@@ -54,7 +59,267 @@ struct radiodns_struct
 {
   char *domain;
   char *target;
-  unsigned char *answer;
+  /* Smallest TTL seen by the most recent radiodns_resolve_target() and
+   * radiodns_resolve_app() calls, or zero if not known.
+   */
+  unsigned long target_ttl;
+  unsigned long app_ttl;
+  radiodns_transport_t *transport;
+  radiodns_intern_t *intern;
+  radiodns_cache_t *cache;
+  radiodns_allocator_t *allocator;
+  /* The time each resolution may take, in milliseconds (or zero), and
+   * the number of times radiodns_cancel() has been called
+   */
+  unsigned long deadline;
+  unsigned long cancels;
+  /* Set if applications are looked up speculatively, before the target
+   * is known
+   */
+  int speculate;
+  /* Set if the context is in the registry, which holds it until the
+   * references beyond the first have gone
+   */
+  int shared;
+  unsigned long refs;
+  uint32_t hash;
+  radiodns_t *next;
 };
 
+/* Return the allocator used by a context's operations and results, and
+ * allocate memory via an allocator (NULL meaning the process-wide one),
+ * as the C library functions of the same names do
+ */
+radiodns_allocator_t *rdns_allocator(radiodns_t *context);
+void *rdns_malloc(radiodns_allocator_t *allocator, size_t size);
+void *rdns_calloc(radiodns_allocator_t *allocator, size_t nmemb, size_t size);
+void *rdns_realloc(radiodns_allocator_t *allocator, void *ptr, size_t size);
+char *rdns_strdup(radiodns_allocator_t *allocator, const char *str);
+void rdns_free(radiodns_allocator_t *allocator, void *ptr);
+
+/* Return the intern pool used by a context, if any, and manage references
+ * to pools; both accept NULL
+ */
+radiodns_intern_t *rdns_intern(radiodns_t *context);
+void rdns_intern_ref(radiodns_intern_t *pool);
+void rdns_intern_release(radiodns_intern_t *pool);
+
+/* Return the cache of application results used by a context, if any, and
+ * manage references to caches; both accept NULL
+ */
+radiodns_cache_t *rdns_cache(radiodns_t *context);
+void rdns_cache_ref(radiodns_cache_t *cache);
+void rdns_cache_release(radiodns_cache_t *cache);
+
+/* An operation looking up, or waiting for, a cached result. When a
+ * lookup being waited for finishes, the waiter's app (a new reference),
+ * ttl, err and herrno are set and wake() invoked; if abandoned is set
+ * instead, the waiter should begin again.
+ */
+struct rdns_cache_wait
+{
+	void (*wake)(struct rdns_cache_wait *wait);
+	void *data;
+	radiodns_app_t *app;
+	unsigned long ttl;
+	int err;
+	int herrno;
+	int abandoned;
+	/* Private to cache.c */
+	radiodns_cache_t *cache;
+	struct rdns_cache_wait *next;
+	struct rdns_cache_wait **prev;
+};
+
+# define RDNS_CACHE_HIT                 0
+# define RDNS_CACHE_MISS                1
+# define RDNS_CACHE_WAIT                2
+
+int rdns_cache_begin(radiodns_cache_t *cache, const char *key, radiodns_transport_t *transport, struct rdns_cache_wait *wait, radiodns_app_t **app, unsigned long *ttl);
+void rdns_cache_complete(struct rdns_cache_wait *owner, const char *key, radiodns_app_t *app, unsigned long ttl, int err, int herrno);
+void rdns_cache_abandon(struct rdns_cache_wait *wait, const char *key);
+
+/* Remember a DNAME record seen while following a chain, and predict the
+ * target of a domain from those remembered
+ */
+void rdns_predict_add(const char *owner, const char *target, unsigned long ttl);
+int rdns_predict(const char *domain, char *buf);
+
+/* Start a query via a transport, invoking its complete callback before
+ * returning if the query can't be performed asynchronously
+ */
+void rdns_submit(radiodns_transport_t *transport, radiodns_query_t *query);
+
+/* Perform several queries at once, returning when all have completed */
+int rdns_batch(radiodns_transport_t *transport, radiodns_query_t *queries, int nqueries);
+
+/* Return the transport which a context should use */
+radiodns_transport_t *rdns_transport(radiodns_t *context);
+
+/* Override the default transport for the current thread */
+void rdns_thread_transport(radiodns_transport_t *transport);
+
+/* Helpers for transports which speak DNS on the wire themselves */
+
+/* Build a query message for query, with the given message ID */
+int rdns_mkquery(const radiodns_query_t *query, unsigned int id, unsigned char *buf, int buflen);
+
+/* Copy a response message into a query's answer buffer, setting len and
+ * herrno as res_query() would
+ */
+void rdns_answer(radiodns_query_t *query, const unsigned char *msg, int len);
+
+/* Fill addrs with the system resolver's configured nameservers,
+ * returning the number found
+ */
+int rdns_nameservers(struct sockaddr_storage *addrs, socklen_t *addrlens, int max);
+
+/* Readiness notification for transports which provide an fd() method: an
+ * epoll set (created by rdns_notify_open()) which becomes readable when
+ * any of the descriptors watched does, or when the timer armed by
+ * rdns_notify_arm() expires. Where epoll and timerfd aren't available,
+ * rdns_notify_open() fails with ENOSYS and the rest do nothing.
+ */
+# define RDNS_NOTIFY_READ               1
+# define RDNS_NOTIFY_WRITE              2
+
+struct rdns_notify
+{
+  int epfd;
+  int timerfd;
+  /* The deadline the timer is armed for, or -1 */
+  int64_t armed;
+};
+
+void rdns_notify_init(struct rdns_notify *notify);
+int rdns_notify_open(struct rdns_notify *notify);
+void rdns_notify_watch(struct rdns_notify *notify, int fd, int events);
+void rdns_notify_arm(struct rdns_notify *notify, int64_t deadline);
+void rdns_notify_clear(struct rdns_notify *notify);
+void rdns_notify_close(struct rdns_notify *notify);
+
+/* The system resolver's per-attempt timeout, in milliseconds */
+int rdns_timeout(void);
+
+/* The current value of a monotonic clock, in milliseconds */
+int64_t rdns_now(void);
+
+/* Return a seed suitable for rdns_random(), and pseudo-random numbers
+ * from a state initialised with one
+ */
+uint64_t rdns_seed(void);
+uint32_t rdns_random(uint64_t *state);
+
+/* A minimal io_uring wrapper; rdns_uring_create() fails with ENOSYS where
+ * io_uring isn't supported. Requests are queued with the
+ * rdns_uring_sendmsg(), _recvmsg() and _cancel() functions (the last
+ * cancelling the request with the given data), submitted by
+ * rdns_uring_wait(), and their results retrieved with
+ * rdns_uring_complete(). Data values must be non-zero.
+ */
+struct rdns_uring;
+struct msghdr;
+
+struct rdns_uring *rdns_uring_create(unsigned int entries);
+void rdns_uring_destroy(struct rdns_uring *ring);
+int rdns_uring_sendmsg(struct rdns_uring *ring, int fd, struct msghdr *msg, uint64_t data);
+int rdns_uring_recvmsg(struct rdns_uring *ring, int fd, struct msghdr *msg, uint64_t data);
+int rdns_uring_cancel(struct rdns_uring *ring, uint64_t data);
+int rdns_uring_wait(struct rdns_uring *ring, int timeout);
+int rdns_uring_complete(struct rdns_uring *ring, uint64_t *data, int *res);
+/* The ring's descriptor, which is readable when completions are waiting,
+ * and the number of requests queued but not yet submitted
+ */
+int rdns_uring_fd(struct rdns_uring *ring);
+unsigned int rdns_uring_pending(struct rdns_uring *ring);
+
+/* Unescaping of TXT record parameters (%XX) and presentation-format
+ * labels (\DDD), using SIMD instructions where the processor supports
+ * them. rdns_unescape_param() copies up to len bytes of src to dest,
+ * stopping at a NUL, white space or (if eq is non-zero) an '=', storing
+ * the number of bytes written in *destlen and returning the number
+ * consumed. rdns_unescape_label() copies the first label of a name,
+ * returning the number of bytes written. Neither NUL-terminates dest.
+ * rdns_unescape_impl() selects the implementation, for benchmarking.
+ */
+# define RDNS_UNESCAPE_AUTO             0
+# define RDNS_UNESCAPE_SCALAR           1
+# define RDNS_UNESCAPE_SSE2             2
+# define RDNS_UNESCAPE_AVX2             3
+
+size_t rdns_unescape_param(char *dest, size_t *destlen, const char *src, size_t len, int eq);
+size_t rdns_unescape_label(char *dest, const char *src, size_t len);
+int rdns_unescape_impl(int impl);
+
+/* Allocate an empty application result, from allocator, whose names come
+ * from pool (if not NULL), and copy a name into it
+ */
+radiodns_app_t *rdns_app_create(radiodns_allocator_t *allocator, radiodns_intern_t *pool);
+char *rdns_app_strdup(radiodns_app_t *app, const char *str);
+
+/* The protocol spoken over radiodnsd's Unix socket. Every message is a
+ * 32-bit length followed by that many bytes. A request is a 32-bit ID
+ * chosen by the client, an op and its arguments; the response to it is
+ * the same ID, an errno and an h_errno value describing any failure, and
+ * the op's results. Responses aren't necessarily sent in the order the
+ * requests were. Integers are big-endian, and strings are a 16-bit length
+ * followed by that many bytes, without a NUL.
+ *
+ * RDNS_DAEMON_TARGET: domain -> target TTL, target
+ * RDNS_DAEMON_APP: domain, name, protocol -> target TTL, target, app
+ *   TTL, instance count, and for each instance: a flag (1 if the instance
+ *   is named), the name if so, the SRV record count, the priority,
+ *   weight, port (all 16-bit) and target of each, the parameter count,
+ *   and the key and value of each
+ * RDNS_DAEMON_STATS: -> a count, and that many names and 64-bit values
+ */
+# define RDNS_DAEMON_TARGET             1
+# define RDNS_DAEMON_APP                2
+# define RDNS_DAEMON_STATS              3
+
+/* The largest request a daemon will accept */
+# define RDNS_DAEMON_MAXREQUEST         4096
+
+/* Where radiodnsd listens unless told otherwise */
+# ifndef RADIODNS_SOCKET
+#  define RADIODNS_SOCKET               "/var/run/radiodnsd.sock"
+# endif
+
+/* A buffer messages are built in (with the rdns_put_*() functions, which
+ * set err on allocation failure) or parsed from (with the rdns_get_*()
+ * functions, which consume data from pos, setting err if there isn't
+ * enough)
+ */
+struct rdns_buf
+{
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	size_t pos;
+	int err;
+};
+
+void rdns_put_u8(struct rdns_buf *buf, unsigned int value);
+void rdns_put_u16(struct rdns_buf *buf, unsigned int value);
+void rdns_put_u32(struct rdns_buf *buf, uint32_t value);
+void rdns_put_u64(struct rdns_buf *buf, uint64_t value);
+void rdns_put_str(struct rdns_buf *buf, const char *str);
+unsigned int rdns_get_u8(struct rdns_buf *buf);
+unsigned int rdns_get_u16(struct rdns_buf *buf);
+uint32_t rdns_get_u32(struct rdns_buf *buf);
+uint64_t rdns_get_u64(struct rdns_buf *buf);
+/* Returns a copy from the default allocator, or NULL with err set */
+char *rdns_get_str(struct rdns_buf *buf);
+
+/* Encode an application result, and decode one into new storage */
+void rdns_put_app(struct rdns_buf *buf, const radiodns_app_t *app);
+radiodns_app_t *rdns_get_app(struct rdns_buf *buf, radiodns_allocator_t *allocator, radiodns_intern_t *pool);
+
+/* Resolve a context's target (if count is zero) or the applications
+ * listed in names via radiodnsd, as radiodns_resolve_apps() does;
+ * returns -2 if the daemon isn't available, or shouldn't be used for this
+ * context
+ */
+int rdns_daemon_resolve(radiodns_t *context, const char *const *names, int count, const char *protocol, radiodns_app_t **apps);
+
 #endif /*!P_RADIODNS_H_*/
@@ -0,0 +1,170 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Predicting targets. RadioDNS domains are usually delegated to
+ * broadcasters by DNAME records part of the way up the tree (such as one
+ * for each ECC), so the DNAMEs seen while following chains to targets are
+ * remembered, until their TTLs expire, and used to guess where the chains
+ * for other domains beneath them will end.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/* Number of DNAME records remembered; the one expiring soonest makes way
+ * for a new one
+ */
+#define PREDICT_DNAMES                  64
+
+struct predict_dname
+{
+	char *owner;
+	char *target;
+	size_t ownerlen;
+	int64_t expires;
+};
+
+static struct predict_dname dnames[PREDICT_DNAMES];
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t predict_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void predict_lock(void);
+static void predict_unlock(void);
+
+/* Remember a DNAME record, mapping names beneath owner to the same names
+ * beneath target, for ttl seconds
+ */
+void
+rdns_predict_add(const char *owner, const char *target, unsigned long ttl)
+{
+	struct predict_dname *dname, *slot;
+	char *o, *t;
+	int64_t now;
+	int c;
+
+	if(!ttl)
+	{
+		return;
+	}
+	now = rdns_now();
+	predict_lock();
+	slot = NULL;
+	for(c = 0; c < PREDICT_DNAMES; c++)
+	{
+		dname = &(dnames[c]);
+		if(dname->owner && !strcasecmp(dname->owner, owner))
+		{
+			slot = dname;
+			break;
+		}
+		if(!slot || (slot->owner && (!dname->owner || dname->expires < slot->expires)))
+		{
+			slot = dname;
+		}
+	}
+	if(slot->owner && !strcasecmp(slot->owner, owner) && !strcasecmp(slot->target, target))
+	{
+		slot->expires = now + (int64_t) ttl * 1000;
+		predict_unlock();
+		return;
+	}
+	if(NULL == (o = rdns_strdup(NULL, owner)) || NULL == (t = rdns_strdup(NULL, target)))
+	{
+		rdns_free(NULL, o);
+		predict_unlock();
+		return;
+	}
+	rdns_free(NULL, slot->owner);
+	rdns_free(NULL, slot->target);
+	slot->owner = o;
+	slot->target = t;
+	slot->ownerlen = strlen(o);
+	slot->expires = now + (int64_t) ttl * 1000;
+	predict_unlock();
+}
+
+/* Rewrite domain by the longest unexpired DNAME whose owner it's beneath,
+ * storing the result in buf (of MAXDNAME + 1 bytes). Returns 1 if one
+ * applied, or 0 (with domain copied unchanged) if none did.
+ */
+int
+rdns_predict(const char *domain, char *buf)
+{
+	const struct predict_dname *dname, *best;
+	size_t len, prefix;
+	int64_t now;
+	int c;
+
+	len = strlen(domain);
+	now = rdns_now();
+	best = NULL;
+	predict_lock();
+	for(c = 0; c < PREDICT_DNAMES; c++)
+	{
+		dname = &(dnames[c]);
+		if(!dname->owner || dname->expires <= now || dname->ownerlen >= len)
+		{
+			continue;
+		}
+		/* A DNAME applies to the names beneath its owner, not the owner */
+		prefix = len - dname->ownerlen;
+		if(domain[prefix - 1] != '.' || strcasecmp(domain + prefix, dname->owner))
+		{
+			continue;
+		}
+		if(!best || dname->ownerlen > best->ownerlen)
+		{
+			best = dname;
+		}
+	}
+	if(!best || len - best->ownerlen + strlen(best->target) > MAXDNAME)
+	{
+		predict_unlock();
+		strcpy(buf, domain);
+		return 0;
+	}
+	prefix = len - best->ownerlen;
+	memcpy(buf, domain, prefix);
+	strcpy(buf + prefix, best->target);
+	predict_unlock();
+	return 1;
+}
+
+static void
+predict_lock(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&predict_mutex);
+#endif
+}
+
+static void
+predict_unlock(void)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&predict_mutex);
+#endif
+}
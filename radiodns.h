@@ -19,10 +19,58 @@
 #ifndef LIBRADIODNS_H_
 # define LIBRADIODNS_H_                 1
 
+# include <stddef.h>
+
 typedef struct radiodns_struct radiodns_t;
 typedef struct radiodns_app_struct radiodns_app_t;
 typedef struct radiodns_srv_struct radiodns_srv_t;
 typedef struct radiodns_kv_struct radiodns_kv_t;
+typedef struct radiodns_watch_struct radiodns_watch_t;
+typedef struct radiodns_transport_struct radiodns_transport_t;
+typedef struct radiodns_query_struct radiodns_query_t;
+typedef struct radiodns_async_struct radiodns_async_t;
+typedef struct radiodns_intern_struct radiodns_intern_t;
+typedef struct radiodns_cache_struct radiodns_cache_t;
+typedef struct radiodns_allocator_struct radiodns_allocator_t;
+typedef struct radiodns_alloc_stats_struct radiodns_alloc_stats_t;
+typedef struct radiodns_server_stats_struct radiodns_server_stats_t;
+typedef struct radiodns_workers_struct radiodns_workers_t;
+typedef struct radiodns_job_struct radiodns_job_t;
+typedef struct radiodns_ensemble_struct radiodns_ensemble_t;
+typedef struct radiodns_dab_component_struct radiodns_dab_component_t;
+
+/* Invoked by radiodns_watch_run() when a watched target or application
+ * changes; name and app are NULL for watches on the target alone.
+ */
+typedef void (*radiodns_watch_fn)(radiodns_t *context, const char *name, const radiodns_app_t *app, void *data);
+
+/* Invoked when an asynchronous resolution completes */
+typedef void (*radiodns_async_fn)(radiodns_async_t *op, void *data);
+
+/* Invoked by the streaming resolution functions for each application
+ * instance as soon as it is complete; the instance (whose next member
+ * isn't meaningful) is only valid until the callback returns
+ */
+typedef void (*radiodns_instance_fn)(const radiodns_app_t *instance, void *data);
+
+/* The kinds of DAB service component in an ensemble */
+# define RADIODNS_DAB_SERVICE           0
+# define RADIODNS_DAB_SC                1
+# define RADIODNS_DAB_XPAD              2
+
+/* A service component in a DAB ensemble: type selects which of
+ * radiodns_create_dab(), _dab_sc() and _dab_xpad() gives its domain, and
+ * so which of pa, appty and uatype are used
+ */
+struct radiodns_dab_component_struct
+{
+	unsigned long sid;
+	unsigned int scids;
+	int type;
+	unsigned int pa;
+	unsigned int appty;
+	unsigned int uatype;
+};
 
 struct radiodns_kv_struct
 {
@@ -30,6 +78,27 @@ struct radiodns_kv_struct
 	const char *value;
 };
 
+/* How a nameserver used by a transport has been performing */
+struct radiodns_server_stats_struct
+{
+	/* The server's address and port, as text */
+	char addr[64];
+	/* Smoothed round-trip time and its mean deviation, in milliseconds,
+	 * or -1 if the server hasn't answered yet
+	 */
+	long srtt;
+	long rttvar;
+	/* Queries which have gone unanswered (or failed) in a row */
+	unsigned int failures;
+	unsigned long queries;
+	unsigned long responses;
+	unsigned long timeouts;
+	/* Copies of slow queries sent to the server by hedging */
+	unsigned long hedges;
+	/* Non-zero if queries are currently sent to this server first */
+	int preferred;
+};
+
 struct radiodns_app_struct
 {
 	radiodns_app_t *next;
@@ -40,6 +109,14 @@ struct radiodns_app_struct
 	radiodns_srv_t *srv;
 	char *_pbuf;
 	int _plen;
+	/* The pool name and srv[].target came from, if any */
+	radiodns_intern_t *_intern;
+	/* References to the list beyond the first, when it's shared */
+	unsigned long _refs;
+	/* The name to query for a named instance not yet resolved */
+	char *_ptr;
+	/* The allocator this instance (and everything in it) came from */
+	radiodns_allocator_t *_alloc;
 };
 
 struct radiodns_srv_struct
@@ -50,20 +127,117 @@ struct radiodns_srv_struct
 	char *target;
 };
 
+/* A single DNS query, as passed to a transport */
+struct radiodns_query_struct
+{
+	const char *name;
+	int qclass;
+	int qtype;
+	unsigned char *answer;
+	int anslen;
+	/* Set by the transport: the length of the answer, or -1 with herrno
+	 * set to the value res_query() would have left in h_errno
+	 */
+	int len;
+	int herrno;
+	/* The errno value describing a failure with a herrno of
+	 * NETDB_INTERNAL, if known, or zero; transports may set it
+	 */
+	int err;
+	/* Invoked by the transport when a submitted query completes */
+	void (*complete)(radiodns_query_t *query);
+	void *data;
+	/* Private to the transport */
+	void *_pending;
+};
+
+/* A transport performs DNS queries on behalf of the library. Simple
+ * transports need only provide query(); those able to have several
+ * queries in flight at once provide submit() and process() as well,
+ * or instead.
+ */
+struct radiodns_transport_struct
+{
+	/* Perform a query, blocking until it completes; returns query->len */
+	int (*query)(radiodns_transport_t *transport, radiodns_query_t *query);
+	/* Start a query without waiting for it; returns 0 or -1 */
+	int (*submit)(radiodns_transport_t *transport, radiodns_query_t *query);
+	/* Wait up to timeout milliseconds (-1 for indefinitely) for submitted
+	 * queries to complete, invoking their callbacks; returns the number
+	 * which are still outstanding, or -1 on error (in which case every
+	 * outstanding query has been completed with an error)
+	 */
+	int (*process)(radiodns_transport_t *transport, int timeout);
+	void (*destroy)(radiodns_transport_t *transport);
+	void *data;
+	/* Abandon a submitted query, which will not then be completed */
+	void (*cancel)(radiodns_transport_t *transport, radiodns_query_t *query);
+	/* Return a descriptor which becomes readable whenever process()
+	 * should be called (with a timeout of zero) by an event loop, or -1
+	 */
+	int (*fd)(radiodns_transport_t *transport);
+};
+
+/* An allocator, through which the library obtains all of the memory it
+ * uses. Blocks must be suitably aligned for any type.
+ */
+struct radiodns_allocator_struct
+{
+	/* Allocate size bytes, returning NULL on failure */
+	void *(*alloc)(radiodns_allocator_t *allocator, size_t size);
+	/* Resize a block as realloc() does; ptr may be NULL */
+	void *(*realloc)(radiodns_allocator_t *allocator, void *ptr, size_t size);
+	/* Free a block; ptr is never NULL */
+	void (*free)(radiodns_allocator_t *allocator, void *ptr);
+	void (*destroy)(radiodns_allocator_t *allocator);
+	void *data;
+};
+
+/* The statistics kept by a counting allocator */
+struct radiodns_alloc_stats_struct
+{
+	/* Bytes currently allocated, and the most allocated at once */
+	size_t current;
+	size_t peak;
+	/* The limit on current, or zero */
+	size_t limit;
+	/* Allocations (and reallocations) made, and refused for exceeding
+	 * the limit
+	 */
+	unsigned long allocs;
+	unsigned long refused;
+};
+
 # ifdef __cplusplus
 extern "C" {
 # endif
 
 	/* Create a new RadioDNS context using a specified domain name */
 	radiodns_t *radiodns_create(const char *domain);
+
+	/* Share a context with the other callers who share one with the same
+	 * domain: returns either context or, having destroyed it, a new
+	 * reference to the context already shared (whose target is then
+	 * reused), released by radiodns_destroy(). Holders share the
+	 * context's settings, and radiodns_cancel() on it cancels the
+	 * resolutions of all of them.
+	 */
+	radiodns_t *radiodns_share(radiodns_t *context);
 	
 	/* Create a new RadioDNS context for a VHF/FM service
 	 * - country must be either a 2-letter country code or a 3-character
 	 *   RDS ECC.
 	 * - suffix may be specified to override the default 'radiodns.org',
 	 *   otherwise NULL
+	 * Either form of country gives the same (canonical) domain, using the
+	 * Global Country Code wherever it's known.
 	 */
 	radiodns_t *radiodns_create_fm(unsigned int freq, unsigned int pi, const char *country, const char *suffix);
+
+	/* Create a new RadioDNS context for a VHF/FM service given its RDS
+	 * ECC (0-0xff), which is combined with the country code in the PI
+	 */
+	radiodns_t *radiodns_create_fm_ecc(unsigned int freq, unsigned int pi, unsigned int ecc, const char *suffix);
 	
 	/* Create a new RadioDNS context for a DAB service delivered via X-PAD */
 	radiodns_t *radiodns_create_dab_xpad(unsigned int appty, unsigned int uatype, unsigned int scids, unsigned long sid, unsigned int eid, unsigned int ecc, const char *suffix);
@@ -107,11 +281,323 @@ extern "C" {
 	/* Locate all instances of the specified application for a context */
 	radiodns_app_t *radiodns_resolve_app(radiodns_t *context, const char *name, const char *protocol);
 	
+	/* Locate the instances of several applications at once, storing
+	 * those of names[n] in apps[n]; returns the number found, or -1
+	 */
+	int radiodns_resolve_apps(radiodns_t *context, const char *const *names, int count, const char *protocol, radiodns_app_t **apps);
+	
 	/* Destroy an application (list of instances) returned by
 	 * radiodns_resolve_app()
 	 */
 	void radiodns_destroy_app(radiodns_app_t *app);
 
+	/* Begin resolving the target FQDN for a context, or the instances of
+	 * an application, without blocking. fn is invoked on completion, from
+	 * within the transport's process() method -- unless the resolution
+	 * completes before these functions return (as it does with
+	 * transports which can only query synchronously), which callers
+	 * should check with radiodns_async_done().
+	 */
+	radiodns_async_t *radiodns_resolve_target_async(radiodns_t *context, radiodns_async_fn fn, void *data);
+	radiodns_async_t *radiodns_resolve_app_async(radiodns_t *context, const char *name, const char *protocol, radiodns_async_fn fn, void *data);
+
+	/* As radiodns_resolve_app() and radiodns_resolve_app_async(), but
+	 * also passing each instance found to instfn as soon as it is
+	 * complete -- the anonymous instance once the application's records
+	 * have been looked up, and each named instance once its PTR record
+	 * has been followed -- before the whole result is returned, or fn
+	 * invoked. instfn may destroy the operation, abandoning the rest.
+	 * These don't use radiodnsd.
+	 */
+	radiodns_app_t *radiodns_resolve_app_stream(radiodns_t *context, const char *name, const char *protocol, radiodns_instance_fn instfn, void *data);
+	radiodns_async_t *radiodns_resolve_app_stream_async(radiodns_t *context, const char *name, const char *protocol, radiodns_instance_fn instfn, radiodns_async_fn fn, void *data);
+
+	/* As radiodns_resolve_app() and radiodns_resolve_app_async(), but
+	 * without following the application's PTR records: named instances
+	 * are returned with only their names (and no service records), and
+	 * are looked up by radiodns_resolve_instance() or
+	 * radiodns_resolve_instance_async() when they're wanted. These use
+	 * neither the context's cache nor radiodnsd.
+	 */
+	radiodns_app_t *radiodns_resolve_app_lazy(radiodns_t *context, const char *name, const char *protocol);
+	radiodns_async_t *radiodns_resolve_app_lazy_async(radiodns_t *context, const char *name, const char *protocol, radiodns_async_fn fn, void *data);
+
+	/* Fill in the service records and parameters of an instance returned
+	 * by radiodns_resolve_app_lazy(), if it hasn't been already; returns
+	 * 0 once the instance is complete, or -1 (with errno and h_errno
+	 * set, errno being ENOENT if the instance's records weren't found).
+	 * The asynchronous form reports the same through
+	 * radiodns_async_error(). The instance must not be destroyed while
+	 * it's being resolved.
+	 */
+	int radiodns_resolve_instance(radiodns_t *context, radiodns_app_t *instance);
+	radiodns_async_t *radiodns_resolve_instance_async(radiodns_t *context, radiodns_app_t *instance, radiodns_async_fn fn, void *data);
+
+	/* Return non-zero once an asynchronous resolution has completed */
+	int radiodns_async_done(const radiodns_async_t *op);
+
+	/* Return the result of a completed resolution, or NULL with
+	 * radiodns_async_error() indicating why; the caller takes ownership
+	 * of the application returned by radiodns_async_app()
+	 */
+	const char *radiodns_async_target(radiodns_async_t *op);
+	radiodns_app_t *radiodns_async_app(radiodns_async_t *op);
+
+	/* Return the errno value describing a failed resolution (or zero),
+	 * and if herrno is non-NULL, store the h_errno value there
+	 */
+	int radiodns_async_error(const radiodns_async_t *op, int *herrno);
+
+	/* Destroy an asynchronous resolution, cancelling it if incomplete */
+	void radiodns_async_destroy(radiodns_async_t *op);
+
+	/* Finish an asynchronous resolution straight away, with whatever it
+	 * has found so far and radiodns_async_error() returning ECANCELED
+	 */
+	void radiodns_async_cancel(radiodns_async_t *op);
+
+	/* Limit each resolution begun on a context to ms milliseconds in
+	 * total, however many queries it makes, or if ms is zero, remove the
+	 * limit. Resolutions which run out of time return whatever they've
+	 * found so far, with errno set to ETIMEDOUT.
+	 */
+	int radiodns_set_deadline(radiodns_t *context, unsigned long ms);
+
+	/* Cut short every resolution in progress on a context, which return
+	 * whatever they've found so far, with errno set to ECANCELED. May be
+	 * called from any thread.
+	 */
+	void radiodns_cancel(radiodns_t *context);
+
+	/* Have each application lookup begun on a context before its target
+	 * is known also look for the application's records at the target
+	 * predicted from DNAME records seen earlier (or the domain itself),
+	 * so that if the prediction is right, the chain and the lookup take
+	 * a single round trip rather than two. Disabled if enabled is zero.
+	 */
+	int radiodns_set_speculate(radiodns_t *context, int enabled);
+
+	/* Create a new watch set, which refreshes the contexts registered
+	 * with it as their records' TTLs expire
+	 */
+	radiodns_watch_t *radiodns_watch_create(void);
+
+	/* Destroy a watch set (the contexts registered with it are not
+	 * destroyed)
+	 */
+	void radiodns_watch_destroy(radiodns_watch_t *watch);
+
+	/* Register a context and (optionally) an application name with a
+	 * watch set; fn is invoked whenever the target or application
+	 * instances change
+	 */
+	int radiodns_watch_add(radiodns_watch_t *watch, radiodns_t *context, const char *name, const char *protocol, radiodns_watch_fn fn, void *data);
+
+	/* Remove a registration previously added with radiodns_watch_add() */
+	int radiodns_watch_remove(radiodns_watch_t *watch, radiodns_t *context, const char *name, const char *protocol);
+
+	/* Return the number of seconds until the next refresh is due, or -1
+	 * if nothing is registered
+	 */
+	long radiodns_watch_next(radiodns_watch_t *watch);
+
+	/* Perform any refreshes which are due, invoking callbacks for those
+	 * which have changed; returns the number of callbacks invoked
+	 */
+	int radiodns_watch_run(radiodns_watch_t *watch);
+
+	/* Return the transport which performs queries using the system
+	 * resolver (res_query()); this is the default
+	 */
+	radiodns_transport_t *radiodns_transport_libresolv(void);
+
+	/* Create a transport which pipelines queries over persistent TCP
+	 * connections to the system resolver's nameservers (RFC 7766)
+	 */
+	radiodns_transport_t *radiodns_transport_tcp(void);
+	radiodns_transport_t *radiodns_transport_udp(void);
+	radiodns_transport_t *radiodns_transport_uring(void);
+
+	/* Have a transport created by radiodns_transport_udp() or
+	 * radiodns_transport_uring() send a copy of any query which goes
+	 * unanswered for longer than nine in ten responses take to another
+	 * nameserver, taking whichever answer arrives first, but sending no
+	 * more than percent copies for every hundred queries; zero (the
+	 * default) disables hedging, as does having only one nameserver
+	 */
+	int radiodns_transport_hedge(radiodns_transport_t *transport, unsigned int percent);
+
+	/* Describe how up to max of the nameservers used by a transport
+	 * created by radiodns_transport_udp() or radiodns_transport_uring()
+	 * have been performing, returning the number it uses
+	 */
+	int radiodns_transport_servers(radiodns_transport_t *transport, radiodns_server_stats_t *stats, int max);
+
+	/* Create a transport which answers queries from an in-memory zone,
+	 * without any network access at all
+	 */
+	radiodns_transport_t *radiodns_transport_zone(void);
+
+	/* Add a record to an in-memory zone, in presentation format; e.g.,
+	 * radiodns_zone_add(zone, "_radiovis._tcp.example.com", 3600, "SRV",
+	 *   "0 100 61613 vis.example.com")
+	 */
+	int radiodns_zone_add(radiodns_transport_t *zone, const char *name, unsigned long ttl, const char *type, const char *rdata);
+
+	/* Add the records in a file, one per line, in the form
+	 * "NAME [TTL] [IN] TYPE RDATA", to an in-memory zone
+	 */
+	int radiodns_zone_load(radiodns_transport_t *zone, const char *path);
+
+	/* Destroy a transport */
+	void radiodns_transport_destroy(radiodns_transport_t *transport);
+
+	/* Set the transport used by a context, or if context is NULL, the
+	 * default used by contexts which have none of their own. The
+	 * transport must outlive any contexts using it.
+	 */
+	int radiodns_set_transport(radiodns_t *context, radiodns_transport_t *transport);
+
+	/* Return the transport used by a context, or if context is NULL, the
+	 * default
+	 */
+	radiodns_transport_t *radiodns_get_transport(radiodns_t *context);
+
+	/* Create a pool in which identical strings are stored once */
+	radiodns_intern_t *radiodns_intern_create(void);
+
+	/* Release a pool; it's freed once nothing else is using it */
+	void radiodns_intern_destroy(radiodns_intern_t *pool);
+
+	/* Return the pool's copy of str, adding it if necessary */
+	const char *radiodns_intern(radiodns_intern_t *pool, const char *str);
+
+	/* Store the instance names and SRV targets of applications resolved
+	 * by a context (or if context is NULL, by contexts with no pool of
+	 * their own) in a pool, so that identical names share a pointer
+	 */
+	int radiodns_set_intern(radiodns_t *context, radiodns_intern_t *pool);
+
+	/* Create a cache in which application results are shared */
+	radiodns_cache_t *radiodns_cache_create(void);
+
+	/* Release a cache; it's freed once nothing else is using it */
+	void radiodns_cache_destroy(radiodns_cache_t *cache);
+
+	/* Share the application results of a context (or if context is NULL,
+	 * of contexts with no cache of their own) with every other context
+	 * using the same cache, until their TTLs expire. Shared results must
+	 * not be modified.
+	 */
+	int radiodns_set_cache(radiodns_t *context, radiodns_cache_t *cache);
+
+	/* Set the allocator used for a context's resolutions and their
+	 * results or, if context is NULL, that used for everything else and
+	 * by contexts without one of their own; NULL selects the C library's
+	 * allocator. The default must be set before anything else has been
+	 * allocated. An allocator must outlive everything allocated from it.
+	 */
+	int radiodns_set_allocator(radiodns_t *context, radiodns_allocator_t *allocator);
+
+	/* Create an allocator which obtains memory from parent (or the C
+	 * library, if NULL) and counts it, refusing allocations which would
+	 * take the total beyond limit bytes if limit is non-zero
+	 */
+	radiodns_allocator_t *radiodns_allocator_counting(radiodns_allocator_t *parent, size_t limit);
+
+	/* Retrieve a counting allocator's statistics, and if reset is
+	 * non-zero, begin a new measurement
+	 */
+	int radiodns_allocator_stats(radiodns_allocator_t *allocator, radiodns_alloc_stats_t *stats, int reset);
+
+	void radiodns_allocator_destroy(radiodns_allocator_t *allocator);
+
+	/* Take another reference to an application result, which
+	 * radiodns_destroy_app() releases
+	 */
+	radiodns_app_t *radiodns_app_ref(radiodns_app_t *app);
+
+	/* Set the path of the socket radiodnsd listens on (by default, that
+	 * named by the RADIODNS_SOCKET environment variable, or the one the
+	 * daemon was built to use), or pass NULL to stop using the daemon.
+	 * While it's running, radiodns_resolve_target(), radiodns_resolve_app()
+	 * and radiodns_resolve_apps() ask it to resolve on behalf of contexts
+	 * using the system resolver. Not thread-safe.
+	 */
+	int radiodns_set_daemon(const char *path);
+
+	/* Create a pool of threads which perform resolutions in the
+	 * background. If create isn't NULL, each thread obtains a transport
+	 * of its own from it, used for contexts which have none; otherwise,
+	 * a pool of more than one thread needs a default transport which
+	 * only performs queries synchronously (EINVAL).
+	 */
+	radiodns_workers_t *radiodns_workers_create(int nworkers, radiodns_transport_t *(*create)(void));
+
+	/* Stop a pool's threads, discarding any jobs not yet collected */
+	void radiodns_workers_destroy(radiodns_workers_t *workers);
+
+	/* Queue a job to resolve count applications of a context, as
+	 * radiodns_resolve_apps() would, or if count is zero, its target.
+	 * The context mustn't be used elsewhere until the job is collected,
+	 * nor, in a pool of more than one thread, have a transport of its own
+	 * which can have queries in flight (EINVAL).
+	 */
+	int radiodns_workers_submit(radiodns_workers_t *workers, radiodns_t *context, const char *const *names, int count, const char *protocol, void *data);
+
+	/* Return the next finished job, or NULL if none are waiting. Not
+	 * thread-safe.
+	 */
+	radiodns_job_t *radiodns_workers_collect(radiodns_workers_t *workers);
+
+	/* Return a descriptor which is readable while finished jobs are
+	 * waiting to be collected
+	 */
+	int radiodns_workers_fd(radiodns_workers_t *workers);
+
+	radiodns_t *radiodns_job_context(const radiodns_job_t *job);
+	void *radiodns_job_data(const radiodns_job_t *job);
+
+	/* Take the result for the nth application named by a job */
+	radiodns_app_t *radiodns_job_app(radiodns_job_t *job, int n);
+
+	/* Return the outcome of a job, and the errno and h_errno values
+	 * describing its failure
+	 */
+	int radiodns_job_result(const radiodns_job_t *job, int *err, int *herrno);
+
+	void radiodns_job_destroy(radiodns_job_t *job);
+
+	/* Create a context for each of count components of a DAB ensemble */
+	radiodns_ensemble_t *radiodns_ensemble_create(unsigned int eid, unsigned int ecc, const radiodns_dab_component_t *components, int count, const char *suffix);
+
+	void radiodns_ensemble_destroy(radiodns_ensemble_t *ensemble);
+
+	int radiodns_ensemble_count(const radiodns_ensemble_t *ensemble);
+
+	/* Return the index of the component with the given SId and SCIdS,
+	 * or -1
+	 */
+	int radiodns_ensemble_find(const radiodns_ensemble_t *ensemble, unsigned long sid, unsigned int scids);
+
+	radiodns_t *radiodns_ensemble_context(const radiodns_ensemble_t *ensemble, int index);
+
+	/* Resolve count applications for every component at once, looking
+	 * up the applications only once for each distinct target. Every
+	 * component must use the same transport (EINVAL); a synchronous one
+	 * resolves them one at a time. Returns the number of components for
+	 * which any were found, or -1.
+	 */
+	int radiodns_ensemble_resolve(radiodns_ensemble_t *ensemble, const char *const *names, int count, const char *protocol);
+
+	/* Take the result for the nth application named for a component */
+	radiodns_app_t *radiodns_ensemble_app(radiodns_ensemble_t *ensemble, int index, int n);
+
+	/* Return the errno value describing why an application wasn't found
+	 * for a component, or zero, and its h_errno value
+	 */
+	int radiodns_ensemble_error(const radiodns_ensemble_t *ensemble, int index, int *herrno);
+
 # ifdef __cplusplus
 }
 # endif
@@ -0,0 +1,396 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* A thin C++20 wrapper around libradiodns. Contexts and application
+ * results are move-only handles which free themselves; everything they
+ * return is a view (std::string_view or std::span) onto the memory the C
+ * API already allocated, so nothing is copied.
+ *
+ *   radiodns::context ctx = radiodns::context::fm(9580, 0xc586, "gb");
+ *   for(radiodns::instance i : ctx.resolve_app("radiovis"))
+ *   {
+ *       for(const radiodns_srv_t &srv : i.srv())
+ *           connect(radiodns::target(srv), srv.port);
+ *   }
+ *
+ * As with the C API, failures are reported by empty handles and views,
+ * with errno and h_errno set.
+ */
+
+#ifndef RADIODNS_HPP_
+# define RADIODNS_HPP_                 1
+
+# include <cstddef>
+# include <iterator>
+# include <optional>
+# include <span>
+# include <string_view>
+# include <utility>
+
+# include "radiodns.h"
+
+namespace radiodns
+{
+	namespace detail
+	{
+		inline std::string_view view(const char *s) noexcept
+		{
+			return (s ? std::string_view(s) : std::string_view());
+		}
+	}
+
+	/* Accessors for the members of service records and parameters */
+	inline std::string_view target(const radiodns_srv_t &srv) noexcept
+	{
+		return detail::view(srv.target);
+	}
+
+	inline std::string_view key(const radiodns_kv_t &kv) noexcept
+	{
+		return detail::view(kv.key);
+	}
+
+	inline std::string_view value(const radiodns_kv_t &kv) noexcept
+	{
+		return detail::view(kv.value);
+	}
+
+	/* A view of one instance of an application, valid for as long as the
+	 * app it came from
+	 */
+	class instance
+	{
+	public:
+		explicit instance(const radiodns_app_t *p) noexcept : app_(p)
+		{
+		}
+
+		/* The name of a named instance, or empty for the default one */
+		std::string_view name() const noexcept
+		{
+			return detail::view(app_->name);
+		}
+
+		std::span<const radiodns_srv_t> srv() const noexcept
+		{
+			return std::span<const radiodns_srv_t>(app_->srv, app_->nsrv);
+		}
+
+		std::span<const radiodns_kv_t> params() const noexcept
+		{
+			return std::span<const radiodns_kv_t>(app_->params, app_->nparams);
+		}
+
+		/* The value of the first parameter with the given name, if any */
+		std::optional<std::string_view> param(std::string_view name) const noexcept
+		{
+			for(const radiodns_kv_t &kv : params())
+			{
+				if(key(kv) == name)
+				{
+					return value(kv);
+				}
+			}
+			return std::nullopt;
+		}
+
+		const radiodns_app_t *get() const noexcept
+		{
+			return app_;
+		}
+
+	private:
+		const radiodns_app_t *app_;
+	};
+
+	/* The instances of an application, as returned by
+	 * radiodns_resolve_app(); empty if none were found
+	 */
+	class app
+	{
+	public:
+		class iterator
+		{
+		public:
+			typedef std::forward_iterator_tag iterator_category;
+			typedef instance value_type;
+			typedef instance reference;
+			typedef std::ptrdiff_t difference_type;
+
+			iterator() noexcept : app_(nullptr)
+			{
+			}
+
+			explicit iterator(const radiodns_app_t *p) noexcept : app_(p)
+			{
+			}
+
+			instance operator*() const noexcept
+			{
+				return instance(app_);
+			}
+
+			iterator &operator++() noexcept
+			{
+				app_ = app_->next;
+				return *this;
+			}
+
+			iterator operator++(int) noexcept
+			{
+				iterator prev = *this;
+
+				app_ = app_->next;
+				return prev;
+			}
+
+			bool operator==(const iterator &other) const noexcept = default;
+
+		private:
+			const radiodns_app_t *app_;
+		};
+
+		app() noexcept : app_(nullptr)
+		{
+		}
+
+		/* Take ownership of a list of instances */
+		explicit app(radiodns_app_t *p) noexcept : app_(p)
+		{
+		}
+
+		app(app &&other) noexcept : app_(other.release())
+		{
+		}
+
+		app &operator=(app &&other) noexcept
+		{
+			reset(other.release());
+			return *this;
+		}
+
+		app(const app &) = delete;
+		app &operator=(const app &) = delete;
+
+		~app()
+		{
+			radiodns_destroy_app(app_);
+		}
+
+		iterator begin() const noexcept
+		{
+			return iterator(app_);
+		}
+
+		iterator end() const noexcept
+		{
+			return iterator();
+		}
+
+		bool empty() const noexcept
+		{
+			return !app_;
+		}
+
+		explicit operator bool() const noexcept
+		{
+			return app_ != nullptr;
+		}
+
+		radiodns_app_t *get() const noexcept
+		{
+			return app_;
+		}
+
+		radiodns_app_t *release() noexcept
+		{
+			return std::exchange(app_, nullptr);
+		}
+
+		void reset(radiodns_app_t *p = nullptr) noexcept
+		{
+			radiodns_destroy_app(std::exchange(app_, p));
+		}
+
+	private:
+		radiodns_app_t *app_;
+	};
+
+	/* A RadioDNS context; empty (with errno set) if it couldn't be
+	 * created
+	 */
+	class context
+	{
+	public:
+		context() noexcept : context_(nullptr)
+		{
+		}
+
+		/* Take ownership of a context */
+		explicit context(radiodns_t *p) noexcept : context_(p)
+		{
+		}
+
+		explicit context(const char *domain) noexcept : context_(radiodns_create(domain))
+		{
+		}
+
+		context(context &&other) noexcept : context_(other.release())
+		{
+		}
+
+		context &operator=(context &&other) noexcept
+		{
+			reset(other.release());
+			return *this;
+		}
+
+		context(const context &) = delete;
+		context &operator=(const context &) = delete;
+
+		~context()
+		{
+			radiodns_destroy(context_);
+		}
+
+		static context fm(unsigned int freq, unsigned int pi, const char *country, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_fm(freq, pi, country, suffix));
+		}
+
+		static context fm_ecc(unsigned int freq, unsigned int pi, unsigned int ecc, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_fm_ecc(freq, pi, ecc, suffix));
+		}
+
+		static context dab(unsigned int scids, unsigned long sid, unsigned int eid, unsigned int ecc, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_dab(scids, sid, eid, ecc, suffix));
+		}
+
+		static context dab_xpad(unsigned int appty, unsigned int uatype, unsigned int scids, unsigned long sid, unsigned int eid, unsigned int ecc, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_dab_xpad(appty, uatype, scids, sid, eid, ecc, suffix));
+		}
+
+		static context dab_sc(unsigned int pa, unsigned int scids, unsigned long sid, unsigned int eid, unsigned int ecc, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_dab_sc(pa, scids, sid, eid, ecc, suffix));
+		}
+
+		static context drm(unsigned long sid, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_drm(sid, suffix));
+		}
+
+		static context amss(unsigned long sid, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_amss(sid, suffix));
+		}
+
+		static context hdradio(unsigned long tx, unsigned int cc, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_hdradio(tx, cc, suffix));
+		}
+
+		static context dvb(unsigned int onid, unsigned int tsid, unsigned long sid, unsigned long nid, const char *suffix = nullptr) noexcept
+		{
+			return context(radiodns_create_dvb(onid, tsid, sid, nid, suffix));
+		}
+
+		std::string_view domain() const noexcept
+		{
+			return detail::view(radiodns_domain(context_));
+		}
+
+		/* The target found by the last resolution, if any */
+		std::string_view target() const noexcept
+		{
+			return detail::view(radiodns_target(context_));
+		}
+
+		/* The returned view remains valid until the target is next
+		 * resolved
+		 */
+		std::string_view resolve_target() noexcept
+		{
+			return detail::view(radiodns_resolve_target(context_));
+		}
+
+		app resolve_app(const char *name, const char *protocol = nullptr) noexcept
+		{
+			return app(radiodns_resolve_app(context_, name, protocol));
+		}
+
+		int set_transport(radiodns_transport_t *transport) noexcept
+		{
+			return radiodns_set_transport(context_, transport);
+		}
+
+		int set_intern(radiodns_intern_t *pool) noexcept
+		{
+			return radiodns_set_intern(context_, pool);
+		}
+
+		int set_cache(radiodns_cache_t *cache) noexcept
+		{
+			return radiodns_set_cache(context_, cache);
+		}
+
+		int set_deadline(unsigned long ms) noexcept
+		{
+			return radiodns_set_deadline(context_, ms);
+		}
+
+		int set_speculate(bool enabled) noexcept
+		{
+			return radiodns_set_speculate(context_, enabled ? 1 : 0);
+		}
+
+		/* May be called from any thread */
+		void cancel() noexcept
+		{
+			radiodns_cancel(context_);
+		}
+
+		explicit operator bool() const noexcept
+		{
+			return context_ != nullptr;
+		}
+
+		radiodns_t *get() const noexcept
+		{
+			return context_;
+		}
+
+		radiodns_t *release() noexcept
+		{
+			return std::exchange(context_, nullptr);
+		}
+
+		void reset(radiodns_t *p = nullptr) noexcept
+		{
+			radiodns_destroy(std::exchange(context_, p));
+		}
+
+	private:
+		radiodns_t *context_;
+	};
+}
+
+#endif /*!RADIODNS_HPP_*/
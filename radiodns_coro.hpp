@@ -0,0 +1,255 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* A C++20 coroutine interface to libradiodns, built upon the asynchronous
+ * resolution functions. Nothing here blocks: a coroutine which awaits a
+ * resolution is suspended until the transport's process() method (called
+ * by the application's event loop, perhaps via radiodns::driver) delivers
+ * the result, and is resumed from within that call. Destroying a suspended
+ * coroutine cancels whatever it was waiting for.
+ *
+ *   radiodns::app_result r = co_await radiodns::resolve_app(context, "radioepg");
+ */
+
+#ifndef RADIODNS_CORO_HPP_
+# define RADIODNS_CORO_HPP_            1
+
+# include <cerrno>
+# include <coroutine>
+# include <string>
+# include <netdb.h>
+
+# include "radiodns.hpp"
+
+namespace radiodns
+{
+	/* The outcome of resolving a target: error and herrno are the errno
+	 * and h_errno values which radiodns_resolve_target() would have left
+	 */
+	struct target_result
+	{
+		std::string target;
+		int error;
+		int herrno;
+
+		explicit operator bool() const noexcept
+		{
+			return !target.empty();
+		}
+	};
+
+	/* The outcome of resolving an application, in the same manner; app is
+	 * empty if no instances were found
+	 */
+	struct app_result
+	{
+		radiodns::app app;
+		int error;
+		int herrno;
+
+		explicit operator bool() const noexcept
+		{
+			return !app.empty();
+		}
+	};
+
+	namespace detail
+	{
+		/* The common part of the awaitables, which owns the underlying
+		 * operation; Derived::start() begins it
+		 */
+		template<typename Derived>
+		class operation
+		{
+		public:
+			operation() noexcept = default;
+			operation(const operation &) = delete;
+			operation &operator=(const operation &) = delete;
+
+			~operation()
+			{
+				radiodns_async_destroy(op_);
+			}
+
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			/* If the operation completes straight away (as it does with
+			 * transports which can only query synchronously), the
+			 * coroutine simply carries on
+			 */
+			bool await_suspend(std::coroutine_handle<> handle) noexcept
+			{
+				handle_ = handle;
+				if(!(op_ = static_cast<Derived *>(this)->start(&operation::resume, this)))
+				{
+					error_ = (errno ? errno : ENOMEM);
+					return false;
+				}
+				return !radiodns_async_done(op_);
+			}
+
+		protected:
+			int error(int *herrno) const noexcept
+			{
+				if(!op_)
+				{
+					*herrno = NETDB_INTERNAL;
+					return error_;
+				}
+				return radiodns_async_error(op_, herrno);
+			}
+
+			radiodns_async_t *op_ = nullptr;
+
+		private:
+			static void resume(radiodns_async_t *, void *data)
+			{
+				static_cast<operation *>(data)->handle_.resume();
+			}
+
+			std::coroutine_handle<> handle_;
+			int error_ = 0;
+		};
+	}
+
+	/* co_await resolve_target(context) yields a target_result */
+	class resolve_target : public detail::operation<resolve_target>
+	{
+	public:
+		explicit resolve_target(radiodns_t *context) noexcept : context_(context)
+		{
+		}
+
+		explicit resolve_target(const radiodns::context &ctx) noexcept : context_(ctx.get())
+		{
+		}
+
+		radiodns_async_t *start(radiodns_async_fn fn, void *data) noexcept
+		{
+			return radiodns_resolve_target_async(context_, fn, data);
+		}
+
+		target_result await_resume()
+		{
+			target_result r;
+			const char *target;
+
+			r.error = error(&r.herrno);
+			if(op_ && (target = radiodns_async_target(op_)))
+			{
+				r.target = target;
+			}
+			return r;
+		}
+
+	private:
+		radiodns_t *context_;
+	};
+
+	/* co_await resolve_app(context, name[, protocol]) yields an app_result */
+	class resolve_app : public detail::operation<resolve_app>
+	{
+	public:
+		resolve_app(radiodns_t *context, std::string name, std::string protocol = "tcp") :
+			context_(context), name_(std::move(name)), protocol_(std::move(protocol))
+		{
+		}
+
+		resolve_app(const radiodns::context &ctx, std::string name, std::string protocol = "tcp") :
+			context_(ctx.get()), name_(std::move(name)), protocol_(std::move(protocol))
+		{
+		}
+
+		radiodns_async_t *start(radiodns_async_fn fn, void *data) noexcept
+		{
+			return radiodns_resolve_app_async(context_, name_.c_str(), protocol_.c_str(), fn, data);
+		}
+
+		app_result await_resume() noexcept
+		{
+			app_result r;
+
+			r.error = error(&r.herrno);
+			if(op_)
+			{
+				r.app.reset(radiodns_async_app(op_));
+			}
+			return r;
+		}
+
+	private:
+		radiodns_t *context_;
+		std::string name_;
+		std::string protocol_;
+	};
+
+	/* Drives a transport on behalf of an event loop. Whenever fd() is
+	 * readable, call process(); coroutines awaiting resolutions are
+	 * resumed from within it. Transports which can only query
+	 * synchronously have nothing to drive, and fd() returns -1.
+	 */
+	class driver
+	{
+	public:
+		/* Drive the default transport */
+		driver() noexcept : transport_(radiodns_get_transport(nullptr))
+		{
+		}
+
+		/* Drive the transport used by a context */
+		explicit driver(radiodns_t *context) noexcept : transport_(radiodns_get_transport(context))
+		{
+		}
+
+		explicit driver(const radiodns::context &ctx) noexcept : transport_(radiodns_get_transport(ctx.get()))
+		{
+		}
+
+		explicit driver(radiodns_transport_t *transport) noexcept : transport_(transport)
+		{
+		}
+
+		int fd() const noexcept
+		{
+			return (transport_->fd ? transport_->fd(transport_) : -1);
+		}
+
+		/* Deliver whatever has completed, waiting up to timeout
+		 * milliseconds (or indefinitely, if negative) for something to;
+		 * returns the number of queries still outstanding, or -1
+		 */
+		int process(int timeout = 0) noexcept
+		{
+			return (transport_->process ? transport_->process(transport_, timeout) : 0);
+		}
+
+		/* Keep going until nothing is outstanding */
+		void run() noexcept
+		{
+			while(process(-1) > 0);
+		}
+
+	private:
+		radiodns_transport_t *transport_;
+	};
+}
+
+#endif /*!RADIODNS_CORO_HPP_*/
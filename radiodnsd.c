@@ -0,0 +1,1211 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* radiodnsd: resolve targets and applications on behalf of the other
+ * processes on a host, which the library does automatically when the
+ * daemon is listening on its socket. Every request is served from one
+ * cache of results, and requests for a target or an application which is
+ * already being looked up wait for that lookup rather than repeating it.
+ * The daemon runs in the foreground, in a single thread driving a
+ * non-blocking transport; 'radiodnsd -S' prints its statistics.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+/* Number of buckets in the table of domains */
+#define DAEMON_DOMAINS                  1024
+/* The shortest time a target is kept for, in milliseconds, so that
+ * targets published without a TTL aren't looked up for every request
+ */
+#define DAEMON_MINTTL                   5000
+/* How often the table of domains is swept of those no longer in use, in
+ * milliseconds, and how many it may hold before those whose targets
+ * haven't yet expired are swept away too
+ */
+#define DAEMON_SWEEP                    1000
+#define DAEMON_MAXDOMAINS               65536
+/* A client's input buffer holds one whole request and the start of the
+ * next. Once a client has DAEMON_MAXPENDING requests unanswered, or
+ * DAEMON_OUTPUT bytes of responses it hasn't read, nothing more is read
+ * from it until it catches up; one which lets DAEMON_MAXOUTPUT bytes
+ * pile up is disconnected.
+ */
+#define DAEMON_INPUT                    (RDNS_DAEMON_MAXREQUEST * 2)
+#define DAEMON_MAXPENDING               1024
+#define DAEMON_OUTPUT                   (256 * 1024)
+#define DAEMON_MAXOUTPUT                (4 * 1024 * 1024)
+
+/* A domain whose target has been, or is being, resolved. A domain being
+ * resolved again while applications are still being looked up beneath its
+ * old target is retired, and replaced in the table by a new one, so that
+ * those lookups can finish with the context they started with.
+ */
+struct domain
+{
+	struct domain *next;
+	char *name;
+	radiodns_t *context;
+	/* When the target must next be resolved */
+	int64_t expires;
+	/* The target lookup in progress, and the requests waiting for it */
+	radiodns_async_t *op;
+	struct request *waiting;
+	/* The number of application lookups in progress */
+	int active;
+	int retired;
+};
+
+struct client
+{
+	struct client *next;
+	int fd;
+	/* The number of requests not yet answered */
+	int pending;
+	int closed;
+	int pollidx;
+	struct rdns_buf in;
+	/* Responses not yet written; out.pos is how much has been */
+	struct rdns_buf out;
+};
+
+struct request
+{
+	struct request *next;
+	struct client *client;
+	struct domain *domain;
+	uint32_t id;
+	int op;
+	char *name;
+	char *protocol;
+	radiodns_async_t *async;
+	int64_t started;
+};
+
+/* Latency is counted in buckets whose upper bounds, in microseconds, are
+ * successive powers of ten from 100us
+ */
+#define DAEMON_BUCKETS                  6
+
+static struct
+{
+	int64_t started;
+	uint64_t requests;
+	uint64_t targets;
+	uint64_t apps;
+	uint64_t stats;
+	uint64_t invalid;
+	uint64_t failed;
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t coalesced;
+	uint64_t inflight;
+	uint64_t clients;
+	uint64_t latency_total;
+	uint64_t latency_max;
+	uint64_t latency[DAEMON_BUCKETS];
+} stats;
+
+static const char *progname = "radiodnsd";
+static struct domain *domains[DAEMON_DOMAINS];
+static int ndomains;
+static int64_t sweep_at;
+static struct client *clients;
+static volatile sig_atomic_t quit;
+
+static void usage(void);
+static int set_nameserver(const char *spec);
+static int print_stats(const char *path);
+static int listen_on(const char *path);
+static int64_t now_us(void);
+static void on_signal(int sig);
+static void client_accept(int fd);
+static void client_read(struct client *client);
+static void client_parse(struct client *client);
+static int client_ready(const struct client *client);
+static void client_flush(struct client *client);
+static void client_close(struct client *client);
+static void client_sweep(void);
+static void request_parse(struct client *client, struct rdns_buf *msg);
+static void request_start(struct request *req);
+static void request_resolved(struct request *req);
+static void request_reply(struct request *req, int err, int herrno, radiodns_app_t *app);
+static void request_stats(struct client *client, uint32_t id);
+static void request_free(struct request *req);
+static void app_done(radiodns_async_t *op, void *data);
+static void target_done(radiodns_async_t *op, void *data);
+static uint32_t domain_hash(const char *name);
+static struct domain *domain_find(const char *name);
+static struct domain *domain_retire(struct domain *domain);
+static void domain_release(struct domain *domain);
+static void domain_sweep(void);
+static void reply_begin(struct rdns_buf *buf, uint32_t id, int err, int herrno);
+static void reply_end(struct client *client, struct rdns_buf *buf, size_t start);
+
+int
+main(int argc, char **argv)
+{
+	struct pollfd *fds;
+	struct client *client;
+	radiodns_transport_t *transport;
+	radiodns_cache_t *cache;
+	const char *path, *kind, *zone;
+	size_t nfds, size;
+	int c, lfd, tfd, timeout, show;
+	char *t;
+
+	if(argv[0])
+	{
+		progname = ((t = strrchr(argv[0], '/')) ? t + 1 : argv[0]);
+	}
+	if(!(path = getenv("RADIODNS_SOCKET")) || !path[0])
+	{
+		path = RADIODNS_SOCKET;
+	}
+	kind = "udp";
+	zone = NULL;
+	show = 0;
+	while(-1 != (c = getopt(argc, argv, "hn:s:t:z:S")))
+	{
+		switch(c)
+		{
+		case 'n':
+			if(set_nameserver(optarg))
+			{
+				fprintf(stderr, "%s: invalid nameserver '%s'\n", progname, optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 't':
+			kind = optarg;
+			break;
+		case 'z':
+			zone = optarg;
+			break;
+		case 'S':
+			show = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(optind < argc)
+	{
+		usage();
+		return 1;
+	}
+	if(show)
+	{
+		return print_stats(path);
+	}
+	if(zone)
+	{
+		if(!(transport = radiodns_transport_zone()) || 0 > radiodns_zone_load(transport, zone))
+		{
+			fprintf(stderr, "%s: %s: failed to load zone: %s\n", progname, zone, strerror(errno));
+			return 1;
+		}
+	}
+	else
+	{
+		if(!strcmp(kind, "udp"))
+		{
+			transport = radiodns_transport_udp();
+		}
+		else if(!strcmp(kind, "tcp"))
+		{
+			transport = radiodns_transport_tcp();
+		}
+		else if(!strcmp(kind, "uring"))
+		{
+			transport = radiodns_transport_uring();
+		}
+		else
+		{
+			fprintf(stderr, "%s: unsupported transport '%s'\n", progname, kind);
+			return 1;
+		}
+		if(!transport)
+		{
+			fprintf(stderr, "%s: failed to create %s transport: %s\n", progname, kind, strerror(errno));
+			return 1;
+		}
+	}
+	/* Our own lookups mustn't be passed back to us */
+	radiodns_set_daemon(NULL);
+	radiodns_set_transport(NULL, transport);
+	if(!(cache = radiodns_cache_create()))
+	{
+		fprintf(stderr, "%s: failed to create cache: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	radiodns_set_cache(NULL, cache);
+	radiodns_cache_destroy(cache);
+	if(0 > (lfd = listen_on(path)))
+	{
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	stats.started = now_us();
+	tfd = (transport->fd ? transport->fd(transport) : -1);
+	fds = NULL;
+	size = 0;
+	while(!quit)
+	{
+		nfds = 2;
+		for(client = clients; client; client = client->next)
+		{
+			nfds++;
+		}
+		if(nfds > size)
+		{
+			size = nfds * 2;
+			if(!(fds = (struct pollfd *) realloc(fds, size * sizeof(struct pollfd))))
+			{
+				fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+				break;
+			}
+		}
+		fds[0].fd = lfd;
+		fds[0].events = POLLIN;
+		fds[1].fd = tfd;
+		fds[1].events = POLLIN;
+		nfds = 2;
+		for(client = clients; client; client = client->next)
+		{
+			/* Requests left unparsed while the client was at its limits */
+			if(!client->closed && client->in.len && client_ready(client))
+			{
+				client_parse(client);
+			}
+			client->pollidx = nfds;
+			fds[nfds].fd = client->fd;
+			fds[nfds].events = (client_ready(client) ? POLLIN : 0) | (client->out.pos < client->out.len ? POLLOUT : 0);
+			if(!fds[nfds].events)
+			{
+				/* Not even for hangups, until there's something to do */
+				fds[nfds].fd = -1;
+			}
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		/* Transports without a descriptor to wait on are polled */
+		timeout = (tfd < 0 && transport->process && stats.inflight ? 10 : -1);
+		if(0 > poll(fds, nfds, timeout))
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+			break;
+		}
+		if(transport->process && (tfd < 0 || fds[1].revents))
+		{
+			transport->process(transport, 0);
+		}
+		for(client = clients; client; client = client->next)
+		{
+			if(client->closed || !fds[client->pollidx].revents)
+			{
+				continue;
+			}
+			if(fds[client->pollidx].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				client_read(client);
+			}
+			if(!client->closed && (fds[client->pollidx].revents & POLLOUT))
+			{
+				client_flush(client);
+			}
+		}
+		if(fds[0].revents)
+		{
+			client_accept(lfd);
+		}
+		client_sweep();
+		domain_sweep();
+	}
+	close(lfd);
+	unlink(path);
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n", progname);
+	fprintf(stderr, "OPTIONS is one or more of:\n");
+	fprintf(stderr, "  -h                  Print this notice and exit\n");
+	fprintf(stderr, "  -n ADDR[:PORT]      Query the IPv4 nameserver ADDR instead of the system's\n");
+	fprintf(stderr, "  -s PATH             Listen on the socket PATH (default " RADIODNS_SOCKET ")\n");
+	fprintf(stderr, "  -t udp|tcp|uring    Resolve using the named transport (default udp)\n");
+	fprintf(stderr, "  -z FILE             Answer queries from records in FILE instead of DNS\n");
+	fprintf(stderr, "  -S                  Print the statistics of the running daemon and exit\n");
+}
+
+static int
+set_nameserver(const char *spec)
+{
+	char buf[64], *p;
+	struct in_addr addr;
+	int port;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	port = NS_DEFAULTPORT;
+	if((p = strchr(buf, ':')))
+	{
+		*p = 0;
+		port = atoi(p + 1);
+	}
+	if(port <= 0 || port > 65535 || 1 != inet_pton(AF_INET, buf, &addr))
+	{
+		return -1;
+	}
+	res_init();
+	_res.nscount = 1;
+	_res.nsaddr_list[0].sin_family = AF_INET;
+	_res.nsaddr_list[0].sin_port = htons(port);
+	_res.nsaddr_list[0].sin_addr = addr;
+	return 0;
+}
+
+/* Ask a running daemon for its statistics, and print them */
+static int
+print_stats(const char *path)
+{
+	struct sockaddr_un sun;
+	struct rdns_buf buf;
+	unsigned char *p;
+	uint64_t value, uptime, requests, total;
+	size_t len;
+	ssize_t r;
+	char *name;
+	int fd, n;
+
+	memset(&sun, 0, sizeof(sun));
+	memset(&buf, 0, sizeof(buf));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if(0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0)) || connect(fd, (struct sockaddr *) &sun, sizeof(sun)))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return 1;
+	}
+	rdns_put_u32(&buf, 5);
+	rdns_put_u32(&buf, 0);
+	rdns_put_u8(&buf, RDNS_DAEMON_STATS);
+	if(buf.err || (ssize_t) buf.len != write(fd, buf.data, buf.len))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return 1;
+	}
+	/* Read until the daemon closes the connection or we have the whole
+	 * response
+	 */
+	buf.len = 0;
+	for(;;)
+	{
+		if(buf.len == buf.size)
+		{
+			if(!(p = (unsigned char *) rdns_realloc(NULL, buf.data, buf.size * 2)))
+			{
+				fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+				return 1;
+			}
+			buf.data = p;
+			buf.size *= 2;
+		}
+		if(0 >= (r = read(fd, buf.data + buf.len, buf.size - buf.len)))
+		{
+			break;
+		}
+		buf.len += r;
+		if(buf.len >= 4)
+		{
+			len = ((size_t) buf.data[0] << 24) | ((size_t) buf.data[1] << 16) | ((size_t) buf.data[2] << 8) | buf.data[3];
+			if(buf.len >= len + 4)
+			{
+				break;
+			}
+		}
+	}
+	close(fd);
+	buf.pos = 4;
+	rdns_get_u32(&buf);
+	rdns_get_u32(&buf);
+	rdns_get_u32(&buf);
+	uptime = requests = total = 0;
+	for(n = rdns_get_u32(&buf); n > 0 && !buf.err; n--)
+	{
+		if(!(name = rdns_get_str(&buf)))
+		{
+			break;
+		}
+		value = rdns_get_u64(&buf);
+		printf("%-24s %llu\n", name, (unsigned long long) value);
+		if(!strcmp(name, "uptime_ms"))
+		{
+			uptime = value;
+		}
+		else if(!strcmp(name, "requests"))
+		{
+			requests = value;
+		}
+		else if(!strcmp(name, "latency_total_us"))
+		{
+			total = value;
+		}
+		rdns_free(NULL, name);
+	}
+	if(buf.err)
+	{
+		fprintf(stderr, "%s: %s: invalid response from daemon\n", progname, path);
+		return 1;
+	}
+	if(uptime)
+	{
+		printf("%-24s %.1f\n", "requests_per_sec", (double) requests * 1000 / uptime);
+	}
+	if(requests)
+	{
+		printf("%-24s %.1f\n", "latency_mean_us", (double) total / requests);
+	}
+	rdns_free(NULL, buf.data);
+	return 0;
+}
+
+/* Listen on path, unless another daemon already is */
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if(strlen(path) >= sizeof(sun.sun_path))
+	{
+		fprintf(stderr, "%s: %s: socket path is too long\n", progname, path);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if(0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+	{
+		fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+		return -1;
+	}
+	if(!connect(fd, (struct sockaddr *) &sun, sizeof(sun)))
+	{
+		fprintf(stderr, "%s: %s: another daemon is already listening\n", progname, path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	/* Anything left there is from a daemon which has gone away */
+	unlink(path);
+	if(0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0)) ||
+	   bind(fd, (struct sockaddr *) &sun, sizeof(sun)) ||
+	   chmod(path, 0666) ||
+	   listen(fd, SOMAXCONN) ||
+	   fcntl(fd, F_SETFL, O_NONBLOCK) ||
+	   fcntl(fd, F_SETFD, FD_CLOEXEC))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return -1;
+	}
+	return fd;
+}
+
+static int64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+on_signal(int sig)
+{
+	(void) sig;
+
+	quit = 1;
+}
+
+static void
+client_accept(int fd)
+{
+	struct client *client;
+	int cfd;
+
+	while(0 <= (cfd = accept(fd, NULL, NULL)))
+	{
+		if(fcntl(cfd, F_SETFL, O_NONBLOCK) || fcntl(cfd, F_SETFD, FD_CLOEXEC) ||
+		   NULL == (client = (struct client *) calloc(1, sizeof(struct client))))
+		{
+			close(cfd);
+			continue;
+		}
+		client->fd = cfd;
+		client->next = clients;
+		clients = client;
+		stats.clients++;
+	}
+}
+
+/* Read whatever a client has sent, and start each complete request, for
+ * as long as it's within its limits
+ */
+static void
+client_read(struct client *client)
+{
+	ssize_t r;
+	int eof;
+
+	if(!client->in.data)
+	{
+		if(!(client->in.data = (unsigned char *) rdns_malloc(NULL, DAEMON_INPUT)))
+		{
+			client_close(client);
+			return;
+		}
+		client->in.size = DAEMON_INPUT;
+	}
+	for(eof = 0; !eof && client_ready(client);)
+	{
+		/* Whatever's left over is less than a whole request, so there's
+		 * always room for the rest of it
+		 */
+		if(0 >= (r = read(client->fd, client->in.data + client->in.len, client->in.size - client->in.len)))
+		{
+			if(r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				break;
+			}
+			if(r < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			/* Answer whatever was sent before the client went away */
+			eof = 1;
+		}
+		else
+		{
+			client->in.len += r;
+		}
+		client_parse(client);
+		if(client->closed)
+		{
+			return;
+		}
+	}
+	client_flush(client);
+	if(eof)
+	{
+		client_close(client);
+	}
+}
+
+/* Start each complete request in a client's input buffer */
+static void
+client_parse(struct client *client)
+{
+	struct rdns_buf msg;
+	unsigned char *p;
+	size_t start, len;
+
+	for(start = 0; client->in.len - start >= 4 && client_ready(client); start += len + 4)
+	{
+		p = client->in.data + start;
+		len = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+		if(len > RDNS_DAEMON_MAXREQUEST)
+		{
+			/* Not a client we can make sense of */
+			stats.invalid++;
+			client_close(client);
+			return;
+		}
+		if(client->in.len - start < len + 4)
+		{
+			break;
+		}
+		msg.data = p;
+		msg.len = len + 4;
+		msg.size = msg.len;
+		msg.pos = 4;
+		msg.err = 0;
+		request_parse(client, &msg);
+		if(client->closed)
+		{
+			return;
+		}
+	}
+	memmove(client->in.data, client->in.data + start, client->in.len - start);
+	client->in.len -= start;
+}
+
+/* Whether a client may have more of its requests started */
+static int
+client_ready(const struct client *client)
+{
+	return (!client->closed && client->pending < DAEMON_MAXPENDING && client->out.len - client->out.pos < DAEMON_OUTPUT);
+}
+
+/* Write as much of a client's responses as it will take */
+static void
+client_flush(struct client *client)
+{
+	ssize_t r;
+
+	while(!client->closed && client->out.pos < client->out.len)
+	{
+		if(0 > (r = send(client->fd, client->out.data + client->out.pos, client->out.len - client->out.pos, MSG_NOSIGNAL)))
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				client_close(client);
+				return;
+			}
+			/* Keep only what's still to be sent */
+			memmove(client->out.data, client->out.data + client->out.pos, client->out.len - client->out.pos);
+			client->out.len -= client->out.pos;
+			client->out.pos = 0;
+			return;
+		}
+		client->out.pos += r;
+	}
+	client->out.len = 0;
+	client->out.pos = 0;
+}
+
+/* Stop talking to a client; it's freed once its outstanding requests
+ * have finished, whose results will be cached for others
+ */
+static void
+client_close(struct client *client)
+{
+	if(client->closed)
+	{
+		return;
+	}
+	close(client->fd);
+	client->fd = -1;
+	client->closed = 1;
+	rdns_free(NULL, client->in.data);
+	rdns_free(NULL, client->out.data);
+	memset(&(client->in), 0, sizeof(client->in));
+	memset(&(client->out), 0, sizeof(client->out));
+}
+
+static void
+client_sweep(void)
+{
+	struct client **p, *client;
+
+	for(p = &clients; *p;)
+	{
+		client = *p;
+		if(client->closed && !client->pending)
+		{
+			*p = client->next;
+			free(client);
+			stats.clients--;
+			continue;
+		}
+		p = &(client->next);
+	}
+}
+
+static void
+request_parse(struct client *client, struct rdns_buf *msg)
+{
+	struct request *req;
+	char *domain;
+
+	stats.requests++;
+	if(NULL == (req = (struct request *) calloc(1, sizeof(struct request))))
+	{
+		client_close(client);
+		return;
+	}
+	req->client = client;
+	req->started = now_us();
+	req->id = rdns_get_u32(msg);
+	req->op = rdns_get_u8(msg);
+	client->pending++;
+	stats.inflight++;
+	if(msg->err)
+	{
+		stats.invalid++;
+		request_reply(req, EINVAL, NETDB_INTERNAL, NULL);
+		return;
+	}
+	switch(req->op)
+	{
+	case RDNS_DAEMON_STATS:
+		stats.stats++;
+		request_stats(client, req->id);
+		request_free(req);
+		return;
+	case RDNS_DAEMON_TARGET:
+		stats.targets++;
+		domain = rdns_get_str(msg);
+		break;
+	case RDNS_DAEMON_APP:
+		stats.apps++;
+		domain = rdns_get_str(msg);
+		req->name = rdns_get_str(msg);
+		req->protocol = rdns_get_str(msg);
+		break;
+	default:
+		domain = NULL;
+		msg->err = EINVAL;
+	}
+	if(msg->err || !domain[0] || (req->name && !req->name[0]) || (req->protocol && !req->protocol[0]))
+	{
+		stats.invalid++;
+		rdns_free(NULL, domain);
+		request_reply(req, (msg->err ? msg->err : EINVAL), NETDB_INTERNAL, NULL);
+		return;
+	}
+	req->domain = domain_find(domain);
+	rdns_free(NULL, domain);
+	if(!req->domain)
+	{
+		request_reply(req, errno, NETDB_INTERNAL, NULL);
+		return;
+	}
+	request_start(req);
+}
+
+/* Wait for the request's domain's target to be resolved, unless it
+ * already has been
+ */
+static void
+request_start(struct request *req)
+{
+	struct domain *domain;
+	radiodns_async_t *op;
+
+	domain = req->domain;
+	if(domain->context->target && rdns_now() < domain->expires)
+	{
+		stats.hits++;
+		request_resolved(req);
+		return;
+	}
+	req->next = domain->waiting;
+	domain->waiting = req;
+	if(domain->op)
+	{
+		stats.coalesced++;
+		return;
+	}
+	if(domain->active)
+	{
+		/* Application lookups are still using the old target */
+		domain->waiting = NULL;
+		domain = domain_retire(domain);
+		if(!domain)
+		{
+			request_reply(req, errno, NETDB_INTERNAL, NULL);
+			return;
+		}
+		req->domain = domain;
+		domain->waiting = req;
+	}
+	stats.lookups++;
+	if(NULL == (op = radiodns_resolve_target_async(domain->context, target_done, domain)))
+	{
+		domain->waiting = NULL;
+		request_reply(req, errno, NETDB_INTERNAL, NULL);
+		return;
+	}
+	domain->op = op;
+	if(radiodns_async_done(op))
+	{
+		target_done(op, domain);
+	}
+}
+
+/* The request's domain's target is known */
+static void
+request_resolved(struct request *req)
+{
+	struct domain *domain;
+	radiodns_async_t *op;
+
+	domain = req->domain;
+	if(req->op == RDNS_DAEMON_TARGET)
+	{
+		request_reply(req, 0, 0, NULL);
+		return;
+	}
+	domain->active++;
+	if(NULL == (op = radiodns_resolve_app_async(domain->context, req->name, req->protocol, app_done, req)))
+	{
+		domain->active--;
+		request_reply(req, errno, NETDB_INTERNAL, NULL);
+		return;
+	}
+	req->async = op;
+	if(radiodns_async_done(op))
+	{
+		app_done(op, req);
+	}
+}
+
+static void
+target_done(radiodns_async_t *op, void *data)
+{
+	struct domain *domain;
+	struct request *req, *next;
+	int64_t ttl;
+	int err, herrno;
+
+	domain = (struct domain *) data;
+	err = radiodns_async_error(op, &herrno);
+	if(radiodns_async_target(op))
+	{
+		ttl = (int64_t) domain->context->target_ttl * 1000;
+		domain->expires = rdns_now() + (ttl > DAEMON_MINTTL ? ttl : DAEMON_MINTTL);
+	}
+	domain->op = NULL;
+	radiodns_async_destroy(op);
+	req = domain->waiting;
+	domain->waiting = NULL;
+	for(; req; req = next)
+	{
+		next = req->next;
+		if(domain->context->target)
+		{
+			request_resolved(req);
+		}
+		else
+		{
+			request_reply(req, (err ? err : EIO), herrno, NULL);
+		}
+	}
+	domain_release(domain);
+}
+
+static void
+app_done(radiodns_async_t *op, void *data)
+{
+	struct request *req;
+	radiodns_app_t *app;
+	int err, herrno;
+
+	req = (struct request *) data;
+	app = radiodns_async_app(op);
+	err = radiodns_async_error(op, &herrno);
+	radiodns_async_destroy(op);
+	req->async = NULL;
+	req->domain->active--;
+	request_reply(req, err, herrno, app);
+	radiodns_destroy_app(app);
+}
+
+/* Send a request's response (if its client is still there), and free it */
+static void
+request_reply(struct request *req, int err, int herrno, radiodns_app_t *app)
+{
+	struct client *client;
+	struct domain *domain;
+	size_t start;
+	int64_t elapsed, remaining;
+	int c;
+
+	client = req->client;
+	domain = req->domain;
+	if(err || herrno || (req->op == RDNS_DAEMON_APP && !app))
+	{
+		stats.failed++;
+	}
+	elapsed = now_us() - req->started;
+	stats.latency_total += elapsed;
+	if((uint64_t) elapsed > stats.latency_max)
+	{
+		stats.latency_max = elapsed;
+	}
+	for(c = 0, remaining = 100; c < DAEMON_BUCKETS - 1 && elapsed >= remaining; c++)
+	{
+		remaining *= 10;
+	}
+	stats.latency[c]++;
+	if(!client->closed)
+	{
+		start = client->out.len;
+		reply_begin(&(client->out), req->id, err, herrno);
+		remaining = 0;
+		if(domain && domain->context->target)
+		{
+			remaining = (domain->expires - rdns_now()) / 1000;
+		}
+		rdns_put_u32(&(client->out), (remaining > 0 ? remaining : 0));
+		rdns_put_str(&(client->out), (domain ? domain->context->target : NULL));
+		if(req->op == RDNS_DAEMON_APP)
+		{
+			rdns_put_u32(&(client->out), (app ? domain->context->app_ttl : 0));
+			rdns_put_app(&(client->out), app);
+		}
+		reply_end(client, &(client->out), start);
+	}
+	if(domain)
+	{
+		domain_release(domain);
+	}
+	request_free(req);
+}
+
+static void
+request_stats(struct client *client, uint32_t id)
+{
+	struct rdns_buf *buf;
+	size_t start;
+	char name[48];
+	int c;
+	uint64_t limit;
+
+	buf = &(client->out);
+	start = buf->len;
+	reply_begin(buf, id, 0, 0);
+	rdns_put_u32(buf, 14 + DAEMON_BUCKETS);
+	rdns_put_str(buf, "uptime_ms");
+	rdns_put_u64(buf, (now_us() - stats.started) / 1000);
+	rdns_put_str(buf, "requests");
+	rdns_put_u64(buf, stats.requests);
+	rdns_put_str(buf, "target_requests");
+	rdns_put_u64(buf, stats.targets);
+	rdns_put_str(buf, "app_requests");
+	rdns_put_u64(buf, stats.apps);
+	rdns_put_str(buf, "stats_requests");
+	rdns_put_u64(buf, stats.stats);
+	rdns_put_str(buf, "invalid");
+	rdns_put_u64(buf, stats.invalid);
+	rdns_put_str(buf, "failed");
+	rdns_put_u64(buf, stats.failed);
+	rdns_put_str(buf, "target_lookups");
+	rdns_put_u64(buf, stats.lookups);
+	rdns_put_str(buf, "target_hits");
+	rdns_put_u64(buf, stats.hits);
+	rdns_put_str(buf, "target_coalesced");
+	rdns_put_u64(buf, stats.coalesced);
+	rdns_put_str(buf, "in_flight");
+	/* Not counting this one */
+	rdns_put_u64(buf, stats.inflight - 1);
+	rdns_put_str(buf, "clients");
+	rdns_put_u64(buf, stats.clients);
+	rdns_put_str(buf, "latency_total_us");
+	rdns_put_u64(buf, stats.latency_total);
+	rdns_put_str(buf, "latency_max_us");
+	rdns_put_u64(buf, stats.latency_max);
+	for(c = 0, limit = 100; c < DAEMON_BUCKETS; c++, limit *= 10)
+	{
+		if(c < DAEMON_BUCKETS - 1)
+		{
+			sprintf(name, "latency_under_%lluus", (unsigned long long) limit);
+		}
+		else
+		{
+			sprintf(name, "latency_over_%lluus", (unsigned long long) limit / 10);
+		}
+		rdns_put_str(buf, name);
+		rdns_put_u64(buf, stats.latency[c]);
+	}
+	reply_end(client, buf, start);
+}
+
+static void
+request_free(struct request *req)
+{
+	req->client->pending--;
+	stats.inflight--;
+	rdns_free(NULL, req->name);
+	rdns_free(NULL, req->protocol);
+	free(req);
+}
+
+static uint32_t
+domain_hash(const char *name)
+{
+	uint32_t hash;
+
+	for(hash = 2166136261U; *name; name++)
+	{
+		hash ^= (unsigned char) tolower((unsigned char) *name);
+		hash *= 16777619U;
+	}
+	return hash & (DAEMON_DOMAINS - 1);
+}
+
+/* Return the entry for a domain, adding it if there isn't one */
+static struct domain *
+domain_find(const char *name)
+{
+	struct domain *domain;
+	uint32_t hash;
+
+	hash = domain_hash(name);
+	for(domain = domains[hash]; domain; domain = domain->next)
+	{
+		if(!strcasecmp(domain->name, name))
+		{
+			return domain;
+		}
+	}
+	if(NULL == (domain = (struct domain *) calloc(1, sizeof(struct domain))))
+	{
+		return NULL;
+	}
+	if(NULL == (domain->name = strdup(name)) || NULL == (domain->context = radiodns_create(name)))
+	{
+		free(domain->name);
+		free(domain);
+		return NULL;
+	}
+	domain->next = domains[hash];
+	domains[hash] = domain;
+	ndomains++;
+	return domain;
+}
+
+/* Remove a domain from the table, to be freed once its lookups have
+ * finished, and return its replacement
+ */
+static struct domain *
+domain_retire(struct domain *domain)
+{
+	struct domain **p;
+
+	for(p = &(domains[domain_hash(domain->name)]); *p != domain; p = &((*p)->next));
+	*p = domain->next;
+	domain->next = NULL;
+	domain->retired = 1;
+	ndomains--;
+	return domain_find(domain->name);
+}
+
+/* Free a retired domain once nothing is using it */
+static void
+domain_release(struct domain *domain)
+{
+	if(!domain->retired || domain->active || domain->op || domain->waiting)
+	{
+		return;
+	}
+	radiodns_destroy(domain->context);
+	free(domain->name);
+	free(domain);
+}
+
+/* Every so often, forget the domains which nothing is using and whose
+ * targets have expired (or, if there are too many, any which nothing is
+ * using), so that the table doesn't hold every domain ever asked about
+ */
+static void
+domain_sweep(void)
+{
+	struct domain **p, *domain;
+	int64_t now;
+	int c, full;
+
+	now = rdns_now();
+	if(now < sweep_at)
+	{
+		return;
+	}
+	sweep_at = now + DAEMON_SWEEP;
+	full = (ndomains > DAEMON_MAXDOMAINS);
+	for(c = 0; c < DAEMON_DOMAINS; c++)
+	{
+		for(p = &(domains[c]); *p;)
+		{
+			domain = *p;
+			if(domain->op || domain->waiting || domain->active || (!full && now < domain->expires))
+			{
+				p = &(domain->next);
+				continue;
+			}
+			*p = domain->next;
+			ndomains--;
+			radiodns_destroy(domain->context);
+			free(domain->name);
+			free(domain);
+		}
+	}
+}
+
+/* Begin a response in buf, with its length to be filled in by
+ * reply_end()
+ */
+static void
+reply_begin(struct rdns_buf *buf, uint32_t id, int err, int herrno)
+{
+	rdns_put_u32(buf, 0);
+	rdns_put_u32(buf, id);
+	rdns_put_u32(buf, (uint32_t) err);
+	rdns_put_u32(buf, (uint32_t) herrno);
+}
+
+static void
+reply_end(struct client *client, struct rdns_buf *buf, size_t start)
+{
+	size_t len;
+
+	if(buf->err)
+	{
+		/* There's no way to tell the client what it's missing */
+		client_close(client);
+		return;
+	}
+	len = buf->len - start - 4;
+	buf->data[start] = len >> 24;
+	buf->data[start + 1] = len >> 16;
+	buf->data[start + 2] = len >> 8;
+	buf->data[start + 3] = len;
+	if(buf->len - buf->pos > DAEMON_MAXOUTPUT)
+	{
+		/* It isn't reading its responses */
+		client_close(client);
+	}
+}
@@ -22,64 +22,1068 @@
 
 #include "p_radiodns.h"
 
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
 /* Maximum answer buffer size -- 16 UDP packets should be sane */
 #define RDNS_ANSWERBUFLEN               (512 * 16)
+/* Maximum number of answer buffers kept for reuse by each thread */
+#define RDNS_ANSWERBUFPOOL              16
 /* Maximum number of parameters supported */
 #define RDNS_MAXPARAMS                  8
+/* Maximum number of CNAME and DNAME records followed to find a target */
+#define RDNS_MAXCHAIN                   16
+/* Longest a synchronous resolution waits for its transport before
+ * checking whether it has been cancelled, in milliseconds
+ */
+#define RDNS_CANCELPOLL                 50
+
+/* States of the speculative lookup of an application's records: none,
+ * in flight, answered and held until the target is known, in flight and
+ * known to be at the right name, or in flight but no longer wanted
+ */
+#define RDNS_SPEC_NONE                  0
+#define RDNS_SPEC_INFLIGHT              1
+#define RDNS_SPEC_ANSWERED              2
+#define RDNS_SPEC_ADOPTED               3
+#define RDNS_SPEC_ABANDONED             4
+
+/* A PTR record being followed to a named application instance */
+struct rdns_ptr
+{
+	radiodns_async_t *op;
+	radiodns_app_t *app;
+	radiodns_query_t query;
+	int pending;
+	/* As returned by app_parse_instance() */
+	int result;
+	char name[MAXDNAME + 1];
+	unsigned char *answer;
+};
 
-static radiodns_app_t *app_create(void);
-static int app_parse_params(radiodns_app_t *app, const char *txtrec);
-static int app_follow_ptr(radiodns_app_t *app, unsigned char *abuf, ns_msg handle, ns_rr rr);
-static int app_parse_txt(radiodns_app_t *app, ns_msg handle, ns_rr rr, char *dnbuf);
+/* Resolution proceeds as a series of queries submitted to the context's
+ * transport, each of whose completion callbacks starts the next step: the
+ * target is found by following CNAME and DNAME records from the domain,
+ * then the application's records are looked up, and then any PTR records
+ * among them are followed (all at once) to the named instances.
+ */
+struct radiodns_async_struct
+{
+	radiodns_t *context;
+	radiodns_transport_t *transport;
+	/* Used for the operation itself and its results */
+	radiodns_allocator_t *alloc;
+	radiodns_async_fn fn;
+	void *data;
+	/* Invoked for each instance as it is found, and the number passed */
+	radiodns_instance_fn instfn;
+	int streamed;
+	/* Set if named instances are to be left for the caller to resolve */
+	int lazy;
+	/* The named instance being resolved by radiodns_resolve_instance() */
+	radiodns_app_t *inst;
+	/* The application wanted, if any */
+	char *name;
+	char *protocol;
+	/* The name currently being queried */
+	char domain[MAXDNAME + 1];
+	int chain;
+	radiodns_query_t query;
+	int querying;
+	struct rdns_ptr *ptrs;
+	int nptrs;
+	int outstanding;
+	radiodns_app_t *defapp;
+	radiodns_app_t *app;
+	unsigned long target_ttl;
+	unsigned long app_ttl;
+	int err;
+	int herrno;
+	int done;
+	/* Set while the operation is being started, or its callback is being
+	 * invoked, and if it's destroyed while queries are still in flight
+	 */
+	int starting;
+	int incallback;
+	int orphaned;
+	/* When the operation must finish by (per rdns_now()), if ever, the
+	 * context's count of cancellations when it began, and if it has been
+	 * cut short, the errno value saying why
+	 */
+	int64_t deadline;
+	unsigned long cancels;
+	int expired;
+	/* Set while looking up, or waiting for, a shared result */
+	struct rdns_cache_wait wait;
+	/* Borrowed while a query is being made */
+	unsigned char *answer;
+	/* The application's records looked up at the predicted target while
+	 * the real one is still being found
+	 */
+	int spec;
+	radiodns_query_t specquery;
+	char specname[MAXDNAME + 1];
+	unsigned char *specanswer;
+};
+
+/* The operations started by radiodns_resolve_apps() */
+struct rdns_multi
+{
+	int outstanding;
+	/* The lowest TTL of the applications found */
+	unsigned long app_ttl;
+};
+
+/* Answer buffers aren't part of operations, but are borrowed for each
+ * query from a pool belonging to the thread, and returned to the pool of
+ * whichever thread is finished with them
+ */
+struct rdns_abuf
+{
+	struct rdns_abuf *next;
+};
+
+static __thread struct rdns_abuf *abuf_pool;
+static __thread int abuf_pooled;
+#ifdef HAVE_PTHREAD_H
+/* Used only to free each thread's pool when it exits */
+static pthread_once_t abuf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t abuf_key;
+static __thread int abuf_registered;
+#endif
+
+/* The deadline shared by every operation of the synchronous resolution in
+ * progress on this thread, if it makes several
+ */
+static __thread int64_t call_deadline;
+
+static radiodns_async_t *async_create(radiodns_t *context, radiodns_async_fn fn, void *data);
+static void async_submit(radiodns_async_t *op, radiodns_query_t *query, const char *name, unsigned char **answer, void (*complete)(radiodns_query_t *query), void *data);
+static int async_wait(radiodns_async_t *op);
+static int async_expired(const radiodns_async_t *op);
+static void async_stop(radiodns_async_t *op, int err);
+static int wait_timeout(int64_t deadline);
+static int async_orphaned(radiodns_async_t *op);
+static void async_finish(radiodns_async_t *op);
+static int async_instance(radiodns_async_t *op, const radiodns_app_t *app);
+static void async_free(radiodns_async_t *op);
+static unsigned char *abuf_get(void);
+static void abuf_put(unsigned char **buf);
+#ifdef HAVE_PTHREAD_H
+static void abuf_init(void);
+static void abuf_cleanup(void *data);
+#endif
+static void target_start(radiodns_async_t *op);
+static void target_complete(radiodns_query_t *query);
+static void target_finish(radiodns_async_t *op, int err);
+static void app_start(radiodns_async_t *op);
+static void app_wake(struct rdns_cache_wait *wait);
+static void app_complete(radiodns_query_t *query);
+static void app_finish(radiodns_async_t *op);
+static void spec_start(radiodns_async_t *op);
+static void spec_complete(radiodns_query_t *query);
+static int spec_adopt(radiodns_async_t *op);
+static void spec_discard(radiodns_async_t *op);
+static void ptr_complete(radiodns_query_t *query);
+static void instance_complete(radiodns_query_t *query);
+static radiodns_async_t *app_async(radiodns_t *context, const char *name, const char *protocol, radiodns_instance_fn instfn, int lazy, radiodns_async_fn fn, void *data);
+static int app_parse_params(radiodns_app_t *app, const char *txt, size_t len);
+static int app_parse_ptr(struct rdns_ptr *ptr, ns_msg handle, ns_rr rr);
+static int app_parse_instance(radiodns_async_t *op, radiodns_app_t *app, radiodns_query_t *query);
+static int app_parse_txt(radiodns_app_t *app, ns_msg handle, ns_rr rr);
 static int app_parse_srv(radiodns_app_t *app, ns_msg handle, ns_rr rr, char *dnbuf, radiodns_srv_t *srv);
+static void ttl_update(unsigned long *ttl, ns_rr rr);
+static void multi_complete(radiodns_async_t *op, void *data);
+static void multi_update(struct rdns_multi *multi, radiodns_async_t *op);
 
 /* Attempt to resolve the target FQDN for a context */
 const char *
 radiodns_resolve_target(radiodns_t *context)
 {
-	int len, c;
-	ns_msg handle;
-	ns_rr rr;
-	char domain[MAXDNAME + 1], dnbuf[MAXDNAME + 1];
+	radiodns_async_t *op;
+	const char *target;
+	int r;
 
 	/* reset these to help with error handling in callers */
 	h_errno = NETDB_INTERNAL;
 	errno = 0;
-	if(!context->answer)
+	if(-2 != (r = rdns_daemon_resolve(context, NULL, 0, NULL, NULL)))
+	{
+		return (r ? NULL : context->target);
+	}
+	if(NULL == (op = radiodns_resolve_target_async(context, NULL, NULL)))
+	{
+		return NULL;
+	}
+	if(async_wait(op))
+	{
+		radiodns_async_destroy(op);
+		return NULL;
+	}
+	target = radiodns_async_target(op);
+	errno = radiodns_async_error(op, &h_errno);
+	radiodns_async_destroy(op);
+	return target;
+}
+
+/* Find all of the records for _<name>._<protocol>.<target> */
+radiodns_app_t *
+radiodns_resolve_app(radiodns_t *context, const char *name, const char *protocol)
+{
+	radiodns_async_t *op;
+	radiodns_app_t *app;
+
+	if(-2 != rdns_daemon_resolve(context, &name, 1, protocol, &app))
+	{
+		return app;
+	}
+	if(NULL == (op = radiodns_resolve_app_async(context, name, protocol, NULL, NULL)))
+	{
+		return NULL;
+	}
+	if(async_wait(op))
+	{
+		radiodns_async_destroy(op);
+		return NULL;
+	}
+	app = radiodns_async_app(op);
+	errno = radiodns_async_error(op, &h_errno);
+	radiodns_async_destroy(op);
+	return app;
+}
+
+/* Find the instances of several applications at once, storing the result
+ * for names[n] in apps[n]. All of the lookups are in flight together, so
+ * this takes about as long as the slowest of them. Returns the number of
+ * applications found, or -1 on error; errno and h_errno describe the
+ * first application not found, unless the resolution was cut short.
+ */
+int
+radiodns_resolve_apps(radiodns_t *context, const char *const *names, int count, const char *protocol, radiodns_app_t **apps)
+{
+	struct rdns_multi multi;
+	radiodns_transport_t *transport;
+	radiodns_async_t **ops;
+	int64_t outer;
+	int c, found, err, herrno, expired;
+
+	h_errno = NETDB_INTERNAL;
+	errno = 0;
+	for(c = 0; c < count; c++)
+	{
+		apps[c] = NULL;
+	}
+	if(-2 != (found = rdns_daemon_resolve(context, names, count, protocol, apps)))
+	{
+		return found;
+	}
+	/* Every operation, including the target's, shares one deadline */
+	outer = call_deadline;
+	if(!outer && context->deadline)
+	{
+		call_deadline = rdns_now() + context->deadline;
+	}
+	/* Resolve the target once up-front, rather than in every operation */
+	if((!context->target && !radiodns_resolve_target(context)) ||
+	   NULL == (ops = (radiodns_async_t **) rdns_calloc(rdns_allocator(context), count ? count : 1, sizeof(radiodns_async_t *))))
+	{
+		call_deadline = outer;
+		return -1;
+	}
+	multi.app_ttl = 0;
+	multi.outstanding = 0;
+	for(c = 0; c < count; c++)
+	{
+		if(NULL == (ops[c] = radiodns_resolve_app_async(context, names[c], protocol, multi_complete, &multi)))
+		{
+			break;
+		}
+		/* Operations finished while starting don't invoke the callback */
+		if(radiodns_async_done(ops[c]))
+		{
+			multi_update(&multi, ops[c]);
+		}
+		else
+		{
+			multi.outstanding++;
+		}
+	}
+	err = (c < count ? errno : 0);
+	while(!err && multi.outstanding)
+	{
+		if(ops[0] && (expired = async_expired(ops[0])))
+		{
+			for(c = 0; c < count && ops[c]; c++)
+			{
+				async_stop(ops[c], expired);
+			}
+			if(!multi.outstanding)
+			{
+				break;
+			}
+		}
+		transport = rdns_transport(context);
+		if(!transport->process || (0 >= transport->process(transport, wait_timeout(call_deadline)) && multi.outstanding))
+		{
+			/* The transport can't be waited on, or has lost track of
+			 * our queries
+			 */
+			err = EIO;
+		}
+	}
+	call_deadline = outer;
+	found = 0;
+	herrno = 0;
+	expired = 0;
+	for(c = 0; c < count && ops[c]; c++)
+	{
+		if(err)
+		{
+			radiodns_async_destroy(ops[c]);
+			continue;
+		}
+		if(!expired)
+		{
+			expired = ops[c]->expired;
+		}
+		if((apps[c] = radiodns_async_app(ops[c])))
+		{
+			found++;
+		}
+		else if(!herrno)
+		{
+			errno = radiodns_async_error(ops[c], &herrno);
+			h_errno = (herrno ? herrno : NETDB_INTERNAL);
+			herrno = 1;
+		}
+		radiodns_async_destroy(ops[c]);
+	}
+	rdns_free(rdns_allocator(context), ops);
+	if(err)
+	{
+		errno = err;
+		return -1;
+	}
+	if(expired)
+	{
+		/* Some of the results are missing, or incomplete */
+		errno = expired;
+		h_errno = NETDB_INTERNAL;
+	}
+	context->app_ttl = multi.app_ttl;
+	return found;
+}
+
+/* Begin resolving the target FQDN for a context */
+radiodns_async_t *
+radiodns_resolve_target_async(radiodns_t *context, radiodns_async_fn fn, void *data)
+{
+	radiodns_async_t *op;
+
+	if(NULL == (op = async_create(context, fn, data)))
+	{
+		return NULL;
+	}
+	target_start(op);
+	op->starting = 0;
+	return op;
+}
+
+/* Begin finding the instances of an application */
+radiodns_async_t *
+radiodns_resolve_app_async(radiodns_t *context, const char *name, const char *protocol, radiodns_async_fn fn, void *data)
+{
+	return radiodns_resolve_app_stream_async(context, name, protocol, NULL, fn, data);
+}
+
+/* Find the instances of an application, passing each to instfn as soon as
+ * it is complete
+ */
+radiodns_app_t *
+radiodns_resolve_app_stream(radiodns_t *context, const char *name, const char *protocol, radiodns_instance_fn instfn, void *data)
+{
+	radiodns_async_t *op;
+	radiodns_app_t *app;
+
+	if(NULL == (op = radiodns_resolve_app_stream_async(context, name, protocol, instfn, NULL, data)))
+	{
+		return NULL;
+	}
+	if(async_wait(op))
+	{
+		radiodns_async_destroy(op);
+		return NULL;
+	}
+	app = radiodns_async_app(op);
+	errno = radiodns_async_error(op, &h_errno);
+	radiodns_async_destroy(op);
+	return app;
+}
+
+/* Begin finding the instances of an application, passing each to instfn
+ * as soon as it is complete, and then invoking fn
+ */
+radiodns_async_t *
+radiodns_resolve_app_stream_async(radiodns_t *context, const char *name, const char *protocol, radiodns_instance_fn instfn, radiodns_async_fn fn, void *data)
+{
+	return app_async(context, name, protocol, instfn, 0, fn, data);
+}
+
+/* Find the instances of an application without following its PTR records:
+ * named instances are returned with their names only, and are resolved by
+ * radiodns_resolve_instance() when they're wanted
+ */
+radiodns_app_t *
+radiodns_resolve_app_lazy(radiodns_t *context, const char *name, const char *protocol)
+{
+	radiodns_async_t *op;
+	radiodns_app_t *app;
+
+	if(NULL == (op = radiodns_resolve_app_lazy_async(context, name, protocol, NULL, NULL)))
+	{
+		return NULL;
+	}
+	if(async_wait(op))
+	{
+		radiodns_async_destroy(op);
+		return NULL;
+	}
+	app = radiodns_async_app(op);
+	errno = radiodns_async_error(op, &h_errno);
+	radiodns_async_destroy(op);
+	return app;
+}
+
+radiodns_async_t *
+radiodns_resolve_app_lazy_async(radiodns_t *context, const char *name, const char *protocol, radiodns_async_fn fn, void *data)
+{
+	return app_async(context, name, protocol, NULL, 1, fn, data);
+}
+
+/* Look up the SRV and TXT records of a named instance returned by
+ * radiodns_resolve_app_lazy(), if that hasn't been done already.
+ * Returns 0 if the instance is now complete, or -1 with errno and
+ * h_errno set.
+ */
+int
+radiodns_resolve_instance(radiodns_t *context, radiodns_app_t *instance)
+{
+	radiodns_async_t *op;
+	int r;
+
+	if(!instance->_ptr)
+	{
+		return 0;
+	}
+	h_errno = NETDB_INTERNAL;
+	errno = 0;
+	if(NULL == (op = radiodns_resolve_instance_async(context, instance, NULL, NULL)))
+	{
+		return -1;
+	}
+	if(async_wait(op))
+	{
+		radiodns_async_destroy(op);
+		return -1;
+	}
+	errno = radiodns_async_error(op, &h_errno);
+	r = (instance->_ptr ? -1 : 0);
+	radiodns_async_destroy(op);
+	return r;
+}
+
+radiodns_async_t *
+radiodns_resolve_instance_async(radiodns_t *context, radiodns_app_t *instance, radiodns_async_fn fn, void *data)
+{
+	radiodns_async_t *op;
+
+	if(NULL == (op = async_create(context, fn, data)))
+	{
+		return NULL;
+	}
+	op->inst = instance;
+	if(!instance->_ptr)
+	{
+		async_finish(op);
+	}
+	else
+	{
+		/* The instance may be resolved by another operation (which frees
+		 * _ptr) before this one's query has completed
+		 */
+		strcpy(op->domain, instance->_ptr);
+		async_submit(op, &(op->query), op->domain, &(op->answer), instance_complete, op);
+	}
+	op->starting = 0;
+	return op;
+}
+
+static radiodns_async_t *
+app_async(radiodns_t *context, const char *name, const char *protocol, radiodns_instance_fn instfn, int lazy, radiodns_async_fn fn, void *data)
+{
+	radiodns_async_t *op;
+
+	if(!protocol)
+	{
+		protocol = "tcp";
+	}
+	if(NULL == (op = async_create(context, fn, data)))
+	{
+		return NULL;
+	}
+	if(NULL == (op->name = rdns_strdup(op->alloc, name)) || NULL == (op->protocol = rdns_strdup(op->alloc, protocol)))
+	{
+		async_free(op);
+		return NULL;
+	}
+	op->instfn = instfn;
+	op->lazy = lazy;
+	if(context->target)
+	{
+		app_start(op);
+	}
+	else
+	{
+		if(context->speculate)
+		{
+			spec_start(op);
+		}
+		target_start(op);
+	}
+	op->starting = 0;
+	return op;
+}
+
+int
+radiodns_async_done(const radiodns_async_t *op)
+{
+	return op->done;
+}
+
+const char *
+radiodns_async_target(radiodns_async_t *op)
+{
+	if(!op->done)
+	{
+		return NULL;
+	}
+	return op->context->target;
+}
+
+radiodns_app_t *
+radiodns_async_app(radiodns_async_t *op)
+{
+	radiodns_app_t *app;
+
+	app = op->app;
+	op->app = NULL;
+	return app;
+}
+
+int
+radiodns_async_error(const radiodns_async_t *op, int *herrno)
+{
+	if(herrno)
+	{
+		*herrno = op->herrno;
+	}
+	return op->err;
+}
+
+/* Destroy an operation, abandoning any queries still in flight. If the
+ * transport can't cancel them, the operation lingers until they complete.
+ */
+void
+radiodns_async_destroy(radiodns_async_t *op)
+{
+	int c;
+
+	if(!op)
+	{
+		return;
+	}
+	op->fn = NULL;
+	if(op->incallback)
+	{
+		op->orphaned = 1;
+		return;
+	}
+	/* Anything waiting for this operation's result will look for it
+	 * again
+	 */
+	rdns_cache_abandon(&(op->wait), op->domain);
+	if(op->transport->cancel)
+	{
+		if(op->querying)
+		{
+			op->transport->cancel(op->transport, &(op->query));
+			op->querying = 0;
+		}
+		for(c = 0; c < op->nptrs; c++)
+		{
+			if(op->ptrs[c].pending)
+			{
+				op->transport->cancel(op->transport, &(op->ptrs[c].query));
+				op->ptrs[c].pending = 0;
+				op->outstanding--;
+			}
+		}
+	}
+	spec_discard(op);
+	if(op->querying || op->outstanding || op->spec)
+	{
+		op->orphaned = 1;
+		return;
+	}
+	async_free(op);
+}
+
+/* Finish an operation now, with whatever it has found so far */
+void
+radiodns_async_cancel(radiodns_async_t *op)
+{
+	async_stop(op, ECANCELED);
+}
+
+/* Limit the time each resolution begun on a context may take, or remove
+ * the limit if ms is zero
+ */
+int
+radiodns_set_deadline(radiodns_t *context, unsigned long ms)
+{
+	if(!context)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	context->deadline = ms;
+	return 0;
+}
+
+/* Cut short the resolutions in progress on a context. This may be called
+ * from any thread: asynchronous resolutions notice when they're next about
+ * to make a query, and synchronous ones within RDNS_CANCELPOLL ms.
+ */
+void
+radiodns_cancel(radiodns_t *context)
+{
+	__atomic_add_fetch(&(context->cancels), 1, __ATOMIC_RELAXED);
+}
+
+/* Have resolutions begun on a context which don't yet know its target look
+ * up the application's records at a predicted target while following the
+ * chain to the real one, or stop them doing so if enabled is zero
+ */
+int
+radiodns_set_speculate(radiodns_t *context, int enabled)
+{
+	if(!context)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	context->speculate = (enabled ? 1 : 0);
+	return 0;
+}
+
+static radiodns_async_t *
+async_create(radiodns_t *context, radiodns_async_fn fn, void *data)
+{
+	radiodns_allocator_t *allocator;
+	radiodns_async_t *op;
+
+	allocator = rdns_allocator(context);
+	if(NULL == (op = (radiodns_async_t *) rdns_calloc(allocator, 1, sizeof(radiodns_async_t))))
+	{
+		return NULL;
+	}
+	op->alloc = allocator;
+	op->context = context;
+	op->transport = rdns_transport(context);
+	op->fn = fn;
+	op->data = data;
+	op->starting = 1;
+	op->cancels = __atomic_load_n(&(context->cancels), __ATOMIC_RELAXED);
+	if(call_deadline)
+	{
+		op->deadline = call_deadline;
+	}
+	else if(context->deadline)
+	{
+		op->deadline = rdns_now() + context->deadline;
+	}
+	return op;
+}
+
+/* Submit an ANY query for name, borrowing an answer buffer for it unless
+ * *answer already holds one. This is always the last thing done by the
+ * caller, as the query may complete (and the operation finish) before it
+ * returns.
+ */
+static void
+async_submit(radiodns_async_t *op, radiodns_query_t *query, const char *name, unsigned char **answer, void (*complete)(radiodns_query_t *query), void *data)
+{
+	memset(query, 0, sizeof(radiodns_query_t));
+	query->name = name;
+	query->qclass = ns_c_in;
+	query->qtype = ns_t_any;
+	query->anslen = RDNS_ANSWERBUFLEN;
+	query->complete = complete;
+	query->data = data;
+	if(query == &(op->query))
+	{
+		op->querying = 1;
+	}
+	/* An operation which has run out of time makes no more queries */
+	if(!op->expired)
+	{
+		op->expired = async_expired(op);
+	}
+	if(op->expired || (!*answer && !(*answer = abuf_get())))
+	{
+		query->len = -1;
+		query->herrno = NETDB_INTERNAL;
+		query->err = ENOMEM;
+		complete(query);
+		return;
+	}
+	query->answer = *answer;
+	rdns_submit(op->transport, query);
+}
+
+/* Drive the transport until an operation has finished, or cut it short
+ * once it has run out of time or been cancelled
+ */
+static int
+async_wait(radiodns_async_t *op)
+{
+	int err;
+
+	while(!op->done)
+	{
+		if((err = async_expired(op)))
+		{
+			async_stop(op, err);
+			if(op->done)
+			{
+				break;
+			}
+		}
+		if(!op->transport->process || (0 >= op->transport->process(op->transport, wait_timeout(op->deadline)) && !op->done))
+		{
+			/* The transport can't be waited on, or has lost track of
+			 * our queries
+			 */
+			errno = EIO;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Record that an operation has finished, and tell whoever started it
+ * (unless they're still waiting for the start function to return). The
+ * callback may destroy the operation.
+ */
+static void
+async_finish(radiodns_async_t *op)
+{
+	const radiodns_app_t *p;
+
+	abuf_put(&(op->answer));
+	spec_discard(op);
+	if(op->expired)
+	{
+		/* Whatever was found is incomplete, so isn't shared */
+		rdns_cache_abandon(&(op->wait), op->domain);
+		op->err = op->expired;
+		op->herrno = NETDB_INTERNAL;
+	}
+	if(op->wait.cache)
+	{
+		rdns_cache_complete(&(op->wait), op->domain, op->app, op->app_ttl, op->err, op->herrno);
+	}
+	op->done = 1;
+	if(!op->streamed)
+	{
+		/* The result came from the cache, so none of its instances have
+		 * been passed to the caller yet
+		 */
+		for(p = op->app; p; p = p->next)
+		{
+			if(async_instance(op, p))
+			{
+				return;
+			}
+		}
+	}
+	if(op->starting || !op->fn)
+	{
+		return;
+	}
+	op->incallback = 1;
+	op->fn(op, op->data);
+	op->incallback = 0;
+	if(op->orphaned)
+	{
+		async_free(op);
+	}
+}
+
+/* Pass a complete instance to the caller's instance callback, if there is
+ * one. Returns non-zero if the callback destroyed the operation, which
+ * mustn't then be touched.
+ */
+static int
+async_instance(radiodns_async_t *op, const radiodns_app_t *app)
+{
+	if(!op->instfn)
+	{
+		return 0;
+	}
+	op->streamed++;
+	op->incallback = 1;
+	op->instfn(app, op->data);
+	op->incallback = 0;
+	if(!op->orphaned)
+	{
+		return 0;
+	}
+	/* Now that it's safe to, abandon whatever is still in progress */
+	op->orphaned = 0;
+	radiodns_async_destroy(op);
+	return 1;
+}
+
+/* Return ETIMEDOUT if an operation has run out of time, ECANCELED if its
+ * context has been cancelled since it began, or zero
+ */
+static int
+async_expired(const radiodns_async_t *op)
+{
+	if(op->cancels != __atomic_load_n(&(op->context->cancels), __ATOMIC_RELAXED))
+	{
+		return ECANCELED;
+	}
+	if(op->deadline && rdns_now() >= op->deadline)
+	{
+		return ETIMEDOUT;
+	}
+	return 0;
+}
+
+/* Cancel whatever queries an operation has in flight and finish it with
+ * whatever it has found so far. If the transport can't cancel queries,
+ * the operation instead finishes once they complete, without making any
+ * more.
+ */
+static void
+async_stop(radiodns_async_t *op, int err)
+{
+	int c;
+
+	if(op->done || op->incallback)
+	{
+		return;
+	}
+	op->expired = err;
+	if(!op->transport->cancel && (op->querying || op->outstanding || op->spec == RDNS_SPEC_ADOPTED))
+	{
+		return;
+	}
+	spec_discard(op);
+	if(op->querying)
+	{
+		op->transport->cancel(op->transport, &(op->query));
+		op->querying = 0;
+	}
+	for(c = 0; c < op->nptrs; c++)
+	{
+		if(op->ptrs[c].pending)
+		{
+			op->transport->cancel(op->transport, &(op->ptrs[c].query));
+			op->ptrs[c].pending = 0;
+			op->ptrs[c].result = -1;
+			op->outstanding--;
+		}
+	}
+	if(op->nptrs && !op->lazy)
+	{
+		/* Return the named instances found already */
+		app_finish(op);
+		return;
+	}
+	async_finish(op);
+}
+
+/* How long a synchronous resolution should wait for its transport at a
+ * time, so that it notices being cancelled, or running out of time
+ */
+static int
+wait_timeout(int64_t deadline)
+{
+	int64_t remaining;
+
+	if(!deadline)
+	{
+		return RDNS_CANCELPOLL;
+	}
+	remaining = deadline - rdns_now();
+	if(remaining < 0)
+	{
+		return 0;
+	}
+	return (remaining < RDNS_CANCELPOLL ? (int) remaining : RDNS_CANCELPOLL);
+}
+
+/* If an operation has been destroyed, free it once the last of its queries
+ * has completed. Returns non-zero if it has been destroyed, in which case
+ * it mustn't be touched.
+ */
+static int
+async_orphaned(radiodns_async_t *op)
+{
+	if(!op->orphaned)
+	{
+		return 0;
+	}
+	if(!op->querying && !op->outstanding && !op->spec)
+	{
+		async_free(op);
+	}
+	return 1;
+}
+
+static void
+async_free(radiodns_async_t *op)
+{
+	int c;
+
+	for(c = 0; c < op->nptrs; c++)
+	{
+		radiodns_destroy_app(op->ptrs[c].app);
+		abuf_put(&(op->ptrs[c].answer));
+	}
+	rdns_free(op->alloc, op->ptrs);
+	abuf_put(&(op->answer));
+	abuf_put(&(op->specanswer));
+	radiodns_destroy_app(op->defapp);
+	radiodns_destroy_app(op->app);
+	rdns_free(op->alloc, op->name);
+	rdns_free(op->alloc, op->protocol);
+	rdns_free(op->alloc, op);
+}
+
+static unsigned char *
+abuf_get(void)
+{
+	struct rdns_abuf *buf;
+
+	if((buf = abuf_pool))
+	{
+		abuf_pool = buf->next;
+		abuf_pooled--;
+		return (unsigned char *) buf;
+	}
+	return (unsigned char *) rdns_malloc(NULL, RDNS_ANSWERBUFLEN);
+}
+
+/* Return a buffer (if there is one) to the pool */
+static void
+abuf_put(unsigned char **buf)
+{
+	struct rdns_abuf *p;
+
+	if(!(p = (struct rdns_abuf *) *buf))
+	{
+		return;
+	}
+	*buf = NULL;
+	if(abuf_pooled == RDNS_ANSWERBUFPOOL)
+	{
+		rdns_free(NULL, p);
+		return;
+	}
+#ifdef HAVE_PTHREAD_H
+	if(!abuf_registered)
+	{
+		pthread_once(&abuf_once, abuf_init);
+		pthread_setspecific(abuf_key, &abuf_registered);
+		abuf_registered = 1;
+	}
+#endif
+	p->next = abuf_pool;
+	abuf_pool = p;
+	abuf_pooled++;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void
+abuf_init(void)
+{
+	pthread_key_create(&abuf_key, abuf_cleanup);
+}
+
+static void
+abuf_cleanup(void *data)
+{
+	struct rdns_abuf *p;
+
+	(void) data;
+
+	while((p = abuf_pool))
+	{
+		abuf_pool = p->next;
+		rdns_free(NULL, p);
+	}
+	abuf_pooled = 0;
+	abuf_registered = 0;
+}
+#endif
+
+static void
+target_start(radiodns_async_t *op)
+{
+	strcpy(op->domain, op->context->domain);
+	op->chain = 0;
+	op->target_ttl = 0;
+	async_submit(op, &(op->query), op->domain, &(op->answer), target_complete, op);
+}
+
+static void
+target_complete(radiodns_query_t *query)
+{
+	radiodns_async_t *op;
+	int len, c;
+	ns_msg handle;
+	ns_rr rr;
+	char dnbuf[MAXDNAME + 1];
+
+	op = (radiodns_async_t *) query->data;
+	op->querying = 0;
+	if(async_orphaned(op))
+	{
+		return;
+	}
+	op->herrno = query->herrno;
+	if(0 >= (len = query->len))
 	{
-		if(NULL == (context->answer = (unsigned char *) malloc(RDNS_ANSWERBUFLEN)))
-		{
-			return NULL;
-		}
+		/* errno means nothing by the time an asynchronous transport
+		 * completes a query, so the transport's own account of the
+		 * failure is used, or failing that, EIO
+		 */
+		target_finish(op, (NETDB_INTERNAL == query->herrno ? (query->err ? query->err : EIO) : 0));
+		return;
 	}
-	free(context->target);
-	context->target = NULL;
-	strcpy(domain, context->domain);
-	for(;;)
+	dnbuf[0] = 0;
+	if(0 <= ns_initparse(query->answer, len, &handle) && 0 <= (len = ns_msg_count(handle, ns_s_an)))
 	{
-		h_errno = 0;
-		if(0 >= (len = res_query(domain, ns_c_in, ns_t_any, context->answer, RDNS_ANSWERBUFLEN)))
-		{
-			if(NETDB_INTERNAL == h_errno)
-			{
-				return NULL;
-			}
-			break;
-		}
-		if(0 > ns_initparse(context->answer, len, &handle))
-		{
-			break;
-		}
-		if(0 > (len = ns_msg_count(handle, ns_s_an)))
-		{
-			break;
-		}
 		/* Resolvers tend towards the sane: the last result in a set of
 		 * DNAME and CNAME replies will be the one we care about. If
 		 * you're building against a resolver which for some reason
 		 * behaves differently, you'll need a workaround here.
 		 */
-		dnbuf[0] = 0;
 		for(c = 0; c < len; c++)
 		{
 			if(ns_parserr(&handle, ns_s_an, c, &rr))
@@ -91,75 +1095,159 @@ radiodns_resolve_target(radiodns_t *context)
 			{
 				continue;
 			}
+			ttl_update(&(op->target_ttl), rr);
 			if(ns_rr_type(rr) == ns_t_dname || ns_rr_type(rr) == ns_t_cname)
 			{
 				dn_expand(ns_msg_base(handle), ns_msg_base(handle) + ns_msg_size(handle), ns_rr_rdata(rr), dnbuf, sizeof(dnbuf));
+				if(ns_rr_type(rr) == ns_t_dname && op->context->speculate)
+				{
+					rdns_predict_add(ns_rr_name(rr), dnbuf, ns_rr_ttl(rr));
+				}
 			}
-		}      
-		if(dnbuf[0])
-		{
-			if(0 == strcmp(domain, dnbuf))
-			{
-				break;
-			}
-			strcpy(domain, dnbuf);
-			continue;
 		}
-		break;
 	}
-	/* Whatever we found last is the target, unless we found nothing at all,
-	 * in which case the target is the same as the original domain.
-	 */
-	if(NULL == (context->target = strdup(domain)))
+	if(dnbuf[0] && strcmp(op->domain, dnbuf) && op->chain < RDNS_MAXCHAIN)
 	{
-		return NULL;
-	}    
-	return context->target;
+		strcpy(op->domain, dnbuf);
+		op->chain++;
+		async_submit(op, &(op->query), op->domain, &(op->answer), target_complete, op);
+		return;
+	}
+	target_finish(op, 0);
 }
 
-/* Find all of the records for _<name>._<protocol>.<target> */
-radiodns_app_t *
-radiodns_resolve_app(radiodns_t *context, const char *name, const char *protocol)
+/* Whatever we found last is the target, unless we found nothing at all,
+ * in which case the target is the same as the original domain. err is the
+ * errno value describing why the lookup failed, or zero.
+ */
+static void
+target_finish(radiodns_async_t *op, int err)
 {
-	char fqdn[MAXDNAME+1], dnbuf[MAXDNAME+1];
-	radiodns_app_t *defapp, *namedapps, *app;
-	ns_msg handle;
-	ns_rr rr;
-	int len, c, r;
-	unsigned char *abuf;
+	radiodns_t *context;
 
-	if(!context->target)
+	context = op->context;
+	if(op->expired)
 	{
-		if(NULL == radiodns_resolve_target(context))
+		/* Leave the context's target as it was */
+		async_finish(op);
+		return;
+	}
+	context->target_ttl = op->target_ttl;
+	/* An unchanged target keeps its string, which the holders of a shared
+	 * context may be using
+	 */
+	if(err || !context->target || strcmp(context->target, op->domain))
+	{
+		rdns_free(NULL, context->target);
+		context->target = NULL;
+		if(err)
+		{
+			op->err = err;
+			async_finish(op);
+			return;
+		}
+		if(NULL == (context->target = rdns_strdup(NULL, op->domain)))
 		{
-			return NULL;
+			op->err = ENOMEM;
+			async_finish(op);
+			return;
 		}
 	}
-	if(!protocol)
+	if(op->name)
 	{
-		protocol = "tcp";
+		app_start(op);
+		return;
 	}
-	if(strlen(name) + strlen(protocol) + strlen(context->target) + 4 > MAXDNAME)
+	async_finish(op);
+}
+
+static void
+app_start(radiodns_async_t *op)
+{
+	radiodns_t *context;
+	radiodns_cache_t *cache;
+	unsigned long ttl;
+
+	context = op->context;
+	if(strlen(op->name) + strlen(op->protocol) + strlen(context->target) + 4 > MAXDNAME)
 	{
-		errno = ENAMETOOLONG;
-		return NULL;
+		op->err = ENAMETOOLONG;
+		async_finish(op);
+		return;
 	}
-	sprintf(fqdn, "_%s._%s.%s", name, protocol, context->target);
-	if(0 >= (len = res_query(fqdn, ns_c_in, ns_t_any, context->answer, RDNS_ANSWERBUFLEN)))
+	sprintf(op->domain, "_%s._%s.%s", op->name, op->protocol, context->target);
+	op->app_ttl = 0;
+	/* Results with unresolved instances can't be shared */
+	if(!op->lazy && (cache = rdns_cache(context)))
 	{
-		return NULL;
-	}	
-	if(0 > ns_initparse(context->answer, len, &handle))
+		op->wait.wake = app_wake;
+		op->wait.data = op;
+		switch(rdns_cache_begin(cache, op->domain, op->transport, &(op->wait), &(op->app), &ttl))
+		{
+		case RDNS_CACHE_HIT:
+			context->app_ttl = ttl;
+			op->err = 0;
+			op->herrno = 0;
+			async_finish(op);
+			return;
+		case RDNS_CACHE_WAIT:
+			abuf_put(&(op->answer));
+			return;
+		}
+	}
+	if(spec_adopt(op))
 	{
-		return NULL;
+		return;
 	}
-	if(0 > (len = ns_msg_count(handle, ns_s_an)))
+	async_submit(op, &(op->query), op->domain, &(op->answer), app_complete, op);
+}
+
+/* The lookup another operation was performing on our behalf has
+ * finished, or been abandoned
+ */
+static void
+app_wake(struct rdns_cache_wait *wait)
+{
+	radiodns_async_t *op;
+
+	op = (radiodns_async_t *) wait->data;
+	if(wait->abandoned)
 	{
-		return NULL;
+		app_start(op);
+		return;
+	}
+	op->app = wait->app;
+	wait->app = NULL;
+	op->context->app_ttl = wait->ttl;
+	op->err = wait->err;
+	op->herrno = wait->herrno;
+	async_finish(op);
+}
+
+static void
+app_complete(radiodns_query_t *query)
+{
+	radiodns_async_t *op;
+	struct rdns_ptr *ptrs;
+	ns_msg handle;
+	ns_rr rr;
+	int len, c, r;
+	char dnbuf[MAXDNAME + 1];
+
+	op = (radiodns_async_t *) query->data;
+	op->querying = 0;
+	if(async_orphaned(op))
+	{
+		return;
+	}
+	op->herrno = query->herrno;
+	if(0 >= (len = query->len) ||
+	   0 > ns_initparse(query->answer, len, &handle) ||
+	   0 > (len = ns_msg_count(handle, ns_s_an)))
+	{
+		async_finish(op);
+		return;
 	}
-	defapp = NULL;
-	namedapps = NULL;
-	abuf = NULL;
 	r = 0; /* -1 == some catchable error, -2 == catastrophic error */
 	for(c = 0; c < len; c++)
 	{
@@ -172,75 +1260,60 @@ radiodns_resolve_app(radiodns_t *context, const char *name, const char *protocol
 		{
 			continue;
 		}
+		ttl_update(&(op->app_ttl), rr);
 		if(ns_rr_type(rr) == ns_t_ptr)
 		{
-			if(!abuf)
-			{
-				if(!(abuf = (unsigned char *) malloc(RDNS_ANSWERBUFLEN)))
-				{
-					r = -2;
-					break;
-				}
-			}
-			if(!(app = app_create()))
+			if(!(ptrs = (struct rdns_ptr *) rdns_realloc(op->alloc, op->ptrs, (op->nptrs + 1) * sizeof(struct rdns_ptr))))
 			{
 				r = -2;
 				break;
 			}
-			r = app_follow_ptr(app, abuf, handle, rr);
-			if(r == 0)
-			{
-				app->next = namedapps;
-				namedapps = app;
-			}
-			else if(r == -1)
-			{
-				radiodns_destroy_app(app);
-				continue;
-			}
-			else
+			op->ptrs = ptrs;
+			memset(&(ptrs[op->nptrs]), 0, sizeof(struct rdns_ptr));
+			ptrs[op->nptrs].op = op;
+			op->nptrs++;
+			if(-2 == (r = app_parse_ptr(&(ptrs[op->nptrs - 1]), handle, rr)))
 			{
-				radiodns_destroy_app(app);
 				break;
-			}	
+			}
 		}
 		else if(ns_rr_type(rr) == ns_t_txt)
 		{
-			if(!defapp)
+			if(!op->defapp)
 			{
-				if(!(defapp = app_create()))
+				if(!(op->defapp = rdns_app_create(op->alloc, rdns_intern(op->context))))
 				{
 					r = -2;
 					break;
 				}
 			}
-			if(-2 == (r = app_parse_txt(defapp, handle, rr, dnbuf)))
+			if(-2 == (r = app_parse_txt(op->defapp, handle, rr)))
 			{
 				break;
 			}
 		}
 		else if(ns_rr_type(rr) == ns_t_srv)
 		{
-			if(!defapp)
+			if(!op->defapp)
 			{
-				if(!(defapp = app_create()))
+				if(!(op->defapp = rdns_app_create(op->alloc, rdns_intern(op->context))))
 				{
 					r = -2;
 					break;
 				}
 			}
-			if(!defapp->srv)
+			if(!op->defapp->srv)
 			{
-				if(!(defapp->srv = (radiodns_srv_t *) calloc(len, sizeof(radiodns_srv_t))))
+				if(!(op->defapp->srv = (radiodns_srv_t *) rdns_calloc(op->defapp->_alloc, len, sizeof(radiodns_srv_t))))
 				{
 					r = -2;
 					break;
 				}
 			}
-			r = app_parse_srv(defapp, handle, rr, dnbuf, &(defapp->srv[defapp->nsrv]));
+			r = app_parse_srv(op->defapp, handle, rr, dnbuf, &(op->defapp->srv[op->defapp->nsrv]));
 			if(r == 0)
 			{
-				defapp->nsrv++;
+				op->defapp->nsrv++;
 			}
 			else if(r == -2)
 			{
@@ -248,27 +1321,302 @@ radiodns_resolve_app(radiodns_t *context, const char *name, const char *protocol
 			}
 		}
 	}
-	free(abuf);
 	if(r == -2)
 	{
-		radiodns_destroy_app(defapp);
-		radiodns_destroy_app(namedapps);
-		return NULL;
+		op->err = ENOMEM;
+		async_finish(op);
+		return;
+	}
+	if(op->defapp && op->defapp->nsrv && async_instance(op, op->defapp))
+	{
+		return;
+	}
+	if(!op->nptrs)
+	{
+		app_finish(op);
+		return;
+	}
+	if(op->lazy)
+	{
+		/* Leave each named instance with the name to query for it */
+		for(c = 0; c < op->nptrs; c++)
+		{
+			if(!op->ptrs[c].result && !(op->ptrs[c].app->_ptr = rdns_strdup(op->ptrs[c].app->_alloc, op->ptrs[c].name)))
+			{
+				op->ptrs[c].result = -2;
+			}
+		}
+		app_finish(op);
+		return;
+	}
+	/* Follow the PTR records all at once. The last of them to complete
+	 * finishes the operation, so nothing here may touch it once it has
+	 * been submitted.
+	 */
+	abuf_put(&(op->answer));
+	len = op->nptrs;
+	ptrs = op->ptrs;
+	op->outstanding = len;
+	for(c = 0; c < len; c++)
+	{
+		ptrs[c].pending = 1;
+		async_submit(op, &(ptrs[c].query), ptrs[c].name, &(ptrs[c].answer), ptr_complete, &(ptrs[c]));
+	}
+}
+
+static void
+ptr_complete(radiodns_query_t *query)
+{
+	struct rdns_ptr *ptr;
+	radiodns_async_t *op;
+
+	ptr = (struct rdns_ptr *) query->data;
+	op = ptr->op;
+	ptr->pending = 0;
+	op->outstanding--;
+	if(async_orphaned(op))
+	{
+		return;
+	}
+	ptr->result = app_parse_instance(op, ptr->app, query);
+	abuf_put(&(ptr->answer));
+	if(!ptr->result && async_instance(op, ptr->app))
+	{
+		return;
+	}
+	if(!op->outstanding)
+	{
+		app_finish(op);
+	}
+}
+
+static void
+instance_complete(radiodns_query_t *query)
+{
+	radiodns_async_t *op;
+	radiodns_app_t *inst, *app;
+	int r;
+
+	op = (radiodns_async_t *) query->data;
+	op->querying = 0;
+	if(async_orphaned(op))
+	{
+		return;
+	}
+	inst = op->inst;
+	op->herrno = query->herrno;
+	if(!inst->_ptr)
+	{
+		/* Another operation got there first */
+		op->err = 0;
+		op->herrno = 0;
+		async_finish(op);
+		return;
+	}
+	if(!(app = rdns_app_create(inst->_alloc, inst->_intern)))
+	{
+		op->err = ENOMEM;
+		async_finish(op);
+		return;
+	}
+	r = app_parse_instance(op, app, query);
+	if(r == -2)
+	{
+		op->err = ENOMEM;
+	}
+	else if(r == 0)
+	{
+		/* Move the records parsed into the instance */
+		inst->srv = app->srv;
+		inst->nsrv = app->nsrv;
+		inst->params = app->params;
+		inst->nparams = app->nparams;
+		inst->_pbuf = app->_pbuf;
+		inst->_plen = app->_plen;
+		app->srv = NULL;
+		app->nsrv = 0;
+		app->params = NULL;
+		app->nparams = 0;
+		app->_pbuf = NULL;
+		rdns_free(inst->_alloc, inst->_ptr);
+		inst->_ptr = NULL;
+		op->err = 0;
+		op->herrno = 0;
+	}
+	else if(NETDB_INTERNAL == op->herrno)
+	{
+		op->err = (query->err ? query->err : EIO);
+	}
+	else
+	{
+		if(!op->herrno)
+		{
+			/* The name exists, but has no service records */
+			op->herrno = NO_DATA;
+		}
+		op->err = ENOENT;
 	}
-	if(defapp)
+	radiodns_destroy_app(app);
+	async_finish(op);
+}
+
+/* Assemble the result: the default instance (if it has any SRV records),
+ * followed by the named instances
+ */
+static void
+app_finish(radiodns_async_t *op)
+{
+	radiodns_app_t *namedapps;
+	int c;
+
+	op->context->app_ttl = op->app_ttl;
+	namedapps = NULL;
+	for(c = 0; c < op->nptrs; c++)
 	{
-		if(defapp->nsrv)
+		if(op->ptrs[c].result == -2)
+		{
+			radiodns_destroy_app(namedapps);
+			op->err = ENOMEM;
+			async_finish(op);
+			return;
+		}
+		if(op->ptrs[c].result == 0)
 		{
-			defapp->next = namedapps;
-			return defapp;
+			op->ptrs[c].app->next = namedapps;
+			namedapps = op->ptrs[c].app;
+			op->ptrs[c].app = NULL;
 		}
-		radiodns_destroy_app(defapp);
+	}
+	if(op->defapp && op->defapp->nsrv)
+	{
+		op->defapp->next = namedapps;
+		op->app = op->defapp;
+		op->defapp = NULL;
+	}
+	else
+	{
+		op->app = namedapps;
 	}
 	/* In the event that there actually wasn't anything worth returning,
 	 * don't confuse matters by leaving errno set to something random.
 	 */
-	errno = 0;
-	return namedapps;
+	op->err = 0;
+	async_finish(op);
+}
+
+/* Look up the application's records at the target predicted for the
+ * domain (the domain itself, unless a DNAME seen earlier says otherwise),
+ * alongside the chain being followed to the real target
+ */
+static void
+spec_start(radiodns_async_t *op)
+{
+	char target[MAXDNAME + 1];
+
+	rdns_predict(op->context->domain, target);
+	if(strlen(op->name) + strlen(op->protocol) + strlen(target) + 4 > MAXDNAME)
+	{
+		return;
+	}
+	sprintf(op->specname, "_%s._%s.", op->name, op->protocol);
+	strcat(op->specname, target);
+	op->spec = RDNS_SPEC_INFLIGHT;
+	async_submit(op, &(op->specquery), op->specname, &(op->specanswer), spec_complete, op);
+}
+
+static void
+spec_complete(radiodns_query_t *query)
+{
+	radiodns_async_t *op;
+	int state;
+
+	op = (radiodns_async_t *) query->data;
+	state = op->spec;
+	op->spec = RDNS_SPEC_NONE;
+	if(async_orphaned(op))
+	{
+		return;
+	}
+	if(state == RDNS_SPEC_ABANDONED)
+	{
+		abuf_put(&(op->specanswer));
+		return;
+	}
+	if(state == RDNS_SPEC_INFLIGHT)
+	{
+		op->spec = RDNS_SPEC_ANSWERED;
+		return;
+	}
+	/* The target has been found, and it's where we looked */
+	abuf_put(&(op->answer));
+	op->answer = op->specanswer;
+	op->specanswer = NULL;
+	if(query->len <= 0 && query->herrno != HOST_NOT_FOUND && query->herrno != NO_DATA)
+	{
+		/* Something went wrong which might not again */
+		async_submit(op, &(op->query), op->domain, &(op->answer), app_complete, op);
+		return;
+	}
+	app_complete(query);
+}
+
+/* Called once the application's records are to be looked up: if they were
+ * looked up speculatively at the right name, use that lookup rather than
+ * starting another. Returns non-zero if so.
+ */
+static int
+spec_adopt(radiodns_async_t *op)
+{
+	radiodns_query_t *query;
+
+	if(op->spec != RDNS_SPEC_INFLIGHT && op->spec != RDNS_SPEC_ANSWERED)
+	{
+		return 0;
+	}
+	query = &(op->specquery);
+	if(strcasecmp(op->specname, op->domain) ||
+	   (op->spec == RDNS_SPEC_ANSWERED && query->len <= 0 && query->herrno != HOST_NOT_FOUND && query->herrno != NO_DATA))
+	{
+		/* The prediction was wrong, or the lookup failed */
+		spec_discard(op);
+		return 0;
+	}
+	if(op->spec == RDNS_SPEC_INFLIGHT)
+	{
+		op->spec = RDNS_SPEC_ADOPTED;
+		abuf_put(&(op->answer));
+		return 1;
+	}
+	op->spec = RDNS_SPEC_NONE;
+	abuf_put(&(op->answer));
+	op->answer = op->specanswer;
+	op->specanswer = NULL;
+	app_complete(query);
+	return 1;
+}
+
+/* Give up on a speculative lookup which is no longer wanted */
+static void
+spec_discard(radiodns_async_t *op)
+{
+	switch(op->spec)
+	{
+	case RDNS_SPEC_ANSWERED:
+		op->spec = RDNS_SPEC_NONE;
+		abuf_put(&(op->specanswer));
+		break;
+	case RDNS_SPEC_INFLIGHT:
+	case RDNS_SPEC_ADOPTED:
+		if(!op->transport->cancel)
+		{
+			op->spec = RDNS_SPEC_ABANDONED;
+			break;
+		}
+		op->transport->cancel(op->transport, &(op->specquery));
+		op->spec = RDNS_SPEC_NONE;
+		abuf_put(&(op->specanswer));
+		break;
+	}
 }
 
 void
@@ -277,38 +1625,67 @@ radiodns_destroy_app(radiodns_app_t *app)
 	radiodns_app_t *p;
 	int c;
 
+	if(app && __atomic_fetch_sub(&(app->_refs), 1, __ATOMIC_ACQ_REL))
+	{
+		/* Still shared */
+		return;
+	}
 	while(app)
 	{
 		p = app->next;
-		for(c = 0; c < app->nsrv; c++)
+		if(!app->_intern)
 		{
-			free(app->srv[c].target);
+			for(c = 0; c < app->nsrv; c++)
+			{
+				rdns_free(app->_alloc, app->srv[c].target);
+			}
+			rdns_free(app->_alloc, app->name);
 		}
-		free(app->srv);
-		free(app->name);
-		free(app->_pbuf);
-		free(app->params);
-		free(app);
+		rdns_intern_release(app->_intern);
+		rdns_free(app->_alloc, app->_ptr);
+		rdns_free(app->_alloc, app->srv);
+		rdns_free(app->_alloc, app->_pbuf);
+		rdns_free(app->_alloc, app->params);
+		rdns_free(app->_alloc, app);
 		app = p;
 	}
 }
 
 
-static radiodns_app_t *
-app_create(void)
+radiodns_app_t *
+rdns_app_create(radiodns_allocator_t *allocator, radiodns_intern_t *pool)
+{
+	radiodns_app_t *app;
+
+	if((app = (radiodns_app_t *) rdns_calloc(allocator, 1, sizeof(radiodns_app_t))))
+	{
+		rdns_intern_ref(pool);
+		app->_intern = pool;
+		app->_alloc = allocator;
+	}
+	return app;
+}
+
+/* Copy a name belonging to an app, from its pool if it has one */
+char *
+rdns_app_strdup(radiodns_app_t *app, const char *str)
 {
-	return calloc(1, sizeof(radiodns_app_t));
+	if(app->_intern)
+	{
+		return (char *) radiodns_intern(app->_intern, str);
+	}
+	return rdns_strdup(app->_alloc, str);
 }
 
+/* Parse the len bytes of a TXT record string into key=value parameters */
 static int
-app_parse_params(radiodns_app_t *app, const char *txtrec)
+app_parse_params(radiodns_app_t *app, const char *txt, size_t len)
 {
-	size_t l;
+	size_t l, n;
 	char *p;
-	const char *t;
+	const char *t, *end;
 	radiodns_kv_t kv;
 	int c;
-	char hbuf[3];
 
 	if(app->nparams == RDNS_MAXPARAMS)
 	{
@@ -317,13 +1694,19 @@ app_parse_params(radiodns_app_t *app, const char *txtrec)
 	}
 	if(!app->params)
 	{
-		if(!(app->params = (radiodns_kv_t *) calloc(RDNS_MAXPARAMS, sizeof(radiodns_kv_t))))
+		if(!(app->params = (radiodns_kv_t *) rdns_calloc(app->_alloc, RDNS_MAXPARAMS, sizeof(radiodns_kv_t))))
 		{
 			return -2;
 		}
 	}
+	/* Parameters end at the first NUL, if there is one */
+	if((t = memchr(txt, 0, len)))
+	{
+		len = t - txt;
+	}
+	end = txt + len;
 	l = app->_plen;
-	if(!(p = (char *) realloc(app->_pbuf, l + strlen(txtrec) + 4)))
+	if(!(p = (char *) rdns_realloc(app->_alloc, app->_pbuf, l + len + 4)))
 	{
 		return -2;
 	}
@@ -338,68 +1721,31 @@ app_parse_params(radiodns_app_t *app, const char *txtrec)
 	}
 	app->_pbuf = p;
 	p = &(p[l]);
-	while(*txtrec && app->nparams < RDNS_MAXPARAMS)
+	while(txt < end && app->nparams < RDNS_MAXPARAMS)
 	{
-		while(isspace(*txtrec))
+		while(txt < end && isspace((unsigned char) *txt))
 		{
-			txtrec++;
+			txt++;
 		}
-		if(!*txtrec)
-		{
-			break;
-		}
-		for(t = txtrec; *t && *t != '='; t++);
-		if(!t)
+		if(NULL == (t = memchr(txt, '=', end - txt)))
 		{
 			break;
 		}
+		/* The key ends at the '=', or at white space before it, in which
+		 * case the rest up to the '=' is ignored
+		 */
 		kv.key = p;
-		t = txtrec;
-		while(*t && *t != '=' && !isspace(*t))
-		{
-			if(*t == '%' && isxdigit(t[1]) && isxdigit(t[2]))
-			{
-				hbuf[0] = t[1];
-				hbuf[1] = t[2];
-				hbuf[2] = 0;
-				c = strtol(hbuf, NULL, 16);
-				*p = c;
-				p++;
-				t += 3;
-				continue;
-			}
-			*p = *t;
-			p++;
-			t++;
-		}
+		rdns_unescape_param(p, &n, txt, t - txt, 1);
+		p += n;
 		*p = 0;
 		p++;
 		kv.value = p;
-		while(*t != '=')
-		{
-			t++;
-		}
 		t++;
-		while(*t && !isspace(*t))
-		{
-			if(*t == '%' && isxdigit(t[1]) && isxdigit(t[2]))
-			{
-				hbuf[0] = t[1];
-				hbuf[1] = t[2];
-				hbuf[2] = 0;
-				c = strtol(hbuf, NULL, 16);
-				*p = c;
-				p++;
-				t += 3;
-				continue;
-			}
-			*p = *t;
-			p++;
-			t++;
-		}
+		t += rdns_unescape_param(p, &n, t, end - t, 0);
+		p += n;
 		*p = 0;
 		p++;
-		txtrec = t;
+		txt = t;
 		app->params[app->nparams] = kv;
 		app->nparams++;
 	}
@@ -411,51 +1757,43 @@ app_parse_params(radiodns_app_t *app, const char *txtrec)
 	return 0;
 }
 
-static int 
-app_follow_ptr(radiodns_app_t *app, unsigned char *abuf, ns_msg phandle, ns_rr prr)
+/* Prepare to follow a PTR record: the instance is named for the first
+ * label of the name it points to
+ */
+static int
+app_parse_ptr(struct rdns_ptr *ptr, ns_msg handle, ns_rr rr)
 {
-	char dnbuf[MAXDNAME + 1], dbuf[4];
-	char *d, *p, *endp;
-	ns_msg handle;
-	ns_rr rr;
-	int c, len, r;
-	
-	dn_expand(ns_msg_base(phandle), ns_msg_base(phandle) + ns_msg_size(phandle), ns_rr_rdata(prr), dnbuf, sizeof(dnbuf));	
-	if(!(app->name = (char *) calloc(1, strlen(dnbuf))))
+	char nbuf[MAXDNAME + 1];
+	size_t len;
+
+	if(!(ptr->app = rdns_app_create(ptr->op->alloc, rdns_intern(ptr->op->context))))
 	{
 		return -2;
 	}
-	d = app->name;
-	p = dnbuf;
-	while(*p && *p != '.')
+	dn_expand(ns_msg_base(handle), ns_msg_base(handle) + ns_msg_size(handle), ns_rr_rdata(rr), ptr->name, sizeof(ptr->name));
+	len = rdns_unescape_label(nbuf, ptr->name, strlen(ptr->name));
+	nbuf[len] = 0;
+	if(!(ptr->app->name = rdns_app_strdup(ptr->app, nbuf)))
 	{
-		if(*p == '\\' && isdigit(p[1]) && isdigit(p[2]) && isdigit(p[3]))
-		{
-			dbuf[0] = p[1];
-			dbuf[1] = p[2];
-			dbuf[2] = p[3];
-			dbuf[3] = 0;
-			c = strtol(dbuf, NULL, 10);
-			*d = c;
-			d++;
-			p += 4;
-			continue;
-		}
-		else if(*p == '\\' && p[1])
-		{
-			/* Skip the backslash, allowing it to escape the '.' */
-			p++;
-		}
-		*d = *p;
-		d++;
-		p++;
+		return -2;
 	}
-	*d = 0;
-	if(0 >= (len = res_query(dnbuf, ns_c_in, ns_t_any, abuf, RDNS_ANSWERBUFLEN)))
+	return 0;
+}
+
+/* Parse the response to a query for the name a PTR record pointed to */
+static int
+app_parse_instance(radiodns_async_t *op, radiodns_app_t *app, radiodns_query_t *query)
+{
+	char dnbuf[MAXDNAME + 1];
+	ns_msg handle;
+	ns_rr rr;
+	int c, len, r;
+
+	if(0 >= (len = query->len))
 	{
 		return -1;
 	}
-	if(0 > ns_initparse(abuf, len, &handle))
+	if(0 > ns_initparse(query->answer, len, &handle))
 	{
 		return -1;
 	}
@@ -463,7 +1801,7 @@ app_follow_ptr(radiodns_app_t *app, unsigned char *abuf, ns_msg phandle, ns_rr p
 	{
 		return -1;
 	}
-	if(!(app->srv = (radiodns_srv_t *) calloc(len, sizeof(radiodns_srv_t))))
+	if(!(app->srv = (radiodns_srv_t *) rdns_calloc(app->_alloc, len, sizeof(radiodns_srv_t))))
 	{
 		return -2;
 	}
@@ -477,9 +1815,10 @@ app_follow_ptr(radiodns_app_t *app, unsigned char *abuf, ns_msg phandle, ns_rr p
 		{
 			continue;
 		}
+		ttl_update(&(op->app_ttl), rr);
 		if(ns_rr_type(rr) == ns_t_txt)
 		{
-			app_parse_txt(app, handle, rr, dnbuf);
+			app_parse_txt(app, handle, rr);
 		}
 		if(ns_rr_type(rr) == ns_t_srv)
 		{
@@ -503,7 +1842,7 @@ app_follow_ptr(radiodns_app_t *app, unsigned char *abuf, ns_msg phandle, ns_rr p
 }
 
 static int
-app_parse_txt(radiodns_app_t *app, ns_msg handle, ns_rr rr, char *dnbuf)
+app_parse_txt(radiodns_app_t *app, ns_msg handle, ns_rr rr)
 {
 	const unsigned char *p, *start;
 	unsigned char l;
@@ -521,9 +1860,7 @@ app_parse_txt(radiodns_app_t *app, ns_msg handle, ns_rr rr, char *dnbuf)
 		{
 			break;
 		}
-		memcpy(dnbuf, p, l);
-		dnbuf[l] = 0;
-		app_parse_params(app, dnbuf);
+		app_parse_params(app, (const char *) p, l);
 		p += l;
 	}
 	return 0;
@@ -534,8 +1871,6 @@ app_parse_srv(radiodns_app_t *app, ns_msg handle, ns_rr rr, char *dnbuf, radiodn
 {
 	const unsigned char *rdata;
 	
-	(void) app;
-
 	rdata = ns_rr_rdata(rr);
 	srv->priority = ns_get16(rdata);
 	rdata += NS_INT16SZ;
@@ -547,9 +1882,44 @@ app_parse_srv(radiodns_app_t *app, ns_msg handle, ns_rr rr, char *dnbuf, radiodn
 	rdata += NS_INT16SZ;
 	
 	dn_expand(ns_msg_base(handle), ns_msg_base(handle) + ns_msg_size(handle), rdata, dnbuf, MAXDNAME);
-	if(!(srv->target = strdup(dnbuf)))
+	if(!(srv->target = rdns_app_strdup(app, dnbuf)))
 	{
 		return -2;
 	}
 	return 0;
 }
+
+/* Fold the TTL of a resource record into a running minimum, where zero
+ * means that nothing has been seen yet.
+ */
+static void
+ttl_update(unsigned long *ttl, ns_rr rr)
+{
+	if(!*ttl || ns_rr_ttl(rr) < *ttl)
+	{
+		*ttl = ns_rr_ttl(rr);
+	}
+}
+
+/* One of the operations started by radiodns_resolve_apps() has finished */
+static void
+multi_complete(radiodns_async_t *op, void *data)
+{
+	struct rdns_multi *multi;
+
+	multi = (struct rdns_multi *) data;
+	multi->outstanding--;
+	multi_update(multi, op);
+}
+
+/* Note the TTL of an application found, which is only available via the
+ * context at the point the operation finishes
+ */
+static void
+multi_update(struct rdns_multi *multi, radiodns_async_t *op)
+{
+	if(op->app && (!multi->app_ttl || op->context->app_ttl < multi->app_ttl))
+	{
+		multi->app_ttl = op->context->app_ttl;
+	}
+}
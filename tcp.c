@@ -0,0 +1,716 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* A transport which keeps long-lived TCP connections open to each of the
+ * system resolver's nameservers, and pipelines queries over them, matching
+ * responses (which may arrive in any order) by message ID, as described
+ * by RFC 7766. Connections are (re-)established on demand, so a server
+ * closing an idle connection costs nothing until the next query.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/* Number of hash buckets for outstanding queries */
+#define TCP_BUCKETS                     256
+/* Size of the receive buffer: one maximally-sized message and its length */
+#define TCP_RBUFLEN                     (NS_MAXMSG + NS_INT16SZ)
+/* Maximum number of times a query will be (re-)sent */
+#define TCP_MAXATTEMPTS                 4
+
+struct tcp_pending
+{
+	struct tcp_pending *next;
+	/* The list of deadlines, in order */
+	struct tcp_pending *tprev, *tnext;
+	radiodns_query_t *query;
+	unsigned int id;
+	int server;
+	int attempts;
+	/* Set while waiting to be re-sent by tcp_reset() */
+	int resetting;
+	int64_t deadline;
+	int msglen;
+	/* The query message, preceded by its length */
+	unsigned char msg[NS_INT16SZ + NS_PACKETSZ];
+};
+
+struct tcp_conn
+{
+	int fd;
+	int connecting;
+	int failures;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned char *wbuf;
+	size_t wlen;
+	size_t wsize;
+	unsigned char *rbuf;
+	size_t rlen;
+};
+
+struct tcp
+{
+	radiodns_transport_t transport;
+	struct tcp_conn conn[MAXNS];
+	int nconn;
+	struct tcp_pending *pending[TCP_BUCKETS];
+	int npending;
+	/* Every query sent waits the same timeout, so the list of deadlines
+	 * is kept in order simply by appending to it
+	 */
+	struct tcp_pending *thead, *ttail;
+	int timeout;
+	uint64_t seed;
+	/* Used by event loops, via tcp_fd() */
+	struct rdns_notify notify;
+};
+
+static int tcp_submit(radiodns_transport_t *transport, radiodns_query_t *query);
+static int tcp_process(radiodns_transport_t *transport, int timeout);
+static void tcp_destroy(radiodns_transport_t *transport);
+static void tcp_cancel(radiodns_transport_t *transport, radiodns_query_t *query);
+static int tcp_fd(radiodns_transport_t *transport);
+static void tcp_schedule(struct tcp *tcp);
+static int tcp_dispatch(struct tcp *tcp, struct tcp_pending *p);
+static int tcp_connect(struct tcp_conn *conn);
+static int tcp_flush(struct tcp_conn *conn);
+static int tcp_read(struct tcp *tcp, int server);
+static void tcp_reset(struct tcp *tcp, int server);
+static struct tcp_pending *tcp_find(struct tcp *tcp, unsigned int id, int server);
+static void tcp_unlink(struct tcp *tcp, struct tcp_pending *p);
+static void tcp_untime(struct tcp *tcp, struct tcp_pending *p);
+static int tcp_samequestion(const struct tcp_pending *p, const unsigned char *buf, size_t len);
+static void tcp_fail(struct tcp *tcp, struct tcp_pending *p, int herrno);
+
+/* Create a transport which pipelines queries over persistent TCP
+ * connections to the system resolver's nameservers
+ */
+radiodns_transport_t *
+radiodns_transport_tcp(void)
+{
+	struct tcp *tcp;
+	struct sockaddr_storage addrs[MAXNS];
+	socklen_t lens[MAXNS];
+	int c;
+
+	if(NULL == (tcp = (struct tcp *) rdns_calloc(NULL, 1, sizeof(struct tcp))))
+	{
+		return NULL;
+	}
+	if(0 >= (tcp->nconn = rdns_nameservers(addrs, lens, MAXNS)))
+	{
+		rdns_free(NULL, tcp);
+		errno = ENOENT;
+		return NULL;
+	}
+	for(c = 0; c < tcp->nconn; c++)
+	{
+		tcp->conn[c].fd = -1;
+		tcp->conn[c].addr = addrs[c];
+		tcp->conn[c].addrlen = lens[c];
+	}
+	rdns_notify_init(&(tcp->notify));
+	tcp->timeout = rdns_timeout();
+	tcp->seed = rdns_seed();
+	tcp->transport.submit = tcp_submit;
+	tcp->transport.process = tcp_process;
+	tcp->transport.destroy = tcp_destroy;
+	tcp->transport.cancel = tcp_cancel;
+	tcp->transport.fd = tcp_fd;
+	tcp->transport.data = tcp;
+	return &(tcp->transport);
+}
+
+static int
+tcp_submit(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	struct tcp *tcp;
+	struct tcp_pending *p;
+	unsigned int h;
+	int len;
+
+	tcp = (struct tcp *) transport->data;
+	query->len = -1;
+	query->herrno = NETDB_INTERNAL;
+	if(tcp->npending >= 0xFFFF)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	if(NULL == (p = (struct tcp_pending *) rdns_calloc(NULL, 1, sizeof(struct tcp_pending))))
+	{
+		return -1;
+	}
+	do
+	{
+		p->id = rdns_random(&(tcp->seed)) & 0xFFFF;
+	}
+	while(tcp_find(tcp, p->id, -1));
+	if(0 > (len = rdns_mkquery(query, p->id, p->msg + NS_INT16SZ, NS_PACKETSZ)))
+	{
+		rdns_free(NULL, p);
+		return -1;
+	}
+	ns_put16(len, p->msg);
+	p->msglen = len + NS_INT16SZ;
+	p->query = query;
+	/* Start with the first server which hasn't been failing */
+	for(p->server = 0; p->server < tcp->nconn - 1; p->server++)
+	{
+		if(!tcp->conn[p->server].failures)
+		{
+			break;
+		}
+	}
+	h = p->id % TCP_BUCKETS;
+	p->next = tcp->pending[h];
+	tcp->pending[h] = p;
+	tcp->npending++;
+	if(tcp_dispatch(tcp, p))
+	{
+		tcp_unlink(tcp, p);
+		rdns_free(NULL, p);
+		query->herrno = TRY_AGAIN;
+		return -1;
+	}
+	query->_pending = p;
+	tcp_schedule(tcp);
+	return 0;
+}
+
+static int
+tcp_process(radiodns_transport_t *transport, int timeout)
+{
+	struct tcp *tcp;
+	struct tcp_pending *p;
+	struct pollfd fds[MAXNS];
+	int map[MAXNS];
+	int64_t now;
+	int c, n, r, err;
+	socklen_t errlen;
+
+	tcp = (struct tcp *) transport->data;
+	rdns_notify_clear(&(tcp->notify));
+	if(!tcp->npending)
+	{
+		tcp_schedule(tcp);
+		return 0;
+	}
+	now = rdns_now();
+	if((p = tcp->thead) && (timeout < 0 || p->deadline - now < timeout))
+	{
+		timeout = (p->deadline > now ? (int) (p->deadline - now) : 0);
+	}
+	n = 0;
+	for(c = 0; c < tcp->nconn; c++)
+	{
+		if(tcp->conn[c].fd == -1)
+		{
+			continue;
+		}
+		fds[n].fd = tcp->conn[c].fd;
+		fds[n].events = POLLIN;
+		if(tcp->conn[c].connecting || tcp->conn[c].wlen)
+		{
+			fds[n].events |= POLLOUT;
+		}
+		fds[n].revents = 0;
+		map[n] = c;
+		n++;
+	}
+	if(0 > (r = poll(fds, n, timeout)))
+	{
+		if(errno == EINTR)
+		{
+			tcp_schedule(tcp);
+			return tcp->npending;
+		}
+		for(c = 0; c < TCP_BUCKETS; c++)
+		{
+			while(tcp->pending[c])
+			{
+				tcp_fail(tcp, tcp->pending[c], NETDB_INTERNAL);
+			}
+		}
+		tcp_schedule(tcp);
+		return -1;
+	}
+	for(c = 0; c < n; c++)
+	{
+		if(!fds[c].revents)
+		{
+			continue;
+		}
+		if(tcp->conn[map[c]].connecting)
+		{
+			err = 0;
+			errlen = sizeof(err);
+			getsockopt(fds[c].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+			if(err)
+			{
+				tcp->conn[map[c]].failures++;
+				tcp_reset(tcp, map[c]);
+				continue;
+			}
+			tcp->conn[map[c]].connecting = 0;
+			tcp->conn[map[c]].failures = 0;
+		}
+		if((fds[c].revents & POLLOUT) && tcp_flush(&(tcp->conn[map[c]])))
+		{
+			tcp_reset(tcp, map[c]);
+			continue;
+		}
+		if((fds[c].revents & (POLLIN | POLLHUP | POLLERR)) && tcp_read(tcp, map[c]))
+		{
+			tcp_reset(tcp, map[c]);
+		}
+	}
+	/* Anything which has now run out of time is re-sent to the next
+	 * server (which moves it to the end of the list), or abandoned if it's
+	 * been tried enough already. The head is read afresh each time, as a
+	 * completion callback may cancel other queries.
+	 */
+	now = rdns_now();
+	while((p = tcp->thead) && p->deadline <= now)
+	{
+		p->server = (p->server + 1) % tcp->nconn;
+		if(p->attempts >= TCP_MAXATTEMPTS || tcp_dispatch(tcp, p))
+		{
+			tcp_fail(tcp, p, TRY_AGAIN);
+		}
+	}
+	tcp_schedule(tcp);
+	return tcp->npending;
+}
+
+/* Abandon a query without completing it; if it has already been written
+ * to the connection, its response will simply be ignored
+ */
+static void
+tcp_cancel(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	struct tcp *tcp;
+	struct tcp_pending *p;
+
+	tcp = (struct tcp *) transport->data;
+	if(!(p = (struct tcp_pending *) query->_pending) || p->query != query)
+	{
+		return;
+	}
+	query->_pending = NULL;
+	tcp_unlink(tcp, p);
+	rdns_free(NULL, p);
+}
+
+/* Return a descriptor for event loops to wait upon: the connections and a
+ * timer for deadlines, in an epoll set
+ */
+static int
+tcp_fd(radiodns_transport_t *transport)
+{
+	struct tcp *tcp;
+
+	tcp = (struct tcp *) transport->data;
+	if(tcp->notify.epfd != -1)
+	{
+		return tcp->notify.epfd;
+	}
+	if(-1 == rdns_notify_open(&(tcp->notify)))
+	{
+		return -1;
+	}
+	tcp_schedule(tcp);
+	return tcp->notify.epfd;
+}
+
+/* Bring the event loop's interest in each connection up to date, and arm
+ * its timer for the earliest deadline
+ */
+static void
+tcp_schedule(struct tcp *tcp)
+{
+	int c;
+
+	if(tcp->notify.epfd == -1)
+	{
+		return;
+	}
+	for(c = 0; c < tcp->nconn; c++)
+	{
+		if(tcp->conn[c].fd != -1)
+		{
+			rdns_notify_watch(&(tcp->notify), tcp->conn[c].fd, RDNS_NOTIFY_READ |
+							  ((tcp->conn[c].connecting || tcp->conn[c].wlen) ? RDNS_NOTIFY_WRITE : 0));
+		}
+	}
+	rdns_notify_arm(&(tcp->notify), (tcp->thead ? tcp->thead->deadline : -1));
+}
+
+static void
+tcp_destroy(radiodns_transport_t *transport)
+{
+	struct tcp *tcp;
+	struct tcp_pending *p;
+	int c;
+
+	tcp = (struct tcp *) transport->data;
+	for(c = 0; c < TCP_BUCKETS; c++)
+	{
+		while((p = tcp->pending[c]))
+		{
+			tcp->pending[c] = p->next;
+			rdns_free(NULL, p);
+		}
+	}
+	for(c = 0; c < tcp->nconn; c++)
+	{
+		if(tcp->conn[c].fd != -1)
+		{
+			close(tcp->conn[c].fd);
+		}
+		rdns_free(NULL, tcp->conn[c].wbuf);
+		rdns_free(NULL, tcp->conn[c].rbuf);
+	}
+	rdns_notify_close(&(tcp->notify));
+	rdns_free(NULL, tcp);
+}
+
+/* Queue a query for sending on the connection to p->server, moving on to
+ * subsequent servers if a connection can't be established
+ */
+static int
+tcp_dispatch(struct tcp *tcp, struct tcp_pending *p)
+{
+	struct tcp_conn *conn;
+	unsigned char *buf;
+	int c;
+
+	conn = NULL;
+	for(c = 0; c < tcp->nconn; c++)
+	{
+		conn = &(tcp->conn[p->server]);
+		if(conn->fd != -1 || !tcp_connect(conn))
+		{
+			break;
+		}
+		conn->failures++;
+		p->server = (p->server + 1) % tcp->nconn;
+	}
+	if(c == tcp->nconn)
+	{
+		return -1;
+	}
+	if(conn->wlen + p->msglen > conn->wsize)
+	{
+		if(NULL == (buf = (unsigned char *) rdns_realloc(NULL, conn->wbuf, conn->wlen + p->msglen + NS_PACKETSZ * 8)))
+		{
+			return -1;
+		}
+		conn->wbuf = buf;
+		conn->wsize = conn->wlen + p->msglen + NS_PACKETSZ * 8;
+	}
+	memcpy(conn->wbuf + conn->wlen, p->msg, p->msglen);
+	conn->wlen += p->msglen;
+	p->attempts++;
+	p->deadline = rdns_now() + tcp->timeout;
+	tcp_untime(tcp, p);
+	p->tnext = NULL;
+	p->tprev = tcp->ttail;
+	if(tcp->ttail)
+	{
+		tcp->ttail->tnext = p;
+	}
+	else
+	{
+		tcp->thead = p;
+	}
+	tcp->ttail = p;
+	if(!conn->connecting)
+	{
+		/* If this fails, poll() will report the error, and the
+		 * connection will be reset by the next tcp_process()
+		 */
+		tcp_flush(conn);
+	}
+	return 0;
+}
+
+static int
+tcp_connect(struct tcp_conn *conn)
+{
+	int fd, flags;
+
+	if(!conn->rbuf && NULL == (conn->rbuf = (unsigned char *) rdns_malloc(NULL, TCP_RBUFLEN)))
+	{
+		return -1;
+	}
+	if(-1 == (fd = socket(conn->addr.ss_family, SOCK_STREAM, 0)))
+	{
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if(connect(fd, (struct sockaddr *) &(conn->addr), conn->addrlen))
+	{
+		if(errno != EINPROGRESS)
+		{
+			close(fd);
+			return -1;
+		}
+		conn->connecting = 1;
+	}
+	conn->fd = fd;
+	conn->wlen = 0;
+	conn->rlen = 0;
+	return 0;
+}
+
+static int
+tcp_flush(struct tcp_conn *conn)
+{
+	ssize_t r;
+
+	while(conn->wlen)
+	{
+		if(0 > (r = send(conn->fd, conn->wbuf, conn->wlen, MSG_NOSIGNAL)))
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				return 0;
+			}
+			return -1;
+		}
+		memmove(conn->wbuf, conn->wbuf + r, conn->wlen - r);
+		conn->wlen -= r;
+	}
+	return 0;
+}
+
+/* Read whatever is available from a connection and deliver any complete
+ * responses; returns -1 if the connection should be reset
+ */
+static int
+tcp_read(struct tcp *tcp, int server)
+{
+	struct tcp_conn *conn;
+	struct tcp_pending *p;
+	size_t len;
+	ssize_t r;
+
+	conn = &(tcp->conn[server]);
+	for(;;)
+	{
+		r = recv(conn->fd, conn->rbuf + conn->rlen, TCP_RBUFLEN - conn->rlen, 0);
+		if(r == 0)
+		{
+			return -1;
+		}
+		if(r < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				return 0;
+			}
+			return -1;
+		}
+		conn->rlen += r;
+		while(conn->rlen >= NS_INT16SZ)
+		{
+			len = ns_get16(conn->rbuf);
+			if(conn->rlen < NS_INT16SZ + len)
+			{
+				break;
+			}
+			/* The ID of a query which was cancelled may since have been
+			 * reused, so its late answer must not be taken for the new
+			 * query's
+			 */
+			if(len >= NS_HFIXEDSZ && (p = tcp_find(tcp, ns_get16(conn->rbuf + NS_INT16SZ), server)) &&
+			   tcp_samequestion(p, conn->rbuf + NS_INT16SZ, len))
+			{
+				tcp_unlink(tcp, p);
+				p->query->_pending = NULL;
+				rdns_answer(p->query, conn->rbuf + NS_INT16SZ, len);
+				if(p->query->complete)
+				{
+					p->query->complete(p->query);
+				}
+				rdns_free(NULL, p);
+			}
+			memmove(conn->rbuf, conn->rbuf + NS_INT16SZ + len, conn->rlen - NS_INT16SZ - len);
+			conn->rlen -= NS_INT16SZ + len;
+		}
+	}
+}
+
+/* Close a connection, and re-send anything which was waiting on it. If it
+ * had been working, the server gets another chance (it probably closed an
+ * idle connection); otherwise, move on to the next one. The queries to be
+ * re-sent are marked first, and each bucket is scanned again after every
+ * one, because a completion callback may cancel other queries.
+ */
+static void
+tcp_reset(struct tcp *tcp, int server)
+{
+	struct tcp_conn *conn;
+	struct tcp_pending *p;
+	int c;
+
+	conn = &(tcp->conn[server]);
+	rdns_notify_watch(&(tcp->notify), conn->fd, 0);
+	close(conn->fd);
+	conn->fd = -1;
+	conn->connecting = 0;
+	conn->wlen = 0;
+	conn->rlen = 0;
+	for(c = 0; c < TCP_BUCKETS; c++)
+	{
+		for(p = tcp->pending[c]; p; p = p->next)
+		{
+			p->resetting = (p->server == server);
+		}
+	}
+	c = 0;
+	while(c < TCP_BUCKETS)
+	{
+		for(p = tcp->pending[c]; p && !p->resetting; p = p->next);
+		if(!p)
+		{
+			c++;
+			continue;
+		}
+		p->resetting = 0;
+		if(conn->failures)
+		{
+			p->server = (server + 1) % tcp->nconn;
+		}
+		if(p->attempts >= TCP_MAXATTEMPTS || tcp_dispatch(tcp, p))
+		{
+			tcp_fail(tcp, p, TRY_AGAIN);
+		}
+	}
+}
+
+static struct tcp_pending *
+tcp_find(struct tcp *tcp, unsigned int id, int server)
+{
+	struct tcp_pending *p;
+
+	for(p = tcp->pending[id % TCP_BUCKETS]; p; p = p->next)
+	{
+		if(p->id == id && (server == -1 || p->server == server))
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static void
+tcp_unlink(struct tcp *tcp, struct tcp_pending *p)
+{
+	struct tcp_pending **pp;
+
+	for(pp = &(tcp->pending[p->id % TCP_BUCKETS]); *pp; pp = &((*pp)->next))
+	{
+		if(*pp == p)
+		{
+			*pp = p->next;
+			tcp->npending--;
+			break;
+		}
+	}
+	tcp_untime(tcp, p);
+}
+
+/* Remove a query from the list of deadlines, if it's on it */
+static void
+tcp_untime(struct tcp *tcp, struct tcp_pending *p)
+{
+	if(!p->tprev && tcp->thead != p)
+	{
+		return;
+	}
+	if(p->tprev)
+	{
+		p->tprev->tnext = p->tnext;
+	}
+	else
+	{
+		tcp->thead = p->tnext;
+	}
+	if(p->tnext)
+	{
+		p->tnext->tprev = p->tprev;
+	}
+	else
+	{
+		tcp->ttail = p->tprev;
+	}
+	p->tprev = NULL;
+	p->tnext = NULL;
+}
+
+/* Check that a response repeats the question which was asked; the query
+ * consists only of a header and the question, so the bytes following the
+ * header must match (other than in case)
+ */
+static int
+tcp_samequestion(const struct tcp_pending *p, const unsigned char *buf, size_t len)
+{
+	const unsigned char *msg;
+	size_t c, msglen;
+
+	msg = p->msg + NS_INT16SZ;
+	msglen = p->msglen - NS_INT16SZ;
+	if(len < msglen || ns_get16(buf + 2 * NS_INT16SZ) != 1)
+	{
+		return 0;
+	}
+	for(c = NS_HFIXEDSZ; c < msglen; c++)
+	{
+		if(buf[c] != msg[c] && tolower(buf[c]) != tolower(msg[c]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+tcp_fail(struct tcp *tcp, struct tcp_pending *p, int herrno)
+{
+	tcp_unlink(tcp, p);
+	p->query->_pending = NULL;
+	p->query->len = -1;
+	p->query->herrno = herrno;
+	if(p->query->complete)
+	{
+		p->query->complete(p->query);
+	}
+	rdns_free(NULL, p);
+}
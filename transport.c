@@ -0,0 +1,498 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+# define RDNS_NOTIFY                    1
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+#endif
+
+static int libresolv_query(radiodns_transport_t *transport, radiodns_query_t *query);
+static void batch_complete(radiodns_query_t *query);
+
+static radiodns_transport_t libresolv_transport = {
+	libresolv_query, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+/* The transport used by contexts which don't have one of their own */
+static radiodns_transport_t *default_transport = &libresolv_transport;
+
+/* The transport used in place of the default by the current thread, if
+ * any; set for worker pool threads
+ */
+static __thread radiodns_transport_t *thread_transport;
+
+/* Return the transport which uses the system resolver */
+radiodns_transport_t *
+radiodns_transport_libresolv(void)
+{
+	return &libresolv_transport;
+}
+
+/* Destroy a transport */
+void
+radiodns_transport_destroy(radiodns_transport_t *transport)
+{
+	if(transport && transport->destroy)
+	{
+		transport->destroy(transport);
+	}
+}
+
+/* Set the transport used by a context, or the default */
+int
+radiodns_set_transport(radiodns_t *context, radiodns_transport_t *transport)
+{
+	if(transport && !transport->query && (!transport->submit || !transport->process))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!context)
+	{
+		default_transport = (transport ? transport : &libresolv_transport);
+		return 0;
+	}
+	context->transport = transport;
+	return 0;
+}
+
+/* Return the transport used by a context, or the default */
+radiodns_transport_t *
+radiodns_get_transport(radiodns_t *context)
+{
+	return rdns_transport(context);
+}
+
+radiodns_transport_t *
+rdns_transport(radiodns_t *context)
+{
+	if(context && context->transport)
+	{
+		return context->transport;
+	}
+	if(thread_transport)
+	{
+		return thread_transport;
+	}
+	return default_transport;
+}
+
+/* Set the transport used by the current thread for contexts without one
+ * of their own, in place of the default; NULL to revert to the default
+ */
+void
+rdns_thread_transport(radiodns_transport_t *transport)
+{
+	thread_transport = transport;
+}
+
+/* Start a query via a transport. If the transport can only perform
+ * queries synchronously, or the query can't be submitted, it's completed
+ * before this function returns.
+ */
+void
+rdns_submit(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	query->len = -1;
+	query->herrno = NETDB_INTERNAL;
+	query->err = 0;
+	query->_pending = NULL;
+	if(transport->submit && transport->process)
+	{
+		if(!transport->submit(transport, query))
+		{
+			return;
+		}
+		query->err = errno;
+	}
+	else
+	{
+		errno = 0;
+		transport->query(transport, query);
+		/* Still describes the failure, having only just happened */
+		if(query->len < 0 && query->herrno == NETDB_INTERNAL && !query->err)
+		{
+			query->err = errno;
+		}
+	}
+	query->complete(query);
+}
+
+/* Perform several queries at once. Transports which can have several
+ * queries in flight have them all submitted before waiting for any;
+ * others simply perform them one after the other.
+ */
+int
+rdns_batch(radiodns_transport_t *transport, radiodns_query_t *queries, int nqueries)
+{
+	int c, outstanding;
+
+	if(!transport->submit || !transport->process)
+	{
+		for(c = 0; c < nqueries; c++)
+		{
+			queries[c].herrno = NETDB_INTERNAL;
+			queries[c].err = 0;
+			transport->query(transport, &(queries[c]));
+		}
+		return 0;
+	}
+	outstanding = 0;
+	for(c = 0; c < nqueries; c++)
+	{
+		queries[c].len = -1;
+		queries[c].herrno = NETDB_INTERNAL;
+		queries[c].err = 0;
+		queries[c].complete = batch_complete;
+		queries[c].data = &outstanding;
+		if(transport->submit(transport, &(queries[c])))
+		{
+			continue;
+		}
+		outstanding++;
+	}
+	while(outstanding)
+	{
+		if(0 > transport->process(transport, -1))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+batch_complete(radiodns_query_t *query)
+{
+	(*(int *) query->data)--;
+}
+
+static int
+libresolv_query(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	(void) transport;
+
+	h_errno = 0;
+	query->len = res_query(query->name, query->qclass, query->qtype, query->answer, query->anslen);
+	query->herrno = h_errno;
+	if(query->len <= 0)
+	{
+		query->len = -1;
+	}
+	return query->len;
+}
+
+/* Build a query message with a particular ID */
+int
+rdns_mkquery(const radiodns_query_t *query, unsigned int id, unsigned char *buf, int buflen)
+{
+	int len;
+
+	if(!(_res.options & RES_INIT) && res_init())
+	{
+		return -1;
+	}
+	if(0 > (len = res_mkquery(ns_o_query, query->name, query->qclass, query->qtype, NULL, 0, NULL, buf, buflen)))
+	{
+		return -1;
+	}
+	ns_put16(id, buf);
+	return len;
+}
+
+/* Deliver a response to a query, interpreting the response code in the
+ * same way as res_query()
+ */
+void
+rdns_answer(radiodns_query_t *query, const unsigned char *msg, int len)
+{
+	query->len = -1;
+	if(len < NS_HFIXEDSZ)
+	{
+		query->herrno = NO_RECOVERY;
+		return;
+	}
+	if(len > query->anslen)
+	{
+		len = query->anslen;
+	}
+	memcpy(query->answer, msg, len);
+	switch(msg[3] & 0x0f)
+	{
+	case ns_r_noerror:
+		if(!ns_get16(msg + 3 * NS_INT16SZ))
+		{
+			query->herrno = NO_DATA;
+			return;
+		}
+		query->herrno = 0;
+		query->len = len;
+		return;
+	case ns_r_nxdomain:
+		query->herrno = HOST_NOT_FOUND;
+		return;
+	case ns_r_servfail:
+		query->herrno = TRY_AGAIN;
+		return;
+	default:
+		query->herrno = NO_RECOVERY;
+		return;
+	}
+}
+
+/* Obtain the list of nameservers from the system resolver */
+int
+rdns_nameservers(struct sockaddr_storage *addrs, socklen_t *addrlens, int max)
+{
+	int c, n;
+
+	if(!(_res.options & RES_INIT) && res_init())
+	{
+		return -1;
+	}
+	n = 0;
+	for(c = 0; c < _res.nscount && n < max; c++)
+	{
+#ifdef __GLIBC__
+		/* glibc keeps IPv6 nameservers to one side */
+		if(_res._u._ext.nsaddrs[c] && _res._u._ext.nsaddrs[c]->sin6_family == AF_INET6)
+		{
+			memcpy(&(addrs[n]), _res._u._ext.nsaddrs[c], sizeof(struct sockaddr_in6));
+			addrlens[n] = sizeof(struct sockaddr_in6);
+			n++;
+			continue;
+		}
+#endif
+		if(_res.nsaddr_list[c].sin_family == AF_INET)
+		{
+			memcpy(&(addrs[n]), &(_res.nsaddr_list[c]), sizeof(struct sockaddr_in));
+			addrlens[n] = sizeof(struct sockaddr_in);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Readiness notification for transports driven by an application's event
+ * loop. The epoll set isn't created until somebody asks for it, so that
+ * transports which are only ever driven by process() pay nothing.
+ */
+void
+rdns_notify_init(struct rdns_notify *notify)
+{
+	notify->epfd = -1;
+	notify->timerfd = -1;
+	notify->armed = -1;
+}
+
+int
+rdns_notify_open(struct rdns_notify *notify)
+{
+#ifdef RDNS_NOTIFY
+	struct epoll_event ev;
+
+	if(notify->epfd != -1)
+	{
+		return notify->epfd;
+	}
+	if(-1 == (notify->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)))
+	{
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = notify->timerfd;
+	if(-1 == (notify->epfd = epoll_create1(EPOLL_CLOEXEC)) ||
+	   epoll_ctl(notify->epfd, EPOLL_CTL_ADD, notify->timerfd, &ev))
+	{
+		rdns_notify_close(notify);
+		return -1;
+	}
+	notify->armed = -1;
+	return notify->epfd;
+#else
+	(void) notify;
+
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Add a descriptor to the set, change the events of interest, or (if
+ * events is zero) remove it
+ */
+void
+rdns_notify_watch(struct rdns_notify *notify, int fd, int events)
+{
+#ifdef RDNS_NOTIFY
+	struct epoll_event ev;
+
+	if(notify->epfd == -1)
+	{
+		return;
+	}
+	if(!events)
+	{
+		epoll_ctl(notify->epfd, EPOLL_CTL_DEL, fd, NULL);
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ((events & RDNS_NOTIFY_READ) ? EPOLLIN : 0) | ((events & RDNS_NOTIFY_WRITE) ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	if(epoll_ctl(notify->epfd, EPOLL_CTL_MOD, fd, &ev) && errno == ENOENT)
+	{
+		epoll_ctl(notify->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+#else
+	(void) notify;
+	(void) fd;
+	(void) events;
+#endif
+}
+
+/* Arrange for the set to become readable at a deadline (per rdns_now()),
+ * immediately if it's zero, or not at all if it's negative
+ */
+void
+rdns_notify_arm(struct rdns_notify *notify, int64_t deadline)
+{
+#ifdef RDNS_NOTIFY
+	struct itimerspec its;
+	int64_t delay;
+
+	if(notify->epfd == -1 || deadline == notify->armed)
+	{
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	if(deadline >= 0)
+	{
+		delay = (deadline ? deadline - rdns_now() : 0);
+		if(delay > 0)
+		{
+			its.it_value.tv_sec = delay / 1000;
+			its.it_value.tv_nsec = (long) (delay % 1000) * 1000000;
+		}
+		else
+		{
+			/* A zero it_value would disarm the timer */
+			its.it_value.tv_nsec = 1;
+		}
+	}
+	timerfd_settime(notify->timerfd, 0, &its, NULL);
+	notify->armed = deadline;
+#else
+	(void) notify;
+	(void) deadline;
+#endif
+}
+
+/* Acknowledge the timer having expired; called by process() */
+void
+rdns_notify_clear(struct rdns_notify *notify)
+{
+#ifdef RDNS_NOTIFY
+	uint64_t expirations;
+
+	if(notify->epfd == -1)
+	{
+		return;
+	}
+	if((ssize_t) sizeof(expirations) == read(notify->timerfd, &expirations, sizeof(expirations)))
+	{
+		notify->armed = -1;
+	}
+#else
+	(void) notify;
+#endif
+}
+
+void
+rdns_notify_close(struct rdns_notify *notify)
+{
+	if(notify->epfd != -1)
+	{
+		close(notify->epfd);
+	}
+	if(notify->timerfd != -1)
+	{
+		close(notify->timerfd);
+	}
+	rdns_notify_init(notify);
+}
+
+int
+rdns_timeout(void)
+{
+	if(!(_res.options & RES_INIT) && res_init())
+	{
+		return RES_TIMEOUT * 1000;
+	}
+	return (_res.retrans > 0 ? _res.retrans : RES_TIMEOUT) * 1000;
+}
+
+int64_t
+rdns_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+rdns_seed(void)
+{
+	uint64_t seed;
+	int fd;
+
+	seed = 0;
+	if(-1 != (fd = open("/dev/urandom", O_RDONLY)))
+	{
+		if((ssize_t) sizeof(seed) != read(fd, &seed, sizeof(seed)))
+		{
+			seed = 0;
+		}
+		close(fd);
+	}
+	seed ^= ((uint64_t) time(NULL) << 32) ^ ((uint64_t) getpid() << 16) ^ (uint64_t) (uintptr_t) &seed;
+	return (seed ? seed : 0x9e3779b97f4a7c15ULL);
+}
+
+/* xorshift64* */
+uint32_t
+rdns_random(uint64_t *state)
+{
+	uint64_t x;
+
+	x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (uint32_t) ((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
@@ -0,0 +1,1945 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* A transport for bulk resolution, which sends queries to the system
+ * resolver's nameservers over a handful of long-lived UDP sockets. Queries
+ * are queued per socket and sent in batches (using sendmmsg() where
+ * available), and responses are received in batches (using recvmmsg())
+ * and matched to outstanding queries by socket and message ID.
+ *
+ * Each query is given a random ID and sent from a randomly-chosen socket;
+ * sockets are replaced, and so move to a fresh kernel-chosen source port,
+ * once they have sent UDP_MAXUSES queries. Responses are only accepted
+ * from the server a query was sent to, and only if they repeat the
+ * question.
+ *
+ * Queries go to whichever server has lately been answering quickest,
+ * judged by a smoothed round-trip time as TCP keeps, passing over servers
+ * which keep failing to answer. Once every UDP_PROBEINTERVAL, a query is
+ * sent to each of the others in turn instead, so that they're measured
+ * again and may recover.
+ *
+ * If hedging is enabled, a query which has gone unanswered for longer than
+ * nine in ten responses take is duplicated to another server, and
+ * whichever copy is answered first completes it. Each query submitted
+ * earns a fraction of a duplicate, so that only so many are ever sent.
+ *
+ * Transports created by radiodns_transport_uring() do the same, but
+ * perform their sends, receives and timeouts through io_uring instead,
+ * keeping UDP_RECVS receives posted on each socket and submitting every
+ * queued send in a single system call.
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE                    1
+#endif
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+/* Number of sockets kept open for each address family */
+#define UDP_SOCKETS                     4
+/* Maximum number of messages sent or received in one system call */
+#define UDP_BATCH                       64
+/* Number of hash buckets for outstanding queries (a power of two) */
+#define UDP_BUCKETS                     4096
+/* Size of each receive buffer */
+#define UDP_BUFLEN                      4096
+/* Maximum number of times a query will be (re-)sent */
+#define UDP_MAXATTEMPTS                 4
+/* Number of queries sent from a socket before it's replaced */
+#define UDP_MAXUSES                     4096
+/* Limits upon the number of queries sent and awaiting a response. The
+ * window grows by one for each response and halves when queries time
+ * out, so that neither the server's receive buffer nor our own overflows
+ * when a batch is sent in one go.
+ */
+#define UDP_MINWINDOW                   16
+#define UDP_MAXWINDOW                   256
+/* Requested socket receive buffer size */
+#define UDP_RCVBUF                      (1024 * 1024)
+/* Number of submission queue entries when using io_uring */
+#define UDP_RINGSIZE                    4096
+/* Number of receives kept posted on each socket when using io_uring */
+#define UDP_RECVS                       32
+/* Number of response times kept for estimating how long a query should
+ * go unanswered before it's duplicated, the least time that may be (in
+ * milliseconds), and the greatest number of duplicates which may be sent
+ * in a burst
+ */
+#define UDP_RTTSAMPLES                  64
+#define UDP_MINHEDGE                    2
+#define UDP_HEDGEBURST                  8
+/* Number of consecutive failures after which a server is passed over,
+ * and how often one of the other servers is sent a query regardless (in
+ * milliseconds)
+ */
+#define UDP_MAXFAILURES                 2
+#define UDP_PROBEINTERVAL               1000
+
+#define UDP_HASH(id, sock)              (((id) ^ ((unsigned int) (sock) << 12)) & (UDP_BUCKETS - 1))
+
+/* io_uring completions for receives are identified by socket and slot,
+ * and so have the lowest bit set; those for sends carry a pointer to the
+ * query, which never does
+ */
+#define UDP_RECVDATA(sock, slot)        ((((uint64_t) (sock) * UDP_RECVS + (slot)) << 1) | 1)
+
+struct udp_pending
+{
+	/* Hash chain, or free list */
+	struct udp_pending *next;
+	/* Send queue of the socket */
+	struct udp_pending *qnext;
+	/* All queries which have been sent, in order of deadline */
+	struct udp_pending *tprev;
+	struct udp_pending *tnext;
+	radiodns_query_t *query;
+	unsigned int id;
+	int sock;
+	int server;
+	int attempts;
+	int queued;
+	int hashed;
+	int64_t sent;
+	int64_t deadline;
+	/* The other copy of a hedged query, and the list of queries which
+	 * will be hedged if they go unanswered until hedgeat
+	 */
+	struct udp_pending *hedge;
+	struct udp_pending *hprev;
+	struct udp_pending *hnext;
+	int waiting;
+	int64_t hedgeat;
+	/* The number of io_uring sends of this query still in progress, and
+	 * whether it has been released meanwhile
+	 */
+	int sending;
+	int orphaned;
+	struct msghdr mh;
+	struct iovec iov;
+	int msglen;
+	unsigned char msg[NS_PACKETSZ];
+};
+
+/* A query whose response was truncated, being retried over TCP */
+struct udp_retry
+{
+	struct udp_retry *next;
+	struct udp *udp;
+	radiodns_query_t *query;
+	radiodns_query_t q;
+};
+
+struct udp_recv
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct sockaddr_storage from;
+	unsigned char buf[UDP_BUFLEN];
+};
+
+struct udp_sock
+{
+	int fd;
+	unsigned long uses;
+	unsigned int outstanding;
+	struct udp_pending *qhead;
+	struct udp_pending *qtail;
+	int qlen;
+	/* Receives posted to the io_uring, and a count of times the socket
+	 * has been opened, to tell whether their completions are stale
+	 */
+	struct udp_recv *recv;
+	int armed;
+	unsigned int generation;
+};
+
+struct udp_server
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int failures;
+	/* Smoothed round-trip time and mean deviation, scaled by 8 and 4
+	 * respectively, in milliseconds
+	 */
+	int srtt;
+	int rttvar;
+	int measured;
+	/* A failing server isn't probed again until then */
+	int64_t retryat;
+	unsigned long queries;
+	unsigned long responses;
+	unsigned long timeouts;
+	unsigned long hedges;
+};
+
+struct udp
+{
+	radiodns_transport_t transport;
+	struct udp_server server[MAXNS];
+	int nservers;
+	/* The last server probed, and when the next probe is due */
+	int probe;
+	int64_t probeat;
+	/* IPv4 sockets, followed by IPv6 sockets */
+	struct udp_sock sock[UDP_SOCKETS * 2];
+	struct udp_pending *pending[UDP_BUCKETS];
+	struct udp_pending *thead;
+	struct udp_pending *ttail;
+	struct udp_pending *freelist;
+	struct udp_pending *orphans;
+	int npending;
+	unsigned int inflight;
+	unsigned int window;
+	int64_t lastcut;
+	int timeout;
+	uint64_t seed;
+	/* Hedging: the percentage of queries which may be duplicated, the
+	 * credit (in hundredths of a duplicate) accrued towards sending
+	 * them, the queries waiting to be, recent response times and the
+	 * delay derived from them
+	 */
+	unsigned int budget;
+	unsigned int credit;
+	struct udp_pending *hhead;
+	struct udp_pending *htail;
+	int rtt[UDP_RTTSAMPLES];
+	unsigned long nrtt;
+	int hedgedelay;
+	/* Used to retry queries whose responses were truncated, along with
+	 * its event loop descriptor, through which it's driven, and the
+	 * retries in progress
+	 */
+	radiodns_transport_t *tcp;
+	int tcpfd;
+	struct udp_retry *retries;
+	int nretries;
+	/* Used for I/O instead of sendmmsg(), recvmmsg() and poll() where
+	 * available
+	 */
+	struct rdns_uring *ring;
+	/* Used by event loops, via udp_fd() */
+	struct rdns_notify notify;
+	unsigned char rbuf[UDP_BATCH][UDP_BUFLEN];
+};
+
+static int udp_submit(radiodns_transport_t *transport, radiodns_query_t *query);
+static int udp_process(radiodns_transport_t *transport, int timeout);
+static void udp_destroy(radiodns_transport_t *transport);
+static void udp_cancel(radiodns_transport_t *transport, radiodns_query_t *query);
+static int udp_fd(radiodns_transport_t *transport);
+static void udp_schedule(struct udp *udp);
+static int udp_dispatch(struct udp *udp, struct udp_pending *p);
+static int udp_socket(struct udp *udp, int family);
+static int udp_open(struct udp *udp, int s, int family);
+static void udp_close(struct udp *udp, int s);
+static int udp_arm(struct udp *udp, int s, int slot);
+static void udp_flush(struct udp *udp, int s);
+static int udp_send(struct udp *udp, int fd, struct udp_pending **batch, int n);
+static void udp_receive(struct udp *udp, int s);
+static int udp_poll(struct udp *udp, int timeout);
+static int udp_wait(struct udp *udp, int timeout);
+static void udp_completion(struct udp *udp, uint64_t data, int res);
+static void udp_response(struct udp *udp, int s, const unsigned char *buf, int len, const struct sockaddr_storage *from);
+static int udp_sameaddr(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+static int udp_samequestion(const struct udp_pending *p, const unsigned char *buf, int len);
+static int udp_truncated(struct udp *udp, radiodns_query_t *query);
+static void udp_retried(radiodns_query_t *q);
+static void udp_unretry(struct udp *udp, struct udp_retry *retry);
+static struct udp_pending *udp_find(struct udp *udp, unsigned int id, int s);
+static void udp_unlink(struct udp *udp, struct udp_pending *p);
+static void udp_sent(struct udp *udp, struct udp_pending *p, int64_t deadline);
+static void udp_expire(struct udp *udp, struct udp_pending *p);
+static void udp_failall(struct udp *udp);
+static void udp_fail(struct udp *udp, struct udp_pending *p, int herrno);
+static void udp_release(struct udp *udp, struct udp_pending *p);
+static int64_t udp_next(struct udp *udp);
+static void udp_hedge(struct udp *udp, int64_t now);
+static void udp_unwait(struct udp *udp, struct udp_pending *p);
+static void udp_unhedge(struct udp *udp, struct udp_pending *p);
+static void udp_drop(struct udp *udp, struct udp_pending *p);
+static void udp_rtt(struct udp *udp, int rtt);
+static int udp_pick(struct udp *udp, int exclude);
+static int udp_best(struct udp *udp, int exclude);
+static void udp_measure(struct udp_server *server, int rtt);
+static void udp_backoff(struct udp_server *server, int64_t now);
+
+/* Create a transport which sends queries in batches over UDP to the
+ * system resolver's nameservers
+ */
+radiodns_transport_t *
+radiodns_transport_udp(void)
+{
+	struct udp *udp;
+	struct sockaddr_storage addrs[MAXNS];
+	socklen_t lens[MAXNS];
+	int c;
+
+	if(NULL == (udp = (struct udp *) rdns_calloc(NULL, 1, sizeof(struct udp))))
+	{
+		return NULL;
+	}
+	if(0 >= (udp->nservers = rdns_nameservers(addrs, lens, MAXNS)))
+	{
+		rdns_free(NULL, udp);
+		errno = ENOENT;
+		return NULL;
+	}
+	for(c = 0; c < udp->nservers; c++)
+	{
+		udp->server[c].addr = addrs[c];
+		udp->server[c].addrlen = lens[c];
+	}
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		udp->sock[c].fd = -1;
+	}
+	rdns_notify_init(&(udp->notify));
+	udp->tcpfd = -1;
+	udp->window = UDP_MINWINDOW * 4;
+	udp->timeout = rdns_timeout();
+	udp->seed = rdns_seed();
+	udp->transport.submit = udp_submit;
+	udp->transport.process = udp_process;
+	udp->transport.destroy = udp_destroy;
+	udp->transport.cancel = udp_cancel;
+	udp->transport.fd = udp_fd;
+	udp->transport.data = udp;
+	return &(udp->transport);
+}
+
+/* Create a batched UDP transport which performs its I/O through io_uring,
+ * or which behaves exactly as radiodns_transport_udp() if io_uring can't
+ * be used
+ */
+radiodns_transport_t *
+radiodns_transport_uring(void)
+{
+	radiodns_transport_t *transport;
+
+	if(NULL == (transport = radiodns_transport_udp()))
+	{
+		return NULL;
+	}
+	((struct udp *) transport->data)->ring = rdns_uring_create(UDP_RINGSIZE);
+	return transport;
+}
+
+/* Duplicate queries which go unanswered for longer than most to another
+ * server, sending no more than percent duplicates for every hundred
+ * queries; zero disables hedging
+ */
+int
+radiodns_transport_hedge(radiodns_transport_t *transport, unsigned int percent)
+{
+	struct udp *udp;
+
+	if(!transport || transport->submit != udp_submit || percent > 100)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	udp = (struct udp *) transport->data;
+	if(!udp->budget && percent)
+	{
+		/* Until enough responses have been seen to go by */
+		udp->hedgedelay = (udp->timeout / 4 > UDP_MINHEDGE ? udp->timeout / 4 : UDP_MINHEDGE);
+	}
+	udp->budget = percent;
+	if(!percent)
+	{
+		while(udp->hhead)
+		{
+			udp_unwait(udp, udp->hhead);
+		}
+	}
+	return 0;
+}
+
+static int
+udp_submit(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	struct udp *udp;
+	struct udp_pending *p;
+
+	udp = (struct udp *) transport->data;
+	query->len = -1;
+	query->herrno = NETDB_INTERNAL;
+	if((p = udp->freelist))
+	{
+		udp->freelist = p->next;
+	}
+	else if(NULL == (p = (struct udp_pending *) rdns_malloc(NULL, sizeof(struct udp_pending))))
+	{
+		return -1;
+	}
+	if(0 > (p->msglen = rdns_mkquery(query, 0, p->msg, NS_PACKETSZ)))
+	{
+		udp_release(udp, p);
+		return -1;
+	}
+	p->query = query;
+	p->attempts = 0;
+	p->sending = 0;
+	p->orphaned = 0;
+	p->hedge = NULL;
+	p->waiting = 0;
+	p->server = udp_pick(udp, -1);
+	if(udp_dispatch(udp, p))
+	{
+		udp_release(udp, p);
+		query->herrno = TRY_AGAIN;
+		return -1;
+	}
+	query->_pending = p;
+	if(udp->budget && udp->credit < UDP_HEDGEBURST * 100)
+	{
+		udp->credit += udp->budget;
+	}
+	udp_schedule(udp);
+	return 0;
+}
+
+static int
+udp_process(radiodns_transport_t *transport, int timeout)
+{
+	struct udp *udp;
+	struct udp_pending *p;
+	int64_t now, next;
+	int c;
+
+	udp = (struct udp *) transport->data;
+	rdns_notify_clear(&(udp->notify));
+	if(!udp->npending && !udp->nretries)
+	{
+		udp_schedule(udp);
+		return 0;
+	}
+	/* Send anything submitted since the last call */
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		if(udp->sock[c].qhead)
+		{
+			udp_flush(udp, c);
+		}
+	}
+	now = rdns_now();
+	if(-1 != (next = udp_next(udp)) && (timeout < 0 || next - now < timeout))
+	{
+		timeout = (next > now ? (int) (next - now) : 0);
+	}
+	if(0 > (udp->ring ? udp_wait(udp, timeout) : udp_poll(udp, timeout)))
+	{
+		if(errno == EINTR)
+		{
+			udp_schedule(udp);
+			return udp->npending + udp->nretries;
+		}
+		udp_failall(udp);
+		udp_schedule(udp);
+		return -1;
+	}
+	/* Deal with whatever the retries over TCP are waiting for */
+	if(udp->nretries)
+	{
+		udp->tcp->process(udp->tcp, 0);
+	}
+	/* Anything which has now run out of time is re-sent to the next
+	 * server, or abandoned if it's been tried enough already
+	 */
+	now = rdns_now();
+	if(udp->thead && udp->thead->deadline <= now && now - udp->lastcut >= udp->timeout)
+	{
+		/* Only once per timeout period, as a single overflow will
+		 * cause many queries to time out together
+		 */
+		udp->window = (udp->window / 2 > UDP_MINWINDOW ? udp->window / 2 : UDP_MINWINDOW);
+		udp->lastcut = now;
+	}
+	while((p = udp->thead) && p->deadline <= now)
+	{
+		udp_unlink(udp, p);
+		/* A timeout counts against the server as a response which took
+		 * that long
+		 */
+		udp->server[p->server].failures++;
+		udp->server[p->server].timeouts++;
+		udp_measure(&(udp->server[p->server]), udp->timeout);
+		udp_backoff(&(udp->server[p->server]), now);
+		if(p->attempts < UDP_MAXATTEMPTS)
+		{
+			p->server = udp_pick(udp, p->server);
+			if(!udp_dispatch(udp, p))
+			{
+				continue;
+			}
+		}
+		if(p->hedge)
+		{
+			/* The other copy may yet be answered */
+			udp_drop(udp, p);
+			continue;
+		}
+		udp_fail(udp, p, TRY_AGAIN);
+	}
+	udp_hedge(udp, now);
+	udp_schedule(udp);
+	return udp->npending + udp->nretries;
+}
+
+/* Abandon a query without completing it */
+static void
+udp_cancel(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	struct udp *udp;
+	struct udp_pending *p;
+	struct udp_retry *retry;
+
+	udp = (struct udp *) transport->data;
+	for(retry = udp->retries; retry; retry = retry->next)
+	{
+		if(retry->query == query)
+		{
+			udp->tcp->cancel(udp->tcp, &(retry->q));
+			udp_unretry(udp, retry);
+			return;
+		}
+	}
+	if(!(p = (struct udp_pending *) query->_pending) || p->query != query)
+	{
+		return;
+	}
+	query->_pending = NULL;
+	udp_unlink(udp, p);
+	udp_unhedge(udp, p);
+	udp_release(udp, p);
+}
+
+/* Return a descriptor for event loops to wait upon: the sockets (or the
+ * io_uring) and a timer, for queued sends and deadlines, in an epoll set
+ */
+static int
+udp_fd(radiodns_transport_t *transport)
+{
+	struct udp *udp;
+	int c;
+
+	udp = (struct udp *) transport->data;
+	if(udp->notify.epfd != -1)
+	{
+		return udp->notify.epfd;
+	}
+	if(-1 == rdns_notify_open(&(udp->notify)))
+	{
+		return -1;
+	}
+	if(udp->ring)
+	{
+		rdns_notify_watch(&(udp->notify), rdns_uring_fd(udp->ring), RDNS_NOTIFY_READ);
+	}
+	else
+	{
+		for(c = 0; c < UDP_SOCKETS * 2; c++)
+		{
+			if(udp->sock[c].fd != -1)
+			{
+				rdns_notify_watch(&(udp->notify), udp->sock[c].fd, RDNS_NOTIFY_READ);
+			}
+		}
+	}
+	if(udp->nretries)
+	{
+		rdns_notify_watch(&(udp->notify), udp->tcpfd, RDNS_NOTIFY_READ);
+	}
+	udp_schedule(udp);
+	return udp->notify.epfd;
+}
+
+/* Arm the event loop's timer: immediately if there's anything waiting to
+ * be sent, otherwise for the earliest deadline
+ */
+static void
+udp_schedule(struct udp *udp)
+{
+	int c;
+
+	if(udp->notify.epfd == -1)
+	{
+		return;
+	}
+	if(udp->ring && rdns_uring_pending(udp->ring))
+	{
+		rdns_notify_arm(&(udp->notify), 0);
+		return;
+	}
+	if(udp->inflight < udp->window)
+	{
+		for(c = 0; c < UDP_SOCKETS * 2; c++)
+		{
+			if(udp->sock[c].qhead)
+			{
+				rdns_notify_arm(&(udp->notify), 0);
+				return;
+			}
+		}
+	}
+	rdns_notify_arm(&(udp->notify), udp_next(udp));
+}
+
+/* Wait for sockets to become readable or writable, and deal with them */
+static int
+udp_poll(struct udp *udp, int timeout)
+{
+	struct pollfd fds[UDP_SOCKETS * 2 + 1];
+	int map[UDP_SOCKETS * 2];
+	int c, n;
+
+	n = 0;
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		if(udp->sock[c].fd == -1)
+		{
+			continue;
+		}
+		fds[n].fd = udp->sock[c].fd;
+		fds[n].events = POLLIN;
+		if(udp->sock[c].qhead && udp->inflight < udp->window)
+		{
+			fds[n].events |= POLLOUT;
+		}
+		fds[n].revents = 0;
+		map[n] = c;
+		n++;
+	}
+	if(udp->nretries)
+	{
+		/* Left to udp_process() */
+		fds[n].fd = udp->tcpfd;
+		fds[n].events = POLLIN;
+		fds[n].revents = 0;
+	}
+	if(0 > poll(fds, n + (udp->nretries ? 1 : 0), timeout))
+	{
+		return -1;
+	}
+	for(c = 0; c < n; c++)
+	{
+		if(fds[c].revents & POLLOUT)
+		{
+			udp_flush(udp, map[c]);
+		}
+		if(fds[c].revents & (POLLIN | POLLERR))
+		{
+			udp_receive(udp, map[c]);
+		}
+	}
+	/* Responses open up the window for anything queued */
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		if(udp->sock[c].fd != -1 && udp->sock[c].qhead)
+		{
+			udp_flush(udp, c);
+		}
+	}
+	return 0;
+}
+
+/* Submit whatever has been queued to the io_uring, wait for completions,
+ * and deal with them
+ */
+static int
+udp_wait(struct udp *udp, int timeout)
+{
+	struct pollfd fds[2];
+	uint64_t data;
+	int c, res;
+
+	if(udp->nretries)
+	{
+		/* Submit without waiting, then wait for either completions or
+		 * the retries over TCP
+		 */
+		if(rdns_uring_wait(udp->ring, 0) && errno != EBUSY)
+		{
+			return -1;
+		}
+		fds[0].fd = rdns_uring_fd(udp->ring);
+		fds[1].fd = udp->tcpfd;
+		fds[0].events = fds[1].events = POLLIN;
+		fds[0].revents = fds[1].revents = 0;
+		if(0 > poll(fds, 2, timeout))
+		{
+			return -1;
+		}
+	}
+	else if(rdns_uring_wait(udp->ring, timeout) && errno != ETIME && errno != EBUSY)
+	{
+		return -1;
+	}
+	while(rdns_uring_complete(udp->ring, &data, &res))
+	{
+		udp_completion(udp, data, res);
+	}
+	/* Responses open up the window for anything queued */
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		if(udp->sock[c].fd != -1 && udp->sock[c].qhead)
+		{
+			udp_flush(udp, c);
+		}
+	}
+	return 0;
+}
+
+static void
+udp_completion(struct udp *udp, uint64_t data, int res)
+{
+	struct udp_sock *sock;
+	struct udp_recv *r;
+	struct udp_pending *p, **pp;
+	unsigned int generation;
+	int s, slot;
+
+	if(data & 1)
+	{
+		s = (int) ((data >> 1) / UDP_RECVS);
+		slot = (int) ((data >> 1) % UDP_RECVS);
+		sock = &(udp->sock[s]);
+		r = &(sock->recv[slot]);
+		sock->armed--;
+		generation = sock->generation;
+		if(res > 0 && sock->fd != -1)
+		{
+			udp_response(udp, s, r->buf, res, &(r->from));
+		}
+		/* Delivering the response may have closed the socket, or even
+		 * closed and re-opened it, in which case the slot has already
+		 * been posted again
+		 */
+		if(sock->fd != -1 && sock->generation == generation && res != -ECANCELED)
+		{
+			udp_arm(udp, s, slot);
+		}
+		return;
+	}
+	p = (struct udp_pending *) (uintptr_t) data;
+	p->sending--;
+	if(p->orphaned)
+	{
+		if(!p->sending)
+		{
+			for(pp = &(udp->orphans); *pp; pp = &((*pp)->next))
+			{
+				if(*pp == p)
+				{
+					*pp = p->next;
+					break;
+				}
+			}
+			p->orphaned = 0;
+			udp_release(udp, p);
+		}
+		return;
+	}
+	if(res < 0 && !p->sending && !p->queued)
+	{
+		udp_expire(udp, p);
+	}
+}
+
+static void
+udp_destroy(radiodns_transport_t *transport)
+{
+	struct udp *udp;
+	struct udp_pending *p;
+	struct udp_retry *retry;
+	int c;
+
+	udp = (struct udp *) transport->data;
+	while((p = udp->thead))
+	{
+		udp->thead = p->tnext;
+		rdns_free(NULL, p);
+	}
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		while((p = udp->sock[c].qhead))
+		{
+			udp->sock[c].qhead = p->qnext;
+			rdns_free(NULL, p);
+		}
+	}
+	/* Closing the ring cancels anything still in progress */
+	rdns_uring_destroy(udp->ring);
+	while((p = udp->freelist))
+	{
+		udp->freelist = p->next;
+		rdns_free(NULL, p);
+	}
+	while((p = udp->orphans))
+	{
+		udp->orphans = p->next;
+		rdns_free(NULL, p);
+	}
+	rdns_notify_close(&(udp->notify));
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		if(udp->sock[c].fd != -1)
+		{
+			close(udp->sock[c].fd);
+		}
+		rdns_free(NULL, udp->sock[c].recv);
+	}
+	radiodns_transport_destroy(udp->tcp);
+	while((retry = udp->retries))
+	{
+		udp->retries = retry->next;
+		rdns_free(NULL, retry);
+	}
+	rdns_free(NULL, udp);
+}
+
+/* Assign a query a socket for sending to p->server, moving on to
+ * subsequent servers if no socket can be opened, and queue it for sending
+ */
+static int
+udp_dispatch(struct udp *udp, struct udp_pending *p)
+{
+	struct udp_sock *sock;
+	int c, s;
+
+	s = -1;
+	for(c = 0; c < udp->nservers; c++)
+	{
+		if(-1 != (s = udp_socket(udp, udp->server[p->server].addr.ss_family)))
+		{
+			break;
+		}
+		p->server = (p->server + 1) % udp->nservers;
+	}
+	if(s == -1)
+	{
+		return -1;
+	}
+	sock = &(udp->sock[s]);
+	p->sock = s;
+	p->hashed = 0;
+	p->qnext = NULL;
+	p->queued = 1;
+	if(sock->qtail)
+	{
+		sock->qtail->qnext = p;
+	}
+	else
+	{
+		sock->qhead = p;
+	}
+	sock->qtail = p;
+	sock->qlen++;
+	sock->outstanding++;
+	sock->uses++;
+	p->attempts++;
+	udp->npending++;
+	if(sock->qlen >= UDP_BATCH)
+	{
+		udp_flush(udp, s);
+	}
+	return 0;
+}
+
+/* Pick a socket of the given family at random, preferring those which
+ * aren't due to be replaced
+ */
+static int
+udp_socket(struct udp *udp, int family)
+{
+	struct udp_sock *sock;
+	int base, start, c, s;
+
+	base = (family == AF_INET6 ? UDP_SOCKETS : 0);
+	start = rdns_random(&(udp->seed)) % UDP_SOCKETS;
+	for(c = 0; c < UDP_SOCKETS; c++)
+	{
+		s = base + (start + c) % UDP_SOCKETS;
+		sock = &(udp->sock[s]);
+		/* A closed socket can't be re-opened while receives posted
+		 * to it are still being cancelled
+		 */
+		if(sock->uses >= UDP_MAXUSES || (sock->fd == -1 && sock->armed))
+		{
+			continue;
+		}
+		if(sock->fd == -1 && udp_open(udp, s, family))
+		{
+			return -1;
+		}
+		return s;
+	}
+	for(c = 0; c < UDP_SOCKETS; c++)
+	{
+		s = base + (start + c) % UDP_SOCKETS;
+		if(udp->sock[s].fd != -1)
+		{
+			return s;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+static int
+udp_open(struct udp *udp, int s, int family)
+{
+	struct udp_sock *sock;
+	int fd, flags, size, c;
+
+	sock = &(udp->sock[s]);
+	if(udp->ring && !sock->recv && NULL == (sock->recv = (struct udp_recv *) rdns_calloc(NULL, UDP_RECVS, sizeof(struct udp_recv))))
+	{
+		return -1;
+	}
+	if(-1 == (fd = socket(family, SOCK_DGRAM, 0)))
+	{
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* Responses to a large batch arrive in a burst */
+	size = UDP_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	sock->fd = fd;
+	sock->uses = 0;
+	sock->generation++;
+	if(udp->ring)
+	{
+		for(c = 0; c < UDP_RECVS; c++)
+		{
+			udp_arm(udp, s, c);
+		}
+	}
+	else
+	{
+		rdns_notify_watch(&(udp->notify), fd, RDNS_NOTIFY_READ);
+	}
+	return 0;
+}
+
+/* Close a socket which is due to be replaced, cancelling any receives
+ * posted to it; its buffers remain in use until they complete
+ */
+static void
+udp_close(struct udp *udp, int s)
+{
+	struct udp_sock *sock;
+	int c;
+
+	sock = &(udp->sock[s]);
+	if(udp->ring && sock->armed)
+	{
+		for(c = 0; c < UDP_RECVS; c++)
+		{
+			rdns_uring_cancel(udp->ring, UDP_RECVDATA(s, c));
+		}
+	}
+	rdns_notify_watch(&(udp->notify), sock->fd, 0);
+	close(sock->fd);
+	sock->fd = -1;
+	sock->uses = 0;
+}
+
+/* Post a receive to the io_uring for one of a socket's slots */
+static int
+udp_arm(struct udp *udp, int s, int slot)
+{
+	struct udp_sock *sock;
+	struct udp_recv *r;
+
+	sock = &(udp->sock[s]);
+	r = &(sock->recv[slot]);
+	r->iov.iov_base = r->buf;
+	r->iov.iov_len = UDP_BUFLEN;
+	memset(&(r->mh), 0, sizeof(struct msghdr));
+	r->mh.msg_name = &(r->from);
+	r->mh.msg_namelen = sizeof(struct sockaddr_storage);
+	r->mh.msg_iov = &(r->iov);
+	r->mh.msg_iovlen = 1;
+	if(rdns_uring_recvmsg(udp->ring, sock->fd, &(r->mh), UDP_RECVDATA(s, slot)))
+	{
+		return -1;
+	}
+	sock->armed++;
+	return 0;
+}
+
+/* Send as much of a socket's queue as it and the window will accept */
+static void
+udp_flush(struct udp *udp, int s)
+{
+	struct udp_sock *sock;
+	struct udp_pending *batch[UDP_BATCH], *p;
+	int64_t deadline;
+	unsigned int h;
+	int c, n, r;
+
+	sock = &(udp->sock[s]);
+	while(sock->qhead && udp->inflight < udp->window)
+	{
+		for(n = 0, p = sock->qhead; p && n < UDP_BATCH && udp->inflight + n < udp->window; p = p->qnext)
+		{
+			/* IDs only need to be unique among queries in flight on
+			 * the socket, so aren't assigned until the last moment
+			 */
+			if(!p->hashed)
+			{
+				do
+				{
+					p->id = rdns_random(&(udp->seed)) & 0xFFFF;
+				}
+				while(udp_find(udp, p->id, s));
+				ns_put16(p->id, p->msg);
+				h = UDP_HASH(p->id, s);
+				p->next = udp->pending[h];
+				udp->pending[h] = p;
+				p->hashed = 1;
+			}
+			batch[n++] = p;
+		}
+		deadline = rdns_now() + udp->timeout;
+		if(0 > (r = udp_send(udp, sock->fd, batch, n)))
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			{
+				return;
+			}
+			/* The first message couldn't be sent at all (for example,
+			 * because the server is unreachable): have it treated as
+			 * having timed out
+			 */
+			deadline = 0;
+			r = 1;
+		}
+		for(c = 0; c < r; c++)
+		{
+			sock->qhead = batch[c]->qnext;
+			sock->qlen--;
+			udp_sent(udp, batch[c], deadline);
+		}
+		if(!sock->qhead)
+		{
+			sock->qtail = NULL;
+		}
+	}
+}
+
+/* Send up to n messages, returning the number sent, or -1 if none were.
+ * When using io_uring, the messages are only queued for sending, and any
+ * failure is reported on completion.
+ */
+static int
+udp_send(struct udp *udp, int fd, struct udp_pending **batch, int n)
+{
+	struct udp_server *server;
+	struct udp_pending *p;
+	int c;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+#endif
+
+	if(udp->ring)
+	{
+		for(c = 0; c < n; c++)
+		{
+			p = batch[c];
+			server = &(udp->server[p->server]);
+			p->iov.iov_base = p->msg;
+			p->iov.iov_len = p->msglen;
+			memset(&(p->mh), 0, sizeof(struct msghdr));
+			p->mh.msg_name = &(server->addr);
+			p->mh.msg_namelen = server->addrlen;
+			p->mh.msg_iov = &(p->iov);
+			p->mh.msg_iovlen = 1;
+			if(rdns_uring_sendmsg(udp->ring, fd, &(p->mh), (uint64_t) (uintptr_t) p))
+			{
+				return (c ? c : -1);
+			}
+			p->sending++;
+		}
+		return n;
+	}
+#ifdef HAVE_SENDMMSG
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+	for(c = 0; c < n; c++)
+	{
+		server = &(udp->server[batch[c]->server]);
+		iov[c].iov_base = batch[c]->msg;
+		iov[c].iov_len = batch[c]->msglen;
+		msgs[c].msg_hdr.msg_name = &(server->addr);
+		msgs[c].msg_hdr.msg_namelen = server->addrlen;
+		msgs[c].msg_hdr.msg_iov = &(iov[c]);
+		msgs[c].msg_hdr.msg_iovlen = 1;
+	}
+	return sendmmsg(fd, msgs, n, 0);
+#else
+	for(c = 0; c < n; c++)
+	{
+		p = batch[c];
+		server = &(udp->server[p->server]);
+		if(0 > sendto(fd, p->msg, p->msglen, 0, (struct sockaddr *) &(server->addr), server->addrlen))
+		{
+			return (c ? c : -1);
+		}
+	}
+	return n;
+#endif
+}
+
+/* Receive and deliver everything waiting on a socket */
+static void
+udp_receive(struct udp *udp, int s)
+{
+	struct sockaddr_storage from[UDP_BATCH];
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	int c, r;
+
+	for(;;)
+	{
+		memset(msgs, 0, sizeof(msgs));
+		for(c = 0; c < UDP_BATCH; c++)
+		{
+			iov[c].iov_base = udp->rbuf[c];
+			iov[c].iov_len = UDP_BUFLEN;
+			msgs[c].msg_hdr.msg_name = &(from[c]);
+			msgs[c].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			msgs[c].msg_hdr.msg_iov = &(iov[c]);
+			msgs[c].msg_hdr.msg_iovlen = 1;
+		}
+		if(0 > (r = recvmmsg(udp->sock[s].fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL)))
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return;
+		}
+		/* Delivering responses may result in this socket being closed */
+		for(c = 0; c < r && udp->sock[s].fd != -1; c++)
+		{
+			udp_response(udp, s, udp->rbuf[c], msgs[c].msg_len, &(from[c]));
+		}
+		if(r < UDP_BATCH || udp->sock[s].fd == -1)
+		{
+			return;
+		}
+	}
+#else
+	socklen_t fromlen;
+	ssize_t r;
+
+	while(udp->sock[s].fd != -1)
+	{
+		fromlen = sizeof(struct sockaddr_storage);
+		if(0 > (r = recvfrom(udp->sock[s].fd, udp->rbuf[0], UDP_BUFLEN, MSG_DONTWAIT, (struct sockaddr *) &(from[0]), &fromlen)))
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return;
+		}
+		udp_response(udp, s, udp->rbuf[0], r, &(from[0]));
+	}
+#endif
+}
+
+static void
+udp_response(struct udp *udp, int s, const unsigned char *buf, int len, const struct sockaddr_storage *from)
+{
+	struct udp_server *server;
+	struct udp_pending *p;
+	radiodns_query_t *query;
+	int rcode, rtt;
+
+	if(len < NS_HFIXEDSZ || !(buf[2] & 0x80))
+	{
+		return;
+	}
+	if(!(p = udp_find(udp, ns_get16(buf), s)) ||
+	   !udp_sameaddr(from, &(udp->server[p->server].addr)) ||
+	   !udp_samequestion(p, buf, len))
+	{
+		return;
+	}
+	rtt = (int) (rdns_now() - p->sent);
+	server = &(udp->server[p->server]);
+	server->responses++;
+	udp_measure(server, rtt);
+	if(udp->window < UDP_MAXWINDOW)
+	{
+		udp->window++;
+	}
+	if(udp->budget)
+	{
+		udp_rtt(udp, rtt);
+	}
+	udp_unlink(udp, p);
+	rcode = buf[3] & 0x0f;
+	if(rcode != ns_r_servfail && rcode != ns_r_notimpl && rcode != ns_r_refused)
+	{
+		server->failures = 0;
+		server->retryat = 0;
+	}
+	else
+	{
+		server->failures++;
+		udp_backoff(server, rdns_now());
+		if(p->hedge)
+		{
+			/* Leave it to the other copy */
+			udp_drop(udp, p);
+			return;
+		}
+		if(p->attempts < udp->nservers)
+		{
+			/* Give another server a chance, as res_send() would */
+			p->server = udp_pick(udp, p->server);
+			if(!udp_dispatch(udp, p))
+			{
+				return;
+			}
+		}
+	}
+	query = p->query;
+	query->_pending = NULL;
+	udp_unhedge(udp, p);
+	udp_release(udp, p);
+	if(buf[2] & 0x02)
+	{
+		if(udp_truncated(udp, query))
+		{
+			/* Completed once the retry is answered */
+			return;
+		}
+	}
+	else
+	{
+		rdns_answer(query, buf, len);
+	}
+	if(query->complete)
+	{
+		query->complete(query);
+	}
+}
+
+static int
+udp_sameaddr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *a4, *b4;
+	const struct sockaddr_in6 *a6, *b6;
+
+	if(a->ss_family != b->ss_family)
+	{
+		return 0;
+	}
+	if(a->ss_family == AF_INET)
+	{
+		a4 = (const struct sockaddr_in *) a;
+		b4 = (const struct sockaddr_in *) b;
+		return (a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+	}
+	if(a->ss_family == AF_INET6)
+	{
+		a6 = (const struct sockaddr_in6 *) a;
+		b6 = (const struct sockaddr_in6 *) b;
+		return (a6->sin6_port == b6->sin6_port && !memcmp(&(a6->sin6_addr), &(b6->sin6_addr), sizeof(struct in6_addr)));
+	}
+	return 0;
+}
+
+/* Check that a response repeats the question which was asked; the query
+ * consists only of a header and the question, so the bytes following the
+ * header must match (other than in case)
+ */
+static int
+udp_samequestion(const struct udp_pending *p, const unsigned char *buf, int len)
+{
+	int c;
+
+	if(len < p->msglen || ns_get16(buf + 2 * NS_INT16SZ) != 1)
+	{
+		return 0;
+	}
+	for(c = NS_HFIXEDSZ; c < p->msglen; c++)
+	{
+		if(buf[c] != p->msg[c] && tolower(buf[c]) != tolower(p->msg[c]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Truncated responses are retried over TCP. The retry is submitted to a
+ * TCP transport driven alongside the sockets, by udp_process() and
+ * through udp_fd(), and completes the query once it's answered. Returns
+ * non-zero if the retry is under way, or zero if the query is already
+ * complete: because it failed, or because the TCP transport has no
+ * descriptor to wait upon, and so the retry was performed there and then.
+ */
+static int
+udp_truncated(struct udp *udp, radiodns_query_t *query)
+{
+	struct udp_retry *retry;
+	radiodns_query_t q;
+
+	query->len = -1;
+	query->herrno = TRY_AGAIN;
+	if(!udp->tcp && !(udp->tcp = radiodns_transport_tcp()))
+	{
+		return 0;
+	}
+	if(udp->tcpfd == -1 && -1 == (udp->tcpfd = udp->tcp->fd(udp->tcp)))
+	{
+		q = *query;
+		if(!rdns_batch(udp->tcp, &q, 1))
+		{
+			query->len = q.len;
+			query->herrno = q.herrno;
+		}
+		return 0;
+	}
+	if(NULL == (retry = (struct udp_retry *) rdns_malloc(NULL, sizeof(struct udp_retry))))
+	{
+		return 0;
+	}
+	retry->udp = udp;
+	retry->query = query;
+	retry->q = *query;
+	retry->q.complete = udp_retried;
+	retry->q.data = retry;
+	retry->q._pending = NULL;
+	if(udp->tcp->submit(udp->tcp, &(retry->q)))
+	{
+		rdns_free(NULL, retry);
+		return 0;
+	}
+	retry->next = udp->retries;
+	udp->retries = retry;
+	if(!udp->nretries++)
+	{
+		rdns_notify_watch(&(udp->notify), udp->tcpfd, RDNS_NOTIFY_READ);
+	}
+	return 1;
+}
+
+/* Complete a query with the answer to its retry over TCP */
+static void
+udp_retried(radiodns_query_t *q)
+{
+	struct udp_retry *retry;
+	radiodns_query_t *query;
+
+	retry = (struct udp_retry *) q->data;
+	query = retry->query;
+	query->len = q->len;
+	query->herrno = q->herrno;
+	query->err = q->err;
+	udp_unretry(retry->udp, retry);
+	if(query->complete)
+	{
+		query->complete(query);
+	}
+}
+
+static void
+udp_unretry(struct udp *udp, struct udp_retry *retry)
+{
+	struct udp_retry **rp;
+
+	for(rp = &(udp->retries); *rp; rp = &((*rp)->next))
+	{
+		if(*rp == retry)
+		{
+			*rp = retry->next;
+			break;
+		}
+	}
+	rdns_free(NULL, retry);
+	if(!--udp->nretries)
+	{
+		/* An idle connection which the server closes would otherwise
+		 * keep waking the event loop
+		 */
+		rdns_notify_watch(&(udp->notify), udp->tcpfd, 0);
+	}
+}
+
+static struct udp_pending *
+udp_find(struct udp *udp, unsigned int id, int s)
+{
+	struct udp_pending *p;
+
+	for(p = udp->pending[UDP_HASH(id, s)]; p; p = p->next)
+	{
+		if(p->id == id && p->sock == s)
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Remove an outstanding query from the hash table, and from either the
+ * list of deadlines or its socket's send queue, closing the socket if
+ * it's due to be replaced and no longer in use
+ */
+static void
+udp_unlink(struct udp *udp, struct udp_pending *p)
+{
+	struct udp_pending **pp, *prev;
+	struct udp_sock *sock;
+
+	for(pp = &(udp->pending[UDP_HASH(p->id, p->sock)]); p->hashed && *pp; pp = &((*pp)->next))
+	{
+		if(*pp == p)
+		{
+			*pp = p->next;
+			break;
+		}
+	}
+	p->hashed = 0;
+	sock = &(udp->sock[p->sock]);
+	if(p->waiting)
+	{
+		udp_unwait(udp, p);
+	}
+	if(!p->queued)
+	{
+		if(p->tprev)
+		{
+			p->tprev->tnext = p->tnext;
+		}
+		else
+		{
+			udp->thead = p->tnext;
+		}
+		if(p->tnext)
+		{
+			p->tnext->tprev = p->tprev;
+		}
+		else
+		{
+			udp->ttail = p->tprev;
+		}
+		udp->inflight--;
+	}
+	else
+	{
+		prev = NULL;
+		for(pp = &(sock->qhead); *pp; pp = &((*pp)->qnext))
+		{
+			if(*pp == p)
+			{
+				*pp = p->qnext;
+				break;
+			}
+			prev = *pp;
+		}
+		if(sock->qtail == p)
+		{
+			sock->qtail = prev;
+		}
+		sock->qlen--;
+		p->queued = 0;
+	}
+	sock->outstanding--;
+	udp->npending--;
+	if(!sock->outstanding && sock->uses >= UDP_MAXUSES)
+	{
+		udp_close(udp, p->sock);
+	}
+}
+
+/* Record that a query has been sent (or given up on, if deadline is
+ * zero), adding it to the list of deadlines. Each attempt has the same
+ * timeout, so the list is kept in order by appending to it; a query which
+ * has already failed goes at the front.
+ */
+static void
+udp_sent(struct udp *udp, struct udp_pending *p, int64_t deadline)
+{
+	p->qnext = NULL;
+	p->queued = 0;
+	p->deadline = deadline;
+	p->sent = deadline - udp->timeout;
+	if(deadline)
+	{
+		udp->server[p->server].queries++;
+	}
+	if(udp->budget && deadline && p->attempts == 1 && !p->hedge && udp->nservers > 1)
+	{
+		/* Hedged only if the first attempt goes unanswered, and only if
+		 * there is another nameserver to send the copy to: the same one
+		 * would most likely be slow again
+		 */
+		p->hedgeat = p->sent + udp->hedgedelay;
+		p->hnext = NULL;
+		p->hprev = udp->htail;
+		if(udp->htail)
+		{
+			udp->htail->hnext = p;
+		}
+		else
+		{
+			udp->hhead = p;
+		}
+		udp->htail = p;
+		p->waiting = 1;
+	}
+	if(!deadline)
+	{
+		p->tprev = NULL;
+		p->tnext = udp->thead;
+		if(udp->thead)
+		{
+			udp->thead->tprev = p;
+		}
+		else
+		{
+			udp->ttail = p;
+		}
+		udp->thead = p;
+	}
+	else
+	{
+		p->tnext = NULL;
+		p->tprev = udp->ttail;
+		if(udp->ttail)
+		{
+			udp->ttail->tnext = p;
+		}
+		else
+		{
+			udp->thead = p;
+		}
+		udp->ttail = p;
+	}
+	udp->inflight++;
+}
+
+/* Move a query which has been sent to the front of the list of deadlines,
+ * so that it's treated as having timed out
+ */
+static void
+udp_expire(struct udp *udp, struct udp_pending *p)
+{
+	udp->inflight--;
+	if(p->tprev)
+	{
+		p->tprev->tnext = p->tnext;
+	}
+	else
+	{
+		udp->thead = p->tnext;
+	}
+	if(p->tnext)
+	{
+		p->tnext->tprev = p->tprev;
+	}
+	else
+	{
+		udp->ttail = p->tprev;
+	}
+	udp_sent(udp, p, 0);
+}
+
+/* Complete everything unsuccessfully */
+static void
+udp_failall(struct udp *udp)
+{
+	struct udp_pending *p;
+	int c;
+
+	for(c = 0; c < UDP_SOCKETS * 2; c++)
+	{
+		while((p = udp->sock[c].qhead))
+		{
+			udp_unlink(udp, p);
+			udp_fail(udp, p, NETDB_INTERNAL);
+		}
+	}
+	while((p = udp->thead))
+	{
+		udp_unlink(udp, p);
+		udp_fail(udp, p, NETDB_INTERNAL);
+	}
+}
+
+/* Complete an unlinked query unsuccessfully */
+static void
+udp_fail(struct udp *udp, struct udp_pending *p, int herrno)
+{
+	radiodns_query_t *query;
+
+	query = p->query;
+	query->_pending = NULL;
+	udp_unhedge(udp, p);
+	udp_release(udp, p);
+	query->len = -1;
+	query->herrno = herrno;
+	if(query->complete)
+	{
+		query->complete(query);
+	}
+}
+
+static void
+udp_release(struct udp *udp, struct udp_pending *p)
+{
+	/* The message can't be re-used while io_uring might still be
+	 * sending it
+	 */
+	if(p->sending)
+	{
+		p->orphaned = 1;
+		p->next = udp->orphans;
+		udp->orphans = p;
+		return;
+	}
+	p->next = udp->freelist;
+	udp->freelist = p;
+}
+
+/* Return the time by which udp_process() must next be called, or -1 */
+static int64_t
+udp_next(struct udp *udp)
+{
+	int64_t next;
+
+	next = (udp->thead ? udp->thead->deadline : -1);
+	if(udp->hhead && (next == -1 || udp->hhead->hedgeat < next))
+	{
+		next = udp->hhead->hedgeat;
+	}
+	return next;
+}
+
+/* Send a copy of each query whose time to be hedged has come, to the next
+ * server, for as long as there's credit to
+ */
+static void
+udp_hedge(struct udp *udp, int64_t now)
+{
+	struct udp_pending *p, *h;
+
+	while((p = udp->hhead) && p->hedgeat <= now)
+	{
+		udp_unwait(udp, p);
+		if(udp->credit < 100)
+		{
+			continue;
+		}
+		if((h = udp->freelist))
+		{
+			udp->freelist = h->next;
+		}
+		else if(NULL == (h = (struct udp_pending *) rdns_malloc(NULL, sizeof(struct udp_pending))))
+		{
+			continue;
+		}
+		memcpy(h->msg, p->msg, p->msglen);
+		h->msglen = p->msglen;
+		h->query = p->query;
+		h->sending = 0;
+		h->orphaned = 0;
+		h->hedge = NULL;
+		h->waiting = 0;
+		/* The copy is never re-sent itself */
+		h->attempts = UDP_MAXATTEMPTS - 1;
+		h->server = udp_pick(udp, p->server);
+		if(udp_dispatch(udp, h))
+		{
+			udp_release(udp, h);
+			continue;
+		}
+		udp->server[h->server].hedges++;
+		h->hedge = p;
+		p->hedge = h;
+		udp->credit -= 100;
+	}
+}
+
+/* Remove a query from the list of those waiting to be hedged */
+static void
+udp_unwait(struct udp *udp, struct udp_pending *p)
+{
+	if(p->hprev)
+	{
+		p->hprev->hnext = p->hnext;
+	}
+	else
+	{
+		udp->hhead = p->hnext;
+	}
+	if(p->hnext)
+	{
+		p->hnext->hprev = p->hprev;
+	}
+	else
+	{
+		udp->htail = p->hprev;
+	}
+	p->waiting = 0;
+}
+
+/* Abandon the other copy of a query which is being completed */
+static void
+udp_unhedge(struct udp *udp, struct udp_pending *p)
+{
+	struct udp_pending *h;
+
+	if(!(h = p->hedge))
+	{
+		return;
+	}
+	p->hedge = NULL;
+	h->hedge = NULL;
+	udp_unlink(udp, h);
+	udp_release(udp, h);
+}
+
+/* Give up on one copy of a hedged query, which has been unlinked, leaving
+ * the query to the other
+ */
+static void
+udp_drop(struct udp *udp, struct udp_pending *p)
+{
+	struct udp_pending *h;
+
+	h = p->hedge;
+	p->hedge = NULL;
+	h->hedge = NULL;
+	p->query->_pending = h;
+	udp_release(udp, p);
+}
+
+/* Record the time a response took, and every so often, re-estimate how
+ * long nine in ten take
+ */
+static void
+udp_rtt(struct udp *udp, int rtt)
+{
+	int sorted[UDP_RTTSAMPLES];
+	int c, d, n, v;
+
+	udp->rtt[udp->nrtt++ % UDP_RTTSAMPLES] = rtt;
+	if(udp->nrtt % (UDP_RTTSAMPLES / 4))
+	{
+		return;
+	}
+	n = (udp->nrtt < UDP_RTTSAMPLES ? (int) udp->nrtt : UDP_RTTSAMPLES);
+	for(c = 0; c < n; c++)
+	{
+		v = udp->rtt[c];
+		for(d = c; d > 0 && sorted[d - 1] > v; d--)
+		{
+			sorted[d] = sorted[d - 1];
+		}
+		sorted[d] = v;
+	}
+	v = sorted[n * 9 / 10];
+	udp->hedgedelay = (v > UDP_MINHEDGE ? v : UDP_MINHEDGE);
+}
+
+/* Choose a server to send a query to, other than exclude (if there's any
+ * choice): the best, unless it's time to probe another
+ */
+static int
+udp_pick(struct udp *udp, int exclude)
+{
+	int64_t now;
+	int c;
+
+	if(udp->nservers == 1)
+	{
+		return 0;
+	}
+	now = rdns_now();
+	if(now >= udp->probeat)
+	{
+		udp->probeat = now + UDP_PROBEINTERVAL;
+		for(c = 0; c < udp->nservers; c++)
+		{
+			udp->probe = (udp->probe + 1) % udp->nservers;
+			if(udp->probe != exclude && udp->server[udp->probe].retryat <= now)
+			{
+				return udp->probe;
+			}
+		}
+	}
+	return udp_best(udp, exclude);
+}
+
+/* Return the server with the lowest smoothed RTT, preferring those which
+ * aren't failing (or if all are, those failing least); servers which
+ * haven't been measured yet come first, so that every server is tried
+ */
+static int
+udp_best(struct udp *udp, int exclude)
+{
+	struct udp_server *a, *b;
+	int c, best;
+
+	best = -1;
+	for(c = 0; c < udp->nservers; c++)
+	{
+		if(c == exclude && udp->nservers > 1)
+		{
+			continue;
+		}
+		if(best == -1)
+		{
+			best = c;
+			continue;
+		}
+		a = &(udp->server[c]);
+		b = &(udp->server[best]);
+		if(a->failures >= UDP_MAXFAILURES || b->failures >= UDP_MAXFAILURES)
+		{
+			if(a->failures < b->failures)
+			{
+				best = c;
+			}
+			continue;
+		}
+		if(a->srtt < b->srtt)
+		{
+			best = c;
+		}
+	}
+	return best;
+}
+
+/* Update a server's smoothed RTT and deviation as RFC 6298 does */
+static void
+udp_measure(struct udp_server *server, int rtt)
+{
+	int delta;
+
+	if(rtt < 0)
+	{
+		rtt = 0;
+	}
+	if(!server->measured)
+	{
+		server->srtt = rtt * 8;
+		server->rttvar = rtt * 2;
+		server->measured = 1;
+		return;
+	}
+	delta = rtt - server->srtt / 8;
+	server->srtt += delta;
+	if(delta < 0)
+	{
+		delta = -delta;
+	}
+	server->rttvar += delta - server->rttvar / 4;
+}
+
+/* Once a server is failing, probe it less often the longer it keeps on
+ * failing, up to once a minute
+ */
+static void
+udp_backoff(struct udp_server *server, int64_t now)
+{
+	int shift;
+
+	if(server->failures < UDP_MAXFAILURES)
+	{
+		return;
+	}
+	shift = server->failures - UDP_MAXFAILURES;
+	if(shift > 6)
+	{
+		shift = 6;
+	}
+	server->retryat = now + ((int64_t) UDP_PROBEINTERVAL << shift);
+}
+
+/* Describe each of a UDP transport's nameservers */
+int
+radiodns_transport_servers(radiodns_transport_t *transport, radiodns_server_stats_t *stats, int max)
+{
+	struct udp *udp;
+	struct udp_server *server;
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	char buf[INET6_ADDRSTRLEN];
+	int c, best;
+
+	if(!transport || transport->submit != udp_submit)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	udp = (struct udp *) transport->data;
+	best = udp_best(udp, -1);
+	for(c = 0; c < udp->nservers && c < max; c++)
+	{
+		server = &(udp->server[c]);
+		buf[0] = 0;
+		if(server->addr.ss_family == AF_INET6)
+		{
+			sin6 = (const struct sockaddr_in6 *) &(server->addr);
+			inet_ntop(AF_INET6, &(sin6->sin6_addr), buf, sizeof(buf));
+			snprintf(stats[c].addr, sizeof(stats[c].addr), "[%s]:%u", buf, ntohs(sin6->sin6_port));
+		}
+		else
+		{
+			sin = (const struct sockaddr_in *) &(server->addr);
+			inet_ntop(AF_INET, &(sin->sin_addr), buf, sizeof(buf));
+			snprintf(stats[c].addr, sizeof(stats[c].addr), "%s:%u", buf, ntohs(sin->sin_port));
+		}
+		stats[c].srtt = (server->measured ? server->srtt / 8 : -1);
+		stats[c].rttvar = (server->measured ? server->rttvar / 4 : -1);
+		stats[c].failures = server->failures;
+		stats[c].queries = server->queries;
+		stats[c].responses = server->responses;
+		stats[c].timeouts = server->timeouts;
+		stats[c].hedges = server->hedges;
+		stats[c].preferred = (c == best);
+	}
+	return udp->nservers;
+}
@@ -0,0 +1,466 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* radiodns-unescape-bench: compare the speed of TXT parameter and label
+ * unescaping using each of the implementations in unescape.c against the
+ * byte-at-a-time loops the resolver used to use, checking that they all
+ * produce the same results. This isn't installed; build it with
+ * 'make radiodns-unescape-bench'.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+
+#include "p_radiodns.h"
+
+/* Size of the output buffer each implementation writes to */
+#define BENCH_BUFLEN                    (2 * 1024 * 1024)
+
+struct corpus
+{
+	char **strings;
+	size_t *lengths;
+	size_t count;
+	size_t bytes;
+};
+
+static struct
+{
+	const char *name;
+	int impl;
+} impls[] = {
+	{ "original", -1 },
+	{ "scalar", RDNS_UNESCAPE_SCALAR },
+	{ "sse2", RDNS_UNESCAPE_SSE2 },
+	{ "avx2", RDNS_UNESCAPE_AVX2 },
+	{ NULL, 0 }
+};
+
+static const char *progname = "radiodns-unescape-bench";
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] [IMPLEMENTATION ...]\n\n", progname);
+	fprintf(stderr, "Unescapes a generated set of TXT record strings and PTR target names using\n"
+			"each IMPLEMENTATION in turn, and reports the rate achieved.\n\n");
+	fprintf(stderr, "OPTIONS is one or more of:\n");
+	fprintf(stderr, " -n COUNT      Unescape each set COUNT times (default: 2000)\n");
+	fprintf(stderr, " -l LENGTH     Generate strings of around LENGTH bytes (default: 200)\n\n");
+	fprintf(stderr, "IMPLEMENTATION is one of original, scalar, sse2 or avx2 (default: all of them)\n");
+}
+
+/* The parameter parsing loop from app_parse_params() as it was, writing
+ * each key and value NUL-terminated to p
+ */
+static size_t
+original_params(char *p, const char *txtrec)
+{
+	char *start;
+	const char *t;
+	int c;
+	char hbuf[3];
+
+	start = p;
+	while(*txtrec)
+	{
+		while(isspace(*txtrec))
+		{
+			txtrec++;
+		}
+		if(!*txtrec)
+		{
+			break;
+		}
+		for(t = txtrec; *t && *t != '='; t++);
+		if(!*t)
+		{
+			break;
+		}
+		t = txtrec;
+		while(*t && *t != '=' && !isspace(*t))
+		{
+			if(*t == '%' && isxdigit(t[1]) && isxdigit(t[2]))
+			{
+				hbuf[0] = t[1];
+				hbuf[1] = t[2];
+				hbuf[2] = 0;
+				c = strtol(hbuf, NULL, 16);
+				*p = c;
+				p++;
+				t += 3;
+				continue;
+			}
+			*p = *t;
+			p++;
+			t++;
+		}
+		*p = 0;
+		p++;
+		while(*t != '=')
+		{
+			t++;
+		}
+		t++;
+		while(*t && !isspace(*t))
+		{
+			if(*t == '%' && isxdigit(t[1]) && isxdigit(t[2]))
+			{
+				hbuf[0] = t[1];
+				hbuf[1] = t[2];
+				hbuf[2] = 0;
+				c = strtol(hbuf, NULL, 16);
+				*p = c;
+				p++;
+				t += 3;
+				continue;
+			}
+			*p = *t;
+			p++;
+			t++;
+		}
+		*p = 0;
+		p++;
+		txtrec = t;
+	}
+	return p - start;
+}
+
+/* The same, as app_parse_params() now does it */
+static size_t
+unescape_params(char *p, const char *txt, size_t len)
+{
+	char *start;
+	const char *t, *end;
+	size_t n;
+
+	start = p;
+	end = txt + len;
+	while(txt < end)
+	{
+		while(txt < end && isspace((unsigned char) *txt))
+		{
+			txt++;
+		}
+		if(NULL == (t = memchr(txt, '=', end - txt)))
+		{
+			break;
+		}
+		rdns_unescape_param(p, &n, txt, t - txt, 1);
+		p += n;
+		*p = 0;
+		p++;
+		t++;
+		t += rdns_unescape_param(p, &n, t, end - t, 0);
+		p += n;
+		*p = 0;
+		p++;
+		txt = t;
+	}
+	return p - start;
+}
+
+/* The label decoding loop from app_parse_ptr() as it was */
+static size_t
+original_label(char *d, const char *p)
+{
+	char dbuf[4], *start;
+	int c;
+
+	start = d;
+	while(*p && *p != '.')
+	{
+		if(*p == '\\' && isdigit(p[1]) && isdigit(p[2]) && isdigit(p[3]))
+		{
+			dbuf[0] = p[1];
+			dbuf[1] = p[2];
+			dbuf[2] = p[3];
+			dbuf[3] = 0;
+			c = strtol(dbuf, NULL, 10);
+			*d = c;
+			d++;
+			p += 4;
+			continue;
+		}
+		else if(*p == '\\' && p[1])
+		{
+			p++;
+		}
+		*d = *p;
+		d++;
+		p++;
+	}
+	return d - start;
+}
+
+/* A deterministic xorshift generator, so that every run unescapes the
+ * same strings
+ */
+static uint32_t
+bench_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (uint32_t) (*state >> 32);
+}
+
+/* Append a random run of len bytes drawn from chars to buf */
+static char *
+append_run(char *buf, size_t len, const char *chars, uint64_t *state)
+{
+	size_t c, nchars;
+
+	nchars = strlen(chars);
+	for(c = 0; c < len; c++)
+	{
+		*buf = chars[bench_random(state) % nchars];
+		buf++;
+	}
+	return buf;
+}
+
+/* Generate TXT record strings resembling DNS-SD metadata: several
+ * key=value pairs, mostly URLs and descriptive text, with the occasional
+ * %XX escape
+ */
+static int
+make_params(struct corpus *corpus, size_t count, size_t length, uint64_t *state)
+{
+	static const char *keys[] = { "url", "lang", "desc", "logo", "path", "schedule", "genre", "txtvers" };
+	static const char *plain = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789/:.-_";
+	static const char *escapes[] = { "%20", "%3D", "%25", "%2c", "%" };
+	char *p, *end;
+	size_t c;
+
+	for(c = 0; c < count; c++)
+	{
+		if(NULL == (p = corpus->strings[corpus->count] = (char *) malloc(length + 64)))
+		{
+			return -1;
+		}
+		end = p + length;
+		while(p < end)
+		{
+			p += sprintf(p, "%s%s=", (p == corpus->strings[corpus->count] ? "" : " "), keys[bench_random(state) % 8]);
+			while(p < end && bench_random(state) % 4)
+			{
+				p = append_run(p, 8 + bench_random(state) % 24, plain, state);
+				if(!(bench_random(state) % 3))
+				{
+					p += sprintf(p, "%s", escapes[bench_random(state) % 5]);
+				}
+			}
+		}
+		*p = 0;
+		corpus->lengths[corpus->count] = p - corpus->strings[corpus->count];
+		corpus->bytes += corpus->lengths[corpus->count];
+		corpus->count++;
+	}
+	return 0;
+}
+
+/* Generate PTR target names whose first labels are service instance names,
+ * with spaces and punctuation escaped as \DDD
+ */
+static int
+make_labels(struct corpus *corpus, size_t count, size_t length, uint64_t *state)
+{
+	static const char *plain = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-";
+	static const char *escapes[] = { "\\032", "\\046", "\\.", "\\\\" };
+	char *p, *end;
+	size_t c;
+
+	if(length > 63 * 4)
+	{
+		length = 63 * 4;
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(NULL == (p = corpus->strings[corpus->count] = (char *) malloc(length + 64)))
+		{
+			return -1;
+		}
+		end = p + length;
+		while(p < end)
+		{
+			p = append_run(p, 4 + bench_random(state) % 12, plain, state);
+			p += sprintf(p, "%s", escapes[bench_random(state) % 4]);
+		}
+		p += sprintf(p, "._radiovis._tcp.example.com");
+		corpus->lengths[corpus->count] = strlen(corpus->strings[corpus->count]);
+		corpus->bytes += corpus->lengths[corpus->count];
+		corpus->count++;
+	}
+	return 0;
+}
+
+static size_t
+run(int impl, int labels, struct corpus *corpus, char *out)
+{
+	size_t c, n;
+
+	n = 0;
+	for(c = 0; c < corpus->count; c++)
+	{
+		if(labels)
+		{
+			n += (impl < 0 ? original_label(out + n, corpus->strings[c]) : rdns_unescape_label(out + n, corpus->strings[c], corpus->lengths[c]));
+		}
+		else
+		{
+			n += (impl < 0 ? original_params(out + n, corpus->strings[c]) : unescape_params(out + n, corpus->strings[c], corpus->lengths[c]));
+		}
+	}
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *sets[] = { "params", "labels" };
+	struct corpus corpus[2];
+	struct timespec start, end;
+	char *expect, *out, *t;
+	size_t c, count, length, n, elen;
+	uint64_t state;
+	double elapsed, base;
+	int d, i, first;
+
+	if(argv[0])
+	{
+		if((t = strrchr(argv[0], '/')))
+		{
+			progname = t + 1;
+		}
+		else
+		{
+			progname = argv[0];
+		}
+	}
+	count = 2000;
+	length = 200;
+	while(-1 != (d = getopt(argc, argv, "hn:l:")))
+	{
+		switch(d)
+		{
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			length = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if(!count || !length || length > 4096)
+	{
+		usage();
+		return 1;
+	}
+	state = 0x9e3779b97f4a7c15ULL;
+	expect = (char *) malloc(BENCH_BUFLEN);
+	out = (char *) malloc(BENCH_BUFLEN);
+	memset(corpus, 0, sizeof(corpus));
+	for(i = 0; i < 2; i++)
+	{
+		corpus[i].strings = (char **) calloc(256, sizeof(char *));
+		corpus[i].lengths = (size_t *) calloc(256, sizeof(size_t));
+		if(!corpus[i].strings || !corpus[i].lengths)
+		{
+			break;
+		}
+	}
+	if(!expect || !out || i < 2 ||
+	   make_params(&corpus[0], 256, length, &state) ||
+	   make_labels(&corpus[1], 256, length, &state))
+	{
+		fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+		return 1;
+	}
+	printf("%-8s %-10s %10s %10s %10s %10s\n", "SET", "IMPL", "STRINGS", "SECONDS", "MB/SEC", "SPEEDUP");
+	first = optind;
+	for(i = 0; i < 2; i++)
+	{
+		elen = run(-1, i, &corpus[i], expect);
+		base = 0;
+		for(d = 0; impls[d].name; d++)
+		{
+			if(first < argc)
+			{
+				for(optind = first; optind < argc; optind++)
+				{
+					if(!strcmp(argv[optind], impls[d].name))
+					{
+						break;
+					}
+				}
+				if(optind == argc)
+				{
+					continue;
+				}
+			}
+			if(impls[d].impl >= 0 && rdns_unescape_impl(impls[d].impl))
+			{
+				printf("%-8s %-10s %10s\n", sets[i], impls[d].name, "unsupported");
+				continue;
+			}
+			n = run(impls[d].impl, i, &corpus[i], out);
+			if(n != elen || memcmp(out, expect, n))
+			{
+				fprintf(stderr, "%s: %s: %s: results differ from the original\n", progname, sets[i], impls[d].name);
+				return 1;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for(c = 0; c < count; c++)
+			{
+				run(impls[d].impl, i, &corpus[i], out);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			if(impls[d].impl < 0)
+			{
+				base = elapsed;
+			}
+			printf("%-8s %-10s %10lu %10.3f %10.1f", sets[i], impls[d].name, (unsigned long) (count * corpus[i].count), elapsed,
+				   (elapsed > 0 ? count * corpus[i].bytes / elapsed / 1e6 : 0));
+			if(base > 0 && elapsed > 0)
+			{
+				printf(" %9.2fx", base / elapsed);
+			}
+			putchar('\n');
+		}
+	}
+	for(i = 0; i < 2; i++)
+	{
+		for(c = 0; c < corpus[i].count; c++)
+		{
+			free(corpus[i].strings[c]);
+		}
+		free(corpus[i].strings);
+		free(corpus[i].lengths);
+	}
+	free(expect);
+	free(out);
+	return 0;
+}
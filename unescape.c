@@ -0,0 +1,374 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Unescaping of TXT record parameters (%XX) and presentation-format DNS
+ * labels (\DDD and \X). Almost all of the bytes in either are copied
+ * verbatim, so the work is in finding the few which aren't: that's done
+ * 32 bytes at a time with AVX2, or 16 with SSE2, where the processor
+ * supports them, and a byte at a time otherwise.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define UNESCAPE_X86                   1
+# include <immintrin.h>
+#endif
+
+typedef size_t (*copy_param_fn)(char *dest, const char *src, size_t len, int eq);
+typedef size_t (*copy_label_fn)(char *dest, const char *src, size_t len);
+
+static size_t copy_param_scalar(char *dest, const char *src, size_t len, int eq);
+static size_t copy_label_scalar(char *dest, const char *src, size_t len);
+#ifdef UNESCAPE_X86
+static size_t copy_param_sse2(char *dest, const char *src, size_t len, int eq);
+static size_t copy_label_sse2(char *dest, const char *src, size_t len);
+static size_t copy_param_avx2(char *dest, const char *src, size_t len, int eq);
+static size_t copy_label_avx2(char *dest, const char *src, size_t len);
+#endif
+static void unescape_init(void);
+static int hexval(int c);
+
+static copy_param_fn copy_param;
+static copy_label_fn copy_label;
+
+/* Select the implementation used, returning -1 if the processor doesn't
+ * support it; RDNS_UNESCAPE_AUTO picks the best available
+ */
+int
+rdns_unescape_impl(int impl)
+{
+	copy_param_fn param;
+	copy_label_fn label;
+
+	switch(impl)
+	{
+	case RDNS_UNESCAPE_AUTO:
+		param = NULL;
+		label = NULL;
+		break;
+	case RDNS_UNESCAPE_SCALAR:
+		param = copy_param_scalar;
+		label = copy_label_scalar;
+		break;
+#ifdef UNESCAPE_X86
+	case RDNS_UNESCAPE_SSE2:
+		if(!__builtin_cpu_supports("sse2"))
+		{
+			return -1;
+		}
+		param = copy_param_sse2;
+		label = copy_label_sse2;
+		break;
+	case RDNS_UNESCAPE_AVX2:
+		if(!__builtin_cpu_supports("avx2"))
+		{
+			return -1;
+		}
+		param = copy_param_avx2;
+		label = copy_label_avx2;
+		break;
+#endif
+	default:
+		errno = ENOSYS;
+		return -1;
+	}
+	__atomic_store_n(&copy_label, label, __ATOMIC_RELAXED);
+	__atomic_store_n(&copy_param, param, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Copy src to dest, decoding %XX escapes, until reaching a NUL, white
+ * space, the end of src, or (if eq is non-zero) an '='. Returns the number
+ * of bytes of src consumed, storing the number written in *destlen. dest
+ * must have room for len bytes: the copy is done a vector at a time, so
+ * bytes beyond those written may be overwritten.
+ */
+size_t
+rdns_unescape_param(char *dest, size_t *destlen, const char *src, size_t len, int eq)
+{
+	copy_param_fn copy;
+	size_t i, o, n;
+	int hi, lo;
+
+	if(!(copy = __atomic_load_n(&copy_param, __ATOMIC_RELAXED)))
+	{
+		unescape_init();
+		copy = __atomic_load_n(&copy_param, __ATOMIC_RELAXED);
+	}
+	/* Decoding escapes only ever shrinks the output, so dest + o never
+	 * gets ahead of src + i, and a vector stored at the former stays
+	 * within len bytes of dest
+	 */
+	i = 0;
+	o = 0;
+	for(;;)
+	{
+		n = copy(dest + o, src + i, len - i, eq);
+		i += n;
+		o += n;
+		if(i == len || src[i] != '%')
+		{
+			break;
+		}
+		if(i + 2 < len && -1 != (hi = hexval(src[i + 1])) && -1 != (lo = hexval(src[i + 2])))
+		{
+			dest[o++] = (char) ((hi << 4) | lo);
+			i += 3;
+			continue;
+		}
+		/* Not an escape after all */
+		dest[o++] = '%';
+		i++;
+	}
+	*destlen = o;
+	return i;
+}
+
+/* Copy the first label of the presentation-format name src to dest,
+ * decoding \DDD and \X escapes, and returning the number of bytes written;
+ * as above, dest must have room for len bytes
+ */
+size_t
+rdns_unescape_label(char *dest, const char *src, size_t len)
+{
+	copy_label_fn copy;
+	size_t i, o, n;
+
+	if(!(copy = __atomic_load_n(&copy_label, __ATOMIC_RELAXED)))
+	{
+		unescape_init();
+		copy = __atomic_load_n(&copy_label, __ATOMIC_RELAXED);
+	}
+	i = 0;
+	o = 0;
+	for(;;)
+	{
+		n = copy(dest + o, src + i, len - i);
+		i += n;
+		o += n;
+		if(i == len || src[i] != '\\')
+		{
+			break;
+		}
+		if(i + 3 < len && isdigit((unsigned char) src[i + 1]) && isdigit((unsigned char) src[i + 2]) && isdigit((unsigned char) src[i + 3]))
+		{
+			dest[o++] = (char) ((src[i + 1] - '0') * 100 + (src[i + 2] - '0') * 10 + (src[i + 3] - '0'));
+			i += 4;
+			continue;
+		}
+		if(i + 1 < len && src[i + 1])
+		{
+			/* Skip the backslash, allowing it to escape the '.' */
+			i++;
+		}
+		dest[o++] = src[i++];
+	}
+	return o;
+}
+
+static void
+unescape_init(void)
+{
+#ifdef UNESCAPE_X86
+	if(!rdns_unescape_impl(RDNS_UNESCAPE_AVX2) || !rdns_unescape_impl(RDNS_UNESCAPE_SSE2))
+	{
+		return;
+	}
+#endif
+	rdns_unescape_impl(RDNS_UNESCAPE_SCALAR);
+}
+
+static int
+hexval(int c)
+{
+	if(c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/* The copiers copy bytes from src to dest up to the first which can't
+ * simply be copied, or len if there's no such byte, and return the number
+ * copied. For parameters, those are NUL, '%', white space (as isspace() in
+ * the C locale) and optionally '='; for labels, NUL, '\' and '.'. The
+ * vector versions store whole vectors, including the block containing
+ * the byte which stopped them.
+ */
+
+static size_t
+copy_param_scalar(char *dest, const char *src, size_t len, int eq)
+{
+	size_t i;
+	unsigned char c;
+
+	for(i = 0; i < len; i++)
+	{
+		c = (unsigned char) src[i];
+		if(!c || c == '%' || c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t' || (eq && c == '='))
+		{
+			break;
+		}
+		dest[i] = c;
+	}
+	return i;
+}
+
+static size_t
+copy_label_scalar(char *dest, const char *src, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < len; i++)
+	{
+		if(!src[i] || src[i] == '\\' || src[i] == '.')
+		{
+			break;
+		}
+		dest[i] = src[i];
+	}
+	return i;
+}
+
+#ifdef UNESCAPE_X86
+
+/* The 16-byte loops are shared by the SSE2 and AVX2 versions, so that the
+ * latter are VEX-encoded throughout
+ */
+# define PARAM_LOOP_128(dest, src, len, eq, i) do { \
+	__m128i x_, m_, t_; \
+	const __m128i zero_ = _mm_setzero_si128(), pct_ = _mm_set1_epi8('%'), space_ = _mm_set1_epi8(' '); \
+	const __m128i tab_ = _mm_set1_epi8('\t'), ctlmax_ = _mm_set1_epi8('\r' - '\t'); \
+	const __m128i equals_ = _mm_set1_epi8(eq ? '=' : '%'); \
+	int mask_; \
+	for(; i + 16 <= len; i += 16) \
+	{ \
+		x_ = _mm_loadu_si128((const __m128i *) (src + i)); \
+		_mm_storeu_si128((__m128i *) (dest + i), x_); \
+		m_ = _mm_or_si128(_mm_cmpeq_epi8(x_, zero_), _mm_cmpeq_epi8(x_, pct_)); \
+		m_ = _mm_or_si128(m_, _mm_or_si128(_mm_cmpeq_epi8(x_, space_), _mm_cmpeq_epi8(x_, equals_))); \
+		/* \t to \r: unsigned (x - '\t') <= '\r' - '\t' */ \
+		t_ = _mm_sub_epi8(x_, tab_); \
+		m_ = _mm_or_si128(m_, _mm_cmpeq_epi8(_mm_min_epu8(t_, ctlmax_), t_)); \
+		if((mask_ = _mm_movemask_epi8(m_))) \
+		{ \
+			return i + __builtin_ctz(mask_); \
+		} \
+	} \
+} while(0)
+
+# define LABEL_LOOP_128(dest, src, len, i) do { \
+	__m128i x_, m_; \
+	const __m128i zero_ = _mm_setzero_si128(), bs_ = _mm_set1_epi8('\\'), dot_ = _mm_set1_epi8('.'); \
+	int mask_; \
+	for(; i + 16 <= len; i += 16) \
+	{ \
+		x_ = _mm_loadu_si128((const __m128i *) (src + i)); \
+		_mm_storeu_si128((__m128i *) (dest + i), x_); \
+		m_ = _mm_or_si128(_mm_cmpeq_epi8(x_, zero_), _mm_or_si128(_mm_cmpeq_epi8(x_, bs_), _mm_cmpeq_epi8(x_, dot_))); \
+		if((mask_ = _mm_movemask_epi8(m_))) \
+		{ \
+			return i + __builtin_ctz(mask_); \
+		} \
+	} \
+} while(0)
+
+__attribute__((target("sse2")))
+static size_t
+copy_param_sse2(char *dest, const char *src, size_t len, int eq)
+{
+	size_t i;
+
+	i = 0;
+	PARAM_LOOP_128(dest, src, len, eq, i);
+	return i + copy_param_scalar(dest + i, src + i, len - i, eq);
+}
+
+__attribute__((target("sse2")))
+static size_t
+copy_label_sse2(char *dest, const char *src, size_t len)
+{
+	size_t i;
+
+	i = 0;
+	LABEL_LOOP_128(dest, src, len, i);
+	return i + copy_label_scalar(dest + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+copy_param_avx2(char *dest, const char *src, size_t len, int eq)
+{
+	__m256i x, m, t;
+	const __m256i zero = _mm256_setzero_si256(), pct = _mm256_set1_epi8('%'), space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t'), ctlmax = _mm256_set1_epi8('\r' - '\t');
+	const __m256i equals = _mm256_set1_epi8(eq ? '=' : '%');
+	size_t i;
+	unsigned int mask;
+
+	for(i = 0; i + 32 <= len; i += 32)
+	{
+		x = _mm256_loadu_si256((const __m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dest + i), x);
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(x, zero), _mm256_cmpeq_epi8(x, pct));
+		m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, space), _mm256_cmpeq_epi8(x, equals)));
+		t = _mm256_sub_epi8(x, tab);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(t, ctlmax), t));
+		if((mask = (unsigned int) _mm256_movemask_epi8(m)))
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+	PARAM_LOOP_128(dest, src, len, eq, i);
+	return i + copy_param_scalar(dest + i, src + i, len - i, eq);
+}
+
+__attribute__((target("avx2")))
+static size_t
+copy_label_avx2(char *dest, const char *src, size_t len)
+{
+	__m256i x, m;
+	const __m256i zero = _mm256_setzero_si256(), bs = _mm256_set1_epi8('\\'), dot = _mm256_set1_epi8('.');
+	size_t i;
+	unsigned int mask;
+
+	for(i = 0; i + 32 <= len; i += 32)
+	{
+		x = _mm256_loadu_si256((const __m256i *) (src + i));
+		_mm256_storeu_si256((__m256i *) (dest + i), x);
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(x, zero), _mm256_or_si256(_mm256_cmpeq_epi8(x, bs), _mm256_cmpeq_epi8(x, dot)));
+		if((mask = (unsigned int) _mm256_movemask_epi8(m)))
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+	LABEL_LOOP_128(dest, src, len, i);
+	return i + copy_label_scalar(dest + i, src + i, len - i);
+}
+
+#endif /*UNESCAPE_X86*/
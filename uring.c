@@ -0,0 +1,414 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Just enough of an io_uring wrapper for the UDP transport, using the
+ * system calls directly rather than depending upon liburing. Where the
+ * kernel headers aren't available, rdns_uring_create() always fails with
+ * ENOSYS, and callers carry on without it.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Completions with this user data (from timeouts and cancellations) are
+ * of no interest to callers
+ */
+#define URING_IGNORED                   0
+
+struct rdns_uring
+{
+	int fd;
+	unsigned int *sqhead;
+	unsigned int *sqtail;
+	unsigned int sqmask;
+	unsigned int sqentries;
+	/* The tail as far as we're concerned, including SQEs which have
+	 * been prepared but not yet made visible to the kernel
+	 */
+	unsigned int sqlocal;
+	unsigned int sqpending;
+	struct io_uring_sqe *sqes;
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int cqmask;
+	struct io_uring_cqe *cqes;
+	void *sqring;
+	size_t sqringlen;
+	void *cqring;
+	size_t cqringlen;
+	size_t sqeslen;
+	/* The timeout of rdns_uring_wait(), which must outlive the call if
+	 * its SQE is left queued because it couldn't be submitted
+	 */
+	struct __kernel_timespec ts;
+};
+
+static struct io_uring_sqe *uring_sqe(struct rdns_uring *ring);
+static int uring_enter(struct rdns_uring *ring, unsigned int wait);
+
+struct rdns_uring *
+rdns_uring_create(unsigned int entries)
+{
+	struct rdns_uring *ring;
+	struct io_uring_params params;
+	unsigned int *array, c;
+
+	if(NULL == (ring = (struct rdns_uring *) rdns_calloc(NULL, 1, sizeof(struct rdns_uring))))
+	{
+		return NULL;
+	}
+	memset(&params, 0, sizeof(params));
+	if(0 > (ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params)))
+	{
+		rdns_free(NULL, ring);
+		return NULL;
+	}
+	ring->sqringlen = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqringlen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cqringlen > ring->sqringlen)
+	{
+		ring->sqringlen = ring->cqringlen;
+	}
+	ring->sqring = mmap(NULL, ring->sqringlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sqring == MAP_FAILED)
+	{
+		close(ring->fd);
+		rdns_free(NULL, ring);
+		return NULL;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cqring = ring->sqring;
+	}
+	else
+	{
+		ring->cqring = mmap(NULL, ring->cqringlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cqring == MAP_FAILED)
+		{
+			munmap(ring->sqring, ring->sqringlen);
+			close(ring->fd);
+			rdns_free(NULL, ring);
+			return NULL;
+		}
+	}
+	ring->sqeslen = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+	{
+		if(ring->cqring != ring->sqring)
+		{
+			munmap(ring->cqring, ring->cqringlen);
+		}
+		munmap(ring->sqring, ring->sqringlen);
+		close(ring->fd);
+		rdns_free(NULL, ring);
+		return NULL;
+	}
+	ring->sqhead = (unsigned int *) ((char *) ring->sqring + params.sq_off.head);
+	ring->sqtail = (unsigned int *) ((char *) ring->sqring + params.sq_off.tail);
+	ring->sqmask = *(unsigned int *) ((char *) ring->sqring + params.sq_off.ring_mask);
+	ring->sqentries = params.sq_entries;
+	ring->sqlocal = *(ring->sqtail);
+	ring->cqhead = (unsigned int *) ((char *) ring->cqring + params.cq_off.head);
+	ring->cqtail = (unsigned int *) ((char *) ring->cqring + params.cq_off.tail);
+	ring->cqmask = *(unsigned int *) ((char *) ring->cqring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqring + params.cq_off.cqes);
+	/* SQEs are always used in order, so the indirection array never
+	 * needs to change
+	 */
+	array = (unsigned int *) ((char *) ring->sqring + params.sq_off.array);
+	for(c = 0; c < params.sq_entries; c++)
+	{
+		array[c] = c;
+	}
+	return ring;
+}
+
+void
+rdns_uring_destroy(struct rdns_uring *ring)
+{
+	if(!ring)
+	{
+		return;
+	}
+	munmap(ring->sqes, ring->sqeslen);
+	if(ring->cqring != ring->sqring)
+	{
+		munmap(ring->cqring, ring->cqringlen);
+	}
+	munmap(ring->sqring, ring->sqringlen);
+	close(ring->fd);
+	rdns_free(NULL, ring);
+}
+
+int
+rdns_uring_sendmsg(struct rdns_uring *ring, int fd, struct msghdr *msg, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = uring_sqe(ring)))
+	{
+		return -1;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->user_data = data;
+	return 0;
+}
+
+int
+rdns_uring_recvmsg(struct rdns_uring *ring, int fd, struct msghdr *msg, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = uring_sqe(ring)))
+	{
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->user_data = data;
+	return 0;
+}
+
+int
+rdns_uring_cancel(struct rdns_uring *ring, uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = uring_sqe(ring)))
+	{
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = URING_IGNORED;
+	return 0;
+}
+
+/* Submit everything which has been queued, and wait up to timeout
+ * milliseconds (or indefinitely, if negative) for at least one
+ * completion. The timeout is itself submitted as a request, which
+ * completes early as soon as anything else does.
+ */
+int
+rdns_uring_wait(struct rdns_uring *ring, int timeout)
+{
+	struct io_uring_sqe *sqe;
+
+	if(*(ring->cqhead) != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+	{
+		timeout = 0;
+	}
+	if(timeout > 0)
+	{
+		if(!(sqe = uring_sqe(ring)))
+		{
+			return -1;
+		}
+		ring->ts.tv_sec = timeout / 1000;
+		ring->ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t) (uintptr_t) &(ring->ts);
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = URING_IGNORED;
+	}
+	return uring_enter(ring, (timeout ? 1 : 0));
+}
+
+/* Retrieve the next completion, returning zero if there are none */
+int
+rdns_uring_complete(struct rdns_uring *ring, uint64_t *data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	for(;;)
+	{
+		head = *(ring->cqhead);
+		if(head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+		{
+			return 0;
+		}
+		cqe = &(ring->cqes[head & ring->cqmask]);
+		*data = cqe->user_data;
+		*res = cqe->res;
+		__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+		if(*data != URING_IGNORED)
+		{
+			return 1;
+		}
+	}
+}
+
+int
+rdns_uring_fd(struct rdns_uring *ring)
+{
+	return ring->fd;
+}
+
+unsigned int
+rdns_uring_pending(struct rdns_uring *ring)
+{
+	return ring->sqpending;
+}
+
+/* Obtain a cleared SQE, submitting what's already been queued to make
+ * room if necessary
+ */
+static struct io_uring_sqe *
+uring_sqe(struct rdns_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if(ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)
+	{
+		if(uring_enter(ring, 0) < 0 ||
+		   ring->sqlocal - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)
+		{
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+	sqe = &(ring->sqes[ring->sqlocal & ring->sqmask]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqlocal++;
+	ring->sqpending++;
+	return sqe;
+}
+
+static int
+uring_enter(struct rdns_uring *ring, unsigned int wait)
+{
+	int r;
+
+	__atomic_store_n(ring->sqtail, ring->sqlocal, __ATOMIC_RELEASE);
+	r = (int) syscall(__NR_io_uring_enter, ring->fd, ring->sqpending, wait, (wait ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+	if(r < 0)
+	{
+		return -1;
+	}
+	ring->sqpending -= r;
+	return 0;
+}
+
+#else /*HAVE_LINUX_IO_URING_H*/
+
+struct rdns_uring *
+rdns_uring_create(unsigned int entries)
+{
+	(void) entries;
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+rdns_uring_destroy(struct rdns_uring *ring)
+{
+	(void) ring;
+}
+
+int
+rdns_uring_sendmsg(struct rdns_uring *ring, int fd, struct msghdr *msg, uint64_t data)
+{
+	(void) ring;
+	(void) fd;
+	(void) msg;
+	(void) data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+rdns_uring_recvmsg(struct rdns_uring *ring, int fd, struct msghdr *msg, uint64_t data)
+{
+	(void) ring;
+	(void) fd;
+	(void) msg;
+	(void) data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+rdns_uring_cancel(struct rdns_uring *ring, uint64_t data)
+{
+	(void) ring;
+	(void) data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+rdns_uring_wait(struct rdns_uring *ring, int timeout)
+{
+	(void) ring;
+	(void) timeout;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+rdns_uring_complete(struct rdns_uring *ring, uint64_t *data, int *res)
+{
+	(void) ring;
+	(void) data;
+	(void) res;
+
+	return 0;
+}
+
+int
+rdns_uring_fd(struct rdns_uring *ring)
+{
+	(void) ring;
+
+	return -1;
+}
+
+unsigned int
+rdns_uring_pending(struct rdns_uring *ring)
+{
+	(void) ring;
+
+	return 0;
+}
+
+#endif /*HAVE_LINUX_IO_URING_H*/
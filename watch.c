@@ -0,0 +1,503 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+/* Registrations are kept on a hashed timing wheel with a granularity of
+ * one second. An entry lives in the slot for (due % RDNS_WHEEL_SLOTS);
+ * entries due more than one rotation away simply stay put until the
+ * wheel comes round to them again.
+ */
+#define RDNS_WHEEL_SLOTS                512
+/* Bounds applied to record TTLs when scheduling a refresh */
+#define RDNS_WATCH_MINTTL               30
+#define RDNS_WATCH_MAXTTL               86400
+/* Refresh interval when nothing was found (and so there's no TTL) */
+#define RDNS_WATCH_NEGTTL               300
+/* Refresh interval following a transient resolver failure */
+#define RDNS_WATCH_RETRY                60
+
+struct watch_entry
+{
+	struct watch_entry *prev;
+	struct watch_entry *next;
+	radiodns_t *context;
+	char *name;
+	char *protocol;
+	radiodns_watch_fn fn;
+	void *data;
+	time_t due;
+	int notified;
+	int removed;
+	char *target;
+	radiodns_app_t *app;
+};
+
+struct radiodns_watch_struct
+{
+	struct watch_entry *slots[RDNS_WHEEL_SLOTS];
+	/* Entries detached from the wheel by radiodns_watch_run() */
+	struct watch_entry *pending;
+	/* The last tick processed */
+	time_t now;
+	size_t count;
+};
+
+static void watch_insert(radiodns_watch_t *watch, struct watch_entry *entry);
+static void watch_unlink(struct watch_entry **list, struct watch_entry *entry);
+static void watch_free(struct watch_entry *entry);
+static struct watch_entry *watch_find(struct watch_entry *list, radiodns_t *context, const char *name, const char *protocol);
+static int watch_refresh(struct watch_entry *entry, time_t now);
+static int app_equal(const radiodns_app_t *a, const radiodns_app_t *b);
+static int instance_equal(const radiodns_app_t *a, const radiodns_app_t *b);
+static int str_equal(const char *a, const char *b);
+
+/* Create a new watch set */
+radiodns_watch_t *
+radiodns_watch_create(void)
+{
+	radiodns_watch_t *watch;
+
+	if(NULL == (watch = (radiodns_watch_t *) rdns_calloc(NULL, 1, sizeof(radiodns_watch_t))))
+	{
+		return NULL;
+	}
+	watch->now = time(NULL);
+	return watch;
+}
+
+/* Destroy a watch set and all of its registrations */
+void
+radiodns_watch_destroy(radiodns_watch_t *watch)
+{
+	struct watch_entry *p;
+	int c;
+
+	if(!watch)
+	{
+		return;
+	}
+	for(c = 0; c < RDNS_WHEEL_SLOTS; c++)
+	{
+		while((p = watch->slots[c]))
+		{
+			watch_unlink(&(watch->slots[c]), p);
+			watch_free(p);
+		}
+	}
+	while((p = watch->pending))
+	{
+		watch_unlink(&(watch->pending), p);
+		watch_free(p);
+	}
+	rdns_free(NULL, watch);
+}
+
+/* Register a context (and optionally an application) with a watch set.
+ * The first refresh is due immediately, and always results in a callback
+ * so that the caller learns the initial state.
+ */
+int
+radiodns_watch_add(radiodns_watch_t *watch, radiodns_t *context, const char *name, const char *protocol, radiodns_watch_fn fn, void *data)
+{
+	struct watch_entry *entry;
+
+	if(!context || !fn)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(name && !protocol)
+	{
+		protocol = "tcp";
+	}
+	if(NULL == (entry = (struct watch_entry *) rdns_calloc(NULL, 1, sizeof(struct watch_entry))))
+	{
+		return -1;
+	}
+	entry->context = context;
+	entry->fn = fn;
+	entry->data = data;
+	if(name)
+	{
+		if(NULL == (entry->name = rdns_strdup(NULL, name)) ||
+		   NULL == (entry->protocol = rdns_strdup(NULL, protocol)))
+		{
+			watch_free(entry);
+			return -1;
+		}
+	}
+	entry->due = time(NULL);
+	watch_insert(watch, entry);
+	watch->count++;
+	return 0;
+}
+
+/* Remove a registration from a watch set */
+int
+radiodns_watch_remove(radiodns_watch_t *watch, radiodns_t *context, const char *name, const char *protocol)
+{
+	struct watch_entry *entry;
+	int c;
+
+	if(name && !protocol)
+	{
+		protocol = "tcp";
+	}
+	/* Removal from within a callback: the entry is on the pending list
+	 * and will be freed once radiodns_watch_run() is done with it.
+	 */
+	if((entry = watch_find(watch->pending, context, name, protocol)))
+	{
+		entry->removed = 1;
+		watch->count--;
+		return 0;
+	}
+	for(c = 0; c < RDNS_WHEEL_SLOTS; c++)
+	{
+		if((entry = watch_find(watch->slots[c], context, name, protocol)))
+		{
+			watch_unlink(&(watch->slots[c]), entry);
+			watch_free(entry);
+			watch->count--;
+			return 0;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/* Return the number of seconds until the next refresh is due */
+long
+radiodns_watch_next(radiodns_watch_t *watch)
+{
+	struct watch_entry *p;
+	time_t now, t;
+
+	if(!watch->count)
+	{
+		return -1;
+	}
+	now = time(NULL);
+	if(now - watch->now >= RDNS_WHEEL_SLOTS)
+	{
+		return 0;
+	}
+	/* Anything overdue must be in a slot between the last processed tick
+	 * and now; beyond that, the first slot holding an entry which is due
+	 * on this rotation gives the answer.
+	 */
+	for(t = watch->now; t < now + RDNS_WHEEL_SLOTS; t++)
+	{
+		for(p = watch->slots[t % RDNS_WHEEL_SLOTS]; p; p = p->next)
+		{
+			if(p->due <= t)
+			{
+				return (t > now ? (long) (t - now) : 0);
+			}
+		}
+	}
+	return RDNS_WHEEL_SLOTS;
+}
+
+/* Perform any refreshes which are due */
+int
+radiodns_watch_run(radiodns_watch_t *watch)
+{
+	struct watch_entry *p, *next;
+	time_t now, t;
+	int c, n;
+
+	now = time(NULL);
+	if(now - watch->now >= RDNS_WHEEL_SLOTS)
+	{
+		t = now - RDNS_WHEEL_SLOTS + 1;
+	}
+	else
+	{
+		t = watch->now;
+	}
+	for(; t <= now; t++)
+	{
+		c = t % RDNS_WHEEL_SLOTS;
+		for(p = watch->slots[c]; p; p = next)
+		{
+			next = p->next;
+			if(p->due <= now)
+			{
+				watch_unlink(&(watch->slots[c]), p);
+				p->next = watch->pending;
+				p->prev = NULL;
+				if(watch->pending)
+				{
+					watch->pending->prev = p;
+				}
+				watch->pending = p;
+			}
+		}
+	}
+	watch->now = now;
+	n = 0;
+	while((p = watch->pending))
+	{
+		if(!p->removed)
+		{
+			n += watch_refresh(p, now);
+		}
+		watch_unlink(&(watch->pending), p);
+		if(p->removed)
+		{
+			watch_free(p);
+			continue;
+		}
+		watch_insert(watch, p);
+	}
+	return n;
+}
+
+static void
+watch_insert(radiodns_watch_t *watch, struct watch_entry *entry)
+{
+	struct watch_entry **slot;
+
+	slot = &(watch->slots[entry->due % RDNS_WHEEL_SLOTS]);
+	entry->prev = NULL;
+	entry->next = *slot;
+	if(*slot)
+	{
+		(*slot)->prev = entry;
+	}
+	*slot = entry;
+}
+
+static void
+watch_unlink(struct watch_entry **list, struct watch_entry *entry)
+{
+	if(entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		*list = entry->next;
+	}
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void
+watch_free(struct watch_entry *entry)
+{
+	rdns_free(NULL, entry->name);
+	rdns_free(NULL, entry->protocol);
+	rdns_free(NULL, entry->target);
+	radiodns_destroy_app(entry->app);
+	rdns_free(NULL, entry);
+}
+
+static struct watch_entry *
+watch_find(struct watch_entry *list, radiodns_t *context, const char *name, const char *protocol)
+{
+	for(; list; list = list->next)
+	{
+		if(list->context == context && !list->removed &&
+		   str_equal(list->name, name) && str_equal(list->protocol, protocol))
+		{
+			return list;
+		}
+	}
+	return NULL;
+}
+
+/* Re-resolve a single registration and schedule its next refresh.
+ * Returns 1 if the callback was invoked, 0 otherwise.
+ */
+static int
+watch_refresh(struct watch_entry *entry, time_t now)
+{
+	const char *target;
+	radiodns_app_t *app;
+	unsigned long ttl;
+	int changed;
+
+	entry->due = now + RDNS_WATCH_RETRY;
+	if(NULL == (target = radiodns_resolve_target(entry->context)))
+	{
+		return 0;
+	}
+	ttl = entry->context->target_ttl;
+	changed = !str_equal(entry->target, target);
+	app = NULL;
+	if(entry->name)
+	{
+		errno = 0;
+		h_errno = 0;
+		app = radiodns_resolve_app(entry->context, entry->name, entry->protocol);
+		if(!app && (errno || h_errno == TRY_AGAIN || h_errno == NO_RECOVERY || h_errno == NETDB_INTERNAL))
+		{
+			/* Transient failure: keep what we had and try again soon */
+			return 0;
+		}
+		if(entry->context->app_ttl && (!ttl || entry->context->app_ttl < ttl))
+		{
+			ttl = entry->context->app_ttl;
+		}
+		if(!app_equal(entry->app, app))
+		{
+			changed = 1;
+		}
+	}
+	if(!ttl)
+	{
+		ttl = RDNS_WATCH_NEGTTL;
+	}
+	else if(ttl < RDNS_WATCH_MINTTL)
+	{
+		ttl = RDNS_WATCH_MINTTL;
+	}
+	else if(ttl > RDNS_WATCH_MAXTTL)
+	{
+		ttl = RDNS_WATCH_MAXTTL;
+	}
+	entry->due = now + ttl;
+	if(entry->notified && !changed)
+	{
+		radiodns_destroy_app(app);
+		return 0;
+	}
+	if(!str_equal(entry->target, target))
+	{
+		rdns_free(NULL, entry->target);
+		if(NULL == (entry->target = rdns_strdup(NULL, target)))
+		{
+			radiodns_destroy_app(app);
+			entry->due = now + RDNS_WATCH_RETRY;
+			return 0;
+		}
+	}
+	radiodns_destroy_app(entry->app);
+	entry->app = app;
+	entry->notified = 1;
+	entry->fn(entry->context, entry->name, entry->app, entry->data);
+	return 1;
+}
+
+/* Compare two application instance lists as sets: resolvers are free to
+ * return records in any order, and a change in ordering alone isn't
+ * worth telling anybody about.
+ */
+static int
+app_equal(const radiodns_app_t *a, const radiodns_app_t *b)
+{
+	const radiodns_app_t *p, *q;
+	int na, nb;
+
+	for(na = 0, p = a; p; p = p->next)
+	{
+		na++;
+	}
+	for(nb = 0, p = b; p; p = p->next)
+	{
+		nb++;
+	}
+	if(na != nb)
+	{
+		return 0;
+	}
+	for(p = a; p; p = p->next)
+	{
+		for(q = b; q; q = q->next)
+		{
+			if(str_equal(p->name, q->name) && instance_equal(p, q))
+			{
+				break;
+			}
+		}
+		if(!q)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+instance_equal(const radiodns_app_t *a, const radiodns_app_t *b)
+{
+	int c, d;
+
+	if(a->nsrv != b->nsrv || a->nparams != b->nparams)
+	{
+		return 0;
+	}
+	for(c = 0; c < a->nsrv; c++)
+	{
+		for(d = 0; d < b->nsrv; d++)
+		{
+			if(a->srv[c].priority == b->srv[d].priority &&
+			   a->srv[c].weight == b->srv[d].weight &&
+			   a->srv[c].port == b->srv[d].port &&
+			   (a->srv[c].target == b->srv[d].target || !strcasecmp(a->srv[c].target, b->srv[d].target)))
+			{
+				break;
+			}
+		}
+		if(d == b->nsrv)
+		{
+			return 0;
+		}
+	}
+	for(c = 0; c < a->nparams; c++)
+	{
+		for(d = 0; d < b->nparams; d++)
+		{
+			if(!strcmp(a->params[c].key, b->params[d].key) &&
+			   !strcmp(a->params[c].value, b->params[d].value))
+			{
+				break;
+			}
+		}
+		if(d == b->nparams)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+str_equal(const char *a, const char *b)
+{
+	if(a == b)
+	{
+		/* Including strings from the same intern pool */
+		return 1;
+	}
+	if(!a || !b)
+	{
+		return a == b;
+	}
+	return !strcmp(a, b);
+}
@@ -0,0 +1,607 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* Worker pools: threads which perform synchronous resolutions on behalf of
+ * a caller (typically a UI thread) which mustn't block. Submitted jobs are
+ * dealt out in turn to the workers' queues, and a worker whose own queue
+ * is empty steals from the others' before sleeping. Finished jobs are
+ * pushed on to a lock-free stack, which the caller takes in one go and
+ * reverses, so that they're collected in the order they finished; an
+ * eventfd (or pipe) becomes readable whenever the stack goes from empty
+ * to not.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+
+struct radiodns_job_struct
+{
+	radiodns_job_t *next;
+	radiodns_t *context;
+	void *data;
+	/* The applications wanted (none, for the target alone), stored
+	 * along with the job, and the results
+	 */
+	const char **names;
+	char *protocol;
+	int count;
+	radiodns_app_t **apps;
+	int found;
+	int err;
+	int herrno;
+};
+
+#ifdef HAVE_PTHREAD_H
+
+struct worker
+{
+	radiodns_workers_t *workers;
+	pthread_t thread;
+	int started;
+	/* Jobs dealt to this worker, taken from the head by the worker and
+	 * from the tail by others
+	 */
+	pthread_mutex_t lock;
+	radiodns_job_t *head;
+	radiodns_job_t *tail;
+	radiodns_transport_t *transport;
+};
+
+struct radiodns_workers_struct
+{
+	struct worker *worker;
+	int nworkers;
+	unsigned int next;
+	/* The number of jobs waiting in the queues, which idle workers
+	 * sleep on
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int queued;
+	int stopping;
+	/* Finished jobs, most recent first, and those taken from the stack
+	 * but not yet collected, in order
+	 */
+	radiodns_job_t *done;
+	radiodns_job_t *collected;
+	/* Readable when done isn't empty; the same descriptor twice, if it's
+	 * an eventfd
+	 */
+	int fd[2];
+};
+
+static void *worker_main(void *arg);
+static radiodns_job_t *worker_take(struct worker *worker);
+static radiodns_job_t *worker_steal(struct worker *worker);
+static void worker_run(radiodns_job_t *job);
+static void workers_signal(radiodns_workers_t *workers);
+static void workers_drain(radiodns_workers_t *workers);
+static int workers_unsafe(int nworkers, radiodns_transport_t *transport);
+
+/* Create a pool of nworkers threads. If create isn't NULL, each worker
+ * uses a transport of its own, which it obtains from create (and
+ * destroys when it exits), for contexts without one; otherwise, they
+ * share the default, which must be safe for them to.
+ */
+radiodns_workers_t *
+radiodns_workers_create(int nworkers, radiodns_transport_t *(*create)(void))
+{
+	radiodns_workers_t *workers;
+	int c;
+
+	if(nworkers < 1 || (!create && workers_unsafe(nworkers, rdns_transport(NULL))))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(NULL == (workers = (radiodns_workers_t *) rdns_calloc(NULL, 1, sizeof(radiodns_workers_t))))
+	{
+		return NULL;
+	}
+	workers->fd[0] = workers->fd[1] = -1;
+	pthread_mutex_init(&(workers->lock), NULL);
+	pthread_cond_init(&(workers->cond), NULL);
+	if(NULL == (workers->worker = (struct worker *) rdns_calloc(NULL, nworkers, sizeof(struct worker))))
+	{
+		radiodns_workers_destroy(workers);
+		return NULL;
+	}
+	workers->nworkers = nworkers;
+	for(c = 0; c < nworkers; c++)
+	{
+		workers->worker[c].workers = workers;
+		pthread_mutex_init(&(workers->worker[c].lock), NULL);
+	}
+#ifdef HAVE_SYS_EVENTFD_H
+	if(0 > (workers->fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)))
+	{
+		radiodns_workers_destroy(workers);
+		return NULL;
+	}
+	workers->fd[1] = workers->fd[0];
+#else
+	if(pipe(workers->fd))
+	{
+		workers->fd[0] = workers->fd[1] = -1;
+		radiodns_workers_destroy(workers);
+		return NULL;
+	}
+	for(c = 0; c < 2; c++)
+	{
+		fcntl(workers->fd[c], F_SETFL, fcntl(workers->fd[c], F_GETFL) | O_NONBLOCK);
+		fcntl(workers->fd[c], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	for(c = 0; c < nworkers; c++)
+	{
+		if(create && NULL == (workers->worker[c].transport = create()))
+		{
+			radiodns_workers_destroy(workers);
+			return NULL;
+		}
+		if((errno = pthread_create(&(workers->worker[c].thread), NULL, worker_main, &(workers->worker[c]))))
+		{
+			radiodns_workers_destroy(workers);
+			return NULL;
+		}
+		workers->worker[c].started = 1;
+	}
+	return workers;
+}
+
+/* Stop the workers, once they've finished the jobs they're performing,
+ * and discard all of the others, collected or not
+ */
+void
+radiodns_workers_destroy(radiodns_workers_t *workers)
+{
+	radiodns_job_t *job;
+	int c;
+
+	if(!workers)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(workers->lock));
+	__atomic_store_n(&(workers->stopping), 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&(workers->cond));
+	pthread_mutex_unlock(&(workers->lock));
+	for(c = 0; c < workers->nworkers; c++)
+	{
+		if(workers->worker[c].started)
+		{
+			pthread_join(workers->worker[c].thread, NULL);
+		}
+	}
+	for(c = 0; c < workers->nworkers; c++)
+	{
+		while((job = workers->worker[c].head))
+		{
+			workers->worker[c].head = job->next;
+			radiodns_job_destroy(job);
+		}
+		radiodns_transport_destroy(workers->worker[c].transport);
+		pthread_mutex_destroy(&(workers->worker[c].lock));
+	}
+	while((job = radiodns_workers_collect(workers)))
+	{
+		radiodns_job_destroy(job);
+	}
+	if(workers->fd[0] != -1)
+	{
+		close(workers->fd[0]);
+	}
+	if(workers->fd[1] != -1 && workers->fd[1] != workers->fd[0])
+	{
+		close(workers->fd[1]);
+	}
+	pthread_cond_destroy(&(workers->cond));
+	pthread_mutex_destroy(&(workers->lock));
+	rdns_free(NULL, workers->worker);
+	rdns_free(NULL, workers);
+}
+
+/* Queue a job to resolve count applications for a context (as
+ * radiodns_resolve_apps() would), or if count is zero, its target
+ */
+int
+radiodns_workers_submit(radiodns_workers_t *workers, radiodns_t *context, const char *const *names, int count, const char *protocol, void *data)
+{
+	struct worker *worker;
+	radiodns_job_t *job;
+	size_t len;
+	char *p;
+	int c;
+
+	if(count < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	/* The default may have changed since the pool was created */
+	if(context->transport ? workers_unsafe(workers->nworkers, context->transport) :
+	   (!workers->worker[0].transport && workers_unsafe(workers->nworkers, rdns_transport(NULL))))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!protocol)
+	{
+		protocol = "tcp";
+	}
+	/* Everything the job refers to is stored along with it */
+	len = sizeof(radiodns_job_t) + count * (sizeof(char *) + sizeof(radiodns_app_t *)) + strlen(protocol) + 1;
+	for(c = 0; c < count; c++)
+	{
+		len += strlen(names[c]) + 1;
+	}
+	if(NULL == (job = (radiodns_job_t *) rdns_calloc(NULL, 1, len)))
+	{
+		return -1;
+	}
+	job->context = context;
+	job->data = data;
+	job->count = count;
+	job->names = (const char **) (job + 1);
+	job->apps = (radiodns_app_t **) (job->names + count);
+	p = (char *) (job->apps + count);
+	for(c = 0; c < count; c++)
+	{
+		job->names[c] = strcpy(p, names[c]);
+		p += strlen(p) + 1;
+	}
+	job->protocol = strcpy(p, protocol);
+	worker = &(workers->worker[__atomic_fetch_add(&(workers->next), 1, __ATOMIC_RELAXED) % workers->nworkers]);
+	pthread_mutex_lock(&(worker->lock));
+	if(worker->tail)
+	{
+		worker->tail->next = job;
+	}
+	else
+	{
+		worker->head = job;
+	}
+	worker->tail = job;
+	pthread_mutex_unlock(&(worker->lock));
+	pthread_mutex_lock(&(workers->lock));
+	workers->queued++;
+	pthread_cond_signal(&(workers->cond));
+	pthread_mutex_unlock(&(workers->lock));
+	return 0;
+}
+
+/* Return the next finished job, or NULL if there are none. Jobs must be
+ * collected by one thread at a time.
+ */
+radiodns_job_t *
+radiodns_workers_collect(radiodns_workers_t *workers)
+{
+	radiodns_job_t *job, *list;
+
+	if(!workers->collected)
+	{
+		/* Reset the descriptor first, so that a job finishing from now
+		 * on makes it readable again
+		 */
+		workers_drain(workers);
+		list = __atomic_exchange_n(&(workers->done), NULL, __ATOMIC_ACQUIRE);
+		while(list)
+		{
+			job = list;
+			list = job->next;
+			job->next = workers->collected;
+			workers->collected = job;
+		}
+	}
+	if((job = workers->collected))
+	{
+		workers->collected = job->next;
+		job->next = NULL;
+	}
+	return job;
+}
+
+/* Return a descriptor which is readable when finished jobs are waiting to
+ * be collected
+ */
+int
+radiodns_workers_fd(radiodns_workers_t *workers)
+{
+	return workers->fd[0];
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *worker;
+	radiodns_workers_t *workers;
+	radiodns_job_t *job, *head;
+
+	worker = (struct worker *) arg;
+	workers = worker->workers;
+	rdns_thread_transport(worker->transport);
+	while(!__atomic_load_n(&(workers->stopping), __ATOMIC_RELAXED))
+	{
+		if(!(job = worker_take(worker)) && !(job = worker_steal(worker)))
+		{
+			pthread_mutex_lock(&(workers->lock));
+			while(!workers->queued && !workers->stopping)
+			{
+				pthread_cond_wait(&(workers->cond), &(workers->lock));
+			}
+			if(workers->stopping)
+			{
+				pthread_mutex_unlock(&(workers->lock));
+				break;
+			}
+			pthread_mutex_unlock(&(workers->lock));
+			continue;
+		}
+		pthread_mutex_lock(&(workers->lock));
+		workers->queued--;
+		pthread_mutex_unlock(&(workers->lock));
+		worker_run(job);
+		head = __atomic_load_n(&(workers->done), __ATOMIC_RELAXED);
+		do
+		{
+			job->next = head;
+		}
+		while(!__atomic_compare_exchange_n(&(workers->done), &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		if(!head)
+		{
+			workers_signal(workers);
+		}
+	}
+	rdns_thread_transport(NULL);
+	return NULL;
+}
+
+/* Take the oldest job from a worker's own queue */
+static radiodns_job_t *
+worker_take(struct worker *worker)
+{
+	radiodns_job_t *job;
+
+	pthread_mutex_lock(&(worker->lock));
+	if((job = worker->head))
+	{
+		if(!(worker->head = job->next))
+		{
+			worker->tail = NULL;
+		}
+		job->next = NULL;
+	}
+	pthread_mutex_unlock(&(worker->lock));
+	return job;
+}
+
+/* Take the newest job from another worker's queue, trying each in turn
+ * from the next along
+ */
+static radiodns_job_t *
+worker_steal(struct worker *worker)
+{
+	radiodns_workers_t *workers;
+	struct worker *victim;
+	radiodns_job_t *job, *prev;
+	int c, n;
+
+	workers = worker->workers;
+	n = worker - workers->worker;
+	for(c = 1; c < workers->nworkers; c++)
+	{
+		victim = &(workers->worker[(n + c) % workers->nworkers]);
+		pthread_mutex_lock(&(victim->lock));
+		if((job = victim->tail))
+		{
+			prev = NULL;
+			if(victim->head != job)
+			{
+				for(prev = victim->head; prev->next != job; prev = prev->next);
+				prev->next = NULL;
+			}
+			else
+			{
+				victim->head = NULL;
+			}
+			victim->tail = prev;
+		}
+		pthread_mutex_unlock(&(victim->lock));
+		if(job)
+		{
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void
+worker_run(radiodns_job_t *job)
+{
+	errno = 0;
+	h_errno = 0;
+	if(job->count)
+	{
+		job->found = radiodns_resolve_apps(job->context, job->names, job->count, job->protocol, job->apps);
+	}
+	else
+	{
+		job->found = (radiodns_resolve_target(job->context) ? 0 : -1);
+	}
+	job->err = errno;
+	job->herrno = h_errno;
+}
+
+static void
+workers_signal(radiodns_workers_t *workers)
+{
+	uint64_t one;
+	ssize_t r;
+
+	one = 1;
+#ifdef HAVE_SYS_EVENTFD_H
+	r = write(workers->fd[1], &one, sizeof(one));
+#else
+	r = write(workers->fd[1], &one, 1);
+#endif
+	(void) r;
+}
+
+static void
+workers_drain(radiodns_workers_t *workers)
+{
+	char buf[64];
+
+	while(0 < read(workers->fd[0], buf, sizeof(buf)));
+}
+
+/* Return nonzero if nworkers threads can't share a transport. Those which
+ * have queries in flight keep state between calls, and aren't
+ * thread-safe; those which only perform queries synchronously (such as
+ * the system resolver and in-memory zones) are taken to be stateless.
+ */
+static int
+workers_unsafe(int nworkers, radiodns_transport_t *transport)
+{
+	return (nworkers > 1 && transport->submit && transport->process);
+}
+
+#else /*HAVE_PTHREAD_H*/
+
+radiodns_workers_t *
+radiodns_workers_create(int nworkers, radiodns_transport_t *(*create)(void))
+{
+	(void) nworkers;
+	(void) create;
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+radiodns_workers_destroy(radiodns_workers_t *workers)
+{
+	(void) workers;
+}
+
+int
+radiodns_workers_submit(radiodns_workers_t *workers, radiodns_t *context, const char *const *names, int count, const char *protocol, void *data)
+{
+	(void) workers;
+	(void) context;
+	(void) names;
+	(void) count;
+	(void) protocol;
+	(void) data;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+radiodns_job_t *
+radiodns_workers_collect(radiodns_workers_t *workers)
+{
+	(void) workers;
+
+	return NULL;
+}
+
+int
+radiodns_workers_fd(radiodns_workers_t *workers)
+{
+	(void) workers;
+
+	return -1;
+}
+
+#endif /*HAVE_PTHREAD_H*/
+
+radiodns_t *
+radiodns_job_context(const radiodns_job_t *job)
+{
+	return job->context;
+}
+
+void *
+radiodns_job_data(const radiodns_job_t *job)
+{
+	return job->data;
+}
+
+/* Return the result for the nth application named when the job was
+ * submitted, ownership of which passes to the caller
+ */
+radiodns_app_t *
+radiodns_job_app(radiodns_job_t *job, int n)
+{
+	radiodns_app_t *app;
+
+	if(n < 0 || n >= job->count)
+	{
+		return NULL;
+	}
+	app = job->apps[n];
+	job->apps[n] = NULL;
+	return app;
+}
+
+/* Return what radiodns_resolve_apps() returned, or for a target, 0 if
+ * it was found and -1 if not, storing the errno and h_errno values which
+ * described the failure, if any
+ */
+int
+radiodns_job_result(const radiodns_job_t *job, int *err, int *herrno)
+{
+	if(err)
+	{
+		*err = job->err;
+	}
+	if(herrno)
+	{
+		*herrno = job->herrno;
+	}
+	return job->found;
+}
+
+void
+radiodns_job_destroy(radiodns_job_t *job)
+{
+	int c;
+
+	if(!job)
+	{
+		return;
+	}
+	for(c = 0; c < job->count; c++)
+	{
+		radiodns_destroy_app(job->apps[c]);
+	}
+	rdns_free(NULL, job);
+}
@@ -0,0 +1,547 @@
+/*
+ * libradiodns: The RadioDNS helper library
+ *
+ * Copyright 2010 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* An in-memory zone, answering queries in the way that a recursive
+ * resolver would (including CNAME chasing and DNAME synthesis), but
+ * without going anywhere near the network. Useful for testing and for
+ * benchmarking the resolution logic in isolation.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_radiodns.h"
+
+#include <arpa/inet.h>
+
+/* Number of hash buckets for records and nodes */
+#define ZONE_BUCKETS                    1024
+/* Maximum length of a CNAME/DNAME chain which will be followed */
+#define ZONE_MAXHOPS                    16
+/* Default TTL for records loaded from a file without one */
+#define ZONE_DEFTTL                     3600
+/* Number of compression pointers tracked per answer */
+#define ZONE_MAXDNPTRS                  64
+
+struct zone_rr
+{
+	struct zone_rr *next;
+	char *owner;
+	int type;
+	unsigned long ttl;
+	unsigned char *rdata;
+	int rdlen;
+};
+
+/* Every owner name and each of its ancestors has a node, so that
+ * NXDOMAIN can be told apart from an empty non-terminal
+ */
+struct zone_node
+{
+	struct zone_node *next;
+	char *name;
+};
+
+struct zone
+{
+	radiodns_transport_t transport;
+	struct zone_rr *rr[ZONE_BUCKETS];
+	struct zone_node *nodes[ZONE_BUCKETS];
+};
+
+struct zone_msg
+{
+	unsigned char *base;
+	unsigned char *p;
+	unsigned char *eom;
+	unsigned char *dnptrs[ZONE_MAXDNPTRS];
+	int ancount;
+	int truncated;
+};
+
+static int zone_query(radiodns_transport_t *transport, radiodns_query_t *query);
+static void zone_destroy(radiodns_transport_t *transport);
+static int zone_rdata(const char *type, const char *rdata, int *rrtype, unsigned char *buf, int buflen);
+static int zone_add_node(struct zone *zone, const char *name);
+static int zone_exists(struct zone *zone, const char *name);
+static int zone_append(struct zone_msg *msg, const char *owner, int type, unsigned long ttl, const unsigned char *rdata, int rdlen);
+static unsigned int zone_hash(const char *name);
+static void zone_canon(char *dest, const char *src);
+
+/* Create a new, empty, in-memory zone */
+radiodns_transport_t *
+radiodns_transport_zone(void)
+{
+	struct zone *zone;
+
+	if(NULL == (zone = (struct zone *) rdns_calloc(NULL, 1, sizeof(struct zone))))
+	{
+		return NULL;
+	}
+	zone->transport.query = zone_query;
+	zone->transport.destroy = zone_destroy;
+	zone->transport.data = zone;
+	return &(zone->transport);
+}
+
+/* Add a record, specified in presentation format, to a zone */
+int
+radiodns_zone_add(radiodns_transport_t *transport, const char *name, unsigned long ttl, const char *type, const char *rdata)
+{
+	struct zone *zone;
+	struct zone_rr *rr;
+	unsigned char buf[NS_MAXMSG];
+	char owner[MAXDNAME + 1];
+	int rrtype, rdlen;
+	unsigned int h;
+
+	if(!transport || transport->query != zone_query || strlen(name) > MAXDNAME)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	zone = (struct zone *) transport->data;
+	if(0 > (rdlen = zone_rdata(type, rdata, &rrtype, buf, sizeof(buf))))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	zone_canon(owner, name);
+	if(NULL == (rr = (struct zone_rr *) rdns_calloc(NULL, 1, sizeof(struct zone_rr))))
+	{
+		return -1;
+	}
+	if(NULL == (rr->owner = rdns_strdup(NULL, owner)) ||
+	   NULL == (rr->rdata = (unsigned char *) rdns_malloc(NULL, rdlen ? rdlen : 1)) ||
+	   zone_add_node(zone, owner))
+	{
+		rdns_free(NULL, rr->owner);
+		rdns_free(NULL, rr->rdata);
+		rdns_free(NULL, rr);
+		return -1;
+	}
+	memcpy(rr->rdata, buf, rdlen);
+	rr->rdlen = rdlen;
+	rr->type = rrtype;
+	rr->ttl = ttl;
+	h = zone_hash(owner) % ZONE_BUCKETS;
+	rr->next = zone->rr[h];
+	zone->rr[h] = rr;
+	return 0;
+}
+
+/* Load records from a file into a zone, returning the number added */
+int
+radiodns_zone_load(radiodns_transport_t *transport, const char *path)
+{
+	FILE *f;
+	char buf[1024], *name, *type, *rdata, *p, *endp;
+	unsigned long ttl;
+	int n;
+
+	if(NULL == (f = fopen(path, "r")))
+	{
+		return -1;
+	}
+	n = 0;
+	while(fgets(buf, sizeof(buf), f))
+	{
+		if((p = strpbrk(buf, ";#\r\n")))
+		{
+			*p = 0;
+		}
+		name = strtok(buf, " \t");
+		if(!name)
+		{
+			continue;
+		}
+		ttl = ZONE_DEFTTL;
+		type = strtok(NULL, " \t");
+		if(type && isdigit((unsigned char) type[0]))
+		{
+			ttl = strtoul(type, &endp, 10);
+			type = strtok(NULL, " \t");
+		}
+		if(type && !strcasecmp(type, "IN"))
+		{
+			type = strtok(NULL, " \t");
+		}
+		rdata = (type ? strtok(NULL, "") : NULL);
+		if(!rdata)
+		{
+			fclose(f);
+			errno = EINVAL;
+			return -1;
+		}
+		while(isspace((unsigned char) *rdata))
+		{
+			rdata++;
+		}
+		p = rdata + strlen(rdata);
+		while(p > rdata && isspace((unsigned char) p[-1]))
+		{
+			p--;
+		}
+		*p = 0;
+		if(p - rdata >= 2 && rdata[0] == '"' && p[-1] == '"')
+		{
+			p[-1] = 0;
+			rdata++;
+		}
+		if(radiodns_zone_add(transport, name, ttl, type, rdata))
+		{
+			fclose(f);
+			return -1;
+		}
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static void
+zone_destroy(radiodns_transport_t *transport)
+{
+	struct zone *zone;
+	struct zone_rr *rr;
+	struct zone_node *node;
+	int c;
+
+	zone = (struct zone *) transport->data;
+	for(c = 0; c < ZONE_BUCKETS; c++)
+	{
+		while((rr = zone->rr[c]))
+		{
+			zone->rr[c] = rr->next;
+			rdns_free(NULL, rr->owner);
+			rdns_free(NULL, rr->rdata);
+			rdns_free(NULL, rr);
+		}
+		while((node = zone->nodes[c]))
+		{
+			zone->nodes[c] = node->next;
+			rdns_free(NULL, node->name);
+			rdns_free(NULL, node);
+		}
+	}
+	rdns_free(NULL, zone);
+}
+
+static int
+zone_query(radiodns_transport_t *transport, radiodns_query_t *query)
+{
+	struct zone *zone;
+	struct zone_rr *rr, *dname;
+	struct zone_msg msg;
+	char name[MAXDNAME + 1], target[MAXDNAME + 1], synth[MAXDNAME + 1];
+	unsigned char rdata[MAXDNAME + 1];
+	const char *suffix;
+	int hops, n, follow, rcode;
+
+	zone = (struct zone *) transport->data;
+	query->len = -1;
+	query->herrno = NETDB_INTERNAL;
+	if(query->anslen < NS_HFIXEDSZ || strlen(query->name) > MAXDNAME)
+	{
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.base = query->answer;
+	msg.eom = query->answer + query->anslen;
+	msg.dnptrs[0] = msg.base;
+	memset(msg.base, 0, NS_HFIXEDSZ);
+	msg.p = msg.base + NS_HFIXEDSZ;
+	if(0 > (n = dn_comp(query->name, msg.p, msg.eom - msg.p, msg.dnptrs, msg.dnptrs + ZONE_MAXDNPTRS)) ||
+	   msg.p + n + 2 * NS_INT16SZ > msg.eom)
+	{
+		return -1;
+	}
+	msg.p += n;
+	ns_put16(query->qtype, msg.p);
+	msg.p += NS_INT16SZ;
+	ns_put16(query->qclass, msg.p);
+	msg.p += NS_INT16SZ;
+	zone_canon(name, query->name);
+	for(hops = 0; hops < ZONE_MAXHOPS; hops++)
+	{
+		follow = 0;
+		for(rr = zone->rr[zone_hash(name) % ZONE_BUCKETS]; rr; rr = rr->next)
+		{
+			if(strcmp(rr->owner, name))
+			{
+				continue;
+			}
+			if(rr->type != query->qtype && query->qtype != ns_t_any && rr->type != ns_t_cname)
+			{
+				continue;
+			}
+			zone_append(&msg, rr->owner, rr->type, rr->ttl, rr->rdata, rr->rdlen);
+			if(rr->type == ns_t_cname && query->qtype != ns_t_cname && query->qtype != ns_t_any)
+			{
+				dn_expand(rr->rdata, rr->rdata + rr->rdlen, rr->rdata, target, sizeof(target));
+				follow = 1;
+			}
+		}
+		if(!follow && !zone_exists(zone, name))
+		{
+			/* Look for a DNAME at the closest ancestor */
+			dname = NULL;
+			for(suffix = strchr(name, '.'); suffix; suffix = strchr(suffix, '.'))
+			{
+				suffix++;
+				for(rr = zone->rr[zone_hash(suffix) % ZONE_BUCKETS]; rr; rr = rr->next)
+				{
+					if(rr->type == ns_t_dname && !strcmp(rr->owner, suffix))
+					{
+						dname = rr;
+						break;
+					}
+				}
+				if(dname)
+				{
+					break;
+				}
+			}
+			if(dname)
+			{
+				dn_expand(dname->rdata, dname->rdata + dname->rdlen, dname->rdata, target, sizeof(target));
+				if((suffix - name) + strlen(target) > MAXDNAME)
+				{
+					break;
+				}
+				memcpy(synth, name, suffix - name);
+				strcpy(&(synth[suffix - name]), target);
+				zone_append(&msg, dname->owner, ns_t_dname, dname->ttl, dname->rdata, dname->rdlen);
+				if(0 > (n = dn_comp(synth, rdata, sizeof(rdata), NULL, NULL)))
+				{
+					break;
+				}
+				zone_append(&msg, name, ns_t_cname, dname->ttl, rdata, n);
+				strcpy(target, synth);
+				follow = (query->qtype != ns_t_cname && query->qtype != ns_t_any);
+				if(!follow)
+				{
+					break;
+				}
+			}
+		}
+		if(!follow)
+		{
+			break;
+		}
+		zone_canon(name, target);
+	}
+	rcode = ns_r_noerror;
+	if(!msg.ancount && !zone_exists(zone, name))
+	{
+		rcode = ns_r_nxdomain;
+	}
+	/* QR, RD, RA, and possibly TC */
+	ns_put16(0x8180 | (msg.truncated ? 0x0200 : 0) | rcode, msg.base + NS_INT16SZ);
+	ns_put16(1, msg.base + 2 * NS_INT16SZ);
+	ns_put16(msg.ancount, msg.base + 3 * NS_INT16SZ);
+	if(!msg.ancount)
+	{
+		query->herrno = (rcode == ns_r_nxdomain ? HOST_NOT_FOUND : NO_DATA);
+		return -1;
+	}
+	query->herrno = 0;
+	query->len = msg.p - msg.base;
+	return query->len;
+}
+
+static int
+zone_append(struct zone_msg *msg, const char *owner, int type, unsigned long ttl, const unsigned char *rdata, int rdlen)
+{
+	int n;
+
+	if(msg->truncated)
+	{
+		return -1;
+	}
+	n = dn_comp(owner, msg->p, msg->eom - msg->p, msg->dnptrs, msg->dnptrs + ZONE_MAXDNPTRS);
+	if(n < 0 || msg->p + n + NS_RRFIXEDSZ + rdlen > msg->eom)
+	{
+		msg->truncated = 1;
+		return -1;
+	}
+	msg->p += n;
+	ns_put16(type, msg->p);
+	msg->p += NS_INT16SZ;
+	ns_put16(ns_c_in, msg->p);
+	msg->p += NS_INT16SZ;
+	ns_put32(ttl, msg->p);
+	msg->p += NS_INT32SZ;
+	ns_put16(rdlen, msg->p);
+	msg->p += NS_INT16SZ;
+	memcpy(msg->p, rdata, rdlen);
+	msg->p += rdlen;
+	msg->ancount++;
+	return 0;
+}
+
+/* Convert presentation-format record data to wire format */
+static int
+zone_rdata(const char *type, const char *rdata, int *rrtype, unsigned char *buf, int buflen)
+{
+	char target[MAXDNAME + 1];
+	unsigned int prio, weight, port;
+	size_t len, l;
+	int n;
+
+	if(!strcasecmp(type, "CNAME") || !strcasecmp(type, "DNAME") || !strcasecmp(type, "PTR"))
+	{
+		*rrtype = (!strcasecmp(type, "CNAME") ? ns_t_cname : (!strcasecmp(type, "DNAME") ? ns_t_dname : ns_t_ptr));
+		return dn_comp(rdata, buf, buflen, NULL, NULL);
+	}
+	if(!strcasecmp(type, "SRV"))
+	{
+		*rrtype = ns_t_srv;
+		if(4 != sscanf(rdata, "%u %u %u %1024s", &prio, &weight, &port, target) ||
+		   prio > 0xFFFF || weight > 0xFFFF || port > 0xFFFF)
+		{
+			return -1;
+		}
+		ns_put16(prio, buf);
+		ns_put16(weight, buf + NS_INT16SZ);
+		ns_put16(port, buf + 2 * NS_INT16SZ);
+		if(0 > (n = dn_comp(target, buf + 3 * NS_INT16SZ, buflen - 3 * NS_INT16SZ, NULL, NULL)))
+		{
+			return -1;
+		}
+		return n + 3 * NS_INT16SZ;
+	}
+	if(!strcasecmp(type, "TXT"))
+	{
+		/* Split into as many character-strings as are needed */
+		*rrtype = ns_t_txt;
+		len = strlen(rdata);
+		n = 0;
+		do
+		{
+			l = (len > 255 ? 255 : len);
+			if(n + 1 + (int) l > buflen)
+			{
+				return -1;
+			}
+			buf[n] = l;
+			memcpy(&(buf[n + 1]), rdata, l);
+			n += 1 + l;
+			rdata += l;
+			len -= l;
+		}
+		while(len);
+		return n;
+	}
+	if(!strcasecmp(type, "A"))
+	{
+		*rrtype = ns_t_a;
+		return (1 == inet_pton(AF_INET, rdata, buf) ? NS_INADDRSZ : -1);
+	}
+	if(!strcasecmp(type, "AAAA"))
+	{
+		*rrtype = ns_t_aaaa;
+		return (1 == inet_pton(AF_INET6, rdata, buf) ? NS_IN6ADDRSZ : -1);
+	}
+	return -1;
+}
+
+static int
+zone_add_node(struct zone *zone, const char *name)
+{
+	struct zone_node *node;
+	unsigned int h;
+
+	for(;;)
+	{
+		if(!zone_exists(zone, name))
+		{
+			if(NULL == (node = (struct zone_node *) rdns_calloc(NULL, 1, sizeof(struct zone_node))))
+			{
+				return -1;
+			}
+			if(NULL == (node->name = rdns_strdup(NULL, name)))
+			{
+				rdns_free(NULL, node);
+				return -1;
+			}
+			h = zone_hash(name) % ZONE_BUCKETS;
+			node->next = zone->nodes[h];
+			zone->nodes[h] = node;
+		}
+		if(NULL == (name = strchr(name, '.')))
+		{
+			return 0;
+		}
+		name++;
+	}
+}
+
+static int
+zone_exists(struct zone *zone, const char *name)
+{
+	struct zone_node *node;
+
+	for(node = zone->nodes[zone_hash(name) % ZONE_BUCKETS]; node; node = node->next)
+	{
+		if(!strcmp(node->name, name))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* FNV-1a */
+static unsigned int
+zone_hash(const char *name)
+{
+	unsigned int h;
+
+	for(h = 2166136261U; *name; name++)
+	{
+		h = (h ^ (unsigned char) *name) * 16777619U;
+	}
+	return h;
+}
+
+/* Canonicalise a domain name: escapes are normalised (by way of a round
+ * trip through wire format), the name is lower-cased, and any trailing
+ * dot is stripped.
+ */
+static void
+zone_canon(char *dest, const char *src)
+{
+	unsigned char wire[NS_MAXCDNAME];
+	char *p;
+
+	if(0 > dn_comp(src, wire, sizeof(wire), NULL, NULL) ||
+	   0 > dn_expand(wire, wire + sizeof(wire), wire, dest, MAXDNAME + 1))
+	{
+		strcpy(dest, src);
+	}
+	for(p = dest; *p; p++)
+	{
+		*p = tolower((unsigned char) *p);
+	}
+	if(p > dest && p[-1] == '.')
+	{
+		p[-1] = 0;
+	}
+}